@@ -20,6 +20,8 @@ constexpr float ProjectContext::kScatMinW;
 constexpr size_t ProjectContext::kMinInitRayNum;
 constexpr int ProjectContext::kMinRayHitNum;
 constexpr int ProjectContext::kMaxRayHitNum;
+constexpr size_t ProjectContext::kMaxOutputFilterNum;
+constexpr float ProjectContext::kDefaultFresnelMaxError;
 
 
 ProjectContextPtrU ProjectContext::CreateFromFile(const char* filename) {
@@ -53,6 +55,7 @@ ProjectContextPtrU ProjectContext::CreateFromFile(const char* filename) {
   proj->ParseCrystalSettings(d);
   proj->ParseRayPathFilterSettings(d);
   proj->ParseMultiScatterSettings(d);
+  proj->ParseOutputFilterSettings(d);
 
   return proj;
 }
@@ -77,6 +80,26 @@ void ProjectContext::SetInitRayNum(size_t ray_num) {
 }
 
 
+size_t ProjectContext::GetRayBatchSize() const {
+  return ray_batch_size_;
+}
+
+
+void ProjectContext::SetRayBatchSize(size_t batch_size) {
+  ray_batch_size_ = batch_size;
+}
+
+
+size_t ProjectContext::GetPoolMemoryBudget() const {
+  return pool_memory_budget_;
+}
+
+
+void ProjectContext::SetPoolMemoryBudget(size_t budget_mb) {
+  pool_memory_budget_ = budget_mb;
+}
+
+
 int ProjectContext::GetRayHitNum() const {
   return ray_hit_num_;
 }
@@ -87,6 +110,26 @@ void ProjectContext::SetRayHitNum(int hit_num) {
 }
 
 
+float ProjectContext::GetFresnelMaxError() const {
+  return fresnel_max_error_;
+}
+
+
+void ProjectContext::SetFresnelMaxError(float max_error) {
+  fresnel_max_error_ = std::max(max_error, 0.0f);
+}
+
+
+float ProjectContext::GetRouletteThreshold() const {
+  return roulette_threshold_;
+}
+
+
+void ProjectContext::SetRouletteThreshold(float threshold) {
+  roulette_threshold_ = std::min(std::max(threshold, 0.0f), 1.0f);
+}
+
+
 std::string ProjectContext::GetDataDirectory() const {
   return data_path_;
 }
@@ -97,6 +140,11 @@ std::string ProjectContext::GetDefaultImagePath() const {
 }
 
 
+std::string ProjectContext::GetDefaultImagePath(size_t layer) const {
+  return PathJoin(data_path_, "img_filter_" + std::to_string(output_filter_ids_.at(layer)) + ".jpg");
+}
+
+
 const Crystal* ProjectContext::GetCrystal(int id) const {
   auto crystal_ctx = GetCrystalContext(id);
   if (crystal_ctx) {
@@ -154,8 +202,33 @@ AbstractRayPathFilter* ProjectContext::GetRayPathFilter(int id) const {
 }
 
 
+const std::vector<int>& ProjectContext::GetOutputFilterIds() const {
+  return output_filter_ids_;
+}
+
+
+void ProjectContext::SetOutputFilterIds(const std::vector<int>& filter_ids) {
+  constexpr size_t kTmpBufferSize = 512;
+  char buffer[kTmpBufferSize];
+
+  if (filter_ids.size() > kMaxOutputFilterNum) {
+    std::snprintf(buffer, kTmpBufferSize, "Too many output filters! At most %zu are supported.", kMaxOutputFilterNum);
+    throw std::invalid_argument(buffer);
+  }
+  for (auto id : filter_ids) {
+    if (GetRayPathFilter(id) == nullptr) {
+      std::snprintf(buffer, kTmpBufferSize, "Output filter %d cannot be found in <ray_path_filter>!", id);
+      throw std::invalid_argument(buffer);
+    }
+  }
+  output_filter_ids_ = filter_ids;
+}
+
+
 ProjectContext::ProjectContext()
-    : sun_ctx_{}, cam_ctx_{}, render_ctx_{}, init_ray_num_(kDefaultInitRayNum), ray_hit_num_(kDefaultRayHitNum) {}
+    : sun_ctx_{}, cam_ctx_{}, render_ctx_{}, init_ray_num_(kDefaultInitRayNum), ray_batch_size_(0),
+      pool_memory_budget_(0), ray_hit_num_(kDefaultRayHitNum), fresnel_max_error_(kDefaultFresnelMaxError),
+      roulette_threshold_(0) {}
 
 
 void ProjectContext::ParseBasicSettings(rapidjson::Document& d) {
@@ -169,6 +242,36 @@ void ProjectContext::ParseBasicSettings(rapidjson::Document& d) {
     SetInitRayNum(p->GetUint());
   }
 
+  p = Pointer("/ray/batch_size").Get(d);
+  if (p != nullptr && !p->IsUint()) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.batch_size> is not unsigned int, using default 0 (no batching)!\n");
+  } else if (p != nullptr) {
+    SetRayBatchSize(p->GetUint());
+  }
+
+  p = Pointer("/ray/pool_memory_budget").Get(d);
+  if (p != nullptr && !p->IsUint()) {
+    std::fprintf(stderr,
+                 "\nWARNING! Config <ray.pool_memory_budget> is not unsigned int, using default 0 (no budget)!\n");
+  } else if (p != nullptr) {
+    SetPoolMemoryBudget(p->GetUint());
+  }
+
+  p = Pointer("/ray/fresnel_max_error").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.fresnel_max_error> is not a number, using default %g!\n",
+                 ProjectContext::kDefaultFresnelMaxError);
+  } else if (p != nullptr) {
+    SetFresnelMaxError(static_cast<float>(p->GetDouble()));
+  }
+
+  p = Pointer("/ray/roulette_threshold").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.roulette_threshold> is not a number, using default 0 (disabled)!\n");
+  } else if (p != nullptr) {
+    SetRouletteThreshold(static_cast<float>(p->GetDouble()));
+  }
+
   p = Pointer("/max_recursion").Get(d);
   if (p == nullptr) {
     std::fprintf(stderr, "\nWARNING! Config missing <max_recursion>, using default %d!\n",
@@ -315,4 +418,24 @@ void ProjectContext::ParseMultiScatterSettings(rapidjson::Document& d) {
   }
 }
 
+
+void ProjectContext::ParseOutputFilterSettings(rapidjson::Document& d) {
+  const auto* p = Pointer("/output_filter").Get(d);
+  if (p == nullptr) {
+    return;
+  }
+  if (!p->IsArray()) {
+    throw std::invalid_argument("Config <output_filter> cannot be recognized!");
+  }
+
+  std::vector<int> filter_ids;
+  for (const auto& f : p->GetArray()) {
+    if (!f.IsInt()) {
+      throw std::invalid_argument("Config <output_filter> cannot be recognized!");
+    }
+    filter_ids.emplace_back(f.GetInt());
+  }
+  SetOutputFilterIds(filter_ids);
+}
+
 }  // namespace icehalo
@@ -38,11 +38,40 @@ class ProjectContext {
   size_t GetInitRayNum() const;
   void SetInitRayNum(size_t ray_num);
 
+  /*! @brief Number of initial rays traced in one batch. 0 means all rays are traced in one batch. */
+  size_t GetRayBatchSize() const;
+  void SetRayBatchSize(size_t batch_size);
+
+  /**
+   * @brief Memory budget of ray segment store and ray info pool, in MiB. 0 means no budget.
+   *
+   * When it is set, batches are made small enough to keep pools within the budget. It is ignored when
+   * Simulator::Run() has no consumer, since all rays are then traced in one batch. See Simulator::Run().
+   */
+  size_t GetPoolMemoryBudget() const;
+  void SetPoolMemoryBudget(size_t budget_mb);
+
   int GetRayHitNum() const;
   void SetRayHitNum(int hit_num);
 
+  /*! @brief Error bound of FresnelTable used in simulation. 0 means reflectance is always computed directly. */
+  float GetFresnelMaxError() const;
+  void SetFresnelMaxError(float max_error);
+
+  /**
+   * @brief Weight threshold of Russian roulette. 0 means it is disabled.
+   *
+   * Rays in crystal whose weights are below it survive with probability w / threshold, and survivors get weight
+   * threshold, so the expected weight is unchanged. Rays leaving crystal with weights below kScatMinW are given the
+   * same chance with kScatMinW, instead of being dropped. Survivors get weight kScatMinW whether they enter next
+   * scattering or not.
+   */
+  float GetRouletteThreshold() const;
+  void SetRouletteThreshold(float threshold);
+
   std::string GetDataDirectory() const;
   std::string GetDefaultImagePath() const;
+  std::string GetDefaultImagePath(size_t layer) const;
 
   const Crystal* GetCrystal(int id) const;
   int32_t GetCrystalId(const Crystal* crystal) const;
@@ -50,6 +79,15 @@ class ProjectContext {
 
   AbstractRayPathFilter* GetRayPathFilter(int id) const;
 
+  /**
+   * @brief Ray path filters that split final rays into output layers.
+   *
+   * Every final exit ray is evaluated against all of these filters in the same trace, and layer k holds the rays
+   * accepted by k-th filter. Empty list means no output layer.
+   */
+  const std::vector<int>& GetOutputFilterIds() const;
+  void SetOutputFilterIds(const std::vector<int>& filter_ids);
+
   static ProjectContextPtrU CreateFromFile(const char* filename);
   static ProjectContextPtrU CreateDefault();
 
@@ -64,6 +102,8 @@ class ProjectContext {
   static constexpr int kMinRayHitNum = 1;
   static constexpr int kMaxRayHitNum = 12;
   static constexpr int kDefaultRayHitNum = 8;
+  static constexpr size_t kMaxOutputFilterNum = 32;
+  static constexpr float kDefaultFresnelMaxError = 1e-5f;
 
   SunContextPtr sun_ctx_;
   CameraContextPtr cam_ctx_;
@@ -81,14 +121,20 @@ class ProjectContext {
   void ParseCrystalSettings(rapidjson::Document& d);
   void ParseRayPathFilterSettings(rapidjson::Document& d);
   void ParseMultiScatterSettings(rapidjson::Document& d);
+  void ParseOutputFilterSettings(rapidjson::Document& d);
 
   size_t init_ray_num_;
+  size_t ray_batch_size_;
+  size_t pool_memory_budget_;
   int ray_hit_num_;
+  float fresnel_max_error_;
+  float roulette_threshold_;
 
   std::string data_path_;
 
   std::vector<CrystalContextPtrU> crystal_store_;
   std::vector<RayPathFilterContextPtrU> filter_store_;
+  std::vector<int> output_filter_ids_;
 };
 
 
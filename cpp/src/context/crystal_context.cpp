@@ -340,25 +340,41 @@ AxisDistribution CrystalContext::GetAxisDistribution() const {
 }
 
 
-int CrystalContext::RandomSampleFace(const float* ray_dir) const {
+int CrystalContext::RandomSampleFace(math::RandomNumberGenerator* rng, const float* ray_dir) const {
   int total_faces = crystal_->TotalFaces();
-  std::unique_ptr<float[]> face_prob_buf{ new float[total_faces] };
   const auto* face_norm = crystal_->GetFaceNorm();
   const auto* face_area = crystal_->GetFaceArea();
 
+  // Faces are sampled proportional to their projected area. The projected areas are computed twice rather than
+  // buffered, so that this method needs no allocation and can be called from multiple threads.
+  auto projected_area = [=](int k) {
+    if (std::isnan(face_norm[k * 3 + 0]) || face_area[k] <= 0) {
+      return 0.0f;
+    }
+    return std::max(-math::Dot3(face_norm + k * 3, ray_dir) * face_area[k], 0.0f);
+  };
+
   float sum = 0;
   for (int k = 0; k < total_faces; k++) {
-    face_prob_buf[k] = 0;
-    if (!std::isnan(face_norm[k * 3 + 0]) && face_area[k] > 0) {
-      face_prob_buf[k] = std::max(-math::Dot3(face_norm + k * 3, ray_dir) * face_area[k], 0.0f);
-      sum += face_prob_buf[k];
-    }
+    sum += projected_area(k);
   }
+
+  float current_p = rng->GetUniform() * sum;
+  float current_cum_p = 0;
+  int last_face = total_faces - 1;
   for (int k = 0; k < total_faces; k++) {
-    face_prob_buf[k] /= sum;
+    float p = projected_area(k);
+    if (p <= 0) {
+      continue;
+    }
+    current_cum_p += p;
+    last_face = k;
+    if (current_p < current_cum_p) {
+      return k;
+    }
   }
 
-  return math::RandomSampler::SampleInt(face_prob_buf.get(), total_faces);
+  return last_face;
 }
 
 
@@ -0,0 +1,274 @@
+#include "core/bvh.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "core/optics.h"
+
+namespace icehalo {
+
+struct Bvh::BuildNode {
+  float box[6];  // min x, min y, min z, max x, max y, max z
+  int left;      // Child index, or -1 for a leaf
+  int right;
+  int first;     // First face in face_index_, for a leaf
+  int face_num;
+};
+
+
+constexpr int Bvh::kWidth;
+constexpr int Bvh::kMaxLeafFaces;
+constexpr int Bvh::kMaxDepth;
+constexpr int Bvh::kStackSize;
+
+Bvh::Bvh(int face_num, const float* face_points, const float* face_data) {
+  // Boxes are padded a little, so that rays starting on a face or going along a box face are not missed due to
+  // rounding errors.
+  constexpr float kPadding = 1e-5f;
+
+  std::vector<float> face_box(face_num * 6);
+  std::vector<float> face_center(face_num * 3);
+  float whole_box[6]{};
+  for (int i = 0; i < face_num; i++) {
+    const float* p = face_points + i * 9;
+    float* b = face_box.data() + i * 6;
+    for (int j = 0; j < 3; j++) {
+      b[j] = std::min(std::min(p[j], p[j + 3]), p[j + 6]);
+      b[j + 3] = std::max(std::max(p[j], p[j + 3]), p[j + 6]);
+      face_center[i * 3 + j] = (b[j] + b[j + 3]) / 2;
+      whole_box[j] = i == 0 ? b[j] : std::min(whole_box[j], b[j]);
+      whole_box[j + 3] = i == 0 ? b[j + 3] : std::max(whole_box[j + 3], b[j + 3]);
+    }
+  }
+  float padding = 0;
+  for (int j = 0; j < 3; j++) {
+    padding = std::max(padding, (whole_box[j + 3] - whole_box[j]) * kPadding);
+  }
+  for (int i = 0; i < face_num; i++) {
+    for (int j = 0; j < 3; j++) {
+      face_box[i * 6 + j] -= padding;
+      face_box[i * 6 + j + 3] += padding;
+    }
+  }
+
+  face_index_.resize(face_num);
+  for (int i = 0; i < face_num; i++) {
+    face_index_[i] = i;
+  }
+
+  std::vector<BuildNode> build_nodes;
+  build_nodes.reserve(face_num * 2);
+  BuildBinary(0, face_num, 0, face_box.data(), face_center.data(), &build_nodes);
+  Collapse(build_nodes, 0);
+
+  face_data_.resize(face_num * Optics::kPacketFaceDataSize);
+  for (int i = 0; i < face_num; i++) {
+    std::copy(face_data + face_index_[i] * Optics::kPacketFaceDataSize,
+              face_data + (face_index_[i] + 1) * Optics::kPacketFaceDataSize,
+              face_data_.data() + i * Optics::kPacketFaceDataSize);
+  }
+}
+
+
+int Bvh::TotalNodes() const {
+  return static_cast<int>(nodes_.size());
+}
+
+
+const BvhNode* Bvh::GetNodes() const {
+  return nodes_.data();
+}
+
+
+const int* Bvh::GetFaceIndex() const {
+  return face_index_.data();
+}
+
+
+const float* Bvh::GetFaceData() const {
+  return face_data_.data();
+}
+
+
+// Faces are split into two halves by a plane perpendicular to an axis. Face centers are put into bins along every
+// axis, and the split between bins with the lowest SAH cost is chosen, i.e. the one that minimizes the sum of
+// (surface area x face number) of two halves.
+int Bvh::BuildBinary(int first, int num, int depth,                     // input
+                     const float* face_box, const float* face_center,  // input
+                     std::vector<BuildNode>* build_nodes) {             // output
+  constexpr int kBinNum = 16;
+  constexpr float kFloatMax = std::numeric_limits<float>::max();
+
+  auto reset_box = [=](float* box) {
+    for (int j = 0; j < 3; j++) {
+      box[j] = kFloatMax;
+      box[j + 3] = -kFloatMax;
+    }
+  };
+  auto grow_box = [](float* box, const float* other) {
+    for (int j = 0; j < 3; j++) {
+      box[j] = std::min(box[j], other[j]);
+      box[j + 3] = std::max(box[j + 3], other[j + 3]);
+    }
+  };
+  auto half_area = [](const float* box) {
+    float dx = box[3] - box[0];
+    float dy = box[4] - box[1];
+    float dz = box[5] - box[2];
+    return dx * dy + dy * dz + dz * dx;
+  };
+
+  BuildNode node{};
+  node.left = -1;
+  node.right = -1;
+  node.first = first;
+  node.face_num = num;
+  float center_box[6];
+  reset_box(node.box);
+  reset_box(center_box);
+  for (int i = first; i < first + num; i++) {
+    const float* c = face_center + face_index_[i] * 3;
+    float c_box[6]{ c[0], c[1], c[2], c[0], c[1], c[2] };
+    grow_box(node.box, face_box + face_index_[i] * 6);
+    grow_box(center_box, c_box);
+  }
+
+  int node_idx = static_cast<int>(build_nodes->size());
+  build_nodes->emplace_back(node);
+  if (num <= kMaxLeafFaces || depth >= kMaxDepth) {
+    return node_idx;
+  }
+
+  int best_axis = -1;
+  int best_split = 0;
+  float best_cost = kFloatMax;
+  for (int axis = 0; axis < 3; axis++) {
+    float lo = center_box[axis];
+    float extent = center_box[axis + 3] - lo;
+    if (!(extent > 0)) {
+      continue;
+    }
+    float bin_box[kBinNum][6];
+    int bin_count[kBinNum]{};
+    for (auto& b : bin_box) {
+      reset_box(b);
+    }
+    for (int i = first; i < first + num; i++) {
+      int f = face_index_[i];
+      int bin = std::min(static_cast<int>((face_center[f * 3 + axis] - lo) / extent * kBinNum), kBinNum - 1);
+      bin_count[bin]++;
+      grow_box(bin_box[bin], face_box + f * 6);
+    }
+
+    // Sweep from right to get the cost of right halves, and then from left.
+    float right_cost[kBinNum]{};
+    float box[6];
+    reset_box(box);
+    int count = 0;
+    for (int b = kBinNum - 1; b > 0; b--) {
+      grow_box(box, bin_box[b]);
+      count += bin_count[b];
+      right_cost[b] = count > 0 ? half_area(box) * count : 0;
+    }
+    reset_box(box);
+    count = 0;
+    for (int b = 0; b < kBinNum - 1; b++) {
+      grow_box(box, bin_box[b]);
+      count += bin_count[b];
+      if (count == 0 || count == num) {
+        continue;
+      }
+      float cost = half_area(box) * count + right_cost[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b + 1;
+      }
+    }
+  }
+
+  // Splitting costs one more box test. Faces that can not be split (e.g. with the same center) stay in one leaf.
+  float leaf_cost = half_area(node.box) * num;
+  if (best_axis < 0 || (best_cost + half_area(node.box) >= leaf_cost && num <= kMaxLeafFaces * 4)) {
+    return node_idx;
+  }
+
+  float lo = center_box[best_axis];
+  float extent = center_box[best_axis + 3] - lo;
+  auto mid = std::partition(face_index_.begin() + first, face_index_.begin() + first + num, [=](int f) {
+    return std::min(static_cast<int>((face_center[f * 3 + best_axis] - lo) / extent * kBinNum), kBinNum - 1) <
+           best_split;
+  });
+  int left_num = static_cast<int>(mid - face_index_.begin()) - first;
+
+  int left = BuildBinary(first, left_num, depth + 1, face_box, face_center, build_nodes);
+  int right = BuildBinary(first + left_num, num - left_num, depth + 1, face_box, face_center, build_nodes);
+  (*build_nodes)[node_idx].left = left;
+  (*build_nodes)[node_idx].right = right;
+  return node_idx;
+}
+
+
+// Children of a 4-wide node are found by opening the largest inner child repeatedly, starting from the two children
+// of a binary node.
+int Bvh::Collapse(const std::vector<BuildNode>& build_nodes, int build_idx) {
+  int children[kWidth]{};
+  int child_num = 0;
+  const auto& root = build_nodes[build_idx];
+  if (root.left < 0) {
+    children[child_num++] = build_idx;
+  } else {
+    children[child_num++] = root.left;
+    children[child_num++] = root.right;
+  }
+  while (child_num < kWidth) {
+    int open_idx = -1;
+    float max_area = -1;
+    for (int i = 0; i < child_num; i++) {
+      const auto& c = build_nodes[children[i]];
+      float area = (c.box[3] - c.box[0]) * (c.box[4] - c.box[1]) + (c.box[4] - c.box[1]) * (c.box[5] - c.box[2]) +
+                   (c.box[5] - c.box[2]) * (c.box[3] - c.box[0]);
+      if (c.left >= 0 && area > max_area) {
+        max_area = area;
+        open_idx = i;
+      }
+    }
+    if (open_idx < 0) {
+      break;
+    }
+    const auto& c = build_nodes[children[open_idx]];
+    children[open_idx] = c.left;
+    children[child_num++] = c.right;
+  }
+
+  int node_idx = static_cast<int>(nodes_.size());
+  nodes_.emplace_back();
+  for (int i = 0; i < kWidth; i++) {
+    auto& node = nodes_[node_idx];
+    if (i >= child_num) {
+      for (int j = 0; j < 3; j++) {
+        node.box[j][i] = std::numeric_limits<float>::max();
+        node.box[j + 3][i] = -std::numeric_limits<float>::max();
+      }
+      node.child[i] = 0;
+      node.face_num[i] = -1;
+      continue;
+    }
+
+    const auto& c = build_nodes[children[i]];
+    for (int j = 0; j < 6; j++) {
+      node.box[j][i] = c.box[j];
+    }
+    if (c.left < 0) {
+      node.child[i] = c.first;
+      node.face_num[i] = c.face_num;
+    } else {
+      int child_idx = Collapse(build_nodes, children[i]);  // May reallocate nodes_
+      nodes_[node_idx].child[i] = child_idx;
+      nodes_[node_idx].face_num[i] = 0;
+    }
+  }
+  return node_idx;
+}
+
+}  // namespace icehalo
@@ -0,0 +1,63 @@
+#ifndef SRC_CORE_BVH_H_
+#define SRC_CORE_BVH_H_
+
+#include <vector>
+
+namespace icehalo {
+
+/*! @brief A node of Bvh. Bounding boxes of its children are stored in SoA layout, so they can be tested against a
+ * ray all at once. One node is 128 bytes.
+ */
+struct BvhNode {
+  float box[6][4];  // min x, min y, min z, max x, max y, max z of every child
+  int child[4];     // Node index of an inner child, or first face (in Bvh order) of a leaf child
+  int face_num[4];  // Face number of a leaf child, 0 for an inner child, and -1 for an empty slot
+};
+
+
+/**
+ * @brief Bounding volume hierarchy over triangles of a crystal.
+ *
+ * It is built with surface area heuristic (SAH) into a binary tree, and then collapsed into a 4-wide tree. Nodes are
+ * flattened into an array, with root at index 0. Faces are reordered so that faces of a leaf are contiguous, and
+ * per-face data (see Optics::FillPacketFaceData()) are stored in the same order.
+ *
+ * It is never changed after construction, so one instance can be shared by all threads.
+ */
+class Bvh {
+ public:
+  /*! @brief Build BVH for triangles.
+   *
+   * @param face_num the face number
+   * @param face_points the face data, 9 floats for one face, represents for 3 vertexes
+   * @param face_data per-face data, see Optics::FillPacketFaceData()
+   */
+  Bvh(int face_num, const float* face_points, const float* face_data);
+
+  int TotalNodes() const;
+  const BvhNode* GetNodes() const;
+  const int* GetFaceIndex() const;   // Original face index, in Bvh order
+  const float* GetFaceData() const;  // Optics::kPacketFaceDataSize floats for one face, in Bvh order
+
+  static constexpr int kWidth = 4;
+  static constexpr int kMaxLeafFaces = 4;  // A leaf may be larger only if its faces can not be split well
+  static constexpr int kMaxDepth = 40;     // Deeper nodes are made leaves
+  static constexpr int kStackSize = (kWidth - 1) * kMaxDepth + 1;  // Enough for a depth-first traversal
+
+ private:
+  struct BuildNode;
+
+  int BuildBinary(int first, int num, int depth,                     // input
+                  const float* face_box, const float* face_center,  // input
+                  std::vector<BuildNode>* build_nodes);             // output
+  int Collapse(const std::vector<BuildNode>& build_nodes, int build_idx);
+
+  std::vector<BvhNode> nodes_;
+  std::vector<int> face_index_;
+  std::vector<float> face_data_;
+};
+
+}  // namespace icehalo
+
+
+#endif  // SRC_CORE_BVH_H_
@@ -1,9 +1,13 @@
 #include "core/crystal.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <limits>
 #include <utility>
 
+#include "core/optics.h"
+
 namespace icehalo {
 
 const std::vector<std::pair<math::Vec3f, int>>& GetHexFaceNormToNumberList() {
@@ -34,11 +38,16 @@ const std::vector<std::pair<math::Vec3f, int>>& GetCubicFaceNormToNumberList() {
 }
 
 
+constexpr int Crystal::kBvhMinFaces;
+constexpr int Crystal::kDirBinRes;
+constexpr int Crystal::kDirBinNum;
+
 Crystal::Crystal(std::vector<math::Vec3f> vertexes,     // vertex
                  std::vector<math::TriangleIdx> faces,  // face indices
                  CrystalType type)                      // crystal type
     : type_(type), vertexes_(std::move(vertexes)), faces_(std::move(faces)), face_number_period_(-1),
-      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr) {
+      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr), face_data_(nullptr),
+      convex_(false) {
   InitBasicData();
   InitCrystalTypeData();
 }
@@ -50,7 +59,7 @@ Crystal::Crystal(std::vector<math::Vec3f> vertexes,     // vertex
                  CrystalType type)                      // crystal type
     : type_(type), vertexes_(std::move(vertexes)), faces_(std::move(faces)),
       face_number_map_(std::move(face_number_map)), face_number_period_(-1), face_bases_(nullptr),
-      face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr) {
+      face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr), face_data_(nullptr), convex_(false) {
   InitBasicData();
 }
 
@@ -90,11 +99,85 @@ const float* Crystal::GetFaceArea() const {
 }
 
 
+const float* Crystal::GetFaceData() const {
+  return face_data_.get();
+}
+
+
 int Crystal::GetFaceNumberPeriod() const {
   return face_number_period_;
 }
 
 
+bool Crystal::IsConvex() const {
+  return convex_;
+}
+
+
+int Crystal::TotalPlanes() const {
+  return static_cast<int>(plane_faces_.size());
+}
+
+
+const float* Crystal::GetPlaneNorm() const {
+  return plane_norm_.data();
+}
+
+
+const float* Crystal::GetPlaneDist() const {
+  return plane_dist_.data();
+}
+
+
+const std::vector<std::vector<int>>& Crystal::GetPlaneFaces() const {
+  return plane_faces_;
+}
+
+
+uint64_t Crystal::GetCandidatePlanes(const float* dir, int face_id) const {
+  // Leave a margin, so that the sign is surely the same as the one computed by intersection kernels.
+  constexpr float kDirEps = 1e-5f;
+
+  if (plane_visibility_.empty()) {
+    return ~uint64_t{ 0 };
+  }
+  const uint64_t* masks = plane_visibility_.data() + GetDirBin(dir) * 2;
+  float dn_in = math::Dot3(dir, face_norm_.get() + face_id * 3);
+  if (dn_in < -kDirEps) {
+    return masks[0];  // Planes facing along dir
+  } else if (dn_in > kDirEps) {
+    return masks[1];  // Planes facing against dir
+  } else {
+    return masks[0] | masks[1];
+  }
+}
+
+
+int Crystal::GetDirBin(const float* dir) {
+  int axis = 0;
+  for (int j = 1; j < 3; j++) {
+    if (std::abs(dir[j]) > std::abs(dir[axis])) {
+      axis = j;
+    }
+  }
+  float a = std::abs(dir[axis]);
+  if (!(a > 0)) {
+    return 0;
+  }
+
+  int iu = static_cast<int>((dir[(axis + 1) % 3] / a + 1) * (kDirBinRes / 2.0f));
+  int iv = static_cast<int>((dir[(axis + 2) % 3] / a + 1) * (kDirBinRes / 2.0f));
+  iu = std::min(std::max(iu, 0), kDirBinRes - 1);
+  iv = std::min(std::max(iv, 0), kDirBinRes - 1);
+  return ((axis * 2 + (dir[axis] < 0 ? 1 : 0)) * kDirBinRes + iu) * kDirBinRes + iv;
+}
+
+
+const Bvh* Crystal::GetBvh() const {
+  return bvh_.get();
+}
+
+
 CrystalType Crystal::GetType() const {
   return type_;
 }
@@ -146,8 +229,134 @@ void Crystal::InitBasicData() {
     std::memcpy(face_vertexes_ptr + i * 9 + 3, vertexes_[idx[1]].val(), 3 * sizeof(float));
     std::memcpy(face_vertexes_ptr + i * 9 + 6, vertexes_[idx[2]].val(), 3 * sizeof(float));
   }
+
+  // Intersection data depend only on the crystal. Compute them once here rather than for every ray.
+  face_data_.reset(new float[face_num * Optics::kPacketFaceDataSize]);
+  Optics::FillPacketFaceData(static_cast<int>(face_num), face_bases_ptr, face_vertexes_ptr, face_norm_ptr,
+                             face_data_.get());
+
+  InitPlaneData();
+  InitBvhData();
+}
+
+
+// Merge coplanar triangles into planes, and check if the crystal is convex, i.e. all vertexes are on the same side
+// of every plane, and that side is the same for all planes.
+void Crystal::InitPlaneData() {
+  constexpr float kPlaneEps = 1e-4;
+
+  float max_area = 0;
+  for (size_t i = 0; i < faces_.size(); i++) {
+    max_area = std::max(max_area, face_area_[i]);
+  }
+
+  plane_norm_.clear();
+  plane_dist_.clear();
+  plane_faces_.clear();
+  for (size_t i = 0; i < faces_.size(); i++) {
+    if (!(face_area_[i] > max_area * kPlaneEps * kPlaneEps)) {
+      continue;  // Degenerate triangle. Its normal is not defined (or not reliable), and it can hardly be hit.
+    }
+    const float* n = face_norm_.get() + i * 3;
+    float dist = math::Dot3(n, face_vertexes_.get() + i * 9);
+
+    size_t plane_idx = 0;
+    for (; plane_idx < plane_faces_.size(); plane_idx++) {
+      if (math::DiffNorm3(n, plane_norm_.data() + plane_idx * 3) < kPlaneEps &&
+          std::abs(dist - plane_dist_[plane_idx]) < kPlaneEps) {
+        break;
+      }
+    }
+    if (plane_idx == plane_faces_.size()) {
+      plane_norm_.insert(plane_norm_.end(), n, n + 3);
+      plane_dist_.emplace_back(dist);
+      plane_faces_.emplace_back();
+    }
+    plane_faces_[plane_idx].emplace_back(static_cast<int>(i));
+  }
+
+  int side = 0;
+  convex_ = !plane_faces_.empty();
+  for (size_t i = 0; convex_ && i < plane_faces_.size(); i++) {
+    for (const auto& v : vertexes_) {
+      float d = math::Dot3(plane_norm_.data() + i * 3, v.val()) - plane_dist_[i];
+      int curr_side = d > kPlaneEps ? 1 : (d < -kPlaneEps ? -1 : 0);
+      if (curr_side == 0) {
+        continue;
+      }
+      if (side == 0) {
+        side = curr_side;
+      } else if (side != curr_side) {
+        convex_ = false;
+        break;
+      }
+    }
+  }
+
+  InitPlaneVisibility();
+}
+
+
+// For directions in a bin, dot(dir, norm) has the same sign as s * norm[a] + u * norm[b] + v * norm[c], where a is
+// the major axis of dir, s is the sign of dir[a], and (u, v) is in the square of the bin on the cube face. It is
+// linear in (u, v), so its extremes are at the corners of the square. Squares are enlarged a little for rounding
+// errors.
+void Crystal::InitPlaneVisibility() {
+  constexpr float kMargin = 1e-3f;
+  constexpr int kMaxPlanes = 64;
+
+  plane_visibility_.clear();
+  int plane_num = TotalPlanes();
+  if (!convex_ || plane_num > kMaxPlanes) {
+    return;
+  }
+
+  plane_visibility_.resize(kDirBinNum * 2);
+  for (int bin = 0; bin < kDirBinNum; bin++) {
+    int axis = bin / (2 * kDirBinRes * kDirBinRes);
+    float sign = bin / (kDirBinRes * kDirBinRes) % 2 == 0 ? 1.0f : -1.0f;
+    int iu = bin / kDirBinRes % kDirBinRes;
+    int iv = bin % kDirBinRes;
+
+    uint64_t pos_mask = 0;
+    uint64_t neg_mask = 0;
+    for (int i = 0; i < plane_num; i++) {
+      const float* n = plane_norm_.data() + i * 3;
+      float max_dot = std::numeric_limits<float>::lowest();
+      float min_dot = std::numeric_limits<float>::max();
+      for (int corner = 0; corner < 4; corner++) {
+        int cu = corner & 1;
+        int cv = corner >> 1;
+        float u = -1.0f + 2.0f * (iu + cu) / kDirBinRes + (cu ? kMargin : -kMargin);
+        float v = -1.0f + 2.0f * (iv + cv) / kDirBinRes + (cv ? kMargin : -kMargin);
+        float d = sign * n[axis] + u * n[(axis + 1) % 3] + v * n[(axis + 2) % 3];
+        max_dot = std::max(max_dot, d);
+        min_dot = std::min(min_dot, d);
+      }
+      if (max_dot > 0) {
+        pos_mask |= uint64_t{ 1 } << i;
+      }
+      if (min_dot < 0) {
+        neg_mask |= uint64_t{ 1 } << i;
+      }
+    }
+    plane_visibility_[bin * 2 + 0] = pos_mask;
+    plane_visibility_[bin * 2 + 1] = neg_mask;
+  }
 }
 
+
+void Crystal::InitBvhData() {
+  int face_num = TotalFaces();
+  if (convex_ || face_num < kBvhMinFaces) {
+    bvh_.reset();
+    return;
+  }
+
+  bvh_.reset(new Bvh(face_num, face_vertexes_.get(), face_data_.get()));
+}
+
+
 void Crystal::InitCrystalTypeData() {
   switch (type_) {
     case CrystalType::kPrism:
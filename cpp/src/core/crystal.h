@@ -1,10 +1,12 @@
 #ifndef SRC_CORE_CRYSTAL_H_
 #define SRC_CORE_CRYSTAL_H_
 
+#include <cstdint>
 #include <memory>
 #include <utility>
 #include <vector>
 
+#include "core/bvh.h"
 #include "core/mymath.h"
 
 namespace icehalo {
@@ -41,9 +43,54 @@ class Crystal {
   const float* GetFaceBaseVector() const;
   const float* GetFaceNorm() const;
   const float* GetFaceArea() const;
+  const float* GetFaceData() const;  // Optics::kPacketFaceDataSize floats for one face, see FillPacketFaceData()
   int GetFaceNumberPeriod() const;
 
+  /**
+   * @brief Whether the crystal is a convex polyhedron.
+   *
+   * For a convex crystal, a ray inside it leaves through the nearest face plane ahead, so intersection can be done
+   * with face planes only, rather than with every triangle.
+   */
+  bool IsConvex() const;
+
+  /*! @brief Number of distinct face planes. Coplanar triangles share one plane. Degenerate triangles are ignored. */
+  int TotalPlanes() const;
+  const float* GetPlaneNorm() const;  // 3 floats for one plane, same as normal of its triangles.
+  const float* GetPlaneDist() const;  // 1 float for one plane. Plane is dot(norm, x) = dist.
+  const std::vector<std::vector<int>>& GetPlaneFaces() const;  // Triangle indices in every plane.
+
+  /**
+   * @brief Planes that a ray may leave through, as a bit mask. Bit i is set for plane i.
+   *
+   * A ray leaving a convex crystal can only hit planes that face along its direction, i.e. where the sign of
+   * dot(dir, plane normal) is different from that of its start face. Directions are put into kDirBinNum bins on the
+   * faces of a cube, and for every bin the planes that any direction in it may face along are kept in a table. Thus
+   * this is a superset of the planes that can be hit, and other planes can be skipped.
+   *
+   * All bits are set for non-convex crystals, or if there are more than 64 planes (planes beyond 64 should always be
+   * tested).
+   *
+   * @param dir the ray direction, 3 floats
+   * @param face_id the face where the ray starts
+   */
+  uint64_t GetCandidatePlanes(const float* dir, int face_id) const;
+
+  /*! @brief Index of the direction bin, in [0, kDirBinNum). The direction need not be normalized. */
+  static int GetDirBin(const float* dir);
+
+  /**
+   * @brief BVH of triangles, or nullptr if not built.
+   *
+   * It is built for non-convex crystals with at least kBvhMinFaces faces, e.g. large meshes loaded from OBJ files.
+   * For them, Optics::Propagate() traverses BVH rather than testing every triangle.
+   */
+  const Bvh* GetBvh() const;
+
   static constexpr float kC = 1.629f;
+  static constexpr int kBvhMinFaces = 64;
+  static constexpr int kDirBinRes = 8;  // Bins along either side of a cube face
+  static constexpr int kDirBinNum = 6 * kDirBinRes * kDirBinRes;
 
   /*! @brief Create a regular hexagon prism crystal
    *
@@ -151,6 +198,9 @@ class Crystal {
 
  protected:
   void InitBasicData();
+  void InitPlaneData();
+  void InitPlaneVisibility();
+  void InitBvhData();
   void InitCrystalTypeData();
   void InitFaceNumberHex();
   void InitFaceNumberCubic();
@@ -166,6 +216,15 @@ class Crystal {
   std::unique_ptr<float[]> face_vertexes_;
   std::unique_ptr<float[]> face_norm_;
   std::unique_ptr<float[]> face_area_;
+  std::unique_ptr<float[]> face_data_;
+
+  bool convex_;
+  std::vector<float> plane_norm_;
+  std::vector<float> plane_dist_;
+  std::vector<std::vector<int>> plane_faces_;
+  std::vector<uint64_t> plane_visibility_;  // 2 masks per direction bin, for dot(dir, norm) > 0 and < 0
+
+  std::unique_ptr<Bvh> bvh_;
 
  private:
   /*! @brief Constructor, given vertexes and faces
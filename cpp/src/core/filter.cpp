@@ -10,21 +10,195 @@ namespace icehalo {
 using rapidjson::Pointer;
 
 
+constexpr int RayPathCode::kMaxLength;
+constexpr unsigned int RayPathCode::kUnknownFaceNumber;
+
+
+unsigned int RayPathCode::Get(int idx) const {
+  return static_cast<unsigned int>(code[idx / 8] >> (idx % 8 * 8)) & 0xffu;
+}
+
+
+void RayPathCode::Set(int idx, int fn) {
+  uint64_t v = (fn >= 0 && fn < static_cast<int>(kUnknownFaceNumber)) ? fn : kUnknownFaceNumber;
+  auto offset = idx % 8 * 8;
+  code[idx / 8] = (code[idx / 8] & ~(0xffull << offset)) | (v << offset);
+}
+
+
+bool RayPathCode::HasUnknownFace(int length) const {
+  for (int i = 0; i < std::min(length, kMaxLength); i++) {
+    if (Get(i) == kUnknownFaceNumber) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+constexpr int RayPathAutomaton::kInitState;
+constexpr int RayPathAutomaton::kDeadState;
+
+
+RayPathAutomaton::RayPathAutomaton() : symbol_num_(0) {}
+
+
+void RayPathAutomaton::Build(const std::vector<std::vector<uint16_t>>& paths, const std::vector<int>& path_ids) {
+  Clear();
+  if (paths.empty()) {
+    return;
+  }
+
+  // Only face numbers appear in paths get symbols, so that the transition table keeps small.
+  symbols_.resize(RayPathCode::kUnknownFaceNumber, -1);
+  for (const auto& p : paths) {
+    for (auto fn : p) {
+      if (fn < symbols_.size() && symbols_[fn] < 0) {
+        symbols_[fn] = symbol_num_++;
+      }
+    }
+  }
+
+  AddState();  // kInitState
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (paths[i].empty()) {
+      continue;
+    }
+    int state = kInitState;
+    for (auto fn : paths[i]) {
+      if (fn >= symbols_.size()) {  // Cannot be stored in a RayPathCode, thus never matches.
+        state = kDeadState;
+        break;
+      }
+      can_go_further_[state] = 1;
+      auto idx = state * symbol_num_ + symbols_[fn];
+      if (transitions_[idx] == kDeadState) {
+        int new_state = AddState();
+        transitions_[idx] = new_state;
+      }
+      state = transitions_[idx];
+    }
+    if (state != kDeadState && matched_path_ids_[state] < 0) {
+      matched_path_ids_[state] = path_ids[i];
+    }
+  }
+}
+
+
+int RayPathAutomaton::AddState() {
+  auto state = static_cast<int>(matched_path_ids_.size());
+  transitions_.resize(transitions_.size() + symbol_num_, kDeadState);
+  matched_path_ids_.emplace_back(-1);
+  can_go_further_.emplace_back(0);
+  return state;
+}
+
+
+void RayPathAutomaton::Clear() {
+  symbol_num_ = 0;
+  symbols_.clear();
+  transitions_.clear();
+  matched_path_ids_.clear();
+  can_go_further_.clear();
+}
+
+
+bool RayPathAutomaton::Empty() const {
+  return matched_path_ids_.empty();
+}
+
+
+int RayPathAutomaton::Next(int state, int fn) const {
+  if (state < 0 || fn < 0 || static_cast<size_t>(fn) >= symbols_.size() || symbols_[fn] < 0) {
+    return kDeadState;
+  }
+  return transitions_[state * symbol_num_ + symbols_[fn]];
+}
+
+
+int RayPathAutomaton::Run(const RayPathCode& path_code, int length) const {
+  int state = Empty() ? kDeadState : kInitState;
+  for (int i = 0; i < std::min(length, RayPathCode::kMaxLength) && state != kDeadState; i++) {
+    state = Next(state, static_cast<int>(path_code.Get(i)));
+  }
+  return length > RayPathCode::kMaxLength ? kDeadState : state;
+}
+
+
+int RayPathAutomaton::GetMatchedPathId(int state) const {
+  return state < 0 ? -1 : matched_path_ids_[state];
+}
+
+
+bool RayPathAutomaton::CanGoFurther(int state) const {
+  return state >= 0 && can_go_further_[state];
+}
+
+
+RayPathInfo::RayPathInfo()
+    : entry_dir(nullptr), exit_dir(nullptr), entry_face_id(-1), exit_face_id(-1), hit_num(0), path_hash(0),
+      path_code{}, path_state(RayPathAutomaton::kInitState) {}
+
+
+RayPathInfo::RayPathInfo(const Crystal* crystal, PoolHandle last_r)
+    : entry_dir(nullptr), exit_dir(nullptr), entry_face_id(-1), exit_face_id(-1), hit_num(1), path_hash(0),
+      path_code{}, path_state(RayPathAutomaton::kInitState) {
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  auto first_r = RayInfoPool::GetInstance()->Get(ray_seg_store->GetRayInfo(last_r))->first_ray_segment;
+  entry_dir = ray_seg_store->GetDir(first_r);
+  exit_dir = ray_seg_store->GetDir(last_r);
+  entry_face_id = ray_seg_store->GetFaceId(first_r);
+  exit_face_id = ray_seg_store->GetFaceId(last_r);
+
+  for (auto p = last_r; ray_seg_store->GetParent(p) != kInvalidPoolHandle; p = ray_seg_store->GetParent(p)) {
+    hit_num++;
+  }
+  int idx = hit_num - 1;
+  for (auto p = last_r; ray_seg_store->GetParent(p) != kInvalidPoolHandle; p = ray_seg_store->GetParent(p)) {
+    idx--;
+    int fn = crystal->FaceNumber(ray_seg_store->GetFaceId(p));
+    path_hash ^= RayPathHashItem(static_cast<unsigned int>(fn), idx);
+    if (idx < RayPathCode::kMaxLength) {
+      path_code.Set(idx, fn);
+    }
+  }
+}
+
+
 AbstractRayPathFilter::AbstractRayPathFilter()
     : symmetry_flag_(kSymmetryNone), complementary_(false), remove_homodromous_(false) {}
 
 
-bool AbstractRayPathFilter::Filter(const Crystal* crystal, RaySegment* last_r) const {
-  if (remove_homodromous_ &&
-      math::Dot3(last_r->dir.val(), last_r->root_ctx->first_ray_segment->dir.val()) > 1.0 - 5 * math::kFloatEps) {
+bool AbstractRayPathFilter::Filter(const Crystal* crystal, const RayPathInfo& ray_path) const {
+  if (remove_homodromous_ && math::Dot3(ray_path.exit_dir, ray_path.entry_dir) > 1.0 - 5 * math::kFloatEps) {
     return false;
   }
 
-  bool result = FilterPath(crystal, last_r);
+  bool result = FilterPath(crystal, ray_path);
   return result ^ complementary_;
 }
 
 
+bool AbstractRayPathFilter::Filter(const Crystal* crystal, PoolHandle last_r) const {
+  RayPathInfo ray_path(crystal, last_r);
+  const auto* automaton = GetPathAutomaton();
+  if (automaton) {
+    ray_path.path_state = automaton->Run(ray_path.path_code, ray_path.hit_num - 1);
+  }
+  return Filter(crystal, ray_path);
+}
+
+
+bool AbstractRayPathFilter::CanPruneRays(const Crystal* /* crystal */) const {
+  return false;
+}
+
+
+const RayPathAutomaton* AbstractRayPathFilter::GetPathAutomaton() const {
+  return nullptr;
+}
+
+
 void AbstractRayPathFilter::SetSymmetryFlag(uint8_t symmetry_flag) {
   symmetry_flag_ = symmetry_flag;
 }
@@ -140,59 +314,45 @@ void AbstractRayPathFilter::LoadFromJson(const rapidjson::Value& root) {
 
 
 size_t RayPathHash(const std::vector<uint16_t>& ray_path, bool reverse) {
-  constexpr size_t kStep = 7;
-  constexpr size_t kTotalBits = sizeof(size_t) * CHAR_BIT;
-
   size_t result = 0;
-  size_t curr_offset = 0;
+  size_t idx = 0;
   if (reverse) {
     for (auto rit = ray_path.rbegin(); rit != ray_path.rend(); ++rit) {
-      unsigned int fn = *rit;
-      size_t tmp_hash = (fn << curr_offset) | (fn >> (kTotalBits - curr_offset));
-      result ^= tmp_hash;
-      curr_offset += kStep;
-      curr_offset %= kTotalBits;
+      result ^= RayPathHashItem(*rit, idx++);
     }
   } else {
     for (unsigned int fn : ray_path) {
-      size_t tmp_hash = (fn << curr_offset) | (fn >> (kTotalBits - curr_offset));
-      result ^= tmp_hash;
-      curr_offset += kStep;
-      curr_offset %= kTotalBits;
+      result ^= RayPathHashItem(fn, idx++);
     }
   }
   return result;
 }
 
 
-size_t RayPathHash(const Crystal* crystal,                  // used for get face number
-                   const RaySegment* last_ray, int length,  // ray path and length
+size_t RayPathHash(const Crystal* crystal,          // used for get face number
+                   PoolHandle last_ray, int length,  // ray path and length
                    bool reverse) {
-  constexpr size_t kStep = 7;
-  constexpr size_t kTotalBits = sizeof(size_t) * CHAR_BIT;
-
   size_t result = 0;
-  size_t curr_offset = reverse ? kStep * (length - 1) % kTotalBits : 0;
+  size_t idx = reverse ? length - 1 : 0;
+  auto ray_seg_store = RaySegmentStore::GetInstance();
   auto p = last_ray;
-  while (p->prev) {
-    unsigned int fn = crystal->FaceNumber(p->face_id);
-    size_t tmp_hash = (fn << curr_offset) | (fn >> (kTotalBits - curr_offset));
-    result ^= tmp_hash;
+  while (ray_seg_store->GetParent(p) != kInvalidPoolHandle) {
+    unsigned int fn = crystal->FaceNumber(ray_seg_store->GetFaceId(p));
+    result ^= RayPathHashItem(fn, idx);
 
     if (reverse) {
-      curr_offset -= kStep;
+      idx--;
     } else {
-      curr_offset += kStep;
+      idx++;
     }
-    curr_offset %= kTotalBits;
-    p = p->prev;
+    p = ray_seg_store->GetParent(p);
   }
 
   return result;
 }
 
 
-bool NoneRayPathFilter::FilterPath(const Crystal* /* crystal */, RaySegment* /* r */) const {
+bool NoneRayPathFilter::FilterPath(const Crystal* /* crystal */, const RayPathInfo& /* ray_path */) const {
   return true;
 }
 
@@ -216,105 +376,107 @@ void SpecificRayPathFilter::ClearPaths() {
 
 void SpecificRayPathFilter::ApplySymmetry(const Crystal* crystal) {
   std::vector<std::vector<uint16_t>> augmented_ray_paths;
+  std::vector<int> augmented_path_ids;  // Index of original path.
 
   // Add the original path.
-  for (const auto& rp : ray_paths_) {
-    augmented_ray_paths.emplace_back(rp);
+  for (size_t i = 0; i < ray_paths_.size(); i++) {
+    augmented_ray_paths.emplace_back(ray_paths_[i]);
+    augmented_path_ids.emplace_back(static_cast<int>(i));
   }
 
   // Add symmetry P.
   auto period = crystal->GetFaceNumberPeriod();
   std::vector<uint16_t> tmp_ray_path;
   if (period > 0 && (symmetry_flag_ & kSymmetryPrism)) {
-    std::vector<std::vector<uint16_t>> ray_paths_copy(augmented_ray_paths);
-    for (const auto& rp : ray_paths_copy) {
+    auto path_num = augmented_ray_paths.size();
+    for (size_t k = 0; k < path_num; k++) {
       for (int i = 0; i < period; i++) {
         tmp_ray_path.clear();
-        for (auto fn : rp) {
+        for (auto fn : augmented_ray_paths[k]) {
           if (fn != 1 && fn != 2) {
             fn = static_cast<uint16_t>((fn + period + i - 3) % period + 3);
           }
           tmp_ray_path.emplace_back(fn);
         }
         augmented_ray_paths.emplace_back(tmp_ray_path);
+        augmented_path_ids.emplace_back(augmented_path_ids[k]);
       }
     }
   }
 
   // Add symmetry B.
   if (symmetry_flag_ & kSymmetryBasal) {
-    std::vector<std::vector<uint16_t>> ray_paths_copy(augmented_ray_paths);
-    for (const auto& rp : ray_paths_copy) {
+    auto path_num = augmented_ray_paths.size();
+    for (size_t k = 0; k < path_num; k++) {
       tmp_ray_path.clear();
-      for (auto fn : rp) {
+      for (auto fn : augmented_ray_paths[k]) {
         if (fn == 1 || fn == 2) {
           fn = static_cast<uint16_t>(fn % 2 + 1);
         }
         tmp_ray_path.emplace_back(fn);
       }
       augmented_ray_paths.emplace_back(tmp_ray_path);
+      augmented_path_ids.emplace_back(augmented_path_ids[k]);
     }
   }
 
   // Add symmetry D.
   if (period > 0 && (symmetry_flag_ & kSymmetryDirection)) {
-    std::vector<std::vector<uint16_t>> ray_paths_copy(augmented_ray_paths);
-    for (const auto& rp : ray_paths_copy) {
+    auto path_num = augmented_ray_paths.size();
+    for (size_t k = 0; k < path_num; k++) {
       tmp_ray_path.clear();
-      for (auto fn : rp) {
+      for (auto fn : augmented_ray_paths[k]) {
         if (fn != 1 && fn != 2) {
           fn = static_cast<uint16_t>(5 + period - fn);
         }
         tmp_ray_path.emplace_back(fn);
       }
       augmented_ray_paths.emplace_back(tmp_ray_path);
+      augmented_path_ids.emplace_back(augmented_path_ids[k]);
     }
   }
 
-  // Add them all.
-  ray_path_hashes_.clear();
-  for (const auto& rp : augmented_ray_paths) {
-    ray_path_hashes_.emplace(RayPathHash(rp));
-  }
+  // Compile them all.
+  path_automaton_.Build(augmented_ray_paths, augmented_path_ids);
 }
 
 
-bool SpecificRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_r) const {
-  if (ray_path_hashes_.empty()) {
-    return true;
-  }
+const RayPathAutomaton* SpecificRayPathFilter::GetPathAutomaton() const {
+  return &path_automaton_;
+}
 
-  int curr_fn0 = crystal->FaceNumber(last_r->root_ctx->first_ray_segment->face_id);
-  if (curr_fn0 < 0 || crystal->GetFaceNumberPeriod() < 0) {  // If do not have face number mapping.
-    return true;
-  }
 
-  // First, check ray path length.
-  size_t curr_ray_path_len = 0;
-  auto p = last_r;
-  while (p->prev) {
-    int curr_fn = crystal->FaceNumber(p->face_id);
-    if (curr_fn < 0) {
+bool SpecificRayPathFilter::CanPruneRays(const Crystal* crystal) const {
+  // Complementary filter accepts rays that fail on paths. And FilterPath() accepts all rays if a crystal does not
+  // have face numbers.
+  if (path_automaton_.Empty() || complementary_ || crystal->GetFaceNumberPeriod() < 0) {
+    return false;
+  }
+  for (int i = 0; i < crystal->TotalFaces(); i++) {
+    if (crystal->FaceNumber(i) < 0) {
       return false;
     }
-    p = p->prev;
-    curr_ray_path_len++;
-  }
-  if (curr_ray_path_len == 0) {
-    return false;
   }
+  return true;
+}
 
-  bool length_matched = false;
-  for (const auto& rp : ray_paths_) {
-    length_matched = length_matched || (curr_ray_path_len == rp.size());
+
+int SpecificRayPathFilter::GetMatchedPath(const RayPathInfo& ray_path) const {
+  return path_automaton_.GetMatchedPathId(ray_path.path_state);
+}
+
+
+bool SpecificRayPathFilter::FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const {
+  if (path_automaton_.Empty()) {
+    return true;
   }
-  if (!length_matched) {
-    return false;
+
+  int curr_fn0 = crystal->FaceNumber(ray_path.entry_face_id);
+  if (curr_fn0 < 0 || crystal->GetFaceNumberPeriod() < 0) {  // If do not have face number mapping.
+    return true;
   }
 
-  // Second, for each filter path, normalize current ray path, and find it in ray_path_hashes.
-  auto current_ray_path_hash = RayPathHash(crystal, last_r, curr_ray_path_len, true);
-  return ray_path_hashes_.count(current_ray_path_hash) != 0;
+  return GetMatchedPath(ray_path) >= 0;
 }
 
 
@@ -407,25 +569,17 @@ void GeneralRayPathFilter::ClearHitNumbers() {
 }
 
 
-bool GeneralRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_r) const {
+bool GeneralRayPathFilter::FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const {
   if (entry_faces_.empty() && exit_faces_.empty()) {
     return true;
   }
 
-  if (!hit_nums_.empty()) {  // Check hit number.
-    auto p = last_r;
-    int n = 0;
-    while (p) {
-      p = p->prev;
-      n++;
-    }
-    if (hit_nums_.count(n) == 0) {
-      return false;
-    }
+  if (!hit_nums_.empty() && hit_nums_.count(ray_path.hit_num) == 0) {  // Check hit number.
+    return false;
   }
 
-  int curr_entry_fn = crystal->FaceNumber(last_r->root_ctx->first_ray_segment->face_id);
-  int curr_exit_fn = crystal->FaceNumber(last_r->face_id);
+  int curr_entry_fn = crystal->FaceNumber(ray_path.entry_face_id);
+  int curr_exit_fn = crystal->FaceNumber(ray_path.exit_face_id);
   if (curr_entry_fn < 0 || curr_exit_fn < 0 ||
       crystal->GetFaceNumberPeriod() < 0) {  // If do not have a face number mapping
     return true;
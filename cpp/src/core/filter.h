@@ -1,6 +1,7 @@
 #ifndef SRC_CORE_FILTER_H_
 #define SRC_CORE_FILTER_H_
 
+#include <climits>
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
@@ -21,14 +22,115 @@ enum Symmetry : uint8_t {
 
 
 size_t RayPathHash(const std::vector<uint16_t>& ray_path, bool reverse = false);
-size_t RayPathHash(const Crystal* crystal, const RaySegment* last_ray, int length, bool reverse = false);
+size_t RayPathHash(const Crystal* crystal, PoolHandle last_ray, int length, bool reverse = false);
+
+
+/*! @brief Hash of the face number at position idx of a ray path. RayPathHash() is XOR of them all.
+ *
+ * So the hash of a ray path can be updated incrementally as the ray goes.
+ */
+inline size_t RayPathHashItem(unsigned int fn, size_t idx) {
+  constexpr size_t kStep = 7;
+  constexpr size_t kTotalBits = sizeof(size_t) * CHAR_BIT;
+
+  size_t offset = idx * kStep % kTotalBits;
+  size_t v = fn;
+  return offset == 0 ? v : (v << offset) | (v >> (kTotalBits - offset));
+}
+
+
+/*! @brief Face numbers of a ray path, packed in 128 bits, 8 bits for each face, in forward order.
+ *
+ * Face numbers out of [0, kUnknownFaceNumber), including faces without a number, are stored as kUnknownFaceNumber.
+ */
+struct RayPathCode {
+  unsigned int Get(int idx) const;
+  void Set(int idx, int fn);
+  bool HasUnknownFace(int length) const;  // Check the first length faces.
+
+  static constexpr int kMaxLength = 16;
+  static constexpr unsigned int kUnknownFaceNumber = 0xff;
+
+  uint64_t code[2];
+};
+
+
+/*! @brief A deterministic automaton over face numbers, i.e. a trie, compiled from a set of ray paths.
+ *
+ * It starts from kInitState, and advances one state for every face a ray hits. kDeadState means no path starts with
+ * face numbers so far. Matching is exact, and it is read-only after built, so it can be shared across threads.
+ */
+class RayPathAutomaton {
+ public:
+  RayPathAutomaton();
+
+  /*! @brief Build from paths. path_ids[i] is reported when paths[i] matches. The first one wins on duplicated paths. */
+  void Build(const std::vector<std::vector<uint16_t>>& paths, const std::vector<int>& path_ids);
+  void Clear();
+  bool Empty() const;
+
+  int Next(int state, int fn) const;
+  int Run(const RayPathCode& path_code, int length) const;  // Start from kInitState and go along a path code.
+  int GetMatchedPathId(int state) const;                    // -1 if no path ends at this state.
+  bool CanGoFurther(int state) const;                       // If some longer path starts with current path.
+
+  static constexpr int kInitState = 0;
+  static constexpr int kDeadState = -1;
+
+ private:
+  int AddState();
+
+  int symbol_num_;
+  std::vector<int> symbols_;      // Symbol of every face number, -1 if the face number is not in any path.
+  std::vector<int> transitions_;  // Next state, indexed by state * symbol_num_ + symbol.
+  std::vector<int> matched_path_ids_;
+  std::vector<uint8_t> can_go_further_;
+};
+
+
+/*! @brief Information of an exit ray and its path, on which filters make decisions.
+ *
+ * It can be filled from a ray segment tree, or directly from tracing buffers, where path code and hash are
+ * updated on every hit, so that no pointer walk is needed.
+ */
+struct RayPathInfo {
+  RayPathInfo();
+  RayPathInfo(const Crystal* crystal, PoolHandle last_r);
+
+  const float* entry_dir;  // Incident direction, in crystal frame.
+  const float* exit_dir;   // Exit direction, in crystal frame.
+  int entry_face_id;       //
+  int exit_face_id;        //
+  int hit_num;             // Number of ray segments, including the incident one.
+  size_t path_hash;        // RayPathHash() of the path, i.e. faces hit after entry, hit_num - 1 in total.
+  RayPathCode path_code;   // Face numbers of the path.
+  int path_state;          // See AbstractRayPathFilter::GetPathAutomaton().
+};
 
 
 class AbstractRayPathFilter : public IJsonizable {
  public:
   AbstractRayPathFilter();
 
-  bool Filter(const Crystal* crystal, RaySegment* last_r) const;
+  bool Filter(const Crystal* crystal, const RayPathInfo& ray_path) const;
+  bool Filter(const Crystal* crystal, PoolHandle last_r) const;
+
+  /**
+   * @brief Get the automaton of accepted paths, if this filter decides on ray paths.
+   *
+   * It is valid after ApplySymmetry(). A tracer advances RayPathInfo::path_state with it on every hit.
+   * Default implementation returns nullptr.
+   */
+  virtual const RayPathAutomaton* GetPathAutomaton() const;
+
+  /**
+   * @brief Check if rays in given crystal can be dropped during tracing.
+   *
+   * If it is true, a ray still in crystal can be dropped once RayPathAutomaton::CanGoFurther() is false for its
+   * path state, because it cannot pass this filter when it exits. Call it after ApplySymmetry(). Default
+   * implementation returns false.
+   */
+  virtual bool CanPruneRays(const Crystal* crystal) const;
 
   void SetSymmetryFlag(uint8_t symmetry_flag);
   void AddSymmetry(Symmetry symmetry);
@@ -45,7 +147,7 @@ class AbstractRayPathFilter : public IJsonizable {
   void LoadFromJson(const rapidjson::Value& root) override;
 
  protected:
-  virtual bool FilterPath(const Crystal* crystal, RaySegment* last_r) const = 0;
+  virtual bool FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const = 0;
 
   uint8_t symmetry_flag_;
   bool complementary_;
@@ -60,7 +162,7 @@ class NoneRayPathFilter : public AbstractRayPathFilter {
   void SaveToJson(rapidjson::Value& root, rapidjson::Value::AllocatorType& allocator) override;
 
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const override;
 };
 
 
@@ -69,15 +171,20 @@ class SpecificRayPathFilter : public AbstractRayPathFilter {
   void AddPath(const std::vector<uint16_t>& path);
   void ClearPaths();
 
+  /*! @brief Get index of the path (in order of AddPath()) that a ray matches, with symmetry. -1 if none. */
+  int GetMatchedPath(const RayPathInfo& ray_path) const;
+
   void ApplySymmetry(const Crystal* crystal) override;
+  const RayPathAutomaton* GetPathAutomaton() const override;
+  bool CanPruneRays(const Crystal* crystal) const override;
   void SaveToJson(rapidjson::Value& root, rapidjson::Value::AllocatorType& allocator) override;
   void LoadFromJson(const rapidjson::Value& root) override;
 
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const override;
 
  private:
-  std::unordered_set<size_t> ray_path_hashes_;
+  RayPathAutomaton path_automaton_;  // Built from symmetry augmented paths.
   std::vector<std::vector<uint16_t>> ray_paths_;
 };
 
@@ -94,7 +201,7 @@ class GeneralRayPathFilter : public AbstractRayPathFilter {
   void LoadFromJson(const rapidjson::Value& root) override;
 
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, const RayPathInfo& ray_path) const override;
 
  private:
   std::unordered_set<uint16_t> entry_faces_;
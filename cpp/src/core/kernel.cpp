@@ -0,0 +1,108 @@
+#include "core/kernel.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+
+
+namespace icehalo {
+
+// Defined in kernel_impl.h, once for every SIMD level.
+namespace kernel_scalar {
+extern const KernelTable kKernelTable;
+}  // namespace kernel_scalar
+
+namespace kernel_sse4 {
+extern const KernelTable kKernelTable;
+}  // namespace kernel_sse4
+
+namespace kernel_avx2 {
+extern const KernelTable kKernelTable;
+}  // namespace kernel_avx2
+
+namespace kernel_avx512 {
+extern const KernelTable kKernelTable;
+}  // namespace kernel_avx512
+
+
+SimdLevel GetMaxSimdLevel() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  // It also checks that the OS saves AVX and AVX-512 registers.
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (avx2 && __builtin_cpu_supports("avx512f")) {
+    return SimdLevel::kAvx512;
+  } else if (avx2) {
+    return SimdLevel::kAvx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    return SimdLevel::kSse4;
+  }
+#endif
+  return SimdLevel::kScalar;
+}
+
+
+SimdLevel GetSimdLevel() {
+  static const SimdLevel kLevel = [] {
+    auto max_level = GetMaxSimdLevel();
+    const char* name = std::getenv("ICEHALO_SIMD_LEVEL");
+    if (name == nullptr || name[0] == '\0') {
+      return max_level;
+    }
+
+    for (auto level : { SimdLevel::kScalar, SimdLevel::kSse4, SimdLevel::kAvx2, SimdLevel::kAvx512 }) {
+      if (std::strcmp(name, GetSimdLevelName(level)) != 0) {
+        continue;
+      }
+      if (level > max_level) {
+        std::fprintf(stderr, "WARNING! ICEHALO_SIMD_LEVEL %s is not supported by CPU. Use %s instead.\n", name,
+                     GetSimdLevelName(max_level));
+        return max_level;
+      }
+      return level;
+    }
+    std::fprintf(stderr, "WARNING! Unknown ICEHALO_SIMD_LEVEL %s. Use %s instead.\n", name,
+                 GetSimdLevelName(max_level));
+    return max_level;
+  }();
+  return kLevel;
+}
+
+
+const char* GetSimdLevelName(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kScalar:
+      return "scalar";
+    case SimdLevel::kSse4:
+      return "sse4";
+    case SimdLevel::kAvx2:
+      return "avx2";
+    case SimdLevel::kAvx512:
+      return "avx512";
+  }
+  return "";
+}
+
+
+const KernelTable& GetKernels() {
+  static const KernelTable& kKernels = GetKernels(GetSimdLevel());
+  return kKernels;
+}
+
+
+const KernelTable& GetKernels(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kSse4:
+      return kernel_sse4::kKernelTable;
+    case SimdLevel::kAvx2:
+      return kernel_avx2::kKernelTable;
+    case SimdLevel::kAvx512:
+      return kernel_avx512::kKernelTable;
+    case SimdLevel::kScalar:
+    default:
+      return kernel_scalar::kKernelTable;
+  }
+}
+
+}  // namespace icehalo
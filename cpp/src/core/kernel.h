@@ -0,0 +1,119 @@
+#ifndef SRC_CORE_KERNEL_H_
+#define SRC_CORE_KERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace icehalo {
+
+class Bvh;
+class FresnelTable;
+enum class VisibleRange;
+
+
+/*! @brief SIMD instruction set levels that kernels are built for, from low to high. */
+enum class SimdLevel {
+  kScalar,  // Baseline x86-64, no explicit SIMD code
+  kSse4,    // SSE4.1
+  kAvx2,    // AVX2 and FMA
+  kAvx512,  // AVX-512F, AVX2 and FMA
+};
+
+
+/**
+ * @brief Hot kernels built for one SIMD level.
+ *
+ * Every kernel source is compiled once for every SIMD level (see kernel_impl.h), and each build fills one table.
+ * Public functions, such as Optics::HitSurface() or math::RotateZ(), call kernels in the table picked at startup.
+ * Arguments are the same as those public functions. See them for details.
+ */
+struct KernelTable {
+  using LineTrianglesKernel = void (*)(const float* pt, const float* dir,  // input
+                                       int face_id, int face_num,          // input
+                                       const float* face_bases,            // input, (pt1 - pt2, pt1 - pt3)
+                                       const float* face_points,           // input, (pt1, pt2, pt3)
+                                       const float* face_norm,             // input
+                                       float* p, int* idx);                // output
+  using LinesTrianglesPacketKernel = void (*)(const float* pt, const float* dir, const int* face_id,  // input
+                                              int face_num, const float* face_data,                 // input
+                                              float* t, int* idx);                                  // output
+  using LinesPlanesPacketKernel = void (*)(const float* pt, const float* dir, const int* face_id,  // input
+                                           const float* face_norm, int plane_num,                 // input
+                                           const float* plane_norm, const float* plane_dist,      // input
+                                           const uint64_t* plane_mask,                            // input
+                                           float* t, int* idx);                                   // output
+  using LinesBvhPacketKernel = void (*)(const float* pt, const float* dir, const int* face_id,  // input
+                                        const float* face_norm, const Bvh* bvh,                // input
+                                        float* t, int* idx);                                   // output
+  using HitSurfaceKernel = void (*)(float n, const FresnelTable* fresnel,           // input
+                                    size_t num, const float* dir_in,                // input
+                                    const float* face_norm, const int* face_id_in,  // input
+                                    const float* w_in,                              // input
+                                    float* dir_out, float* w_out);                  // output
+  using HitSurfacePacketKernel = void (*)(float n, const FresnelTable* fresnel,                          // input
+                                          const float* dir, const float* norm, const float* w,  // input
+                                          float* dir_reflection, float* dir_refraction,         // output
+                                          float* w_reflection, float* w_refraction);            // output
+  using RotateZWithDataStepKernel = void (*)(const float* lon_lat_roll,                      // input
+                                             const float* input_vec,                         // input
+                                             float* output_vec,                              // output
+                                             size_t input_step, size_t output_step, size_t data_num);
+  using RotateZBackKernel = void (*)(const float* lon_lat_roll, const float* input_vec,  // input
+                                     float* output_vec, size_t data_num);                // output
+  using ProjectionKernel = void (*)(const float* cam_rot,          // Camera rotation (lon, lat, roll), in degree.
+                                    float hov,                     // Half field of view, in degree
+                                    size_t data_number,            // Data number
+                                    const float* dir,              // Ray directions, [x, y, z]
+                                    int img_wid, int img_hei,      // Image size
+                                    int* img_xy,                   // Image coordinates
+                                    VisibleRange visible_range);  // Visible range
+
+  SimdLevel level;
+
+  LineTrianglesKernel intersect_line_with_triangles;
+  LineTrianglesKernel intersect_line_with_triangles_simd;
+  LinesTrianglesPacketKernel intersect_lines_with_triangles_packet;
+  LinesPlanesPacketKernel intersect_lines_with_planes_packet;     // Any plane number
+  LinesPlanesPacketKernel intersect_lines_with_planes_packet_8;   // Unrolled for 8 planes. plane_num is ignored
+  LinesPlanesPacketKernel intersect_lines_with_planes_packet_10;  // Unrolled for 10 planes. plane_num is ignored
+  LinesPlanesPacketKernel intersect_lines_with_planes_packet_20;  // Unrolled for 20 planes. plane_num is ignored
+  LinesBvhPacketKernel intersect_lines_with_bvh_packet;
+  HitSurfaceKernel hit_surface;
+  HitSurfaceKernel hit_surface_simd;
+  HitSurfacePacketKernel hit_surface_packet;
+
+  RotateZWithDataStepKernel rotate_z_with_data_step;
+  RotateZBackKernel rotate_z_back;
+
+  ProjectionKernel rect_linear;
+  ProjectionKernel equal_area_fish_eye;
+  ProjectionKernel equidistant_fish_eye;
+  ProjectionKernel dual_equal_area_fish_eye;
+  ProjectionKernel dual_equidistant_fish_eye;
+};
+
+
+/*! @brief The highest SIMD level supported by the running CPU, found with cpuid. */
+SimdLevel GetMaxSimdLevel();
+
+/**
+ * @brief The SIMD level used by kernels. It is chosen at first call and never changes.
+ *
+ * It is GetMaxSimdLevel() by default. Environment variable ICEHALO_SIMD_LEVEL (one of scalar, sse4, avx2, avx512)
+ * forces a lower level, e.g. for benchmarking. A level higher than GetMaxSimdLevel() is not allowed, and a warning
+ * is printed.
+ */
+SimdLevel GetSimdLevel();
+
+const char* GetSimdLevelName(SimdLevel level);
+
+/*! @brief Kernels of GetSimdLevel(). */
+const KernelTable& GetKernels();
+
+/*! @brief Kernels of a given level. The caller must make sure that the CPU supports it. */
+const KernelTable& GetKernels(SimdLevel level);
+
+}  // namespace icehalo
+
+
+#endif  // SRC_CORE_KERNEL_H_
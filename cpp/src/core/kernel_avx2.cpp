@@ -0,0 +1,8 @@
+// Kernels for SimdLevel::kAvx2. See kernel_impl.h
+#if !defined(__AVX2__) || !defined(__FMA__) || defined(__AVX512F__)
+#error "kernel_avx2.cpp must be compiled with AVX2 and FMA but without AVX-512"
+#endif
+
+#define ICEHALO_KERNEL_NAMESPACE kernel_avx2
+#define ICEHALO_KERNEL_LEVEL kAvx2
+#include "core/kernel_impl.h"
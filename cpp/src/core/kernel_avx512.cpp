@@ -0,0 +1,8 @@
+// Kernels for SimdLevel::kAvx512. See kernel_impl.h
+#if !defined(__AVX512F__) || !defined(__AVX2__) || !defined(__FMA__)
+#error "kernel_avx512.cpp must be compiled with AVX-512F, AVX2 and FMA"
+#endif
+
+#define ICEHALO_KERNEL_NAMESPACE kernel_avx512
+#define ICEHALO_KERNEL_LEVEL kAvx512
+#include "core/kernel_impl.h"
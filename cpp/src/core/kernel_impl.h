@@ -0,0 +1,1425 @@
+// This file has no include guard. It is included once by every kernel_<level>.cpp, with ICEHALO_KERNEL_NAMESPACE
+// and ICEHALO_KERNEL_LEVEL defined, and every such source is compiled with compiler flags of its SIMD level. Thus
+// code here is built for every level, and the level specific branches are selected by macros like __AVX2__.
+//
+// Inline functions defined in other files, e.g. std::sqrt(float), std::max() or members of std::unique_ptr, are not
+// used here. If one of them is not inlined, the linker keeps only one copy of it, which may be the copy built here
+// with instructions that the CPU lacks. C library functions (e.g. sqrtf()), plain new / delete, and out-of-line
+// functions (e.g. math::Dot3()) are used instead.
+#if !defined(ICEHALO_KERNEL_NAMESPACE) || !defined(ICEHALO_KERNEL_LEVEL)
+#error "ICEHALO_KERNEL_NAMESPACE and ICEHALO_KERNEL_LEVEL must be defined before including kernel_impl.h"
+#endif
+
+#include <immintrin.h>
+#include <math.h>
+
+#include <cstring>
+#include <limits>
+
+#include "core/bvh.h"
+#include "core/kernel.h"
+#include "core/mymath.h"
+#include "core/optics.h"
+#include "core/render.h"
+
+
+namespace icehalo {
+
+namespace ICEHALO_KERNEL_NAMESPACE {
+
+constexpr int kPacketSize = Optics::kPacketSize;
+constexpr int kPacketFaceDataSize = Optics::kPacketFaceDataSize;
+constexpr float kFloatMax = std::numeric_limits<float>::max();
+constexpr int kInvalidImgXy = std::numeric_limits<int>::min();
+
+#if defined(__AVX512F__)
+// Some AVX-512 intrinsics fill unused lanes from _mm512_undefined_ps(), which GCC reports as uninitialized. Their
+// masked forms with an explicit source (or zero) are used instead, such as the ones below.
+inline __m512 GatherPs(__m512i idx, const float* addr) {
+  return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, idx, addr, 4);
+}
+
+inline __m512 AbsPs(__m512 x) {
+  return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(0x7fffffff)));
+}
+#endif
+
+
+void IntersectLineWithTriangles(const float* pt, const float* dir,  // input
+                                int face_id, int face_num,          // input
+                                const float* face_bases,            // input (pt1 - pt2, pt1 - pt3)
+                                const float* face_points,           // input (pt1, pt2, pt3)
+                                const float* face_norm,             // input
+                                float* p, int* idx) {               // output
+  float min_t = kFloatMax;
+  const float* norm_in = face_norm + face_id * 3;
+  float flag_in = math::Dot3(dir, norm_in);
+
+  for (int i = 0; i < face_num; i++) {
+    const float* curr_face_point = face_points + i * 9;
+    const float* curr_face_base = face_bases + i * 6;
+    const float* curr_face_norm = face_norm + i * 3;
+
+    if (math::Dot3(dir, curr_face_norm) * flag_in >= 0) {
+      continue;
+    }
+
+    float ff04 = curr_face_base[0] * curr_face_base[4];
+    float ff05 = curr_face_base[0] * curr_face_base[5];
+    float ff13 = curr_face_base[1] * curr_face_base[3];
+    float ff15 = curr_face_base[1] * curr_face_base[5];
+    float ff23 = curr_face_base[2] * curr_face_base[3];
+    float ff24 = curr_face_base[2] * curr_face_base[4];
+
+    float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 - dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
+    if (math::FloatEqualZero(c)) {
+      continue;
+    }
+
+
+    float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
+              ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
+    float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 - pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
+    float t = (a - b) / c;
+    if (t <= math::kFloatEps) {
+      continue;
+    }
+
+    float dp01 = dir[0] * pt[1];
+    float dp02 = dir[0] * pt[2];
+    float dp10 = dir[1] * pt[0];
+    float dp12 = dir[1] * pt[2];
+    float dp20 = dir[2] * pt[0];
+    float dp21 = dir[2] * pt[1];
+
+    a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] - dp21 * curr_face_base[3] -
+        dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
+    b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
+        dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
+        dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
+    float alpha = (a + b) / c;
+    if (alpha < 0 || alpha > 1) {
+      continue;
+    }
+
+    a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] - dp21 * curr_face_base[0] -
+        dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
+    b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
+        dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
+        dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
+    float beta = -(a + b) / c;
+
+    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
+      min_t = t;
+      p[0] = pt[0] + t * dir[0];
+      p[1] = pt[1] + t * dir[1];
+      p[2] = pt[2] + t * dir[2];
+      *idx = i;
+    }
+  }
+}
+
+
+void IntersectLineWithTrianglesSimd(const float* pt, const float* dir,  // input
+                                    int face_id, int face_num,          // input
+                                    const float* face_bases,            // input
+                                    const float* face_points,           // input
+                                    const float* face_norm,             // input
+                                    float* p, int* idx) {               // output
+#if defined(__SSE4_1__)
+  float min_t = kFloatMax;
+  const float* norm_in = face_norm + face_id * 3;
+
+  __m128 DIR = _mm_loadu_ps(dir);
+  __m128 PT = _mm_loadu_ps(pt);
+  __m128 NORM_IN = _mm_loadu_ps(norm_in);
+  __m128 DN_IN = _mm_dp_ps(DIR, NORM_IN, 0x71);
+
+  for (int i = 0; i < face_num; i++) {
+    const float* curr_face_point = face_points + i * 9;
+    const float* curr_face_base = face_bases + i * 6;
+    const float* curr_face_norm = face_norm + i * 3;
+
+    __m128 CURR_FACE_NORM = _mm_loadu_ps(curr_face_norm);
+
+    __m128 DN_CURR = _mm_dp_ps(DIR, CURR_FACE_NORM, 0x71);
+    __m128 FLAG = _mm_mul_ps(DN_IN, DN_CURR);
+
+    if (FLAG[0] >= 0) {
+      continue;
+    }
+
+    /* Here use permute to get the production of curr_face_base.
+     * The original plain code is:
+     *
+     *   float ff04 = curr_face_base[0] * curr_face_base[4];
+     *   float ff05 = curr_face_base[0] * curr_face_base[5];
+     *   float ff13 = curr_face_base[1] * curr_face_base[3];
+     *   float ff15 = curr_face_base[1] * curr_face_base[5];
+     *   float ff23 = curr_face_base[2] * curr_face_base[3];
+     *   float ff24 = curr_face_base[2] * curr_face_base[4];
+     *
+     *        |<-- high -- low -->|
+     * index: 5   4   3   2   1   0
+     * index: 1   0   2   4   3   5
+     */
+    __m128 CURR_FB0 = _mm_loadu_ps(curr_face_base + 0);
+    __m128 CURR_FB1 = _mm_loadu_ps(curr_face_base + 3);
+    __m128 FF0 = _mm_mul_ps(CURR_FB0, _mm_shuffle_ps(CURR_FB1, CURR_FB1, 0xD2));
+    __m128 FF1 = _mm_mul_ps(CURR_FB1, _mm_shuffle_ps(CURR_FB0, CURR_FB0, 0xD2));
+
+    /*
+     * The original plain code is:
+     *
+     *   float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 -
+     *             dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
+     *
+     *      |<-- high ------ low -->|
+     * dir: 2   1   0   -   2   1   0
+     * ff1: 1   0   2  ff0: 1   0   2
+     */
+    __m128 SUB_FF = _mm_sub_ps(FF1, FF0);
+    __m128 SUB_PERM_FF = _mm_shuffle_ps(SUB_FF, SUB_FF, 0xD2);
+    __m128 C = _mm_dp_ps(DIR, SUB_PERM_FF, 0x71);
+
+    if (math::FloatEqualZero(C[0])) {
+      continue;
+    }
+
+
+    /*
+     *   float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
+     *             ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
+     *   float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 -
+     *             pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
+     *
+     *        |<-- high ------ low -->|
+     * fp/pt: 2   1   0   -   2   1   0
+     * ff1  : 1   0   2  ff0: 1   0   2
+     */
+    __m128 CURR_FACE_POINT = _mm_loadu_ps(curr_face_point);
+    __m128 A = _mm_dp_ps(SUB_PERM_FF, CURR_FACE_POINT, 0x71);
+    __m128 B = _mm_dp_ps(SUB_PERM_FF, PT, 0x71);
+    float t = (A[0] - B[0]) / C[0];
+    if (t <= math::kFloatEps) {
+      continue;
+    }
+    __m128 FACE_POINT_C9 = _mm_shuffle_ps(CURR_FACE_POINT, CURR_FACE_POINT, 0xC9);
+    __m128 FACE_POINT_D2 = _mm_shuffle_ps(CURR_FACE_POINT, CURR_FACE_POINT, 0xD2);
+
+    /*
+     *   float dp01 = dir[0] * pt[1];
+     *   float dp02 = dir[0] * pt[2];
+     *   float dp10 = dir[1] * pt[0];
+     *   float dp12 = dir[1] * pt[2];
+     *   float dp20 = dir[2] * pt[0];
+     *   float dp21 = dir[2] * pt[1];
+     *
+     *      |<-- high -|-- low -->|
+     * dir: 2   1   0  |  2   1   0
+     * pt : 1   0   2  |  0   2   1
+     */
+    __m128 DP0 = _mm_mul_ps(DIR, _mm_shuffle_ps(PT, PT, 0xC9));
+    __m128 DP1 = _mm_mul_ps(DIR, _mm_shuffle_ps(PT, PT, 0xD2));
+    __m128 SUB_PERM_DP = _mm_sub_ps(_mm_shuffle_ps(DP0, DP0, 0xC9), _mm_shuffle_ps(DP1, DP1, 0xD2));
+
+    /*
+     *   a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] -
+     *       dp21 * curr_face_base[3] - dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
+     *   b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
+     *       dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
+     *       dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
+     *
+     * a:
+     *      |<-- high ---|--- low -->|
+     * fb1: 5   4   3  - |   5   4   3
+     * dp0: 0   2   1  dp1:  1   0   2
+     *
+     * b:
+     *      |<-- high --|--- low -->|
+     * dir: 2   1   0   |   2   1   0
+     * fb1: 3   5   4   |   4   3   5
+     * fp : 1   0   2   |   0   2   1
+     */
+    A = _mm_dp_ps(CURR_FB1, SUB_PERM_DP, 0x71);
+    B = _mm_dp_ps(DIR,
+                  _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(CURR_FB1, CURR_FB1, 0xC9), FACE_POINT_D2),
+                             _mm_mul_ps(_mm_shuffle_ps(CURR_FB1, CURR_FB1, 0xD2), FACE_POINT_C9)),
+                  0x71);
+    float alpha = (A[0] + B[0]) / C[0];
+    if (alpha < 0 || alpha > 1) {
+      continue;
+    }
+
+    /*
+     *   a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] -
+     *       dp21 * curr_face_base[0] - dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
+     *   b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
+     *       dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
+     *       dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
+     *
+     * a:
+     *      |<-- high ---|--- low -->|
+     * fb0: 2   1   0    |   2   1   0
+     * dp1: 0   2   1  dp0:  1   0   2
+     *
+     * b:
+     *      |<-- high --|--- low -->|
+     * dir: 2   1   0   |   2   1   0
+     * fb0: 0   2   1   |   1   0   2
+     * fp : 1   0   2   |   0   2   1
+     */
+    A = _mm_dp_ps(CURR_FB0, SUB_PERM_DP, 0x71);
+    B = _mm_dp_ps(DIR,
+                  _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(CURR_FB0, CURR_FB0, 0xC9), FACE_POINT_D2),
+                             _mm_mul_ps(_mm_shuffle_ps(CURR_FB0, CURR_FB0, 0xD2), FACE_POINT_C9)),
+                  0x71);
+    float beta = -(A[0] + B[0]) / C[0];
+
+    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
+      min_t = t;
+      p[0] = pt[0] + t * dir[0];
+      p[1] = pt[1] + t * dir[1];
+      p[2] = pt[2] + t * dir[2];
+      *idx = i;
+    }
+  }
+#else
+  IntersectLineWithTriangles(pt, dir, face_id, face_num, face_bases, face_points, face_norm, p, idx);
+#endif
+}
+
+
+void IntersectLinesWithTrianglesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                       int face_num, const float* face_data,                 // input
+                                       float* t, int* idx) {                                 // output
+  constexpr int kN = kPacketSize;
+#if defined(__AVX512F__)
+  __m512 PX = _mm512_loadu_ps(pt);
+  __m512 PY = _mm512_loadu_ps(pt + kN);
+  __m512 PZ = _mm512_loadu_ps(pt + kN * 2);
+  __m512 DX = _mm512_loadu_ps(dir);
+  __m512 DY = _mm512_loadu_ps(dir + kN);
+  __m512 DZ = _mm512_loadu_ps(dir + kN * 2);
+
+  // Normal of the face every line starts from
+  __m512i FACE_OFFSET = _mm512_mullo_epi32(_mm512_loadu_si512(face_id), _mm512_set1_epi32(kPacketFaceDataSize));
+  __m512 DN_IN = _mm512_mul_ps(DX, GatherPs(FACE_OFFSET, face_data + 0));
+  DN_IN = _mm512_add_ps(DN_IN, _mm512_mul_ps(DY, GatherPs(FACE_OFFSET, face_data + 1)));
+  DN_IN = _mm512_add_ps(DN_IN, _mm512_mul_ps(DZ, GatherPs(FACE_OFFSET, face_data + 2)));
+
+  // cross(dir, pt)
+  __m512 XX = _mm512_sub_ps(_mm512_mul_ps(DY, PZ), _mm512_mul_ps(DZ, PY));
+  __m512 XY = _mm512_sub_ps(_mm512_mul_ps(DZ, PX), _mm512_mul_ps(DX, PZ));
+  __m512 XZ = _mm512_sub_ps(_mm512_mul_ps(DX, PY), _mm512_mul_ps(DY, PX));
+
+  const __m512 ZERO = _mm512_setzero_ps();
+  const __m512 ONE = _mm512_set1_ps(1.0f);
+  const __m512 EPS = _mm512_set1_ps(math::kFloatEps);
+  const __m512 NEG_EPS = _mm512_set1_ps(-math::kFloatEps);
+  __m512 MIN_T = _mm512_set1_ps(kFloatMax);
+  __m512i IDX = _mm512_set1_epi32(-1);
+
+  auto dot3 = [](__m512 x, __m512 y, __m512 z, const float* v) {
+    __m512 r = _mm512_mul_ps(x, _mm512_set1_ps(v[0]));
+    r = _mm512_add_ps(r, _mm512_mul_ps(y, _mm512_set1_ps(v[1])));
+    return _mm512_add_ps(r, _mm512_mul_ps(z, _mm512_set1_ps(v[2])));
+  };
+
+  for (int i = 0; i < face_num; i++) {
+    const float* curr_data = face_data + i * kPacketFaceDataSize;
+
+    __mmask16 valid = _mm512_cmp_ps_mask(_mm512_mul_ps(DN_IN, dot3(DX, DY, DZ, curr_data)), ZERO, _CMP_LT_OQ);
+    if (!valid) {
+      continue;
+    }
+
+    __m512 C = dot3(DX, DY, DZ, curr_data + 3);
+    valid &= _mm512_cmp_ps_mask(C, NEG_EPS, _CMP_LE_OQ) | _mm512_cmp_ps_mask(C, EPS, _CMP_GE_OQ);
+    __m512 INV_C = _mm512_div_ps(ONE, C);
+
+    __m512 T = _mm512_sub_ps(_mm512_set1_ps(curr_data[6]), dot3(PX, PY, PZ, curr_data + 3));
+    T = _mm512_mul_ps(T, INV_C);
+    valid &= _mm512_cmp_ps_mask(T, EPS, _CMP_GT_OQ) & _mm512_cmp_ps_mask(T, MIN_T, _CMP_LT_OQ);
+    if (!valid) {
+      continue;
+    }
+
+    __m512 ALPHA = _mm512_mul_ps(_mm512_add_ps(dot3(XX, XY, XZ, curr_data + 7), dot3(DX, DY, DZ, curr_data + 10)),  //
+                                 INV_C);
+    __m512 BETA = _mm512_mul_ps(_mm512_add_ps(dot3(XX, XY, XZ, curr_data + 13), dot3(DX, DY, DZ, curr_data + 16)),  //
+                                _mm512_sub_ps(ZERO, INV_C));
+    valid &= _mm512_cmp_ps_mask(ALPHA, ZERO, _CMP_GE_OQ) & _mm512_cmp_ps_mask(BETA, ZERO, _CMP_GE_OQ) &
+             _mm512_cmp_ps_mask(_mm512_add_ps(ALPHA, BETA), ONE, _CMP_LE_OQ);
+
+    MIN_T = _mm512_mask_blend_ps(valid, MIN_T, T);
+    IDX = _mm512_mask_blend_epi32(valid, IDX, _mm512_set1_epi32(i));
+  }
+
+  _mm512_storeu_ps(t, MIN_T);
+  _mm512_storeu_si512(idx, IDX);
+#elif defined(__AVX2__)
+  for (int b = 0; b < kN; b += 8) {  // Two halves of a packet
+    __m256 PX = _mm256_loadu_ps(pt + b);
+    __m256 PY = _mm256_loadu_ps(pt + b + kN);
+    __m256 PZ = _mm256_loadu_ps(pt + b + kN * 2);
+    __m256 DX = _mm256_loadu_ps(dir + b);
+    __m256 DY = _mm256_loadu_ps(dir + b + kN);
+    __m256 DZ = _mm256_loadu_ps(dir + b + kN * 2);
+
+    // Normal of the face every line starts from
+    __m256i FACE_OFFSET = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(face_id + b)),
+                                             _mm256_set1_epi32(kPacketFaceDataSize));
+    __m256 DN_IN = _mm256_mul_ps(DX, _mm256_i32gather_ps(face_data + 0, FACE_OFFSET, 4));
+    DN_IN = _mm256_add_ps(DN_IN, _mm256_mul_ps(DY, _mm256_i32gather_ps(face_data + 1, FACE_OFFSET, 4)));
+    DN_IN = _mm256_add_ps(DN_IN, _mm256_mul_ps(DZ, _mm256_i32gather_ps(face_data + 2, FACE_OFFSET, 4)));
+
+    // cross(dir, pt)
+    __m256 XX = _mm256_sub_ps(_mm256_mul_ps(DY, PZ), _mm256_mul_ps(DZ, PY));
+    __m256 XY = _mm256_sub_ps(_mm256_mul_ps(DZ, PX), _mm256_mul_ps(DX, PZ));
+    __m256 XZ = _mm256_sub_ps(_mm256_mul_ps(DX, PY), _mm256_mul_ps(DY, PX));
+
+    const __m256 ZERO = _mm256_setzero_ps();
+    const __m256 ONE = _mm256_set1_ps(1.0f);
+    const __m256 EPS = _mm256_set1_ps(math::kFloatEps);
+    const __m256 NEG_EPS = _mm256_set1_ps(-math::kFloatEps);
+    __m256 MIN_T = _mm256_set1_ps(kFloatMax);
+    __m256 IDX = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    auto dot3 = [](__m256 x, __m256 y, __m256 z, const float* v) {
+      __m256 r = _mm256_mul_ps(x, _mm256_set1_ps(v[0]));
+      r = _mm256_add_ps(r, _mm256_mul_ps(y, _mm256_set1_ps(v[1])));
+      return _mm256_add_ps(r, _mm256_mul_ps(z, _mm256_set1_ps(v[2])));
+    };
+
+    for (int i = 0; i < face_num; i++) {
+      const float* curr_data = face_data + i * kPacketFaceDataSize;
+
+      __m256 valid = _mm256_cmp_ps(_mm256_mul_ps(DN_IN, dot3(DX, DY, DZ, curr_data)), ZERO, _CMP_LT_OQ);
+      if (_mm256_testz_ps(valid, valid)) {
+        continue;
+      }
+
+      __m256 C = dot3(DX, DY, DZ, curr_data + 3);
+      __m256 NOT_ZERO = _mm256_or_ps(_mm256_cmp_ps(C, NEG_EPS, _CMP_LE_OQ), _mm256_cmp_ps(C, EPS, _CMP_GE_OQ));
+      valid = _mm256_and_ps(valid, NOT_ZERO);
+      __m256 INV_C = _mm256_div_ps(ONE, C);
+
+      __m256 T = _mm256_sub_ps(_mm256_set1_ps(curr_data[6]), dot3(PX, PY, PZ, curr_data + 3));
+      T = _mm256_mul_ps(T, INV_C);
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, EPS, _CMP_GT_OQ));
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, MIN_T, _CMP_LT_OQ));
+      if (_mm256_testz_ps(valid, valid)) {
+        continue;
+      }
+
+      __m256 ALPHA = _mm256_mul_ps(_mm256_add_ps(dot3(XX, XY, XZ, curr_data + 7), dot3(DX, DY, DZ, curr_data + 10)),  //
+                                   INV_C);
+      __m256 BETA = _mm256_mul_ps(_mm256_add_ps(dot3(XX, XY, XZ, curr_data + 13), dot3(DX, DY, DZ, curr_data + 16)),  //
+                                  _mm256_sub_ps(ZERO, INV_C));
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(ALPHA, ZERO, _CMP_GE_OQ));
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(BETA, ZERO, _CMP_GE_OQ));
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(ALPHA, BETA), ONE, _CMP_LE_OQ));
+
+      MIN_T = _mm256_blendv_ps(MIN_T, T, valid);
+      IDX = _mm256_blendv_ps(IDX, _mm256_castsi256_ps(_mm256_set1_epi32(i)), valid);
+    }
+
+    _mm256_storeu_ps(t + b, MIN_T);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(idx + b), _mm256_castps_si256(IDX));
+  }
+#else
+  for (int k = 0; k < kN; k++) {
+    float px = pt[k];
+    float py = pt[k + kN];
+    float pz = pt[k + kN * 2];
+    float dx = dir[k];
+    float dy = dir[k + kN];
+    float dz = dir[k + kN * 2];
+    const float* norm_in = face_data + face_id[k] * kPacketFaceDataSize;
+    float dn_in = dx * norm_in[0] + dy * norm_in[1] + dz * norm_in[2];
+    float xx = dy * pz - dz * py;
+    float xy = dz * px - dx * pz;
+    float xz = dx * py - dy * px;
+
+    t[k] = kFloatMax;
+    idx[k] = -1;
+    for (int i = 0; i < face_num; i++) {
+      const float* d = face_data + i * kPacketFaceDataSize;
+      if ((dx * d[0] + dy * d[1] + dz * d[2]) * dn_in >= 0) {
+        continue;
+      }
+      float c = dx * d[3] + dy * d[4] + dz * d[5];
+      if (math::FloatEqualZero(c)) {
+        continue;
+      }
+      float curr_t = (d[6] - (px * d[3] + py * d[4] + pz * d[5])) / c;
+      if (curr_t <= math::kFloatEps || curr_t >= t[k]) {
+        continue;
+      }
+      float alpha = (xx * d[7] + xy * d[8] + xz * d[9] + dx * d[10] + dy * d[11] + dz * d[12]) / c;
+      float beta = -(xx * d[13] + xy * d[14] + xz * d[15] + dx * d[16] + dy * d[17] + dz * d[18]) / c;
+      if (alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
+        t[k] = curr_t;
+        idx[k] = i;
+      }
+    }
+  }
+#endif
+}
+
+
+// Call f(0), f(1), ..., f(N - 1), with all calls unrolled at compile time.
+template <int I, int N>
+struct StaticFor {
+  template <class F>
+  static void Run(F& f) {
+    f(I);
+    StaticFor<I + 1, N>::Run(f);
+  }
+};
+
+template <int N>
+struct StaticFor<N, N> {
+  template <class F>
+  static void Run(F& /* f */) {}
+};
+
+
+// Planes not in plane_mask are skipped. Planes beyond 64 are always run.
+template <int PlaneNum, class F>
+void RunPlaneSteps(int plane_num, uint64_t plane_mask, F& f) {
+  auto masked_f = [&](int i) {
+    if (i >= 64 || (plane_mask >> i) & 1) {
+      f(i);
+    }
+  };
+  if (PlaneNum == Optics::kAnyPlaneNum) {
+    for (int i = 0; i < plane_num; i++) {
+      masked_f(i);
+    }
+  } else {
+    StaticFor<0, (PlaneNum > 0 ? PlaneNum : 0)>::Run(masked_f);
+  }
+}
+
+
+// Planes that any lane in [begin, end) may hit. No mask means all planes.
+uint64_t MergePlaneMask(const uint64_t* plane_mask, int begin, int end) {
+  if (!plane_mask) {
+    return ~uint64_t{ 0 };
+  }
+  uint64_t mask = 0;
+  for (int k = begin; k < end; k++) {
+    mask |= plane_mask[k];
+  }
+  return mask;
+}
+
+
+// If PlaneNum is not kAnyPlaneNum, the loop over planes is fully unrolled, and plane_num is ignored.
+template <int PlaneNum>
+void IntersectLinesWithPlanesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                    const float* face_norm, int plane_num,                 // input
+                                    const float* plane_norm, const float* plane_dist,      // input
+                                    const uint64_t* plane_mask,                            // input
+                                    float* t, int* idx) {                                  // output
+  constexpr int kN = kPacketSize;
+#if defined(__AVX512F__)
+  __m512 PX = _mm512_loadu_ps(pt);
+  __m512 PY = _mm512_loadu_ps(pt + kN);
+  __m512 PZ = _mm512_loadu_ps(pt + kN * 2);
+  __m512 DX = _mm512_loadu_ps(dir);
+  __m512 DY = _mm512_loadu_ps(dir + kN);
+  __m512 DZ = _mm512_loadu_ps(dir + kN * 2);
+
+  // Normal of the face every line starts from
+  __m512i FACE_OFFSET = _mm512_mullo_epi32(_mm512_loadu_si512(face_id), _mm512_set1_epi32(3));
+  __m512 DN_IN = _mm512_mul_ps(DX, GatherPs(FACE_OFFSET, face_norm + 0));
+  DN_IN = _mm512_add_ps(DN_IN, _mm512_mul_ps(DY, GatherPs(FACE_OFFSET, face_norm + 1)));
+  DN_IN = _mm512_add_ps(DN_IN, _mm512_mul_ps(DZ, GatherPs(FACE_OFFSET, face_norm + 2)));
+
+  const __m512 ZERO = _mm512_setzero_ps();
+  const __m512 EPS = _mm512_set1_ps(math::kFloatEps);
+  const __m512 NEG_EPS = _mm512_set1_ps(-math::kFloatEps);
+  __m512 MIN_T = _mm512_set1_ps(kFloatMax);
+  __m512i IDX = _mm512_set1_epi32(-1);
+
+  auto plane_step = [&](int i) {
+    const float* n = plane_norm + i * 3;
+    __m512 DN = _mm512_mul_ps(DX, _mm512_set1_ps(n[0]));
+    DN = _mm512_add_ps(DN, _mm512_mul_ps(DY, _mm512_set1_ps(n[1])));
+    DN = _mm512_add_ps(DN, _mm512_mul_ps(DZ, _mm512_set1_ps(n[2])));
+    __m512 PN = _mm512_mul_ps(PX, _mm512_set1_ps(n[0]));
+    PN = _mm512_add_ps(PN, _mm512_mul_ps(PY, _mm512_set1_ps(n[1])));
+    PN = _mm512_add_ps(PN, _mm512_mul_ps(PZ, _mm512_set1_ps(n[2])));
+    __m512 T = _mm512_div_ps(_mm512_sub_ps(_mm512_set1_ps(plane_dist[i]), PN), DN);
+
+    __mmask16 valid = _mm512_cmp_ps_mask(_mm512_mul_ps(DN_IN, DN), ZERO, _CMP_LT_OQ);
+    valid &= _mm512_cmp_ps_mask(DN, NEG_EPS, _CMP_LE_OQ) | _mm512_cmp_ps_mask(DN, EPS, _CMP_GE_OQ);
+    valid &= _mm512_cmp_ps_mask(T, EPS, _CMP_GT_OQ) & _mm512_cmp_ps_mask(T, MIN_T, _CMP_LT_OQ);
+
+    MIN_T = _mm512_mask_blend_ps(valid, MIN_T, T);
+    IDX = _mm512_mask_blend_epi32(valid, IDX, _mm512_set1_epi32(i));
+  };
+  RunPlaneSteps<PlaneNum>(plane_num, MergePlaneMask(plane_mask, 0, kN), plane_step);
+
+  _mm512_storeu_ps(t, MIN_T);
+  _mm512_storeu_si512(idx, IDX);
+#elif defined(__AVX2__)
+  for (int b = 0; b < kN; b += 8) {  // Two halves of a packet
+    __m256 PX = _mm256_loadu_ps(pt + b);
+    __m256 PY = _mm256_loadu_ps(pt + b + kN);
+    __m256 PZ = _mm256_loadu_ps(pt + b + kN * 2);
+    __m256 DX = _mm256_loadu_ps(dir + b);
+    __m256 DY = _mm256_loadu_ps(dir + b + kN);
+    __m256 DZ = _mm256_loadu_ps(dir + b + kN * 2);
+
+    // Normal of the face every line starts from
+    __m256i FACE_OFFSET = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(face_id + b)),
+                                             _mm256_set1_epi32(3));
+    __m256 DN_IN = _mm256_mul_ps(DX, _mm256_i32gather_ps(face_norm + 0, FACE_OFFSET, 4));
+    DN_IN = _mm256_add_ps(DN_IN, _mm256_mul_ps(DY, _mm256_i32gather_ps(face_norm + 1, FACE_OFFSET, 4)));
+    DN_IN = _mm256_add_ps(DN_IN, _mm256_mul_ps(DZ, _mm256_i32gather_ps(face_norm + 2, FACE_OFFSET, 4)));
+
+    const __m256 ZERO = _mm256_setzero_ps();
+    const __m256 EPS = _mm256_set1_ps(math::kFloatEps);
+    const __m256 NEG_EPS = _mm256_set1_ps(-math::kFloatEps);
+    __m256 MIN_T = _mm256_set1_ps(kFloatMax);
+    __m256 IDX = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    auto plane_step = [&](int i) {
+      const float* n = plane_norm + i * 3;
+      __m256 DN = _mm256_mul_ps(DX, _mm256_set1_ps(n[0]));
+      DN = _mm256_add_ps(DN, _mm256_mul_ps(DY, _mm256_set1_ps(n[1])));
+      DN = _mm256_add_ps(DN, _mm256_mul_ps(DZ, _mm256_set1_ps(n[2])));
+      __m256 PN = _mm256_mul_ps(PX, _mm256_set1_ps(n[0]));
+      PN = _mm256_add_ps(PN, _mm256_mul_ps(PY, _mm256_set1_ps(n[1])));
+      PN = _mm256_add_ps(PN, _mm256_mul_ps(PZ, _mm256_set1_ps(n[2])));
+      __m256 T = _mm256_div_ps(_mm256_sub_ps(_mm256_set1_ps(plane_dist[i]), PN), DN);
+
+      __m256 valid = _mm256_cmp_ps(_mm256_mul_ps(DN_IN, DN), ZERO, _CMP_LT_OQ);
+      __m256 NOT_ZERO = _mm256_or_ps(_mm256_cmp_ps(DN, NEG_EPS, _CMP_LE_OQ), _mm256_cmp_ps(DN, EPS, _CMP_GE_OQ));
+      valid = _mm256_and_ps(valid, NOT_ZERO);
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, EPS, _CMP_GT_OQ));
+      valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, MIN_T, _CMP_LT_OQ));
+
+      MIN_T = _mm256_blendv_ps(MIN_T, T, valid);
+      IDX = _mm256_blendv_ps(IDX, _mm256_castsi256_ps(_mm256_set1_epi32(i)), valid);
+    };
+    RunPlaneSteps<PlaneNum>(plane_num, MergePlaneMask(plane_mask, b, b + 8), plane_step);
+
+    _mm256_storeu_ps(t + b, MIN_T);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(idx + b), _mm256_castps_si256(IDX));
+  }
+#else
+  for (int k = 0; k < kN; k++) {
+    float px = pt[k];
+    float py = pt[k + kN];
+    float pz = pt[k + kN * 2];
+    float dx = dir[k];
+    float dy = dir[k + kN];
+    float dz = dir[k + kN * 2];
+    const float* norm_in = face_norm + face_id[k] * 3;
+    float dn_in = dx * norm_in[0] + dy * norm_in[1] + dz * norm_in[2];
+
+    t[k] = kFloatMax;
+    idx[k] = -1;
+    auto plane_step = [&](int i) {
+      const float* n = plane_norm + i * 3;
+      float dn = dx * n[0] + dy * n[1] + dz * n[2];
+      if (dn * dn_in >= 0 || (dn > -math::kFloatEps && dn < math::kFloatEps)) {
+        return;
+      }
+      float curr_t = (plane_dist[i] - (px * n[0] + py * n[1] + pz * n[2])) / dn;
+      if (curr_t > math::kFloatEps && curr_t < t[k]) {
+        t[k] = curr_t;
+        idx[k] = i;
+      }
+    };
+
+    // Lanes run one by one, so only candidate planes of every lane are visited.
+    uint64_t mask = plane_mask ? plane_mask[k] : ~uint64_t{ 0 };
+    int step_num = PlaneNum == Optics::kAnyPlaneNum ? plane_num : PlaneNum;
+    if (step_num > 64) {
+      RunPlaneSteps<Optics::kAnyPlaneNum>(step_num, mask, plane_step);
+      continue;
+    }
+    if (step_num < 64) {
+      mask &= (uint64_t{ 1 } << (step_num > 0 ? step_num : 0)) - 1;
+    }
+    for (; mask; mask &= mask - 1) {
+      plane_step(__builtin_ctzll(mask));
+    }
+  }
+#endif
+}
+
+
+// Every lane traverses BVH on its own, because rays in a packet go in all directions. All children of a node are
+// tested at once, and those hit are visited from near to far, so that far ones are often culled by the nearest
+// intersection found so far. Faces are tested in the same way as IntersectLinesWithTrianglesPacket(), and ties are
+// broken by face index, so results are the same as it.
+void IntersectLinesWithBvhPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                 const float* face_norm, const Bvh* bvh,                // input
+                                 float* t, int* idx) {                                  // output
+  constexpr int kN = kPacketSize;
+  constexpr int kW = Bvh::kWidth;
+  constexpr float kMinDir = 1e-20f;  // Keep 1 / dir finite
+  const BvhNode* nodes = bvh->GetNodes();
+  const int* face_index = bvh->GetFaceIndex();
+  const float* face_data = bvh->GetFaceData();
+
+  for (int k = 0; k < kN; k++) {
+    float px = pt[k];
+    float py = pt[k + kN];
+    float pz = pt[k + kN * 2];
+    float dx = dir[k];
+    float dy = dir[k + kN];
+    float dz = dir[k + kN * 2];
+    const float* norm_in = face_norm + face_id[k] * 3;
+    float dn_in = dx * norm_in[0] + dy * norm_in[1] + dz * norm_in[2];
+    float xx = dy * pz - dz * py;
+    float xy = dz * px - dx * pz;
+    float xz = dx * py - dy * px;
+
+    float p[3]{ px, py, pz };
+    float inv_d[3]{ dx, dy, dz };
+    for (auto& v : inv_d) {
+      v = 1.0f / (fabsf(v) >= kMinDir ? v : (v < 0 ? -kMinDir : kMinDir));
+    }
+
+    float min_t = kFloatMax;
+    int min_idx = -1;
+    int stack[Bvh::kStackSize];
+    int stack_top = 0;
+    stack[stack_top++] = 0;
+    while (stack_top > 0) {
+      const BvhNode* node = nodes + stack[--stack_top];
+
+      // Slab test. Intervals are clipped to [0, min_t].
+      float t_near[kW];
+      int hit_mask = 0;
+#if defined(__SSE4_1__)
+      __m128 NEAR = _mm_setzero_ps();
+      __m128 FAR = _mm_set1_ps(min_t);
+      for (int j = 0; j < 3; j++) {
+        __m128 P = _mm_set1_ps(p[j]);
+        __m128 INV_D = _mm_set1_ps(inv_d[j]);
+        __m128 T0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->box[j]), P), INV_D);
+        __m128 T1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->box[j + 3]), P), INV_D);
+        NEAR = _mm_max_ps(NEAR, _mm_min_ps(T0, T1));
+        FAR = _mm_min_ps(FAR, _mm_max_ps(T0, T1));
+      }
+      _mm_storeu_ps(t_near, NEAR);
+      hit_mask = _mm_movemask_ps(_mm_cmple_ps(NEAR, FAR));
+#else
+      for (int c = 0; c < kW; c++) {
+        float curr_near = 0;
+        float curr_far = min_t;
+        for (int j = 0; j < 3; j++) {
+          float t0 = (node->box[j][c] - p[j]) * inv_d[j];
+          float t1 = (node->box[j + 3][c] - p[j]) * inv_d[j];
+          float lo = t0 < t1 ? t0 : t1;
+          float hi = t0 < t1 ? t1 : t0;
+          curr_near = lo > curr_near ? lo : curr_near;
+          curr_far = hi < curr_far ? hi : curr_far;
+        }
+        t_near[c] = curr_near;
+        hit_mask |= (curr_near <= curr_far) << c;
+      }
+#endif
+
+      // Sort children hit from near to far.
+      int order[kW];
+      int hit_num = 0;
+      for (int c = 0; c < kW; c++) {
+        if (!(hit_mask & (1 << c)) || node->face_num[c] < 0) {
+          continue;
+        }
+        int i = hit_num++;
+        for (; i > 0 && t_near[order[i - 1]] > t_near[c]; i--) {
+          order[i] = order[i - 1];
+        }
+        order[i] = c;
+      }
+
+      // Push inner children from far to near, and test faces in leaves right away.
+      for (int i = hit_num - 1; i >= 0; i--) {
+        if (node->face_num[order[i]] == 0) {
+          stack[stack_top++] = node->child[order[i]];
+        }
+      }
+      for (int i = 0; i < hit_num; i++) {
+        int slot = order[i];
+        if (node->face_num[slot] == 0 || t_near[slot] > min_t) {
+          continue;
+        }
+        for (int f = node->child[slot]; f < node->child[slot] + node->face_num[slot]; f++) {
+          const float* d = face_data + f * kPacketFaceDataSize;
+          if ((dx * d[0] + dy * d[1] + dz * d[2]) * dn_in >= 0) {
+            continue;
+          }
+          float c = dx * d[3] + dy * d[4] + dz * d[5];
+          if (math::FloatEqualZero(c)) {
+            continue;
+          }
+          float curr_t = (d[6] - (px * d[3] + py * d[4] + pz * d[5])) / c;
+          if (curr_t <= math::kFloatEps || curr_t > min_t) {
+            continue;
+          }
+          float alpha = (xx * d[7] + xy * d[8] + xz * d[9] + dx * d[10] + dy * d[11] + dz * d[12]) / c;
+          float beta = -(xx * d[13] + xy * d[14] + xz * d[15] + dx * d[16] + dy * d[17] + dz * d[18]) / c;
+          if (alpha >= 0 && beta >= 0 && alpha + beta <= 1 && (curr_t < min_t || face_index[f] < min_idx)) {
+            min_t = curr_t;
+            min_idx = face_index[f];
+          }
+        }
+      }
+    }
+    t[k] = min_t;
+    idx[k] = min_idx;
+  }
+}
+
+
+// If fresnel (a FresnelTable of fresnel_size intervals) is given, reflectance is interpolated in it.
+void HitSurfaceOne(float n, const float* fresnel, int fresnel_size,      // input
+                   const float* dir_in, const float* norm, float w_in,  // input
+                   float* dir_out, float* w_out) {                       // output
+  float cos_theta = math::Dot3(dir_in, norm);
+  float rr = cos_theta > 0 ? n : 1.0f / n;
+  float c = fabsf(cos_theta);
+  float s2 = 1.0f - c * c;
+  float d = 1.0f - rr * rr * (s2 > 0.0f ? s2 : 0.0f);  // |cos_theta| may exceed 1 by rounding
+
+  bool is_total_reflected = d <= 0.0f;
+  float d_sqrt = is_total_reflected ? 0.0f : sqrtf(d);
+
+  if (!fresnel) {
+    w_out[0] = Optics::GetReflectRatio(cos_theta, rr) * w_in;
+  } else if (is_total_reflected) {
+    w_out[0] = w_in;
+  } else {
+    // sqrt(d) is cosine of the refractive angle. The angle in air is the refractive one for rays going out.
+    float x = (cos_theta > 0 ? d_sqrt : c) * fresnel_size;
+    int i = static_cast<int>(x);
+    i = i < fresnel_size - 1 ? i : fresnel_size - 1;
+    w_out[0] = (fresnel[i] + (fresnel[i + 1] - fresnel[i]) * (x - i)) * w_in;
+  }
+  w_out[1] = is_total_reflected ? -1 : w_in - w_out[0];
+
+  // Refractive direction is rr * dir - (rr - sqrt(d) / |cos|) * cos * norm.
+  float k = rr * cos_theta - (cos_theta > 0 ? d_sqrt : -d_sqrt);
+  float* tmp_dir_reflection = dir_out;
+  float* tmp_dir_refraction = dir_out + 3;
+  for (int j = 0; j < 3; j++) {
+    tmp_dir_reflection[j] = dir_in[j] - 2 * cos_theta * norm[j];                                        // Reflection
+    tmp_dir_refraction[j] = is_total_reflected ? tmp_dir_reflection[j] : rr * dir_in[j] - k * norm[j];  // Refraction
+  }
+}
+
+
+void HitSurface(float n, const FresnelTable* fresnel,           // input
+                size_t num, const float* dir_in,                // input
+                const float* face_norm, const int* face_id_in,  // input
+                const float* w_in,                              // input
+                float* dir_out, float* w_out) {                 // output
+  const float* table = fresnel ? fresnel->GetData() : nullptr;
+  int table_size = fresnel ? fresnel->Size() : 0;
+  for (decltype(num) i = 0; i < num; i++) {
+    HitSurfaceOne(n, table, table_size, dir_in + i * 3, face_norm + face_id_in[i] * 3, w_in[i],  // input
+                  dir_out + i * 6, w_out + i * 2);                                              // output
+  }
+}
+
+
+void HitSurfacePacket(float n, const FresnelTable* fresnel,                          // input
+                      const float* dir, const float* norm, const float* w,  // input
+                      float* dir_reflection, float* dir_refraction,         // output
+                      float* w_reflection, float* w_refraction) {           // output
+  constexpr int kN = kPacketSize;
+  const float* table = fresnel ? fresnel->GetData() : nullptr;
+  int table_size = fresnel ? fresnel->Size() : 0;
+  // Same formulas as HitSurface(), with D for d there.
+#if defined(__AVX512F__)
+  const __m512 ZERO = _mm512_setzero_ps();
+  const __m512 ONE = _mm512_set1_ps(1.0f);
+  const __m512 HALF = _mm512_set1_ps(0.5f);
+  const __m512 ONE_HALF = _mm512_set1_ps(1.5f);
+
+  __m512 D[3];
+  __m512 N[3];
+  for (int j = 0; j < 3; j++) {
+    D[j] = _mm512_loadu_ps(dir + j * kN);
+    N[j] = _mm512_loadu_ps(norm + j * kN);
+  }
+  __m512 COS = _mm512_mul_ps(D[0], N[0]);
+  COS = _mm512_add_ps(COS, _mm512_mul_ps(D[1], N[1]));
+  COS = _mm512_add_ps(COS, _mm512_mul_ps(D[2], N[2]));
+
+  __mmask16 inside = _mm512_cmp_ps_mask(COS, ZERO, _CMP_GT_OQ);
+  __m512 RR = _mm512_mask_blend_ps(inside, _mm512_set1_ps(1.0f / n), _mm512_set1_ps(n));
+  __m512 C = AbsPs(COS);
+  __m512 S2 = _mm512_maskz_max_ps(0xffff, _mm512_sub_ps(ONE, _mm512_mul_ps(C, C)), ZERO);
+  __m512 DD = _mm512_sub_ps(ONE, _mm512_mul_ps(_mm512_mul_ps(RR, RR), S2));
+  __mmask16 total_reflected = _mm512_cmp_ps_mask(DD, ZERO, _CMP_LE_OQ);
+
+  // sqrt(D) = D * rsqrt(D), with one Newton step. It is 0 if D <= 0.
+  __m512 Y = _mm512_maskz_rsqrt14_ps(0xffff, DD);
+  Y = _mm512_mul_ps(Y, _mm512_sub_ps(ONE_HALF, _mm512_mul_ps(_mm512_mul_ps(HALF, DD), _mm512_mul_ps(Y, Y))));
+  __m512 D_SQRT = _mm512_maskz_mul_ps(static_cast<__mmask16>(~total_reflected), DD, Y);
+
+  __m512 R;
+  if (table) {
+    __m512 X = _mm512_mul_ps(_mm512_mask_blend_ps(inside, C, D_SQRT), _mm512_set1_ps(static_cast<float>(table_size)));
+    __m512i I = _mm512_maskz_cvttps_epi32(0xffff, X);
+    I = _mm512_maskz_min_epi32(0xffff, I, _mm512_set1_epi32(table_size - 1));
+    __m512 T0 = GatherPs(I, table);
+    __m512 T1 = GatherPs(I, table + 1);
+    __m512 FRAC = _mm512_sub_ps(X, _mm512_maskz_cvtepi32_ps(0xffff, I));
+    R = _mm512_add_ps(T0, _mm512_mul_ps(_mm512_sub_ps(T1, T0), FRAC));
+    R = _mm512_mask_blend_ps(total_reflected, R, ONE);
+  } else {
+    __m512 RC = _mm512_mul_ps(RR, C);
+    __m512 RS = _mm512_div_ps(_mm512_sub_ps(RC, D_SQRT), _mm512_add_ps(RC, D_SQRT));
+    __m512 RD = _mm512_mul_ps(RR, D_SQRT);
+    __m512 RP = _mm512_div_ps(_mm512_sub_ps(RD, C), _mm512_add_ps(RD, C));
+    R = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(RS, RS), _mm512_mul_ps(RP, RP)), HALF);
+  }
+
+  __m512 W = _mm512_loadu_ps(w);
+  __m512 W_REFLECTION = _mm512_mul_ps(R, W);
+  __m512 W_REFRACTION = _mm512_mask_blend_ps(total_reflected, _mm512_sub_ps(W, W_REFLECTION), _mm512_set1_ps(-1.0f));
+  _mm512_storeu_ps(w_reflection, W_REFLECTION);
+  _mm512_storeu_ps(w_refraction, W_REFRACTION);
+
+  __m512 COS2 = _mm512_add_ps(COS, COS);
+  __m512 RR_COS = _mm512_mul_ps(RR, COS);
+  __m512 K = _mm512_mask_sub_ps(_mm512_add_ps(RR_COS, D_SQRT), inside, RR_COS, D_SQRT);
+  for (int j = 0; j < 3; j++) {
+    __m512 REFLECTION = _mm512_sub_ps(D[j], _mm512_mul_ps(COS2, N[j]));
+    __m512 REFRACTION = _mm512_sub_ps(_mm512_mul_ps(RR, D[j]), _mm512_mul_ps(K, N[j]));
+    _mm512_storeu_ps(dir_reflection + j * kN, REFLECTION);
+    _mm512_storeu_ps(dir_refraction + j * kN, _mm512_mask_blend_ps(total_reflected, REFRACTION, REFLECTION));
+  }
+#elif defined(__AVX2__)
+  for (int b = 0; b < kN; b += 8) {  // Two halves of a packet
+    const __m256 ZERO = _mm256_setzero_ps();
+    const __m256 ONE = _mm256_set1_ps(1.0f);
+    const __m256 HALF = _mm256_set1_ps(0.5f);
+    const __m256 ONE_HALF = _mm256_set1_ps(1.5f);
+    const __m256 SIGN_MASK = _mm256_set1_ps(-0.0f);
+
+    __m256 D[3];
+    __m256 N[3];
+    for (int j = 0; j < 3; j++) {
+      D[j] = _mm256_loadu_ps(dir + j * kN + b);
+      N[j] = _mm256_loadu_ps(norm + j * kN + b);
+    }
+    __m256 COS = _mm256_mul_ps(D[0], N[0]);
+    COS = _mm256_add_ps(COS, _mm256_mul_ps(D[1], N[1]));
+    COS = _mm256_add_ps(COS, _mm256_mul_ps(D[2], N[2]));
+
+    __m256 inside = _mm256_cmp_ps(COS, ZERO, _CMP_GT_OQ);
+    __m256 RR = _mm256_blendv_ps(_mm256_set1_ps(1.0f / n), _mm256_set1_ps(n), inside);
+    __m256 C = _mm256_andnot_ps(SIGN_MASK, COS);
+    __m256 S2 = _mm256_max_ps(_mm256_sub_ps(ONE, _mm256_mul_ps(C, C)), ZERO);
+    __m256 DD = _mm256_sub_ps(ONE, _mm256_mul_ps(_mm256_mul_ps(RR, RR), S2));
+    __m256 total_reflected = _mm256_cmp_ps(DD, ZERO, _CMP_LE_OQ);
+
+    // sqrt(D) = D * rsqrt(D), with one Newton step. It is 0 if D <= 0.
+    __m256 Y = _mm256_rsqrt_ps(DD);
+    Y = _mm256_mul_ps(Y, _mm256_sub_ps(ONE_HALF, _mm256_mul_ps(_mm256_mul_ps(HALF, DD), _mm256_mul_ps(Y, Y))));
+    __m256 D_SQRT = _mm256_andnot_ps(total_reflected, _mm256_mul_ps(DD, Y));
+
+    __m256 R;
+    if (table) {
+      __m256 X = _mm256_mul_ps(_mm256_blendv_ps(C, D_SQRT, inside), _mm256_set1_ps(static_cast<float>(table_size)));
+      __m256i I = _mm256_min_epi32(_mm256_cvttps_epi32(X), _mm256_set1_epi32(table_size - 1));
+      __m256 T0 = _mm256_i32gather_ps(table, I, 4);
+      __m256 T1 = _mm256_i32gather_ps(table + 1, I, 4);
+      R = _mm256_add_ps(T0, _mm256_mul_ps(_mm256_sub_ps(T1, T0), _mm256_sub_ps(X, _mm256_cvtepi32_ps(I))));
+      R = _mm256_blendv_ps(R, ONE, total_reflected);
+    } else {
+      __m256 RC = _mm256_mul_ps(RR, C);
+      __m256 RS = _mm256_div_ps(_mm256_sub_ps(RC, D_SQRT), _mm256_add_ps(RC, D_SQRT));
+      __m256 RD = _mm256_mul_ps(RR, D_SQRT);
+      __m256 RP = _mm256_div_ps(_mm256_sub_ps(RD, C), _mm256_add_ps(RD, C));
+      R = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(RS, RS), _mm256_mul_ps(RP, RP)), HALF);
+    }
+
+    __m256 W = _mm256_loadu_ps(w + b);
+    __m256 W_REFLECTION = _mm256_mul_ps(R, W);
+    __m256 W_REFRACTION = _mm256_blendv_ps(_mm256_sub_ps(W, W_REFLECTION), _mm256_set1_ps(-1.0f), total_reflected);
+    _mm256_storeu_ps(w_reflection + b, W_REFLECTION);
+    _mm256_storeu_ps(w_refraction + b, W_REFRACTION);
+
+    __m256 COS2 = _mm256_add_ps(COS, COS);
+    __m256 RR_COS = _mm256_mul_ps(RR, COS);
+    __m256 K = _mm256_blendv_ps(_mm256_add_ps(RR_COS, D_SQRT), _mm256_sub_ps(RR_COS, D_SQRT), inside);
+    for (int j = 0; j < 3; j++) {
+      __m256 REFLECTION = _mm256_sub_ps(D[j], _mm256_mul_ps(COS2, N[j]));
+      __m256 REFRACTION = _mm256_sub_ps(_mm256_mul_ps(RR, D[j]), _mm256_mul_ps(K, N[j]));
+      _mm256_storeu_ps(dir_reflection + j * kN + b, REFLECTION);
+      _mm256_storeu_ps(dir_refraction + j * kN + b, _mm256_blendv_ps(REFRACTION, REFLECTION, total_reflected));
+    }
+  }
+#else
+  for (int k = 0; k < kN; k++) {
+    float curr_dir[3]{ dir[k], dir[k + kN], dir[k + kN * 2] };
+    float curr_norm[3]{ norm[k], norm[k + kN], norm[k + kN * 2] };
+    float curr_dir_out[6];
+    float curr_w_out[2];
+    HitSurfaceOne(n, table, table_size, curr_dir, curr_norm, w[k], curr_dir_out, curr_w_out);
+    for (int j = 0; j < 3; j++) {
+      dir_reflection[j * kN + k] = curr_dir_out[j];
+      dir_refraction[j * kN + k] = curr_dir_out[j + 3];
+    }
+    w_reflection[k] = curr_w_out[0];
+    w_refraction[k] = curr_w_out[1];
+  }
+#endif
+}
+
+
+// Rays are packed into packets in structure-of-arrays layout. Unused lanes in the last packet repeat the first ray,
+// so every ray is computed in the same way, no matter how rays are split into ranges.
+void HitSurfaceSimd(float n, const FresnelTable* fresnel,           // input
+                    size_t num, const float* dir_in,                // input
+                    const float* face_norm, const int* face_id_in,  // input
+                    const float* w_in,                              // input
+                    float* dir_out, float* w_out) {                 // output
+#if defined(__AVX2__)
+  float packet_dir[kPacketSize * 3];
+  float packet_norm[kPacketSize * 3];
+  float packet_w[kPacketSize];
+  float packet_dir_reflection[kPacketSize * 3];
+  float packet_dir_refraction[kPacketSize * 3];
+  float packet_w_reflection[kPacketSize];
+  float packet_w_refraction[kPacketSize];
+  for (decltype(num) i = 0; i < num; i += kPacketSize) {
+    auto n_rays = num - i < static_cast<size_t>(kPacketSize) ? num - i : static_cast<size_t>(kPacketSize);
+    for (int k = 0; k < kPacketSize; k++) {
+      auto ray_idx = i + (static_cast<size_t>(k) < n_rays ? k : 0);
+      const float* tmp_norm = face_norm + face_id_in[ray_idx] * 3;
+      for (int j = 0; j < 3; j++) {
+        packet_dir[j * kPacketSize + k] = dir_in[ray_idx * 3 + j];
+        packet_norm[j * kPacketSize + k] = tmp_norm[j];
+      }
+      packet_w[k] = w_in[ray_idx];
+    }
+
+    HitSurfacePacket(n, fresnel, packet_dir, packet_norm, packet_w,  // input
+                     packet_dir_reflection, packet_dir_refraction,   // output
+                     packet_w_reflection, packet_w_refraction);      // output
+
+    for (size_t k = 0; k < n_rays; k++) {
+      auto ray_idx = i + k;
+      w_out[ray_idx * 2 + 0] = packet_w_reflection[k];
+      w_out[ray_idx * 2 + 1] = packet_w_refraction[k];
+      for (int j = 0; j < 3; j++) {
+        dir_out[ray_idx * 6 + j] = packet_dir_reflection[j * kPacketSize + k];
+        dir_out[ray_idx * 6 + 3 + j] = packet_dir_refraction[j * kPacketSize + k];
+      }
+    }
+  }
+#else
+  HitSurface(n, fresnel, num, dir_in, face_norm, face_id_in, w_in, dir_out, w_out);
+#endif
+}
+
+
+void RotateZWithDataStep(const float* lon_lat_roll,  // longitude, latitude, roll
+                         const float* input_vec,     // input data
+                         float* output_vec,          // output data
+                         size_t input_step, size_t output_step, size_t data_num) {
+
+  // clang-format off
+  /* The original cods are as follows:
+   *
+   *   float ax[9] = {
+   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
+   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
+   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
+   *     sin(lon_lat_roll[1])
+   *   };
+   *
+   *   ConstDummyMatrix mat_rot_trans(ax, 3, 3);
+   *   ConstDummyMatrix mat_input_vec(input_vec, data_num, 3);
+   *   DummyMatrix mat_res_vec(output_vec, data_num, 3);
+   *   MatrixMultiply(mat_input_vec, mat_rot_trans, &mat_res_vec);
+   *
+   * Since this method is called frequently, we use a little different way to do the multiplication.
+   */
+  // clang-format on
+
+  // Evaluate each trigonometric function only once.
+  const float c0 = cosf(lon_lat_roll[0]);
+  const float s0 = sinf(lon_lat_roll[0]);
+  const float c1 = cosf(lon_lat_roll[1]);
+  const float s1 = sinf(lon_lat_roll[1]);
+  const float c2 = cosf(lon_lat_roll[2]);
+  const float s2 = sinf(lon_lat_roll[2]);
+
+  const float ax[] = {
+    -c2 * s0 - c0 * s1 * s2,
+    c0 * c2 - s0 * s1 * s2,
+    c1 * s2,
+    -c0 * c2 * s1 + s0 * s2,
+    -c2 * s0 * s1 - c0 * s2,
+    c1 * c2,
+    c0 * c1,
+    c1 * s0,
+    s1,
+    0
+  };
+
+#if defined(__SSE4_1__)
+  __m128 AX0 = _mm_loadu_ps(ax + 0);
+  __m128 AX1 = _mm_loadu_ps(ax + 3);
+  __m128 AX2 = _mm_loadu_ps(ax + 6);
+
+  for (decltype(data_num) i = 0; i < data_num; i++) {
+    float* tmp_out = output_vec + i * output_step;
+
+    __m128 INPUT_V = _mm_loadu_ps(input_vec + i * input_step);
+    __m128 DP = _mm_dp_ps(INPUT_V, AX0, 0x71);
+    tmp_out[0] = DP[0];
+    DP = _mm_dp_ps(INPUT_V, AX1, 0x71);
+    tmp_out[1] = DP[0];
+    DP = _mm_dp_ps(INPUT_V, AX2, 0x71);
+    tmp_out[2] = DP[0];
+  }
+#else
+  // Then do the matrix multiplication (using Dot3 actually)
+  for (decltype(data_num) i = 0; i < data_num; i++) {
+    const float* tmp_v = input_vec + i * input_step;
+    float* tmp_out = output_vec + i * output_step;
+    for (int j = 0; j < 3; j++) {
+      tmp_out[j] = math::Dot3(tmp_v, ax + j * 3);
+    }
+  }
+#endif
+}
+
+
+void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num) {
+
+  // clang-format off
+  /* The original codes are as follows:
+   *
+   *   float ax[9] = {
+   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
+   *     -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
+   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
+   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
+   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
+   *     sin(lon_lat_roll[1])
+   *   };
+   *
+   *   ConstDummyMatrix mat_rot(ax, 3, 3);
+   *   ConstDummyMatrix mat_input_vec(input_vec, data_num, 3);
+   *   DummyMatrix mat_output_vec(output_vec, data_num, 3);
+   *   MatrixMultiply(mat_input_vec, mat_rot, &mat_output_vec);
+   *
+   * Since this method is called frequently, we use a little different way to do the multiplication.
+   */
+  // clang-format on
+
+  // Here the ax is transposed, for better memory locality.
+  const float c0 = cosf(lon_lat_roll[0]);
+  const float s0 = sinf(lon_lat_roll[0]);
+  const float c1 = cosf(lon_lat_roll[1]);
+  const float s1 = sinf(lon_lat_roll[1]);
+  const float c2 = cosf(lon_lat_roll[2]);
+  const float s2 = sinf(lon_lat_roll[2]);
+
+  const float ax[] = {
+    -c2 * s0 - c0 * s1 * s2,
+    -c0 * c2 * s1 + s0 * s2,
+    c0 * c1,
+    c0 * c2 - s0 * s1 * s2,
+    -c2 * s0 * s1 - c0 * s2,
+    c1 * s0,
+    c1 * s2,
+    c1 * c2,
+    s1,
+    0
+  };
+
+#if defined(__SSE4_1__)
+  __m128 AX0 = _mm_loadu_ps(ax + 0);
+  __m128 AX1 = _mm_loadu_ps(ax + 3);
+  __m128 AX2 = _mm_loadu_ps(ax + 6);
+
+  for (size_t i = 0; i < data_num; i++) {
+    float* tmp_out = output_vec + i * 3;
+
+    __m128 INPUT_V = _mm_loadu_ps(input_vec + i * 3);
+    __m128 DP = _mm_dp_ps(INPUT_V, AX0, 0x71);
+    tmp_out[0] = DP[0];
+    DP = _mm_dp_ps(INPUT_V, AX1, 0x71);
+    tmp_out[1] = DP[0];
+    DP = _mm_dp_ps(INPUT_V, AX2, 0x71);
+    tmp_out[2] = DP[0];
+  }
+#else
+  // Then do the matrix multiplication (using Dot3 actually)
+  for (decltype(data_num) i = 0; i < data_num; i++) {
+    const float* tmp_v = input_vec + i * 3;
+    float* tmp_out = output_vec + i * 3;
+    for (int j = 0; j < 3; j++) {
+      tmp_out[j] = math::Dot3(tmp_v, ax + j * 3);
+    }
+  }
+#endif
+}
+
+
+void EqualAreaFishEye(const float* cam_rot,          // Camera rotation. [lon, lat, roll]
+                      float hov,                     // Half field of view.
+                      size_t data_number,            // Data number
+                      const float* dir,              // Ray directions, [x, y, z]
+                      int img_wid, int img_hei,      // Image size
+                      int* img_xy,                   // Image coordinates
+                      VisibleRange visible_range) {  // Visible range
+  float img_r = (img_wid > img_hei ? img_wid : img_hei) / 2.0f;
+  float* dir_copy = new float[data_number * 3]{};
+  float cam_rot_copy[3];
+  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
+  cam_rot_copy[0] *= -1;
+  cam_rot_copy[1] *= -1;
+  for (auto& i : cam_rot_copy) {
+    i *= math::kDegreeToRad;
+  }
+
+  RotateZWithDataStep(cam_rot_copy, dir, dir_copy, 4, 3, data_number);
+  for (size_t i = 0; i < data_number; i++) {
+    if (fabs(math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else {
+      float lon = atan2f(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
+      float lat = asinf(dir_copy[i * 3 + 2] / math::Norm3(dir_copy + i * 3));
+      float proj_r = img_r / 2.0f / sinf(hov / 2.0f * math::kDegreeToRad);
+      float r = 2.0f * proj_r * sinf((math::kPi / 2.0f - lat) / 2.0f);
+
+      img_xy[i * 2 + 0] = static_cast<int>(round(r * cosf(lon) + img_wid / 2.0));
+      img_xy[i * 2 + 1] = static_cast<int>(round(r * sinf(lon) + img_hei / 2.0));
+    }
+  }
+  delete[] dir_copy;
+}
+
+
+void EquidistantFishEye(const float* cam_rot,          // Camera rotation. [lon, lat, roll]
+                        float hov,                     // Half field of view.
+                        size_t data_number,            // Data number
+                        const float* dir,              // Ray directions, [x, y, z]
+                        int img_wid, int img_hei,      // Image size
+                        int* img_xy,                   // Image coordinates
+                        VisibleRange visible_range) {  // Visible range
+  float img_r = (img_wid > img_hei ? img_wid : img_hei) / 2.0f;
+  float* dir_copy = new float[data_number * 3]{};
+  float cam_rot_copy[3];
+  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
+  cam_rot_copy[0] *= -1;
+  cam_rot_copy[1] *= -1;
+  for (auto& i : cam_rot_copy) {
+    i *= math::kDegreeToRad;
+  }
+
+  RotateZWithDataStep(cam_rot_copy, dir, dir_copy, 4, 3, data_number);
+  for (decltype(data_number) i = 0; i < data_number; i++) {
+    if (fabs(math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else {
+      float lon = atan2f(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
+      float lat = asinf(dir_copy[i * 3 + 2] / math::Norm3(dir_copy + i * 3));
+      float r = (math::kPi / 2.0f - lat) / (hov * math::kDegreeToRad) * img_r;
+
+      img_xy[i * 2 + 0] = static_cast<int>(round(r * cosf(lon) + img_wid / 2.0));
+      img_xy[i * 2 + 1] = static_cast<int>(round(r * sinf(lon) + img_hei / 2.0));
+    }
+  }
+  delete[] dir_copy;
+}
+
+
+void DualEqualAreaFishEye(const float* /* cam_rot */,          // Not used
+                          float /* hov */,                     // Not used
+                          size_t data_number,                  // Data number
+                          const float* dir,                    // Ray directions, [x, y, z]
+                          int img_wid, int img_hei,            // Image size
+                          int* img_xy,                         // Image coordinates
+                          VisibleRange /* visible_range */) {  // Not used
+  float img_r = (img_wid / 2 < img_hei ? img_wid / 2 : img_hei) / 2.0f;
+  float proj_r = img_r / 2.0f / sinf(45.0f * math::kDegreeToRad);
+
+  float* dir_copy = new float[data_number * 3]{};
+  float cam_rot_copy[3] = { 90.0f, 89.999f, 0.0f };
+  cam_rot_copy[0] *= -1;
+  cam_rot_copy[1] *= -1;
+  for (auto& i : cam_rot_copy) {
+    i *= math::kDegreeToRad;
+  }
+
+  RotateZWithDataStep(cam_rot_copy, dir, dir_copy, 4, 3, data_number);
+  for (decltype(data_number) i = 0; i < data_number; i++) {
+    if (fabs(math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else {
+      float lon = atan2f(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
+      float lat = asinf(dir_copy[i * 3 + 2] / math::Norm3(dir_copy + i * 3));
+      if (lat < 0) {
+        lon = math::kPi - lon;
+      }
+      float r = 2.0f * proj_r * sinf((math::kPi / 2.0f - fabsf(lat)) / 2.0f);
+
+      img_xy[i * 2 + 0] = static_cast<int>(round(r * cosf(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
+      img_xy[i * 2 + 1] = static_cast<int>(round(r * sinf(lon) + img_r - 0.5));
+    }
+  }
+  delete[] dir_copy;
+}
+
+
+void DualEquidistantFishEye(const float* /* cam_rot */,          // Not used
+                            float /* hov */,                     // Not used
+                            size_t data_number,                  // Data number
+                            const float* dir,                    // Ray directions, [x, y, z]
+                            int img_wid, int img_hei,            // Image size
+                            int* img_xy,                         // Image coordinates
+                            VisibleRange /* visible_range */) {  // Not used
+  float img_r = (img_wid / 2 < img_hei ? img_wid / 2 : img_hei) / 2.0f;
+
+  float* dir_copy = new float[data_number * 3]{};
+  float cam_rot_copy[3] = { 90.0f, 89.999f, 0.0f };
+  cam_rot_copy[0] *= -1;
+  cam_rot_copy[1] *= -1;
+  for (auto& i : cam_rot_copy) {
+    i *= math::kDegreeToRad;
+  }
+
+  RotateZWithDataStep(cam_rot_copy, dir, dir_copy, 4, 3, data_number);
+  for (decltype(data_number) i = 0; i < data_number; i++) {
+    if (fabs(math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else {
+      float lon = atan2f(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
+      float lat = asinf(dir_copy[i * 3 + 2] / math::Norm3(dir_copy + i * 3));
+      if (lat < 0) {
+        lon = math::kPi - lon;
+      }
+      float r = (1.0f - fabsf(lat) * 2.0f / math::kPi) * img_r;
+
+      img_xy[i * 2 + 0] = static_cast<int>(round(r * cosf(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
+      img_xy[i * 2 + 1] = static_cast<int>(round(r * sinf(lon) + img_r - 0.5));
+    }
+  }
+  delete[] dir_copy;
+}
+
+
+void RectLinear(const float* cam_rot,          // Camera rotation. [lon, lat, roll]
+                float hov,                     // Half field of view.
+                size_t data_number,            // Data number
+                const float* dir,              // Ray directions, [x, y, z]
+                int img_wid, int img_hei,      // Image size
+                int* img_xy,                   // Image coordinates
+                VisibleRange visible_range) {  // Visible range
+  float* dir_copy = new float[data_number * 3]{};
+  float cam_rot_copy[3];
+  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
+  cam_rot_copy[0] *= -1;
+  cam_rot_copy[1] *= -1;
+  for (auto& i : cam_rot_copy) {
+    i *= math::kDegreeToRad;
+  }
+
+  RotateZWithDataStep(cam_rot_copy, dir, dir_copy, 4, 3, data_number);
+  for (size_t i = 0; i < data_number; i++) {
+    if (dir_copy[i * 3 + 2] < 0 || fabs(math::Norm3(dir_copy + i * 3) - 1.0) > 1e-4) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
+      img_xy[i * 2 + 0] = kInvalidImgXy;
+      img_xy[i * 2 + 1] = kInvalidImgXy;
+    } else {
+      float x = dir_copy[i * 3 + 0] / dir_copy[i * 3 + 2];
+      float y = dir_copy[i * 3 + 1] / dir_copy[i * 3 + 2];
+      x = static_cast<float>(img_wid / 2.0 * x / tanf(hov * math::kDegreeToRad) + img_wid / 2.0);
+      y = static_cast<float>(img_wid / 2.0 * y / tanf(hov * math::kDegreeToRad) + img_hei / 2.0);
+
+      img_xy[i * 2 + 0] = static_cast<int>(round(x));
+      img_xy[i * 2 + 1] = static_cast<int>(round(y));
+    }
+  }
+  delete[] dir_copy;
+}
+
+
+extern const KernelTable kKernelTable{
+  SimdLevel::ICEHALO_KERNEL_LEVEL,
+
+  &IntersectLineWithTriangles,
+  &IntersectLineWithTrianglesSimd,
+  &IntersectLinesWithTrianglesPacket,
+  &IntersectLinesWithPlanesPacket<Optics::kAnyPlaneNum>,
+  &IntersectLinesWithPlanesPacket<8>,
+  &IntersectLinesWithPlanesPacket<10>,
+  &IntersectLinesWithPlanesPacket<20>,
+  &IntersectLinesWithBvhPacket,
+  &HitSurface,
+  &HitSurfaceSimd,
+  &HitSurfacePacket,
+
+  &RotateZWithDataStep,
+  &RotateZBack,
+
+  &RectLinear,
+  &EqualAreaFishEye,
+  &EquidistantFishEye,
+  &DualEqualAreaFishEye,
+  &DualEquidistantFishEye,
+};
+
+}  // namespace ICEHALO_KERNEL_NAMESPACE
+
+}  // namespace icehalo
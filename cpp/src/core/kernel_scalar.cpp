@@ -0,0 +1,8 @@
+// Kernels for SimdLevel::kScalar. See kernel_impl.h
+#if defined(__SSE4_1__)
+#error "kernel_scalar.cpp must be compiled without SSE4.1"
+#endif
+
+#define ICEHALO_KERNEL_NAMESPACE kernel_scalar
+#define ICEHALO_KERNEL_LEVEL kScalar
+#include "core/kernel_impl.h"
@@ -0,0 +1,8 @@
+// Kernels for SimdLevel::kSse4. See kernel_impl.h
+#if !defined(__SSE4_1__) || defined(__AVX__)
+#error "kernel_sse4.cpp must be compiled with SSE4.1 but without AVX"
+#endif
+
+#define ICEHALO_KERNEL_NAMESPACE kernel_sse4
+#define ICEHALO_KERNEL_LEVEL kSse4
+#include "core/kernel_impl.h"
@@ -1,10 +1,10 @@
 #include "core/mymath.h"
 
-#include <smmintrin.h>
-#include <xmmintrin.h>
-
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+
+#include "core/kernel.h"
 
 
 namespace icehalo {
@@ -77,143 +77,12 @@ void RotateZWithDataStep(const float* lon_lat_roll,  // longitude, latitude, rol
                          const float* input_vec,     // input data
                          float* output_vec,          // output data
                          size_t input_step, size_t output_step, size_t data_num) {
-  using std::cos;
-  using std::sin;
-
-  // clang-format off
-  /* The original cods are as follows:
-   *
-   *   float ax[9] = {
-   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-   *     sin(lon_lat_roll[1])
-   *   };
-   *
-   *   ConstDummyMatrix mat_rot_trans(ax, 3, 3);
-   *   ConstDummyMatrix mat_input_vec(input_vec, data_num, 3);
-   *   DummyMatrix mat_res_vec(output_vec, data_num, 3);
-   *   MatrixMultiply(mat_input_vec, mat_rot_trans, &mat_res_vec);
-   *
-   * Since this method is called frequently, we use a little different way to do the multiplication.
-   */
-  // clang-format on
-
-  const float ax[] = {
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-    sin(lon_lat_roll[1]),
-    0
-  };
-
-#if defined(__AVX__) && defined(__SSE4_1__)
-  __m128 AX0 = _mm_loadu_ps(ax + 0);
-  __m128 AX1 = _mm_loadu_ps(ax + 3);
-  __m128 AX2 = _mm_loadu_ps(ax + 6);
-
-  for (decltype(data_num) i = 0; i < data_num; i++) {
-    float* tmp_out = output_vec + i * output_step;
-
-    __m128 INPUT_V = _mm_loadu_ps(input_vec + i * input_step);
-    __m128 DP = _mm_dp_ps(INPUT_V, AX0, 0x71);
-    tmp_out[0] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX1, 0x71);
-    tmp_out[1] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX2, 0x71);
-    tmp_out[2] = DP[0];
-  }
-#else
-  // Then do the matrix multiplication (using Dot3 actually)
-  for (decltype(data_num) i = 0; i < data_num; i++) {
-    const float* tmp_v = input_vec + i * input_step;
-    float* tmp_out = output_vec + i * output_step;
-    for (int j = 0; j < 3; j++) {
-      tmp_out[j] = Dot3(tmp_v, ax + j * 3);
-    }
-  }
-#endif
+  GetKernels().rotate_z_with_data_step(lon_lat_roll, input_vec, output_vec, input_step, output_step, data_num);
 }
 
 
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num) {
-  using std::cos;
-  using std::sin;
-
-  // clang-format off
-  /* The original codes are as follows:
-   *
-   *   float ax[9] = {
-   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-   *     -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-   *     -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-   *     cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-   *     cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-   *     sin(lon_lat_roll[1])
-   *   };
-   *
-   *   ConstDummyMatrix mat_rot(ax, 3, 3);
-   *   ConstDummyMatrix mat_input_vec(input_vec, data_num, 3);
-   *   DummyMatrix mat_output_vec(output_vec, data_num, 3);
-   *   MatrixMultiply(mat_input_vec, mat_rot, &mat_output_vec);
-   *
-   * Since this method is called frequently, we use a little different way to do the multiplication.
-   */
-  // clang-format on
-
-  // Here the ax is transposed, for better memory locality.
-  const float ax[] = {
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) * sin(lon_lat_roll[1]) + sin(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[1]),
-    cos(lon_lat_roll[0]) * cos(lon_lat_roll[2]) - sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    -cos(lon_lat_roll[2]) * sin(lon_lat_roll[0]) * sin(lon_lat_roll[1]) - cos(lon_lat_roll[0]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[0]),
-    cos(lon_lat_roll[1]) * sin(lon_lat_roll[2]),
-    cos(lon_lat_roll[1]) * cos(lon_lat_roll[2]),
-    sin(lon_lat_roll[1]),
-    0
-  };
-
-#if defined(__AVX__) && defined(__SSE4_1__)
-  __m128 AX0 = _mm_loadu_ps(ax + 0);
-  __m128 AX1 = _mm_loadu_ps(ax + 3);
-  __m128 AX2 = _mm_loadu_ps(ax + 6);
-
-  for (size_t i = 0; i < data_num; i++) {
-    float* tmp_out = output_vec + i * 3;
-
-    __m128 INPUT_V = _mm_loadu_ps(input_vec + i * 3);
-    __m128 DP = _mm_dp_ps(INPUT_V, AX0, 0x71);
-    tmp_out[0] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX1, 0x71);
-    tmp_out[1] = DP[0];
-    DP = _mm_dp_ps(INPUT_V, AX2, 0x71);
-    tmp_out[2] = DP[0];
-  }
-#else
-  // Then do the matrix multiplication (using Dot3 actually)
-  for (decltype(data_num) i = 0; i < data_num; i++) {
-    const float* tmp_v = input_vec + i * 3;
-    float* tmp_out = output_vec + i * 3;
-    for (int j = 0; j < 3; j++) {
-      tmp_out[j] = Dot3(tmp_v, ax + j * 3);
-    }
-  }
-#endif
+  GetKernels().rotate_z_back(lon_lat_roll, input_vec, output_vec, data_num);
 }
 
 
@@ -554,28 +423,93 @@ const int* TriangleIdx::idx() const {
 HalfSpaceSet::HalfSpaceSet(int n, float* a, float* b, float* c, float* d) : n(n), a(a), b(b), c(c), d(d) {}
 
 
-RandomNumberGenerator::RandomNumberGenerator(uint32_t seed)
-    : generator_{ static_cast<std::mt19937::result_type>(seed) } {}
+RandomNumberGenerator::RandomNumberGenerator(uint64_t key, uint64_t stream)
+    : key_{ static_cast<uint32_t>(key), static_cast<uint32_t>(key >> 32) },
+      counter_{ 0, 0, static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32) }, block_{}, block_idx_(4),
+      has_cached_gauss_(false), cached_gauss_(0) {}
 
 
-RandomNumberGenerator* RandomNumberGenerator::GetInstance() {
+uint64_t RandomNumberGenerator::GetDefaultSeed() {
 #ifdef RANDOM_SEED
-  static std::unique_ptr<RandomNumberGenerator> instance_{ new RandomNumberGenerator(
-      static_cast<uint32_t>(std::chrono::system_clock::now().time_since_epoch().count())) };
+  static const uint64_t seed = static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+  return seed;
 #else
-  static std::unique_ptr<RandomNumberGenerator> instance_{ new RandomNumberGenerator(kDefaultRandomSeed) };
+  return kDefaultRandomSeed;
 #endif
-  return instance_.get();
+}
+
+
+uint64_t RandomNumberGenerator::MakeKey(uint64_t seed, uint64_t sub_key) {
+  // SplitMix64 finalizer
+  uint64_t z = seed + (sub_key + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+
+void RandomNumberGenerator::GenerateBlock() {
+  constexpr uint32_t kMul0 = 0xD2511F53;
+  constexpr uint32_t kMul1 = 0xCD9E8D57;
+  constexpr uint32_t kWeyl0 = 0x9E3779B9;
+  constexpr uint32_t kWeyl1 = 0xBB67AE85;
+  constexpr int kRounds = 10;
+
+  uint32_t c[4] = { counter_[0], counter_[1], counter_[2], counter_[3] };
+  uint32_t k[2] = { key_[0], key_[1] };
+  for (int i = 0; i < kRounds; i++) {
+    if (i > 0) {
+      k[0] += kWeyl0;
+      k[1] += kWeyl1;
+    }
+    uint64_t p0 = static_cast<uint64_t>(kMul0) * c[0];
+    uint64_t p1 = static_cast<uint64_t>(kMul1) * c[2];
+    uint32_t next[4] = {
+      static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0],
+      static_cast<uint32_t>(p1),
+      static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1],
+      static_cast<uint32_t>(p0),
+    };
+    std::memcpy(c, next, sizeof(c));
+  }
+  std::memcpy(block_, c, sizeof(block_));
+  block_idx_ = 0;
+
+  // Only block counter is increased. Stream id is kept.
+  counter_[0]++;
+  if (counter_[0] == 0) {
+    counter_[1]++;
+  }
+}
+
+
+uint32_t RandomNumberGenerator::GetUint32() {
+  if (block_idx_ >= 4) {
+    GenerateBlock();
+  }
+  return block_[block_idx_++];
 }
 
 
 float RandomNumberGenerator::GetGaussian() {
-  return gauss_dist_(generator_);
+  // Box-Muller transform. Two values are generated at a time.
+  if (has_cached_gauss_) {
+    has_cached_gauss_ = false;
+    return cached_gauss_;
+  }
+
+  float u1 = 1.0f - GetUniform();  // (0, 1]
+  float u2 = GetUniform();
+  float r = std::sqrt(-2.0f * std::log(u1));
+  float q = 2.0f * kPi * u2;
+  cached_gauss_ = r * std::sin(q);
+  has_cached_gauss_ = true;
+  return r * std::cos(q);
 }
 
 
 float RandomNumberGenerator::GetUniform() {
-  return uniform_dist_(generator_);
+  return static_cast<float>(GetUint32() >> 8) * (1.0f / 16777216.0f);  // [0, 1), 24 bits precision
 }
 
 
@@ -589,9 +523,8 @@ float RandomNumberGenerator::Get(Distribution dist, float mean, float std) {
 }
 
 
-void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
-
+void RandomSampler::SampleSphericalPointsCart(RandomNumberGenerator* rng, const float* dir, float std, float* data,
+                                              size_t num) {
   float lon = std::atan2(dir[1], dir[0]);
   float lat = std::asin(dir[2] / math::Norm3(dir));
   float rot[3] = { lon, lat, 0 };
@@ -612,8 +545,7 @@ void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t step) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::SampleSphericalPointsSph(RandomNumberGenerator* rng, float* data, size_t num, size_t step) {
   for (decltype(num) i = 0; i < num; i++) {
     float u = rng->GetUniform() * 2 - 1;
     float lambda = rng->GetUniform() * 2 * math::kPi;
@@ -624,8 +556,8 @@ void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t ste
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::SampleSphericalPointsSph(RandomNumberGenerator* rng, const AxisDistribution& axis_dist,
+                                             float* data, size_t num) {
   for (decltype(num) i = 0; i < num; i++) {
     float phi = rng->Get(axis_dist.latitude_dist,                 // distribute
                          axis_dist.latitude_mean * kDegreeToRad,  // mean
@@ -651,8 +583,8 @@ void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist,
 }
 
 
-void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::SampleTriangularPoints(RandomNumberGenerator* rng, const float* vertexes, float* data,
+                                           size_t num) {
   for (decltype(num) i = 0; i < num; i++) {
     float a = rng->GetUniform();
     float b = rng->GetUniform();
@@ -669,9 +601,7 @@ void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, s
 }
 
 
-int RandomSampler::SampleInt(const float* p, int max) {
-  auto rng = RandomNumberGenerator::GetInstance();
-
+int RandomSampler::SampleInt(RandomNumberGenerator* rng, const float* p, int max) {
   float current_cum_p = 0;
   float current_p = rng->GetUniform();
 
@@ -686,8 +616,7 @@ int RandomSampler::SampleInt(const float* p, int max) {
 }
 
 
-int RandomSampler::SampleInt(int max) {
-  auto rng = RandomNumberGenerator::GetInstance();
+int RandomSampler::SampleInt(RandomNumberGenerator* rng, int max) {
   return std::min(static_cast<int>(rng->GetUniform() * max), max - 1);
 }
 
@@ -2,9 +2,8 @@
 #define SRC_CORE_MYMATH_H_
 
 #include <cmath>
+#include <cstdint>
 #include <memory>
-#include <mutex>
-#include <random>
 #include <vector>
 
 namespace icehalo {
@@ -100,22 +99,43 @@ enum class Distribution {
 };
 
 
+/*! @brief Counter based random number generator (Philox4x32-10).
+ *
+ * A generator is fully determined by a (key, stream) pair and the number of values drawn from it. There is no shared
+ * state, so every worker (or every ray) can own its stream, and results do not depend on how work is scheduled
+ * among threads.
+ */
 class RandomNumberGenerator {
  public:
+  /*! @brief Create a generator.
+   *
+   * @param key the key, usually derived from a seed. Different keys give independent sequences.
+   * @param stream stream id under the key. Different streams give independent sequences.
+   */
+  explicit RandomNumberGenerator(uint64_t key = GetDefaultSeed(), uint64_t stream = 0);
+
+  uint32_t GetUint32();
   float GetGaussian();
   float GetUniform();
   float Get(Distribution dist, float mean, float std);
 
-  static RandomNumberGenerator* GetInstance();
+  /*! @brief Get the default seed. It is fixed unless RANDOM_SEED is defined. */
+  static uint64_t GetDefaultSeed();
+
+  /*! @brief Mix a seed and a sub-key (e.g. a run count) into a new key. */
+  static uint64_t MakeKey(uint64_t seed, uint64_t sub_key);
 
  private:
-  explicit RandomNumberGenerator(uint32_t seed);
+  void GenerateBlock();
 
-  std::mt19937 generator_;
-  std::normal_distribution<float> gauss_dist_;
-  std::uniform_real_distribution<float> uniform_dist_;
+  uint32_t key_[2];
+  uint32_t counter_[4];  // { block_lo, block_hi, stream_lo, stream_hi }
+  uint32_t block_[4];
+  int block_idx_;
+  bool has_cached_gauss_;
+  float cached_gauss_;
 
-  static constexpr uint32_t kDefaultRandomSeed = 1;
+  static constexpr uint64_t kDefaultRandomSeed = 1;
 };
 
 using RngPtrU = std::unique_ptr<RandomNumberGenerator>;
@@ -125,50 +145,58 @@ class RandomSampler {
  public:
   /*! @brief Generate points distributed uniformly on sphere around a give point, in Cartesian form.
    *
+   * @param rng random number generator.
    * @param dir the given point, xyz.
    * @param std half range (like radii), in degree.
    * @param data output data, xyz.
    * @param num number of points.
    */
-  static void SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num = 1);
+  static void SampleSphericalPointsCart(RandomNumberGenerator* rng, const float* dir, float std, float* data,
+                                        size_t num = 1);
 
   /*! @brief Generate points distributed uniformly on sphere, in spherical form, (lon, lat).
    *
+   * @param rng random number generator.
    * @param data output data, (lon, lat), in rad
    * @param num
    */
-  static void SampleSphericalPointsSph(float* data, size_t num = 1, size_t step = 3);
+  static void SampleSphericalPointsSph(RandomNumberGenerator* rng, float* data, size_t num = 1, size_t step = 3);
 
   /*! @brief Generate points distributed on sphere surface up to latitude, in spherical form, (lon, lat).
    *
+   * @param rng random number generator.
    * @param axis_dist axis distribution, including information of zenith / azimuth / roll.
    * @param data output data, (lon, lat), in rad
    * @param num number of points.
    */
-  static void SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num = 1);
+  static void SampleSphericalPointsSph(RandomNumberGenerator* rng, const AxisDistribution& axis_dist, float* data,
+                                       size_t num = 1);
 
   /*! @brief Generate points evenly distributed on a triangle, in Cartesian form, xyz.
    *
+   * @param rng random number generator.
    * @param vertexes vertexes of the triangle.
    * @param data output data, xyz.
    * @param num number of points.
    */
-  static void SampleTriangularPoints(const float* vertexes, float* data, size_t num = 1);
+  static void SampleTriangularPoints(RandomNumberGenerator* rng, const float* vertexes, float* data, size_t num = 1);
 
   /*! @brief Random choose an integer index from [0, max), proportional to probabilities in p.
    *
+   * @param rng random number generator.
    * @param p probabilities, must have max values, sum of all p should be 1.0f.
    * @param max range bound.
    * @return chosen index.
    */
-  static int SampleInt(const float* p, int max);
+  static int SampleInt(RandomNumberGenerator* rng, const float* p, int max);
 
   /*! @brief Random choose an integer from [0, max)
    *
+   * @param rng random number generator.
    * @param max range bound.
    * @return chosen integer.
    */
-  static int SampleInt(int max);
+  static int SampleInt(RandomNumberGenerator* rng, int max);
 
   RandomSampler() = delete;
 };
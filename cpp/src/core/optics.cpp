@@ -1,250 +1,436 @@
 #include "optics.h"
 
-#include <immintrin.h>
-#include <smmintrin.h>
-#include <xmmintrin.h>
-
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <functional>
 #include <limits>
+#include <memory>
+#include <stdexcept>
 
 #include "context/context.h"
+#include "core/kernel.h"
 #include "core/mymath.h"
 #include "util/obj_pool.h"
+#include "util/page_alloc.h"
 
 
 namespace icehalo {
 
-RaySegment::RaySegment()
-    : next_reflect(nullptr), next_refract(nullptr), prev(nullptr), root_ctx(nullptr), pt(0, 0, 0), dir(0, 0, 0), w(0),
-      face_id(-1), state(RaySegmentState::kOnGoing) {}
+constexpr size_t RaySegmentStore::kChunkSize;
+constexpr size_t RaySegmentStore::kMaxChunkNum;
+constexpr size_t RaySegmentStore::kSegmentBytes;
 
 
-RaySegment::RaySegment(const float* pt, const float* dir, float w, int face_id)
-    : next_reflect(nullptr), next_refract(nullptr), prev(nullptr), root_ctx(nullptr), pt(pt), dir(dir), w(w),
-      face_id(face_id), state(RaySegmentState::kOnGoing) {}
+RaySegmentStore::RaySegmentStore() : chunks_(new std::atomic<Chunk*>[kMaxChunkNum]), size_(0) {
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    chunks_[i].store(nullptr);
+  }
+}
 
 
-void RaySegment::Serialize(File& file, bool with_boi) const {
-  if (with_boi) {
-    file.Write(ISerializable::kDefaultBoi);
+RaySegmentStore::~RaySegmentStore() {
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    DeleteChunk(chunks_[i].load());
   }
+}
 
-  uint32_t chunk_id, obj_id;
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(next_reflect);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(next_refract);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(prev);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-  std::tie(chunk_id, obj_id) = RayInfoPool::GetInstance()->GetObjectSerializeIndex(root_ctx);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-
-  file.Write(pt.val(), 3);
-  file.Write(dir.val(), 3);
-  file.Write(w);
-  file.Write(static_cast<int16_t>(face_id));
 
-  file.Write(static_cast<uint8_t>(state));
+RaySegmentStore* RaySegmentStore::GetInstance() {
+  static auto instance = new RaySegmentStore();
+  return instance;
 }
 
 
-void RaySegment::Deserialize(File& file, endian::Endianness endianness) {
-  endianness = CheckEndianness(file, endianness);
-  bool need_swap = (endianness != endian::kCompileEndian);
-
-  uint32_t chunk_id, obj_id;
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
-  }
-  next_reflect = reinterpret_cast<RaySegment*>(CombineU32AsPointer(chunk_id, obj_id));
-
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
-  }
-  next_refract = reinterpret_cast<RaySegment*>(CombineU32AsPointer(chunk_id, obj_id));
+RaySegmentStore::Chunk* RaySegmentStore::AllocateChunk() {
+  auto* c = new Chunk{};
+  c->pt = AllocateArray<float>(kChunkSize * 3);
+  c->dir = AllocateArray<float>(kChunkSize * 3);
+  c->w = AllocateArray<float>(kChunkSize);
+  c->face_id = AllocateArray<int>(kChunkSize);
+  c->state = AllocateArray<RaySegmentState>(kChunkSize);
+  c->parent = AllocateArray<PoolHandle>(kChunkSize);
+  c->ray_info = AllocateArray<PoolHandle>(kChunkSize);
+  return c;
+}
 
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
-  }
-  prev = reinterpret_cast<RaySegment*>(CombineU32AsPointer(chunk_id, obj_id));
 
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
+void RaySegmentStore::DeleteChunk(Chunk* chunk) {
+  if (!chunk) {
+    return;
   }
-  root_ctx = reinterpret_cast<RayInfo*>(CombineU32AsPointer(chunk_id, obj_id));
-
-  float vec3f_buf[3];
-  file.Read(vec3f_buf, 3);
-  if (need_swap) {
-    endian::ByteSwap::Swap(vec3f_buf, 3);
-  }
-  pt.val(vec3f_buf);
+  FreeArray(chunk->pt, kChunkSize * 3);
+  FreeArray(chunk->dir, kChunkSize * 3);
+  FreeArray(chunk->w, kChunkSize);
+  FreeArray(chunk->face_id, kChunkSize);
+  FreeArray(chunk->state, kChunkSize);
+  FreeArray(chunk->parent, kChunkSize);
+  FreeArray(chunk->ray_info, kChunkSize);
+  delete chunk;
+}
 
-  file.Read(vec3f_buf, 3);
-  if (need_swap) {
-    endian::ByteSwap::Swap(vec3f_buf, 3);
-  }
-  dir.val(vec3f_buf);
 
-  file.Read(&w);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&w);
+// Same as ObjectPool::AddChunks(). A thread that loses the race frees its own chunk.
+void RaySegmentStore::AddChunks(size_t idx0, size_t idx1) {
+  for (size_t i = idx0 / kChunkSize; i * kChunkSize < idx1; i++) {
+    if (chunks_[i].load(std::memory_order_acquire)) {
+      continue;
+    }
+    Chunk* chunk = AllocateChunk();
+    Chunk* expected = nullptr;
+    if (!chunks_[i].compare_exchange_strong(expected, chunk, std::memory_order_acq_rel)) {
+      DeleteChunk(chunk);
+    }
   }
+}
 
-  int16_t face_id_data;
-  file.Read(&face_id_data);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&face_id_data);
-  }
-  face_id = face_id_data;
 
-  uint8_t state_data;
-  file.Read(&state_data);
-  state = static_cast<RaySegmentState>(state_data);
+size_t RaySegmentStore::ReserveSegments(size_t num) {
+  auto id = size_.load(std::memory_order_relaxed);
+  do {
+    if (num > kInvalidPoolHandle - id) {
+      throw std::overflow_error("Too many ray segments!");
+    }
+  } while (!size_.compare_exchange_weak(id, id + num, std::memory_order_relaxed));
+  AddChunks(id, id + num);
+  return id;
 }
 
 
-void Optics::HitSurface(const Crystal* crystal, float n, size_t num,                    // input
-                        const float* dir_in, const int* face_id_in, const float* w_in,  // input
-                        float* dir_out, float* w_out) {                                 // output
-  auto face_norm = crystal->GetFaceNorm();
-
-  for (decltype(num) i = 0; i < num; i++) {
-    const float* tmp_dir = dir_in + i * 3;
-    const float* tmp_norm = face_norm + face_id_in[i] * 3;
+void RaySegmentStore::Clear() {
+  size_.store(0);
+}
 
-    float cos_theta = math::Dot3(tmp_dir, tmp_norm);
-    float rr = cos_theta > 0 ? n : 1.0f / n;
-    float d = (1.0f - rr * rr) / (cos_theta * cos_theta) + rr * rr;
 
-    bool is_total_reflected = d <= 0.0f;
+size_t RaySegmentStore::Size() const {
+  return size_.load();
+}
 
-    w_out[2 * i + 0] = GetReflectRatio(cos_theta, rr) * w_in[i];
-    w_out[2 * i + 1] = is_total_reflected ? -1 : w_in[i] - w_out[2 * i + 0];
 
-    float* tmp_dir_reflection = dir_out + (i * 2 + 0) * 3;
-    float* tmp_dir_refraction = dir_out + (i * 2 + 1) * 3;
-    for (int j = 0; j < 3; j++) {
-      tmp_dir_reflection[j] = tmp_dir[j] - 2 * cos_theta * tmp_norm[j];  // Reflection
-      tmp_dir_refraction[j] = is_total_reflected ?
-                                  tmp_dir_reflection[j] :
-                                  rr * tmp_dir[j] - (rr - std::sqrt(d)) * cos_theta * tmp_norm[j];  // Refraction
+size_t RaySegmentStore::GetMemoryUsage() const {
+  size_t chunk_num = 0;
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    if (chunks_[i].load(std::memory_order_acquire)) {
+      chunk_num++;
     }
   }
+  return chunk_num * kSegmentBytes * kChunkSize;
 }
 
 
-RayInfo::RayInfo() : first_ray_segment(nullptr), prev_ray_segment(nullptr), crystal_id(-1), main_axis{ 0, 0, 0 } {}
+// Same as ObjectPool::ReleaseChunks().
+void RaySegmentStore::ReleaseChunks(size_t max_bytes) {
+  auto memory = GetMemoryUsage();
+  auto used_chunk_num = (size_.load() + kChunkSize - 1) / kChunkSize;
+  for (size_t i = kMaxChunkNum; i > used_chunk_num && memory > max_bytes; i--) {
+    Chunk* chunk = chunks_[i - 1].exchange(nullptr, std::memory_order_acq_rel);
+    if (chunk) {
+      DeleteChunk(chunk);
+      memory -= kSegmentBytes * kChunkSize;
+    }
+  }
+}
 
 
-RayInfo::RayInfo(RaySegment* seg, int crystal_id, const float* main_axis)
-    : first_ray_segment(seg), prev_ray_segment(nullptr), crystal_id(crystal_id), main_axis(main_axis) {}
+void RaySegmentStore::Set(PoolHandle h, const float* pt, const float* dir, float w, int face_id,  // input
+                          PoolHandle parent, PoolHandle ray_info, RaySegmentState state) {        // input
+  auto& c = GetChunk(h);
+  auto i = h % kChunkSize;
+  std::copy(pt, pt + 3, c.pt + i * 3);
+  std::copy(dir, dir + 3, c.dir + i * 3);
+  c.w[i] = w;
+  c.face_id[i] = face_id;
+  c.state[i] = state;
+  c.parent[i] = parent;
+  c.ray_info[i] = ray_info;
+}
 
 
-void RayInfo::Serialize(File& file, bool with_boi) const {
+void RaySegmentStore::Serialize(File& file, bool with_boi) const {
   if (with_boi) {
     file.Write(ISerializable::kDefaultBoi);
   }
 
-  uint32_t chunk_id, obj_id;
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(first_ray_segment);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-
-  std::tie(chunk_id, obj_id) = RaySegmentPool::GetInstance()->GetObjectSerializeIndex(prev_ray_segment);
-  file.Write(chunk_id);
-  file.Write(obj_id);
-
-  file.Write(crystal_id);
+  uint64_t total_num = size_.load();
+  file.Write(total_num);
 
-  file.Write(main_axis.val(), 3);
+  auto write_column = [&](size_t step, std::function<void(const Chunk&, size_t)> write) {
+    for (size_t i = 0; i * kChunkSize < total_num; i++) {
+      write(*chunks_[i].load(std::memory_order_acquire), std::min(total_num - i * kChunkSize, kChunkSize) * step);
+    }
+  };
+  write_column(3, [&](const Chunk& c, size_t n) { file.Write(c.pt, n); });
+  write_column(3, [&](const Chunk& c, size_t n) { file.Write(c.dir, n); });
+  write_column(1, [&](const Chunk& c, size_t n) { file.Write(c.w, n); });
+  write_column(1, [&](const Chunk& c, size_t n) { file.Write(c.face_id, n); });
+  write_column(1, [&](const Chunk& c, size_t n) { file.Write(c.state, n); });
+  write_column(1, [&](const Chunk& c, size_t n) { file.Write(c.parent, n); });
+  write_column(1, [&](const Chunk& c, size_t n) { file.Write(c.ray_info, n); });
 }
 
 
-void RayInfo::Deserialize(File& file, endian::Endianness endianness) {
+void RaySegmentStore::Deserialize(File& file, endian::Endianness endianness) {
   endianness = CheckEndianness(file, endianness);
   bool need_swap = (endianness != endian::kCompileEndian);
 
-  uint32_t chunk_id, obj_id;
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
+  uint64_t total_num;
+  file.Read(&total_num);
   if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
+    endian::ByteSwap::Swap(&total_num);
   }
-  first_ray_segment = reinterpret_cast<RaySegment*>(CombineU32AsPointer(chunk_id, obj_id));
-
-  file.Read(&chunk_id);
-  file.Read(&obj_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_id);
-    endian::ByteSwap::Swap(&obj_id);
+  if (total_num > kInvalidPoolHandle) {
+    throw std::invalid_argument("Ray segment number is invalid!");
   }
-  prev_ray_segment = reinterpret_cast<RaySegment*>(CombineU32AsPointer(chunk_id, obj_id));
 
-  file.Read(&crystal_id);
-  if (need_swap) {
-    endian::ByteSwap::Swap(&crystal_id);
-  }
+  AddChunks(0, total_num);
+  size_.store(total_num);
+
+  auto read_column = [&](size_t step, std::function<void(Chunk&, size_t)> read) {
+    for (size_t i = 0; i * kChunkSize < total_num; i++) {
+      read(*chunks_[i].load(std::memory_order_acquire), std::min(total_num - i * kChunkSize, kChunkSize) * step);
+    }
+  };
+  read_column(3, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.pt, n); });
+  read_column(3, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.dir, n); });
+  read_column(1, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.w, n); });
+  read_column(1, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.face_id, n); });
+  read_column(1, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.state, n); });
+  read_column(1, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.parent, n); });
+  read_column(1, [&](Chunk& c, size_t n) { ReadColumn(file, need_swap, c.ray_info, n); });
+}
+
+
+void Optics::HitSurface(const Crystal* crystal, float n, size_t num,                    // input
+                        const float* dir_in, const int* face_id_in, const float* w_in,  // input
+                        float* dir_out, float* w_out,                                   // output
+                        const FresnelTable* fresnel) {
+  GetKernels().hit_surface(n, fresnel, num, dir_in, crystal->GetFaceNorm(), face_id_in, w_in, dir_out, w_out);
+}
+
+
+RayInfo::RayInfo()
+    : first_ray_segment(kInvalidPoolHandle), prev_ray_segment(kInvalidPoolHandle), crystal_id(-1),
+      main_axis{ 0, 0, 0 } {}
+
+
+RayInfo::RayInfo(PoolHandle seg, int crystal_id, const float* main_axis)
+    : first_ray_segment(seg), prev_ray_segment(kInvalidPoolHandle), crystal_id(crystal_id), main_axis(main_axis) {}
+
+
+void RayInfo::SwapBytes() {
+  endian::ByteSwap::Swap(&first_ray_segment);
+  endian::ByteSwap::Swap(&prev_ray_segment);
+  endian::ByteSwap::Swap(&crystal_id);
 
   float vec3f_buf[3];
-  file.Read(vec3f_buf, 3);
-  if (need_swap) {
-    endian::ByteSwap::Swap(vec3f_buf, 3);
-  }
+  std::copy(main_axis.val(), main_axis.val() + 3, vec3f_buf);
+  endian::ByteSwap::Swap(vec3f_buf, 3);
   main_axis.val(vec3f_buf);
 }
 
 
+void Optics::HitSurfaceSimd(const Crystal* crystal, float n, size_t num,                    // input
+                            const float* dir_in, const int* face_id_in, const float* w_in,  // input
+                            float* dir_out, float* w_out,                                   // output
+                            const FresnelTable* fresnel) {
+  GetKernels().hit_surface_simd(n, fresnel, num, dir_in, crystal->GetFaceNorm(), face_id_in, w_in, dir_out, w_out);
+}
+
+
+constexpr int Optics::kPacketSize;
+constexpr int Optics::kPacketFaceDataSize;
+constexpr int Optics::kAnyPlaneNum;
+constexpr int Optics::kHitSurfaceUlp;
+constexpr int Optics::kNonConvex;
+
 void Optics::Propagate(const Crystal* crystal, size_t num,                                                 // input
                        const float* pt_in, const float* dir_in, const float* w_in, const int* face_id_in,  // input
                        float* pt_out, int* face_id_out) {                                                  // output
+  GetPropagateFunc(crystal)(crystal, num, pt_in, dir_in, w_in, face_id_in, pt_out, face_id_out);
+}
+
+
+// Built-in crystal types have a known maximum plane number, so their kernels are specialized on it. Crystals with
+// fewer planes (e.g. a pyramid with a zero height segment) are padded. Others, including all custom crystals, use
+// the generic kernels.
+Optics::PropagateFunc Optics::GetPropagateFunc(const Crystal* crystal) {
+  if (!crystal->IsConvex()) {
+    return &PropagateInPackets<kNonConvex>;
+  }
+
+  int plane_num = crystal->TotalPlanes();
+  switch (crystal->GetType()) {
+    case CrystalType::kPrism:
+    case CrystalType::kIrregularPrism:
+      if (plane_num <= 8) {
+        return &PropagateInPackets<8>;
+      }
+      break;
+    case CrystalType::kCubicPyramid:
+      if (plane_num <= 10) {
+        return &PropagateInPackets<10>;
+      }
+      break;
+    case CrystalType::kPyramid_H3:
+    case CrystalType::kPyramid_I2H3:
+    case CrystalType::kPyramid_I4H3:
+    case CrystalType::kIrregularPyramid:
+    case CrystalType::kPyramidStackHalf:
+      if (plane_num <= 20) {
+        return &PropagateInPackets<20>;
+      }
+      break;
+    default:
+      break;
+  }
+  return &PropagateInPackets<kAnyPlaneNum>;
+}
+
+
+// Rays are packed into packets in structure-of-arrays layout. Only alive rays are packed, so no lane is wasted
+// on rays that are skipped. Unused lanes in the last packet repeat the first ray, and their results are ignored.
+// Convex crystals use plane kernel, large non-convex ones use BVH kernel, and others use triangle kernel.
+template <int PlaneNum>
+void Optics::PropagateInPackets(const Crystal* crystal, size_t num,                          // input
+                                const float* pt_in, const float* dir_in, const float* w_in,  // input
+                                const int* face_id_in,                                       // input
+                                float* pt_out, int* face_id_out) {                           // output
+  constexpr bool kConvex = PlaneNum != kNonConvex;
   for (decltype(num) i = 0; i < num; i++) {
     face_id_out[i] = -1;
   }
 
   auto total_faces = crystal->TotalFaces();
+  const Bvh* bvh = crystal->GetBvh();
+
+  // Copy plane data for a fixed plane number. Padding planes have zero normals and are never hit.
+  constexpr int kFixedPlaneNum = PlaneNum > 0 ? PlaneNum : 1;
+  float fixed_plane_norm[kFixedPlaneNum * 3]{};
+  float fixed_plane_dist[kFixedPlaneNum]{};
+  const float* plane_norm = crystal->GetPlaneNorm();
+  const float* plane_dist = crystal->GetPlaneDist();
+  if (PlaneNum > 0) {
+    std::copy(plane_norm, plane_norm + crystal->TotalPlanes() * 3, fixed_plane_norm);
+    std::copy(plane_dist, plane_dist + crystal->TotalPlanes(), fixed_plane_dist);
+    plane_norm = fixed_plane_norm;
+    plane_dist = fixed_plane_dist;
+  }
+
+  const auto& kernels = GetKernels();
+  auto intersect_planes = PlaneNum == 8  ? kernels.intersect_lines_with_planes_packet_8 :
+                          PlaneNum == 10 ? kernels.intersect_lines_with_planes_packet_10 :
+                          PlaneNum == 20 ? kernels.intersect_lines_with_planes_packet_20 :
+                                           kernels.intersect_lines_with_planes_packet;
+
+  // SIMD kernels test a whole packet against a plane at once, and the union of lane masks seldom skips any plane, so
+  // candidate planes only pay off where lanes run one by one.
+  bool use_plane_mask = kConvex && GetSimdLevel() < SimdLevel::kAvx2;
+
+  size_t packet_ray_idx[kPacketSize];
+  float packet_pt[kPacketSize * 3];
+  float packet_dir[kPacketSize * 3];
+  int packet_face_id[kPacketSize];
+  uint64_t packet_plane_mask[kPacketSize];
+  float packet_t[kPacketSize];
+  int packet_idx[kPacketSize];
+  decltype(num) i = 0;
+  while (i < num) {
+    int n = 0;
+    for (; i < num && n < kPacketSize; i++) {
+      if (w_in[i] < ProjectContext::kPropMinW) {
+        continue;
+      }
+      packet_ray_idx[n] = i;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    for (int k = 0; k < kPacketSize; k++) {
+      auto ray_idx = packet_ray_idx[k < n ? k : 0];
+      for (int j = 0; j < 3; j++) {
+        packet_pt[j * kPacketSize + k] = pt_in[ray_idx / 2 * 3 + j];
+        packet_dir[j * kPacketSize + k] = dir_in[ray_idx * 3 + j];
+      }
+      packet_face_id[k] = face_id_in[ray_idx / 2];
+      if (use_plane_mask) {
+        packet_plane_mask[k] = crystal->GetCandidatePlanes(dir_in + ray_idx * 3, packet_face_id[k]);
+      }
+    }
+
+    if (kConvex) {
+      intersect_planes(packet_pt, packet_dir, packet_face_id, crystal->GetFaceNorm(),  // input
+                       crystal->TotalPlanes(), plane_norm, plane_dist,                 // input
+                       use_plane_mask ? packet_plane_mask : nullptr,                   // input
+                       packet_t, packet_idx);                                          // output
+    } else if (bvh) {
+      kernels.intersect_lines_with_bvh_packet(packet_pt, packet_dir, packet_face_id,  // input
+                                              crystal->GetFaceNorm(), bvh,            // input
+                                              packet_t, packet_idx);                  // output
+    } else {
+      kernels.intersect_lines_with_triangles_packet(packet_pt, packet_dir, packet_face_id,  // input
+                                                    total_faces, crystal->GetFaceData(),   // input
+                                                    packet_t, packet_idx);                 // output
+    }
+
+    for (int k = 0; k < n; k++) {
+      if (packet_idx[k] < 0) {
+        continue;
+      }
+      auto ray_idx = packet_ray_idx[k];
+      float* p = pt_out + ray_idx * 3;
+      for (int j = 0; j < 3; j++) {
+        p[j] = packet_pt[j * kPacketSize + k] + packet_t[k] * packet_dir[j * kPacketSize + k];
+      }
+      face_id_out[ray_idx] = kConvex ? FindFaceInPlane(crystal, packet_idx[k], p) : packet_idx[k];
+    }
+  }
+}
+
+
+// Find the triangle where a point lies in. The point is already on the plane, so only barycentric coordinates are
+// checked. The triangle that contains the point best is taken, so a point on an edge still gets a triangle.
+int Optics::FindFaceInPlane(const Crystal* crystal, int plane_idx, const float* pt) {
+  const auto& plane_faces = crystal->GetPlaneFaces()[plane_idx];
+  if (plane_faces.size() == 1) {
+    return plane_faces[0];
+  }
+
   auto face_bases = crystal->GetFaceBaseVector();
   auto face_vertexes = crystal->GetFaceVertex();
-  auto face_norms = crystal->GetFaceNorm();
-  for (decltype(num) i = 0; i < num; i++) {
-    if (w_in[i] < ProjectContext::kPropMinW) {
-      continue;
+  int best_face = plane_faces[0];
+  float best_score = std::numeric_limits<float>::lowest();
+  for (auto f : plane_faces) {
+    const float* e0 = face_bases + f * 6;
+    const float* e1 = face_bases + f * 6 + 3;
+    float v[3];
+    math::Vec3FromTo(face_vertexes + f * 9, pt, v);
+
+    float d00 = math::Dot3(e0, e0);
+    float d01 = math::Dot3(e0, e1);
+    float d11 = math::Dot3(e1, e1);
+    float d20 = math::Dot3(v, e0);
+    float d21 = math::Dot3(v, e1);
+    float denom = d00 * d11 - d01 * d01;
+    float alpha = (d11 * d20 - d01 * d21) / denom;
+    float beta = (d00 * d21 - d01 * d20) / denom;
+
+    float score = std::min(std::min(alpha, beta), 1 - alpha - beta);
+    if (score > best_score) {
+      best_score = score;
+      best_face = f;
+    }
+    if (score >= 0) {
+      break;
     }
-#if defined(__SSE4_1__) && defined(__AVX__)
-    IntersectLineWithTrianglesSimd(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                                   face_bases, face_vertexes, face_norms,                              //
-                                   pt_out + i * 3, face_id_out + i);                                   // output
-#else
-    IntersectLineWithTriangles(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                               face_bases, face_vertexes, face_norms,                              //
-                               pt_out + i * 3, face_id_out + i);                                   // output
-#endif
   }
+  return best_face;
 }
 
 
 float Optics::GetReflectRatio(float cos_angle, float rr) {
-  float s = std::sqrt(1.0f - cos_angle * cos_angle);
   float c = std::abs(cos_angle);
-  float d = std::max(1.0f - (rr * s) * (rr * s), 0.0f);
+  float d = std::max(1.0f - rr * rr * std::max(1.0f - c * c, 0.0f), 0.0f);  // |cos_angle| may exceed 1 by rounding
   float d_sqrt = std::sqrt(d);
 
   float Rs = (rr * c - d_sqrt) / (rr * c + d_sqrt);
@@ -262,72 +448,7 @@ void Optics::IntersectLineWithTriangles(const float* pt, const float* dir,  // i
                                         const float* face_points,           // input (pt1, pt2, pt3)
                                         const float* face_norm,             // input
                                         float* p, int* idx) {               // output
-  float min_t = std::numeric_limits<float>::max();
-  const float* norm_in = face_norm + face_id * 3;
-  float flag_in = math::Dot3(dir, norm_in);
-
-  for (int i = 0; i < face_num; i++) {
-    const float* curr_face_point = face_points + i * 9;
-    const float* curr_face_base = face_bases + i * 6;
-    const float* curr_face_norm = face_norm + i * 3;
-
-    if (math::Dot3(dir, curr_face_norm) * flag_in >= 0) {
-      continue;
-    }
-
-    float ff04 = curr_face_base[0] * curr_face_base[4];
-    float ff05 = curr_face_base[0] * curr_face_base[5];
-    float ff13 = curr_face_base[1] * curr_face_base[3];
-    float ff15 = curr_face_base[1] * curr_face_base[5];
-    float ff23 = curr_face_base[2] * curr_face_base[3];
-    float ff24 = curr_face_base[2] * curr_face_base[4];
-
-    float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 - dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
-    if (math::FloatEqualZero(c)) {
-      continue;
-    }
-
-
-    float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
-              ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
-    float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 - pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
-    float t = (a - b) / c;
-    if (t <= math::kFloatEps) {
-      continue;
-    }
-
-    float dp01 = dir[0] * pt[1];
-    float dp02 = dir[0] * pt[2];
-    float dp10 = dir[1] * pt[0];
-    float dp12 = dir[1] * pt[2];
-    float dp20 = dir[2] * pt[0];
-    float dp21 = dir[2] * pt[1];
-
-    a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] - dp21 * curr_face_base[3] -
-        dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
-    b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
-        dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
-        dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
-    float alpha = (a + b) / c;
-    if (alpha < 0 || alpha > 1) {
-      continue;
-    }
-
-    a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] - dp21 * curr_face_base[0] -
-        dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
-    b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
-        dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
-        dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
-    float beta = -(a + b) / c;
-
-    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
-      min_t = t;
-      p[0] = pt[0] + t * dir[0];
-      p[1] = pt[1] + t * dir[1];
-      p[2] = pt[2] + t * dir[2];
-      *idx = i;
-    }
-  }
+  GetKernels().intersect_line_with_triangles(pt, dir, face_id, face_num, face_bases, face_points, face_norm, p, idx);
 }
 
 
@@ -337,160 +458,81 @@ void Optics::IntersectLineWithTrianglesSimd(const float* pt, const float* dir,
                                             const float* face_points,           // input
                                             const float* face_norm,             // input
                                             float* p, int* idx) {               // output
-  float min_t = std::numeric_limits<float>::max();
-  const float* norm_in = face_norm + face_id * 3;
+  GetKernels().intersect_line_with_triangles_simd(pt, dir, face_id, face_num, face_bases, face_points, face_norm, p,
+                                                  idx);
+}
 
-  __m128 DIR = _mm_loadu_ps(dir);
-  __m128 PT = _mm_loadu_ps(pt);
-  __m128 NORM_IN = _mm_loadu_ps(norm_in);
-  __m128 DN_IN = _mm_dp_ps(DIR, NORM_IN, 0x71);
 
+void Optics::FillPacketFaceData(int face_num, const float* face_bases, const float* face_points,  // input
+                                const float* face_norm,                                          // input
+                                float* face_data) {                                              // output
   for (int i = 0; i < face_num; i++) {
-    const float* curr_face_point = face_points + i * 9;
-    const float* curr_face_base = face_bases + i * 6;
-    const float* curr_face_norm = face_norm + i * 3;
+    const float* fb = face_bases + i * 6;
+    const float* fp = face_points + i * 9;
+    const float* fn = face_norm + i * 3;
+    float* d = face_data + i * kPacketFaceDataSize;
+
+    // Face normal, used to check the direction
+    d[0] = fn[0];
+    d[1] = fn[1];
+    d[2] = fn[2];
+
+    // Plane coefficients. Same as ff15 - ff24, ff23 - ff05, ff04 - ff13 in IntersectLineWithTriangles()
+    d[3] = fb[1] * fb[5] - fb[2] * fb[4];
+    d[4] = fb[2] * fb[3] - fb[0] * fb[5];
+    d[5] = fb[0] * fb[4] - fb[1] * fb[3];
+    d[6] = d[3] * fp[0] + d[4] * fp[1] + d[5] * fp[2];
+
+    // Coefficients for alpha. The first 3 are multiplied by cross(dir, pt), and the last 3 by dir.
+    d[7] = fb[3];
+    d[8] = fb[4];
+    d[9] = fb[5];
+    d[10] = fb[4] * fp[2] - fb[5] * fp[1];
+    d[11] = fb[5] * fp[0] - fb[3] * fp[2];
+    d[12] = fb[3] * fp[1] - fb[4] * fp[0];
+
+    // Coefficients for beta, in the same way as alpha
+    d[13] = fb[0];
+    d[14] = fb[1];
+    d[15] = fb[2];
+    d[16] = fb[1] * fp[2] - fb[2] * fp[1];
+    d[17] = fb[2] * fp[0] - fb[0] * fp[2];
+    d[18] = fb[0] * fp[1] - fb[1] * fp[0];
+
+    d[19] = 0;  // Padding
+  }
+}
 
-    __m128 CURR_FACE_NORM = _mm_loadu_ps(curr_face_norm);
 
-    __m128 DN_CURR = _mm_dp_ps(DIR, CURR_FACE_NORM, 0x71);
-    __m128 FLAG = _mm_mul_ps(DN_IN, DN_CURR);
+void Optics::IntersectLinesWithTrianglesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                               int face_num, const float* face_data,                 // input
+                                               float* t, int* idx) {                                 // output
+  GetKernels().intersect_lines_with_triangles_packet(pt, dir, face_id, face_num, face_data, t, idx);
+}
 
-    if (FLAG[0] >= 0) {
-      continue;
-    }
 
-    /* Here use permute to get the production of curr_face_base.
-     * The original plain code is:
-     *
-     *   float ff04 = curr_face_base[0] * curr_face_base[4];
-     *   float ff05 = curr_face_base[0] * curr_face_base[5];
-     *   float ff13 = curr_face_base[1] * curr_face_base[3];
-     *   float ff15 = curr_face_base[1] * curr_face_base[5];
-     *   float ff23 = curr_face_base[2] * curr_face_base[3];
-     *   float ff24 = curr_face_base[2] * curr_face_base[4];
-     *
-     *        |<-- high -- low -->|
-     * index: 5   4   3   2   1   0
-     * index: 1   0   2   4   3   5
-     */
-    __m128 CURR_FB0 = _mm_loadu_ps(curr_face_base + 0);
-    __m128 CURR_FB1 = _mm_loadu_ps(curr_face_base + 3);
-    __m128 FF0 = _mm_mul_ps(CURR_FB0, _mm_permute_ps(CURR_FB1, 0xD2));
-    __m128 FF1 = _mm_mul_ps(CURR_FB1, _mm_permute_ps(CURR_FB0, 0xD2));
-
-    /*
-     * The original plain code is:
-     *
-     *   float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 -
-     *             dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
-     *
-     *      |<-- high ------ low -->|
-     * dir: 2   1   0   -   2   1   0
-     * ff1: 1   0   2  ff0: 1   0   2
-     */
-    __m128 SUB_PERM_FF = _mm_permute_ps(_mm_sub_ps(FF1, FF0), 0xD2);
-    __m128 C = _mm_dp_ps(DIR, SUB_PERM_FF, 0x71);
-
-    if (math::FloatEqualZero(C[0])) {
-      continue;
-    }
+void Optics::IntersectLinesWithPlanesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                            const float* face_norm, int plane_num,                 // input
+                                            const float* plane_norm, const float* plane_dist,      // input
+                                            const uint64_t* plane_mask,                            // input
+                                            float* t, int* idx) {                                  // output
+  GetKernels().intersect_lines_with_planes_packet(pt, dir, face_id, face_norm, plane_num, plane_norm, plane_dist,
+                                                  plane_mask, t, idx);
+}
 
 
-    /*
-     *   float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
-     *             ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
-     *   float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 -
-     *             pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
-     *
-     *        |<-- high ------ low -->|
-     * fp/pt: 2   1   0   -   2   1   0
-     * ff1  : 1   0   2  ff0: 1   0   2
-     */
-    __m128 CURR_FACE_POINT = _mm_loadu_ps(curr_face_point);
-    __m128 A = _mm_dp_ps(SUB_PERM_FF, CURR_FACE_POINT, 0x71);
-    __m128 B = _mm_dp_ps(SUB_PERM_FF, PT, 0x71);
-    float t = (A[0] - B[0]) / C[0];
-    if (t <= math::kFloatEps) {
-      continue;
-    }
+void Optics::IntersectLinesWithBvhPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                         const float* face_norm, const Bvh* bvh,                // input
+                                         float* t, int* idx) {                                  // output
+  GetKernels().intersect_lines_with_bvh_packet(pt, dir, face_id, face_norm, bvh, t, idx);
+}
 
-    /*
-     *   float dp01 = dir[0] * pt[1];
-     *   float dp02 = dir[0] * pt[2];
-     *   float dp10 = dir[1] * pt[0];
-     *   float dp12 = dir[1] * pt[2];
-     *   float dp20 = dir[2] * pt[0];
-     *   float dp21 = dir[2] * pt[1];
-     *
-     *      |<-- high -|-- low -->|
-     * dir: 2   1   0  |  2   1   0
-     * pt : 1   0   2  |  0   2   1
-     */
-    __m128 DP0 = _mm_mul_ps(DIR, _mm_permute_ps(PT, 0xC9));
-    __m128 DP1 = _mm_mul_ps(DIR, _mm_permute_ps(PT, 0xD2));
-    __m128 SUB_PERM_DP = _mm_sub_ps(_mm_permute_ps(DP0, 0xC9), _mm_permute_ps(DP1, 0xD2));
-
-    /*
-     *   a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] -
-     *       dp21 * curr_face_base[3] - dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
-     *   b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
-     *       dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
-     *       dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
-     *
-     * a:
-     *      |<-- high ---|--- low -->|
-     * fb1: 5   4   3  - |   5   4   3
-     * dp0: 0   2   1  dp1:  1   0   2
-     *
-     * b:
-     *      |<-- high --|--- low -->|
-     * dir: 2   1   0   |   2   1   0
-     * fb1: 3   5   4   |   4   3   5
-     * fp : 1   0   2   |   0   2   1
-     */
-    A = _mm_dp_ps(CURR_FB1, SUB_PERM_DP, 0x71);
-    B = _mm_dp_ps(DIR,
-                  _mm_sub_ps(_mm_mul_ps(_mm_permute_ps(CURR_FB1, 0xC9), _mm_permute_ps(CURR_FACE_POINT, 0xD2)),
-                             _mm_mul_ps(_mm_permute_ps(CURR_FB1, 0xD2), _mm_permute_ps(CURR_FACE_POINT, 0xC9))),
-                  0x71);
-    float alpha = (A[0] + B[0]) / C[0];
-    if (alpha < 0 || alpha > 1) {
-      continue;
-    }
 
-    /*
-     *   a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] -
-     *       dp21 * curr_face_base[0] - dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
-     *   b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
-     *       dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
-     *       dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
-     *
-     * a:
-     *      |<-- high ---|--- low -->|
-     * fb0: 2   1   0    |   2   1   0
-     * dp1: 0   2   1  dp0:  1   0   2
-     *
-     * b:
-     *      |<-- high --|--- low -->|
-     * dir: 2   1   0   |   2   1   0
-     * fb0: 0   2   1   |   1   0   2
-     * fp : 1   0   2   |   0   2   1
-     */
-    A = _mm_dp_ps(CURR_FB0, SUB_PERM_DP, 0x71);
-    B = _mm_dp_ps(DIR,
-                  _mm_sub_ps(_mm_mul_ps(_mm_permute_ps(CURR_FB0, 0xC9), _mm_permute_ps(CURR_FACE_POINT, 0xD2)),
-                             _mm_mul_ps(_mm_permute_ps(CURR_FB0, 0xD2), _mm_permute_ps(CURR_FACE_POINT, 0xC9))),
-                  0x71);
-    float beta = -(A[0] + B[0]) / C[0];
-
-    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
-      min_t = t;
-      p[0] = pt[0] + t * dir[0];
-      p[1] = pt[1] + t * dir[1];
-      p[2] = pt[2] + t * dir[2];
-      *idx = i;
-    }
-  }
+void Optics::HitSurfacePacket(float n, const float* dir, const float* norm, const float* w,  // input
+                              float* dir_reflection, float* dir_refraction,                 // output
+                              float* w_reflection, float* w_refraction,                     // output
+                              const FresnelTable* fresnel) {
+  GetKernels().hit_surface_packet(n, fresnel, dir, norm, w, dir_reflection, dir_refraction, w_reflection, w_refraction);
 }
 
 
@@ -519,4 +561,75 @@ double IceRefractiveIndex::Get(double wave_length) {
 }
 
 
+constexpr int FresnelTable::kMinSize;
+constexpr int FresnelTable::kMaxSize;
+
+FresnelTable::FresnelTable(float n, float max_error) : n_(n), max_error_(0) {
+  if (!(n > 1.0f)) {
+    throw std::invalid_argument("Refractive index must be larger than 1!");
+  }
+  if (!(max_error > 0)) {
+    throw std::invalid_argument("Max error of Fresnel table must be positive!");
+  }
+
+  // Errors are checked at a few points in every interval, against reflectance in double.
+  constexpr int kCheckNum = 4;
+  for (int size = kMinSize; size <= kMaxSize; size *= 2) {
+    table_.resize(size + 1);
+    for (int i = 0; i <= size; i++) {
+      table_[i] = static_cast<float>(GetReflectRatio(static_cast<double>(i) / size, n));
+    }
+    max_error_ = 0;
+    for (int i = 0; i < size; i++) {
+      for (int j = 1; j < kCheckNum; j++) {
+        double x = (i + static_cast<double>(j) / kCheckNum) / size;
+        double err = std::abs(Get(static_cast<float>(x)) - GetReflectRatio(x, n));
+        max_error_ = std::max(max_error_, static_cast<float>(err));
+      }
+    }
+    if (max_error_ <= max_error) {
+      return;
+    }
+  }
+  std::fprintf(stderr, "WARNING! Fresnel table can not reach error %.3g with %d entries. Its error is %.3g.\n",
+               max_error, kMaxSize + 1, max_error_);
+}
+
+
+float FresnelTable::GetRefractiveIndex() const {
+  return n_;
+}
+
+
+float FresnelTable::GetMaxError() const {
+  return max_error_;
+}
+
+
+int FresnelTable::Size() const {
+  return static_cast<int>(table_.size()) - 1;
+}
+
+
+const float* FresnelTable::GetData() const {
+  return table_.data();
+}
+
+
+float FresnelTable::Get(float cos_air) const {
+  int size = Size();
+  float x = std::min(std::max(cos_air, 0.0f), 1.0f) * size;
+  int i = std::min(static_cast<int>(x), size - 1);
+  return table_[i] + (table_[i + 1] - table_[i]) * (x - i);
+}
+
+
+// Same as Optics::GetReflectRatio(), written with cosine of the angle in air and in crystal.
+double FresnelTable::GetReflectRatio(double cos_air, double n) {
+  double cos_ice = std::sqrt(1.0 - (1.0 - cos_air * cos_air) / (n * n));
+  double Rs = (cos_air - n * cos_ice) / (cos_air + n * cos_ice);
+  double Rp = (cos_ice - n * cos_air) / (cos_ice + n * cos_air);
+  return (Rs * Rs + Rp * Rp) / 2;
+}
+
 }  // namespace icehalo
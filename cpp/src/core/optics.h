@@ -2,18 +2,19 @@
 #define SRC_CORE_OPTICS_H_
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
-#include <mutex>
 #include <vector>
 
 #include "core/crystal.h"
 #include "core/mymath.h"
 #include "io/serialize.h"
+#include "util/obj_pool.h"
 
 
 namespace icehalo {
 
-struct RayInfo;
+class FresnelTable;
 
 enum class RaySegmentState : uint8_t {
   kOnGoing = 0,
@@ -23,78 +24,78 @@ enum class RaySegmentState : uint8_t {
   kContinued = 4,
 };
 
-struct RaySegment : public ISerializable {
-  RaySegment();
-  RaySegment(const float* pt, const float* dir, float w, int face_id);
+/**
+ * @brief Ray segments of all rays, stored as a structure of arrays.
+ *
+ * A segment is referred to by its PoolHandle, and every attribute lives in its own array. Then a loop over one
+ * attribute streams through memory, and does not pull other attributes into cache. Arrays grow by chunks of
+ * kChunkSize segments, and are not initialized. A segment is valid after Set().
+ *
+ * ReserveSegments() is lock-free like ObjectPool::ReserveObjects(), and chunks are never moved. Set() and other
+ * setters can be called from multiple threads at the same time, as long as they touch different segments.
+ */
+class RaySegmentStore : public ISerializable {
+ public:
+  ~RaySegmentStore() override;
 
-  /**
-   * @brief Serialize self to a file.
-   *
-   * There are 4 pointers in this struct, of 2 types, RaySegment and RayInfo. Both of them are pooled
-   * object types. Thus we store two uint32_t data (chunk ID, object ID) to hold the pointer.
-   *
-   * The file layout will be:
-   * uint32 * 2,        // next_reflect
-   * uint32 * 2,        // next_refract
-   * uint32 * 2,        // prev
-   * uint32 * 2,        // root_ctx
-   * float * 3,         // pt
-   * float * 3,         // dir
-   * float,             // w
-   * int16,             // face_id
-   * uint8,             // state
-   *
-   * @warning We do **NOT** store raw pointer, which is impossible and is improper for deserialization.
-   *
-   * @param file
-   * @param with_boi
-   */
-  void Serialize(File& file, bool with_boi) const override;
+  RaySegmentStore(const RaySegmentStore&) = delete;
+  void operator=(const RaySegmentStore&) = delete;
+
+  static RaySegmentStore* GetInstance();
 
   /**
-   * @brief Deserialize (load data) from a file.
-   *
-   * Since there are 4 pointer members in this struct, and they cannot be serialized plainly, we store
-   * 2 uint32 data instead (see RaySegment::Serialize(File&, bool) ). The caller should further call
-   * ObjectPool<T>::GetPointerFromSerializeData(T*) to get real pointer.
+   * @brief Reserve some consecutive segments. It can be called from multiple threads at the same time.
    *
-   * @warning ObjectPool<T>::GetPointerFromSerializeData(T*) must be called **AFTER** the entire
-   * object pool finishing its deserialization.
-   *
-   * @param file
-   * @param endianness
+   * @param num the number of segments to reserve.
+   * @return the handle of the first reserved segment.
+   * @throw std::overflow_error if the store would hold more segments than PoolHandle can address.
    */
-  void Deserialize(File& file, endian::Endianness endianness) override;
+  size_t ReserveSegments(size_t num);
 
-  RaySegment* next_reflect;
-  RaySegment* next_refract;
-  RaySegment* prev;
-  RayInfo* root_ctx;
+  /*! @brief Drop all segments. Chunks are kept and reused. */
+  void Clear();
 
-  math::Vec3f pt;
-  math::Vec3f dir;
-  float w;
-  int face_id;
+  /*! @brief The number of reserved segments. */
+  size_t Size() const;
 
-  RaySegmentState state;
-};
+  /*! @brief Bytes taken by allocated chunks, including those kept after Clear(). */
+  size_t GetMemoryUsage() const;
+
+  /**
+   * @brief Free unused chunks, from the last one, until allocated chunks take at most max_bytes.
+   *
+   * Chunks holding reserved segments are never freed. It must not be called together with ReserveSegments().
+   */
+  void ReleaseChunks(size_t max_bytes);
 
+  void Set(PoolHandle h, const float* pt, const float* dir, float w, int face_id,  // input
+           PoolHandle parent, PoolHandle ray_info, RaySegmentState state);        // input
 
-struct RayInfo : public ISerializable {
-  RayInfo();
-  RayInfo(RaySegment* seg, int crystal_id, const float* main_axis);
+  // Accessors are in the hot path of tracing and filtering, and are kept inline.
+  const float* GetPoint(PoolHandle h) const { return GetChunk(h).pt + h % kChunkSize * 3; }
+  const float* GetDir(PoolHandle h) const { return GetChunk(h).dir + h % kChunkSize * 3; }
+  float GetWeight(PoolHandle h) const { return GetChunk(h).w[h % kChunkSize]; }
+  int GetFaceId(PoolHandle h) const { return GetChunk(h).face_id[h % kChunkSize]; }
+  RaySegmentState GetState(PoolHandle h) const { return GetChunk(h).state[h % kChunkSize]; }
+  PoolHandle GetParent(PoolHandle h) const { return GetChunk(h).parent[h % kChunkSize]; }
+  PoolHandle GetRayInfo(PoolHandle h) const { return GetChunk(h).ray_info[h % kChunkSize]; }
+  void SetState(PoolHandle h, RaySegmentState state) { GetChunk(h).state[h % kChunkSize] = state; }
+  void SetWeight(PoolHandle h, float w) { GetChunk(h).w[h % kChunkSize] = w; }
 
   /**
    * @brief Serialize self to a file.
    *
-   * There are 2 pointers in this struct, of type RaySegment. RaySegment is a pooled object type. Thus
-   * we store two uint32_t data (chunk ID, object ID) to hold the pointer.
+   * Attributes are written one after another, each as raw memory, chunk by chunk.
    *
-   * The file layout will be:
-   * uint32 * 2,            // first_ray_segment
-   * uint32 * 2,            // prev_ray_segment
-   * int32,                 // crystal ID
-   * float * 3,             // main_axis
+   * The file layout is:
+   * uint64,            // the number of segments, N
+   * float * 3 * N,     // pt
+   * float * 3 * N,     // dir
+   * float * N,         // w
+   * int32 * N,         // face_id
+   * uint8 * N,         // state
+   * uint32 * N,        // parent
+   * uint32 * N,        // ray_info
    *
    * @param file
    * @param with_boi
@@ -104,35 +105,105 @@ struct RayInfo : public ISerializable {
   /**
    * @brief Deserialize (load data) from a file.
    *
-   * Since there are 2 pointer members in this struct, and they cannot be serialized plainly, we store
-   * 2 uint32 data (see RaySegment::Serialize(File&, bool) ) instead. The caller should further call
-   * ObjectPool<T>::GetPointerFromSerializeData(T*) to get real ray segment pointer.
-   *
-   * @warning ObjectPool<T>::GetPointerFromSerializeData(T*) must be called **AFTER** the entire
-   * object pool finishing its deserialization.
+   * @warning It will clear all existing segments.
    *
    * @param file
    * @param endianness
    */
   void Deserialize(File& file, endian::Endianness endianness) override;
 
-  RaySegment* first_ray_segment;
-  RaySegment* prev_ray_segment;
+  static constexpr size_t kChunkSize = 1024 * 1024;
+  static constexpr size_t kMaxChunkNum = (kInvalidPoolHandle + kChunkSize - 1) / kChunkSize;
+  static constexpr size_t kSegmentBytes =
+      sizeof(float) * 7 + sizeof(int) + sizeof(RaySegmentState) + sizeof(PoolHandle) * 2;
+
+ private:
+  struct Chunk {
+    float* pt;
+    float* dir;
+    float* w;
+    int* face_id;
+    RaySegmentState* state;
+    PoolHandle* parent;    // Handle of previous segment on the path. kInvalidPoolHandle for the first one.
+    PoolHandle* ray_info;  // Handle of a RayInfo, see RayInfoPool.
+  };
+
+  RaySegmentStore();
+  void AddChunks(size_t idx0, size_t idx1);
+  static Chunk* AllocateChunk();
+  static void DeleteChunk(Chunk* chunk);
+
+  Chunk& GetChunk(PoolHandle h) const { return *chunks_[h / kChunkSize].load(std::memory_order_acquire); }
+
+  template <class T>
+  static void ReadColumn(File& file, bool need_swap, T* data, size_t n) {
+    file.Read(data, n);
+    if (need_swap) {
+      endian::ByteSwap::Swap(data, n);
+    }
+  }
+
+  std::unique_ptr<std::atomic<Chunk*>[]> chunks_;  // kMaxChunkNum slots. Chunks are kept after Clear() and reused.
+  std::atomic<size_t> size_;
+};
+
+
+/*! @brief Information shared by all segments of a ray. It is a pooled object, see RayInfoPool. */
+struct RayInfo {
+  RayInfo();
+  RayInfo(PoolHandle seg, int crystal_id, const float* main_axis);
+
+  /*! @brief Swap byte order of every member. Used when loading data of different endianness. */
+  void SwapBytes();
+
+  PoolHandle first_ray_segment;
+  PoolHandle prev_ray_segment;  // The segment of last scattering this ray comes from
   int32_t crystal_id;
   math::Vec3f main_axis;
 };
 
 
+// Kernels (HitSurface*(), IntersectLine*() and so on) run with the SIMD level picked at startup. See core/kernel.h
 class Optics {
  public:
+  /*! \brief Compute reflection and refraction of rays on their faces.
+   *
+   * If fresnel is given, reflectance is looked up in it instead of GetReflectRatio(), and its refractive index must
+   * be n.
+   */
   static void HitSurface(const Crystal* crystal, float n, size_t num,                    // input
                          const float* dir_in, const int* face_id_in, const float* w_in,  // input
-                         float* dir_out, float* w_out);                                  // output
+                         float* dir_out, float* w_out,                                   // output
+                         const FresnelTable* fresnel = nullptr);
+
+  /*! \brief Same as HitSurface(), but computed in packets with HitSurfacePacket(). Fall back to HitSurface() if
+   * SIMD level (see GetSimdLevel()) is lower than AVX2.
+   *
+   * If fresnel is given, it is used in the same way as HitSurface(), on all SIMD levels.
+   */
+  static void HitSurfaceSimd(const Crystal* crystal, float n, size_t num,                    // input
+                             const float* dir_in, const int* face_id_in, const float* w_in,  // input
+                             float* dir_out, float* w_out,                                   // output
+                             const FresnelTable* fresnel = nullptr);
 
   static void Propagate(const Crystal* crystal, size_t num,                                                 // input
                         const float* pt_in, const float* dir_in, const float* w_in, const int* face_id_in,  // input
                         float* pt_out, int* face_id_out);                                                   // output
 
+  using PropagateFunc = void (*)(const Crystal* crystal, size_t num,                          // input
+                                 const float* pt_in, const float* dir_in, const float* w_in,  // input
+                                 const int* face_id_in,                                       // input
+                                 float* pt_out, int* face_id_out);                            // output
+
+  /*! \brief Choose the propagate kernel for a crystal.
+   *
+   * Propagate() is the same as calling the returned function. It is better to choose once for many calls on the
+   * same crystal. Convex built-in crystals get kernels specialized on their maximum plane number, where the loop
+   * over planes is unrolled at compile time. Other crystals get generic kernels, and those with a BVH (see
+   * Crystal::GetBvh()) traverse it.
+   */
+  static PropagateFunc GetPropagateFunc(const Crystal* crystal);
+
   static float GetReflectRatio(float cos_angle, float rr);
 
   /*! \brief Intersect a line with many faces and find the nearest intersection point.
@@ -158,6 +229,119 @@ class Optics {
                                              const float* face_points,           //
                                              const float* face_norm,             //
                                              float* p, int* idx);                // output
+
+  /*! \brief Compute per-face data used by IntersectLinesWithTrianglesPacket().
+   *
+   * For every face there are kPacketFaceDataSize floats: face normal, plane coefficients of the line-plane
+   * equation, and coefficients of the two barycentric coordinates. They depend only on the crystal, so every
+   * crystal computes them once, see Crystal::GetFaceData().
+   *
+   * \param face_num the face number
+   * \param face_bases the face data, 6 floats for one face, represents for 2 base vector
+   * \param face_points the face data, 9 floats for one face, represents for 3 vertexes
+   * \param face_norm the face data, 3 floats for one face
+   * \param face_data output argument, kPacketFaceDataSize * face_num floats
+   */
+  static void FillPacketFaceData(int face_num, const float* face_bases, const float* face_points,  // input
+                                 const float* face_norm,                                          // input
+                                 float* face_data);                                               // output
+
+  /*! \brief Intersect a packet of lines with many faces and find the nearest intersection for every line.
+   *
+   * Lines are in structure-of-arrays layout, one line per lane. All lanes are tested against one face at a time,
+   * and the nearest intersection of every lane is tracked with masks. It gives the same result as
+   * IntersectLineWithTriangles() for every line, except for rounding errors.
+   *
+   * \param pt points on lines, kPacketSize x, then kPacketSize y, then kPacketSize z
+   * \param dir directions of lines, in the same layout as pt
+   * \param face_id face index where every line starts, kPacketSize ints
+   * \param face_num the face number
+   * \param face_data per-face data, see FillPacketFaceData()
+   * \param t output argument, the distance from pt to the intersection point, kPacketSize floats
+   * \param idx output argument, the face index of the intersection point, or -1 if there is no intersection
+   */
+  static void IntersectLinesWithTrianglesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                                int face_num, const float* face_data,                 // input
+                                                float* t, int* idx);                                  // output
+
+  /*! \brief Intersect a packet of lines with face planes of a convex crystal, and find the nearest one ahead.
+   *
+   * It works like IntersectLinesWithTrianglesPacket(), but no barycentric test is needed, because for a line starting
+   * on the surface of a convex crystal, the nearest plane ahead (among those facing the other way from the start face)
+   * is exactly where it leaves the crystal.
+   *
+   * \param pt points on lines, kPacketSize x, then kPacketSize y, then kPacketSize z
+   * \param dir directions of lines, in the same layout as pt
+   * \param face_id face (triangle) index where every line starts, kPacketSize ints
+   * \param face_norm the face data, 3 floats for one face
+   * \param plane_num the plane number
+   * \param plane_norm plane normals, 3 floats for one plane
+   * \param plane_dist plane distances, 1 float for one plane
+   * \param plane_mask planes to test for every line, kPacketSize masks, see Crystal::GetCandidatePlanes(). Other
+   *                   planes are skipped. nullptr means all planes
+   * \param t output argument, the distance from pt to the intersection point, kPacketSize floats
+   * \param idx output argument, the plane index of the intersection point, or -1 if there is no intersection
+   */
+  static void IntersectLinesWithPlanesPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                             const float* face_norm, int plane_num,                 // input
+                                             const float* plane_norm, const float* plane_dist,      // input
+                                             const uint64_t* plane_mask,                            // input
+                                             float* t, int* idx);                                   // output
+
+  /*! \brief Intersect a packet of lines with triangles of a crystal by traversing its BVH.
+   *
+   * It gives the same result as IntersectLinesWithTrianglesPacket() for every line, but only faces in BVH leaves
+   * that a line goes through are tested.
+   *
+   * \param pt points on lines, kPacketSize x, then kPacketSize y, then kPacketSize z
+   * \param dir directions of lines, in the same layout as pt
+   * \param face_id face index where every line starts, kPacketSize ints
+   * \param face_norm the face data, 3 floats for one face
+   * \param bvh BVH of the crystal, see Crystal::GetBvh()
+   * \param t output argument, the distance from pt to the intersection point, kPacketSize floats
+   * \param idx output argument, the face index of the intersection point, or -1 if there is no intersection
+   */
+  static void IntersectLinesWithBvhPacket(const float* pt, const float* dir, const int* face_id,  // input
+                                          const float* face_norm, const Bvh* bvh,                // input
+                                          float* t, int* idx);                                   // output
+
+  /*! \brief Compute reflection and refraction of a packet of rays, in the same way as HitSurface().
+   *
+   * Square roots are computed with rsqrt and one Newton step. Rays that are totally reflected get refractive weight
+   * -1 and refractive direction same as reflective one.
+   *
+   * All outputs match HitSurface() within kHitSurfaceUlp ULPs of 1.0 (directions are unit vectors and weights are
+   * not greater than input ones).
+   *
+   * \param n refractive index of ice
+   * \param dir incident directions, kPacketSize x, then kPacketSize y, then kPacketSize z
+   * \param norm normals of faces being hit, in the same layout as dir
+   * \param w incident weights, kPacketSize floats
+   * \param dir_reflection output argument, reflective directions, in the same layout as dir
+   * \param dir_refraction output argument, refractive directions, in the same layout as dir
+   * \param w_reflection output argument, reflective weights, kPacketSize floats
+   * \param w_refraction output argument, refractive weights, kPacketSize floats
+   * \param fresnel if given, reflectance is interpolated in it as HitSurface() does
+   */
+  static void HitSurfacePacket(float n, const float* dir, const float* norm, const float* w,  // input
+                               float* dir_reflection, float* dir_refraction,                 // output
+                               float* w_reflection, float* w_refraction,                     // output
+                               const FresnelTable* fresnel = nullptr);
+
+  static constexpr int kPacketSize = 16;  // Same for all SIMD levels. AVX2 kernels work on its two halves.
+  static constexpr int kPacketFaceDataSize = 20;  // 19 floats used, and padded to keep every record 16-byte aligned
+  static constexpr int kAnyPlaneNum = 0;
+  static constexpr int kHitSurfaceUlp = 4;
+
+ private:
+  static constexpr int kNonConvex = -1;
+
+  template <int PlaneNum>
+  static void PropagateInPackets(const Crystal* crystal, size_t num,                          // input
+                                 const float* pt_in, const float* dir_in, const float* w_in,  // input
+                                 const int* face_id_in,                                       // input
+                                 float* pt_out, int* face_id_out);                            // output
+  static int FindFaceInPlane(const Crystal* crystal, int plane_idx, const float* pt);
 };
 
 
@@ -180,6 +364,46 @@ class IceRefractiveIndex {
   static constexpr float kCoefE[] = { 0.699934f, 0.640071f, 0.960906f, 0.964654f };
 };
 
+
+/**
+ * @brief Reflectance of an ice surface (see Optics::GetReflectRatio()) for one refractive index, in a lookup table.
+ *
+ * Reflectance is the same for rays going into and out of crystal along the same path, so one table serves both
+ * sides. It is indexed by cosine of the angle in air, i.e. |cos| of incident angle for rays coming in, and cosine of
+ * refractive angle for rays going out. Reflectance is smooth against it over [0, 1], even near the critical angle
+ * where it is not smooth against the incident angle inside crystal, so linear interpolation works well.
+ *
+ * It is never changed after construction, so one instance can be shared by all threads.
+ */
+class FresnelTable {
+ public:
+  /*! @brief Build the table. Its size is doubled from kMinSize until the interpolation error is below max_error.
+   *
+   * @param n the refractive index
+   * @param max_error the error bound of reflectance. It must be positive. If it can not be reached with kMaxSize,
+   *                  a warning is printed.
+   */
+  FresnelTable(float n, float max_error);
+
+  float GetRefractiveIndex() const;
+  float GetMaxError() const;  // The largest error found when building, against reflectance in double
+  int Size() const;           // Interval number. There are Size() + 1 entries
+  const float* GetData() const;
+
+  /*! @brief Reflectance of a ray whose angle in air has cosine cos_air, in [0, 1]. */
+  float Get(float cos_air) const;
+
+  static constexpr int kMinSize = 16;
+  static constexpr int kMaxSize = 1 << 16;
+
+ private:
+  static double GetReflectRatio(double cos_air, double n);
+
+  float n_;
+  float max_error_;
+  std::vector<float> table_;
+};
+
 }  // namespace icehalo
 
 
@@ -1,11 +1,11 @@
 #include "render.h"
 
 #include <cmath>
-#include <cstring>
 #include <limits>
 #include <utility>
 
 #include "context/context.h"
+#include "core/kernel.h"
 #include "core/mymath.h"
 #include "util/threadingpool.h"
 
@@ -18,40 +18,7 @@ void EqualAreaFishEye(const float* cam_rot,          // Camera rotation. [lon, l
                       int img_wid, int img_hei,      // Image size
                       int* img_xy,                   // Image coordinates
                       VisibleRange visible_range) {  // Visible range
-  float img_r = std::max(img_wid, img_hei) / 2.0f;
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-  float cam_rot_copy[3];
-  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (auto& i : cam_rot_copy) {
-    i *= math::kDegreeToRad;
-  }
-
-  math::RotateZWithDataStep(cam_rot_copy, dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (std::abs(math::Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / math::Norm3(dir_copy.get() + i * 3));
-      float proj_r = img_r / 2.0f / std::sin(hov / 2.0f * math::kDegreeToRad);
-      float r = 2.0f * proj_r * std::sin((math::kPi / 2.0f - lat) / 2.0f);
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_wid / 2.0));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_hei / 2.0));
-    }
-  }
+  GetKernels().equal_area_fish_eye(cam_rot, hov, data_number, dir, img_wid, img_hei, img_xy, visible_range);
 }
 
 
@@ -62,114 +29,29 @@ void EquidistantFishEye(const float* cam_rot,          // Camera rotation. [lon,
                         int img_wid, int img_hei,      // Image size
                         int* img_xy,                   // Image coordinates
                         VisibleRange visible_range) {  // Visible range
-  float img_r = std::max(img_wid, img_hei) / 2.0f;
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-  float cam_rot_copy[3];
-  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (auto& i : cam_rot_copy) {
-    i *= math::kDegreeToRad;
-  }
-
-  math::RotateZWithDataStep(cam_rot_copy, dir, dir_copy.get(), 4, 3, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(math::Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / math::Norm3(dir_copy.get() + i * 3));
-      float r = (math::kPi / 2.0f - lat) / (hov * math::kDegreeToRad) * img_r;
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_wid / 2.0));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_hei / 2.0));
-    }
-  }
+  GetKernels().equidistant_fish_eye(cam_rot, hov, data_number, dir, img_wid, img_hei, img_xy, visible_range);
 }
 
 
-void DualEqualAreaFishEye(const float* /* cam_rot */,          // Not used
-                          float /* hov */,                     // Not used
-                          size_t data_number,                  // Data number
-                          const float* dir,                    // Ray directions, [x, y, z]
-                          int img_wid, int img_hei,            // Image size
-                          int* img_xy,                         // Image coordinates
-                          VisibleRange /* visible_range */) {  // Not used
-  float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-  float proj_r = img_r / 2.0f / std::sin(45.0f * math::kDegreeToRad);
-
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-  float cam_rot_copy[3] = { 90.0f, 89.999f, 0.0f };
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (auto& i : cam_rot_copy) {
-    i *= math::kDegreeToRad;
-  }
-
-  math::RotateZWithDataStep(cam_rot_copy, dir, dir_copy.get(), 4, 3, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(math::Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / math::Norm3(dir_copy.get() + i * 3));
-      if (lat < 0) {
-        lon = math::kPi - lon;
-      }
-      float r = 2.0f * proj_r * std::sin((math::kPi / 2.0f - std::abs(lat)) / 2.0f);
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_r - 0.5));
-    }
-  }
+void DualEqualAreaFishEye(const float* cam_rot,          // Not used
+                          float hov,                     // Not used
+                          size_t data_number,            // Data number
+                          const float* dir,              // Ray directions, [x, y, z]
+                          int img_wid, int img_hei,      // Image size
+                          int* img_xy,                   // Image coordinates
+                          VisibleRange visible_range) {  // Not used
+  GetKernels().dual_equal_area_fish_eye(cam_rot, hov, data_number, dir, img_wid, img_hei, img_xy, visible_range);
 }
 
 
-void DualEquidistantFishEye(const float* /* cam_rot */,          // Not used
-                            float /* hov */,                     // Not used
-                            size_t data_number,                  // Data number
-                            const float* dir,                    // Ray directions, [x, y, z]
-                            int img_wid, int img_hei,            // Image size
-                            int* img_xy,                         // Image coordinates
-                            VisibleRange /* visible_range */) {  // Not used
-  float img_r = std::min(img_wid / 2, img_hei) / 2.0f;
-
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-  float cam_rot_copy[3] = { 90.0f, 89.999f, 0.0f };
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (auto& i : cam_rot_copy) {
-    i *= math::kDegreeToRad;
-  }
-
-  math::RotateZWithDataStep(cam_rot_copy, dir, dir_copy.get(), 4, 3, data_number);
-  for (decltype(data_number) i = 0; i < data_number; i++) {
-    if (std::abs(math::Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float lon = std::atan2(dir_copy[i * 3 + 1], dir_copy[i * 3 + 0]);
-      float lat = std::asin(dir_copy[i * 3 + 2] / math::Norm3(dir_copy.get() + i * 3));
-      if (lat < 0) {
-        lon = math::kPi - lon;
-      }
-      float r = (1.0f - std::abs(lat) * 2.0f / math::kPi) * img_r;
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(r * std::cos(lon) + img_r + (lat > 0 ? -0.5 : 2 * img_r - 0.5)));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(r * std::sin(lon) + img_r - 0.5));
-    }
-  }
+void DualEquidistantFishEye(const float* cam_rot,          // Not used
+                            float hov,                     // Not used
+                            size_t data_number,            // Data number
+                            const float* dir,              // Ray directions, [x, y, z]
+                            int img_wid, int img_hei,      // Image size
+                            int* img_xy,                   // Image coordinates
+                            VisibleRange visible_range) {  // Not used
+  GetKernels().dual_equidistant_fish_eye(cam_rot, hov, data_number, dir, img_wid, img_hei, img_xy, visible_range);
 }
 
 
@@ -180,39 +62,7 @@ void RectLinear(const float* cam_rot,          // Camera rotation. [lon, lat, ro
                 int img_wid, int img_hei,      // Image size
                 int* img_xy,                   // Image coordinates
                 VisibleRange visible_range) {  // Visible range
-  std::unique_ptr<float[]> dir_copy{ new float[data_number * 3]{} };
-  float cam_rot_copy[3];
-  std::memcpy(cam_rot_copy, cam_rot, sizeof(float) * 3);
-  cam_rot_copy[0] *= -1;
-  cam_rot_copy[1] *= -1;
-  for (auto& i : cam_rot_copy) {
-    i *= math::kDegreeToRad;
-  }
-
-  math::RotateZWithDataStep(cam_rot_copy, dir, dir_copy.get(), 4, 3, data_number);
-  for (size_t i = 0; i < data_number; i++) {
-    if (dir_copy[i * 3 + 2] < 0 || std::abs(math::Norm3(dir_copy.get() + i * 3) - 1.0) > 1e-4) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kFront && dir_copy[i * 3 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kUpper && dir[i * 4 + 2] > 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else if (visible_range == VisibleRange::kLower && dir[i * 4 + 2] < 0) {
-      img_xy[i * 2 + 0] = std::numeric_limits<int>::min();
-      img_xy[i * 2 + 1] = std::numeric_limits<int>::min();
-    } else {
-      float x = dir_copy[i * 3 + 0] / dir_copy[i * 3 + 2];
-      float y = dir_copy[i * 3 + 1] / dir_copy[i * 3 + 2];
-      x = static_cast<float>(img_wid / 2.0 * x / std::tan(hov * math::kDegreeToRad) + img_wid / 2.0);
-      y = static_cast<float>(img_wid / 2.0 * y / std::tan(hov * math::kDegreeToRad) + img_hei / 2.0);
-
-      img_xy[i * 2 + 0] = static_cast<int>(std::round(x));
-      img_xy[i * 2 + 1] = static_cast<int>(std::round(y));
-    }
-  }
+  GetKernels().rect_linear(cam_rot, hov, data_number, dir, img_wid, img_hei, img_xy, visible_range);
 }
 
 
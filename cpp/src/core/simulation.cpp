@@ -1,11 +1,17 @@
 #include "simulation.h"
 
+#include <immintrin.h>
+
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <numeric>
 #include <stack>
 #include <utility>
 
 #include "core/mymath.h"
 #include "util/obj_pool.h"
+#include "util/page_alloc.h"
 #include "util/threadingpool.h"
 
 namespace icehalo {
@@ -79,6 +85,9 @@ void SimpleRayData::Deserialize(File& file, endian::Endianness endianness) {
 void SimulationRayData::Clear() {
   rays_.clear();
   exit_ray_segments_.clear();
+  exit_ray_data_.clear();
+  exit_ray_layer_masks_.clear();
+  init_ray_num_ = 0;
   RayInfoPool::GetInstance()->Clear();
   wavelength_info_ = {};
 }
@@ -89,43 +98,111 @@ void SimulationRayData::PrepareNewScatter(size_t ray_num) {
   rays_.back().reserve(ray_num);
   exit_ray_segments_.emplace_back();
   exit_ray_segments_.back().reserve(ray_num * 2);
+  exit_ray_data_.emplace_back();
+  exit_ray_layer_masks_.emplace_back();
 }
 
 
-void SimulationRayData::AddRay(RayInfo* ray) {
+void SimulationRayData::AddRay(PoolHandle ray) {
   rays_.back().emplace_back(ray);
 }
 
 
-void SimulationRayData::AddExitRaySegment(RaySegment* r) {
+void SimulationRayData::AddInitRayNum(size_t num) {
+  init_ray_num_ += num;
+}
+
+
+void SimulationRayData::AddExitRaySegment(PoolHandle r) {
   exit_ray_segments_.back().emplace_back(r);
 }
 
 
+void SimulationRayData::AddExitRayData(const std::vector<float>& data) {
+  auto& last_data = exit_ray_data_.back();
+  last_data.insert(last_data.end(), data.begin(), data.end());
+}
+
+
+std::vector<float>& SimulationRayData::GetLastExitRayData() {
+  return exit_ray_data_.back();
+}
+
+
+void SimulationRayData::AddExitRayLayerMasks(const std::vector<uint32_t>& masks) {
+  auto& last_masks = exit_ray_layer_masks_.back();
+  last_masks.insert(last_masks.end(), masks.begin(), masks.end());
+}
+
+
+std::vector<uint32_t>& SimulationRayData::GetLastExitRayLayerMasks() {
+  return exit_ray_layer_masks_.back();
+}
+
+
 SimpleRayData SimulationRayData::CollectFinalRayData() const {
+  return CollectRayData(kAllLayers);
+}
+
+
+SimpleRayData SimulationRayData::CollectFinalRayData(size_t layer) const {
+  return CollectRayData(layer < 32 ? 1u << layer : 0u);
+}
+
+
+// Collect final rays that are in any of given layers. kAllLayers means all final rays, even if there is no layer.
+SimpleRayData SimulationRayData::CollectRayData(uint32_t layer_mask) const {
+  auto selected = [=](size_t k, size_t i) {
+    if (layer_mask == kAllLayers) {
+      return true;
+    }
+    return k < exit_ray_layer_masks_.size() && i < exit_ray_layer_masks_[k].size() &&
+           (exit_ray_layer_masks_[k][i] & layer_mask) != 0;
+  };
+
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  auto ray_info_pool = RayInfoPool::GetInstance();
   size_t num = 0;
-  for (const auto& sr : exit_ray_segments_) {
-    for (const auto& r : sr) {
-      if (r->state == RaySegmentState::kFinished) {
+  for (size_t k = 0; k < exit_ray_segments_.size(); k++) {
+    const auto& sr = exit_ray_segments_[k];
+    for (size_t i = 0; i < sr.size(); i++) {
+      if (ray_seg_store->GetState(sr[i]) == RaySegmentState::kFinished && selected(k, i)) {
+        num++;
+      }
+    }
+  }
+  for (size_t k = 0; k < exit_ray_data_.size(); k++) {
+    for (size_t i = 0; i < exit_ray_data_[k].size() / 4; i++) {
+      if (selected(k, i)) {
         num++;
       }
     }
   }
 
   SimpleRayData final_ray_data(num);
-  if (!rays_.empty()) {
-    final_ray_data.init_ray_num = rays_[0].size();
-  }
+  final_ray_data.init_ray_num = init_ray_num_;
   final_ray_data.wavelength = wavelength_info_.wavelength;
   final_ray_data.wavelength_weight = wavelength_info_.weight;
   float* p = final_ray_data.buf.get();
-  for (const auto& sr : exit_ray_segments_) {
-    for (const auto& r : sr) {
-      if (r->state == RaySegmentState::kFinished) {
-        const auto* axis = r->root_ctx->main_axis.val();
-        math::RotateZBack(axis, r->dir.val(), p);
-        p[3] = r->w;
-        final_ray_data.total_ray_energy += r->w;
+  for (size_t k = 0; k < exit_ray_segments_.size(); k++) {
+    const auto& sr = exit_ray_segments_[k];
+    for (size_t i = 0; i < sr.size(); i++) {
+      auto r = sr[i];
+      if (ray_seg_store->GetState(r) == RaySegmentState::kFinished && selected(k, i)) {
+        const auto* axis = ray_info_pool->Get(ray_seg_store->GetRayInfo(r))->main_axis.val();
+        math::RotateZBack(axis, ray_seg_store->GetDir(r), p);
+        p[3] = ray_seg_store->GetWeight(r);
+        final_ray_data.total_ray_energy += p[3];
+        p += 4;
+      }
+    }
+  }
+  for (size_t k = 0; k < exit_ray_data_.size(); k++) {
+    const auto& d = exit_ray_data_[k];
+    for (size_t i = 0; i < d.size() / 4; i++) {
+      if (selected(k, i)) {
+        std::copy(d.data() + i * 4, d.data() + i * 4 + 4, p);
+        final_ray_data.total_ray_energy += d[i * 4 + 3];
         p += 4;
       }
     }
@@ -134,13 +211,13 @@ SimpleRayData SimulationRayData::CollectFinalRayData() const {
 }
 
 
-const std::vector<RaySegment*>& SimulationRayData::GetLastExitRaySegments() const {
+const std::vector<PoolHandle>& SimulationRayData::GetLastExitRaySegments() const {
   return exit_ray_segments_.back();
 }
 
 
 #ifdef FOR_TEST
-const std::vector<std::vector<RaySegment*>>& SimulationRayData::GetExitRaySegments() const {
+const std::vector<std::vector<PoolHandle>>& SimulationRayData::GetExitRaySegments() const {
   return exit_ray_segments_;
 }
 #endif
@@ -155,32 +232,20 @@ void SimulationRayData::Serialize(File& file, bool with_boi) const {
   file.Write(wl);
   file.Write(wavelength_info_.weight);
 
-  auto ray_info_pool = RayInfoPool::GetInstance();
-  auto ray_seg_pool = RaySegmentPool::GetInstance();
-  ray_info_pool->Serialize(file, false);
-  ray_seg_pool->Serialize(file, false);
+  RayInfoPool::GetInstance()->Serialize(file, false);
+  RaySegmentStore::GetInstance()->Serialize(file, false);
 
   uint32_t multi_scatters = rays_.size();
   file.Write(multi_scatters);
   for (const auto& sc : rays_) {
     uint32_t num = sc.size();
     file.Write(num);
-    for (const auto& r : sc) {
-      uint32_t chunk_id, obj_id;
-      std::tie(chunk_id, obj_id) = ray_info_pool->GetObjectSerializeIndex(r);
-      file.Write(chunk_id);
-      file.Write(obj_id);
-    }
+    file.Write(sc.data(), num);
   }
   for (const auto& sc : exit_ray_segments_) {
     uint32_t num = sc.size();
     file.Write(num);
-    for (const auto& r : sc) {
-      uint32_t chunk_id, obj_id;
-      std::tie(chunk_id, obj_id) = ray_seg_pool->GetObjectSerializeIndex(r);
-      file.Write(chunk_id);
-      file.Write(obj_id);
-    }
+    file.Write(sc.data(), num);
   }
 }
 
@@ -203,21 +268,8 @@ void SimulationRayData::Deserialize(File& file, endian::Endianness endianness) {
     endian::ByteSwap::Swap(&wavelength_info_.weight);
   }
 
-  auto ray_info_pool = RayInfoPool::GetInstance();
-  auto ray_seg_pool = RaySegmentPool::GetInstance();
-  ray_info_pool->Deserialize(file, endianness);
-  ray_seg_pool->Deserialize(file, endianness);
-
-  ray_info_pool->Map([=](RayInfo& r) {
-    r.first_ray_segment = ray_seg_pool->GetPointerFromSerializeData(r.first_ray_segment);
-    r.prev_ray_segment = ray_seg_pool->GetPointerFromSerializeData(r.prev_ray_segment);
-  });
-  ray_seg_pool->Map([=](RaySegment& r) {
-    r.next_reflect = ray_seg_pool->GetPointerFromSerializeData(r.next_reflect);
-    r.next_refract = ray_seg_pool->GetPointerFromSerializeData(r.next_refract);
-    r.prev = ray_seg_pool->GetPointerFromSerializeData(r.prev);
-    r.root_ctx = ray_info_pool->GetPointerFromSerializeData(r.root_ctx);
-  });
+  RayInfoPool::GetInstance()->Deserialize(file, endianness);
+  RaySegmentStore::GetInstance()->Deserialize(file, endianness);
 
   uint32_t multi_scatters;
   file.Read(&multi_scatters);
@@ -225,49 +277,30 @@ void SimulationRayData::Deserialize(File& file, endian::Endianness endianness) {
     endian::ByteSwap::Swap(&multi_scatters);
   }
 
-  for (size_t k = 0; k < multi_scatters; k++) {
-    rays_.emplace_back();
-    uint32_t num;
-    file.Read(&num);
-    if (need_swap) {
-      endian::ByteSwap::Swap(&num);
-    }
-    for (size_t i = 0; i < num; i++) {
-      uint32_t chunk_id, obj_id;
-      file.Read(&chunk_id);
-      file.Read(&obj_id);
+  for (auto* handles : { &rays_, &exit_ray_segments_ }) {
+    for (size_t k = 0; k < multi_scatters; k++) {
+      uint32_t num;
+      file.Read(&num);
       if (need_swap) {
-        endian::ByteSwap::Swap(&chunk_id);
-        endian::ByteSwap::Swap(&obj_id);
+        endian::ByteSwap::Swap(&num);
       }
-      rays_.back().emplace_back(ray_info_pool->GetPointerFromSerializeData(chunk_id, obj_id));
-    }
-  }
-
-  for (size_t k = 0; k < multi_scatters; k++) {
-    exit_ray_segments_.emplace_back();
-    uint32_t num;
-    file.Read(&num);
-    if (need_swap) {
-      endian::ByteSwap::Swap(&num);
-    }
-    for (size_t i = 0; i < num; i++) {
-      uint32_t chunk_id, obj_id;
-      file.Read(&chunk_id);
-      file.Read(&obj_id);
+      handles->emplace_back(num);
+      file.Read(handles->back().data(), num);
       if (need_swap) {
-        endian::ByteSwap::Swap(&chunk_id);
-        endian::ByteSwap::Swap(&obj_id);
+        endian::ByteSwap::Swap(handles->back().data(), num);
       }
-      auto r = ray_seg_pool->GetPointerFromSerializeData(chunk_id, obj_id);
-      exit_ray_segments_.back().emplace_back(r);
     }
   }
+
+  if (!rays_.empty()) {
+    init_ray_num_ = rays_[0].size();
+  }
 }
 
 
 Simulator::BufferData::BufferData()
-    : pt{ nullptr }, dir{ nullptr }, w{ nullptr }, face_id{ nullptr }, ray_seg{ nullptr }, ray_num(0) {}
+    : pt{ nullptr }, dir{ nullptr }, w{ nullptr }, face_id{ nullptr }, ray_seg{ nullptr }, root_idx{ nullptr },
+      path_code{ nullptr }, path_hash{ nullptr }, path_state{ nullptr }, ray_num(0) {}
 
 
 Simulator::BufferData::~BufferData() {
@@ -284,27 +317,39 @@ void Simulator::BufferData::Clear() {
 
 
 void Simulator::BufferData::DeleteBuffer(int idx) {
-  delete[] pt[idx];
-  delete[] dir[idx];
-  delete[] w[idx];
-  delete[] face_id[idx];
-  delete[] ray_seg[idx];
+  FreeArray(pt[idx], ray_num * 3);
+  FreeArray(dir[idx], ray_num * 3);
+  FreeArray(w[idx], ray_num);
+  FreeArray(face_id[idx], ray_num);
+  FreeArray(ray_seg[idx], ray_num);
+  FreeArray(root_idx[idx], ray_num);
+  FreeArray(path_code[idx], ray_num);
+  FreeArray(path_hash[idx], ray_num);
+  FreeArray(path_state[idx], ray_num);
 
   pt[idx] = nullptr;
   dir[idx] = nullptr;
   w[idx] = nullptr;
   face_id[idx] = nullptr;
   ray_seg[idx] = nullptr;
+  root_idx[idx] = nullptr;
+  path_code[idx] = nullptr;
+  path_hash[idx] = nullptr;
+  path_state[idx] = nullptr;
 }
 
 
 void Simulator::BufferData::Allocate(size_t ray_number) {
   for (int i = 0; i < 2; i++) {
-    auto tmp_pt = new float[ray_number * 3];
-    auto tmp_dir = new float[ray_number * 3];
-    auto tmp_w = new float[ray_number];
-    auto tmp_face_id = new int[ray_number];
-    auto tmp_ray_seg = new RaySegment*[ray_number];
+    auto tmp_pt = AllocateArray<float>(ray_number * 3);
+    auto tmp_dir = AllocateArray<float>(ray_number * 3);
+    auto tmp_w = AllocateArray<float>(ray_number);
+    auto tmp_face_id = AllocateArray<int>(ray_number);
+    auto tmp_ray_seg = AllocateArray<PoolHandle>(ray_number);
+    auto tmp_root_idx = AllocateArray<uint32_t>(ray_number);
+    auto tmp_path_code = AllocateArray<RayPathCode>(ray_number);
+    auto tmp_path_hash = AllocateArray<size_t>(ray_number);
+    auto tmp_path_state = AllocateArray<int>(ray_number);
 
     if (pt[i]) {
       size_t n = std::min(this->ray_num, ray_number);
@@ -312,7 +357,11 @@ void Simulator::BufferData::Allocate(size_t ray_number) {
       std::memcpy(tmp_dir, dir[i], sizeof(float) * 3 * n);
       std::memcpy(tmp_w, w[i], sizeof(float) * n);
       std::memcpy(tmp_face_id, face_id[i], sizeof(int) * n);
-      std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(void*) * n);
+      std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(PoolHandle) * n);
+      std::memcpy(tmp_root_idx, root_idx[i], sizeof(uint32_t) * n);
+      std::memcpy(tmp_path_code, path_code[i], sizeof(RayPathCode) * n);
+      std::memcpy(tmp_path_hash, path_hash[i], sizeof(size_t) * n);
+      std::memcpy(tmp_path_state, path_state[i], sizeof(int) * n);
 
       DeleteBuffer(i);
     }
@@ -322,6 +371,10 @@ void Simulator::BufferData::Allocate(size_t ray_number) {
     w[i] = tmp_w;
     face_id[i] = tmp_face_id;
     ray_seg[i] = tmp_ray_seg;
+    root_idx[i] = tmp_root_idx;
+    path_code[i] = tmp_path_code;
+    path_hash[i] = tmp_path_hash;
+    path_state[i] = tmp_path_state;
   }
   this->ray_num = ray_number;
 }
@@ -344,18 +397,127 @@ void Simulator::BufferData::Print() {
 }
 
 
-Simulator::EntryRayData::EntryRayData() : ray_dir(nullptr), ray_seg(nullptr), ray_num(0), buf_size(0) {}
+// Check if a ray in buffer 1 is still propagating inside crystal.
+bool Simulator::BufferData::IsAlive(size_t idx) const {
+  return face_id[1][idx] >= 0 && w[1][idx] > ProjectContext::kPropMinW;
+}
+
+
+// Count alive rays in buffer 1, in range [idx0, idx1).
+size_t Simulator::BufferData::CountAliveRays(size_t idx0, size_t idx1) const {
+  size_t cnt = 0;
+  size_t i = idx0;
+#if defined(__AVX512F__)
+  const __m512 kMinW = _mm512_set1_ps(ProjectContext::kPropMinW);
+  const __m512i kZero = _mm512_setzero_si512();
+  for (; i + 16 <= idx1; i += 16) {
+    __mmask16 alive = _mm512_cmp_ps_mask(_mm512_loadu_ps(w[1] + i), kMinW, _CMP_GT_OQ) &
+                      _mm512_cmpge_epi32_mask(_mm512_loadu_si512(face_id[1] + i), kZero);
+    cnt += __builtin_popcount(alive);
+  }
+#endif
+  for (; i < idx1; i++) {
+    if (IsAlive(i)) {
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+
+// Copy alive rays in buffer 1, in range [idx0, idx1), into buffer 0, starting from dst_idx.
+// In lightweight mode root_idx is copied, otherwise ray_seg is copied.
+void Simulator::BufferData::CompactAliveRays(size_t idx0, size_t idx1, size_t dst_idx, bool lightweight) {
+  size_t i = idx0;
+#if defined(__AVX512F__)
+  static_assert(sizeof(PoolHandle) == sizeof(int32_t), "Handles are compressed as 32-bit integers.");
+  static_assert(sizeof(size_t) == sizeof(int64_t), "Path hashes are compressed as 64-bit integers.");
+  const __m512 kMinW = _mm512_set1_ps(ProjectContext::kPropMinW);
+  const __m512i kZero = _mm512_setzero_si512();
+  for (; i + 16 <= idx1; i += 16) {
+    __m512 curr_w = _mm512_loadu_ps(w[1] + i);
+    __m512i curr_face_id = _mm512_loadu_si512(face_id[1] + i);
+    __mmask16 alive = _mm512_cmp_ps_mask(curr_w, kMinW, _CMP_GT_OQ) & _mm512_cmpge_epi32_mask(curr_face_id, kZero);
+    if (!alive) {
+      continue;
+    }
+
+    _mm512_mask_compressstoreu_ps(w[0] + dst_idx, alive, curr_w);
+    _mm512_mask_compressstoreu_epi32(face_id[0] + dst_idx, alive, curr_face_id);
+    auto alive_lo = static_cast<__mmask8>(alive & 0xff);
+    auto alive_hi = static_cast<__mmask8>(alive >> 8);
+    auto dst_idx_hi = dst_idx + __builtin_popcount(alive_lo);
+    _mm512_mask_compressstoreu_epi64(path_hash[0] + dst_idx, alive_lo, _mm512_loadu_si512(path_hash[1] + i));
+    _mm512_mask_compressstoreu_epi64(path_hash[0] + dst_idx_hi, alive_hi, _mm512_loadu_si512(path_hash[1] + i + 8));
+    _mm512_mask_compressstoreu_epi32(path_state[0] + dst_idx, alive, _mm512_loadu_si512(path_state[1] + i));
+    if (lightweight) {
+      _mm512_mask_compressstoreu_epi32(root_idx[0] + dst_idx, alive, _mm512_loadu_si512(root_idx[1] + i));
+    } else {
+      _mm512_mask_compressstoreu_epi32(ray_seg[0] + dst_idx, alive, _mm512_loadu_si512(ray_seg[1] + i));
+    }
+
+    // Points, directions and path codes are not 32/64-bit elements, and are copied one by one.
+    for (unsigned int m = alive; m; m &= m - 1) {
+      auto j = i + __builtin_ctz(m);
+      std::memcpy(pt[0] + dst_idx * 3, pt[1] + j * 3, sizeof(float) * 3);
+      std::memcpy(dir[0] + dst_idx * 3, dir[1] + j * 3, sizeof(float) * 3);
+      path_code[0][dst_idx] = path_code[1][j];
+      dst_idx++;
+    }
+  }
+#endif
+  for (; i < idx1; i++) {
+    if (IsAlive(i)) {
+      std::memcpy(pt[0] + dst_idx * 3, pt[1] + i * 3, sizeof(float) * 3);
+      std::memcpy(dir[0] + dst_idx * 3, dir[1] + i * 3, sizeof(float) * 3);
+      w[0][dst_idx] = w[1][i];
+      face_id[0][dst_idx] = face_id[1][i];
+      path_code[0][dst_idx] = path_code[1][i];
+      path_hash[0][dst_idx] = path_hash[1][i];
+      path_state[0][dst_idx] = path_state[1][i];
+      if (lightweight) {
+        root_idx[0][dst_idx] = root_idx[1][i];
+      } else {
+        ray_seg[0][dst_idx] = ray_seg[1][i];
+      }
+      dst_idx++;
+    }
+  }
+}
+
+
+void Simulator::BufferData::Swap() {
+  std::swap(pt[0], pt[1]);
+  std::swap(dir[0], dir[1]);
+  std::swap(w[0], w[1]);
+  std::swap(face_id[0], face_id[1]);
+  std::swap(ray_seg[0], ray_seg[1]);
+  std::swap(root_idx[0], root_idx[1]);
+  std::swap(path_code[0], path_code[1]);
+  std::swap(path_hash[0], path_hash[1]);
+  std::swap(path_state[0], path_state[1]);
+}
+
+
+Simulator::EntryRayData::EntryRayData()
+    : ray_dir(nullptr), ray_w(nullptr), ray_seg(nullptr), ray_axis(nullptr), ray_entry_dir(nullptr),
+      ray_entry_face_id(nullptr), ray_num(0), buf_size(0) {}
 
 
 Simulator::EntryRayData::~EntryRayData() {
   delete[] ray_dir;
+  delete[] ray_w;
   delete[] ray_seg;
+  delete[] ray_axis;
+  delete[] ray_entry_dir;
+  delete[] ray_entry_face_id;
 }
 
 
 void Simulator::EntryRayData::Clear() {
   std::fill(ray_dir, ray_dir + buf_size * 3, 0.0f);
-  std::fill(ray_seg, ray_seg + buf_size, nullptr);
+  std::fill(ray_w, ray_w + buf_size, 0.0f);
+  std::fill(ray_seg, ray_seg + buf_size, kInvalidPoolHandle);
   ray_num = 0;
 }
 
@@ -363,10 +525,19 @@ void Simulator::EntryRayData::Clear() {
 void Simulator::EntryRayData::Allocate(size_t ray_number) {
   if (ray_number > buf_size) {
     delete[] ray_dir;
+    delete[] ray_w;
     delete[] ray_seg;
+    delete[] ray_axis;
+    delete[] ray_entry_dir;
+    delete[] ray_entry_face_id;
 
     ray_dir = new float[ray_number * 3]{};
-    ray_seg = new RaySegment* [ray_number] {};
+    ray_w = new float[ray_number]{};
+    ray_seg = new PoolHandle[ray_number];
+    std::fill(ray_seg, ray_seg + ray_number, kInvalidPoolHandle);
+    ray_axis = new float[ray_number * 3]{};
+    ray_entry_dir = new float[ray_number * 3]{};
+    ray_entry_face_id = new int[ray_number]{};
 
     buf_size = ray_number;
   } else {
@@ -378,8 +549,10 @@ void Simulator::EntryRayData::Allocate(size_t ray_number) {
 
 
 Simulator::Simulator(ProjectContextPtr context)
-    : context_(std::move(context)), simulation_ray_data_{}, current_wavelength_index_(-1), total_ray_num_(0),
-      active_ray_num_(0), buffer_size_(0), buffer_{}, entry_ray_data_{}, entry_ray_offset_(0) {}
+    : context_(std::move(context)), simulation_ray_data_{}, current_wavelength_index_(-1), lightweight_mode_(false),
+      curr_lightweight_(false), current_scatter_index_(0), run_count_(0), run_random_key_(0), random_key_(0),
+      total_ray_num_(0), active_ray_num_(0), buffer_size_(0), buffer_{}, entry_ray_data_{}, entry_ray_offset_(0),
+      trace_count_(0), peak_pool_memory_(0), fresnel_table_{} {}
 
 
 void Simulator::SetCurrentWavelengthIndex(int index) {
@@ -392,24 +565,107 @@ void Simulator::SetCurrentWavelengthIndex(int index) {
 }
 
 
+void Simulator::EnableLightweightMode(bool enable) {
+  lightweight_mode_ = enable;
+}
+
+
+bool Simulator::GetLightweightMode() const {
+  return lightweight_mode_;
+}
+
+
 // Start simulation
 void Simulator::Run() {
-  simulation_ray_data_.Clear();
-  RaySegmentPool::GetInstance()->Clear();
-  RayInfoPool::GetInstance()->Clear();
-  entry_ray_data_.Clear();
-  entry_ray_offset_ = 0;
+  RunBatches(context_->GetInitRayNum(), nullptr);
+}
+
+
+void Simulator::Run(const BatchConsumer& consumer) {
+  auto batch_size = context_->GetRayBatchSize();
+  RunBatches(batch_size > 0 ? batch_size : context_->GetInitRayNum(), consumer);
+}
+
+
+void Simulator::RunBatches(size_t batch_size, const BatchConsumer& consumer) {
+  ClearBatchData();
 
   if (current_wavelength_index_ < 0) {
     std::fprintf(stderr, "Warning! wavelength is not set!");
     return;
   }
+  curr_lightweight_ = lightweight_mode_;
+  output_filters_.clear();
+
+  // Reflectance table is built once for a run, since all rays of a run have the same wavelength.
+  auto n = static_cast<float>(IceRefractiveIndex::Get(context_->wavelengths_[current_wavelength_index_].wavelength));
+  auto fresnel_max_error = context_->GetFresnelMaxError();
+  if (fresnel_max_error <= 0) {
+    fresnel_table_.reset();
+  } else if (!fresnel_table_ || fresnel_table_->GetRefractiveIndex() != n ||
+             fresnel_table_->GetMaxError() > fresnel_max_error) {
+    fresnel_table_.reset(new FresnelTable(n, fresnel_max_error));
+  }
+  for (auto id : context_->GetOutputFilterIds()) {
+    output_filters_.emplace_back(context_->GetRayPathFilter(id));
+  }
+
+  // Every run gets its own key, so that repeated runs (and different wavelengths) use different rays.
+  run_random_key_ =
+      math::RandomNumberGenerator::MakeKey(math::RandomNumberGenerator::GetDefaultSeed(), run_count_++);
+
+  // Pools are empty in lightweight mode, and the budget is not needed. Without a consumer all rays must stay in one
+  // batch, so the budget is not applied either.
+  size_t budget = curr_lightweight_ || !consumer ? 0 : context_->GetPoolMemoryBudget() * 1024 * 1024;
+  size_t pool_memory_per_ray = 0;  // Of reserved objects. Largest one of all batches so far.
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  auto ray_info_pool = RayInfoPool::GetInstance();
+  peak_pool_memory_ = 0;
+
+  auto total_ray_num = context_->GetInitRayNum();
+  size_t batch_idx = 0;
+  size_t curr_batch_size = 0;
+  for (size_t batch_start = 0; batch_start < total_ray_num; batch_start += curr_batch_size, batch_idx++) {
+    if (batch_idx > 0) {
+      ClearBatchData();
+    }
+    if (budget > 0) {
+      // Pools are empty here. Chunks kept from earlier batches (or runs) above the budget are freed.
+      ray_seg_store->ReleaseChunks(budget - std::min(budget, ray_info_pool->GetMemoryUsage()));
+      ray_info_pool->ReleaseChunks(budget - std::min(budget, ray_seg_store->GetMemoryUsage()));
+    }
+    curr_batch_size = std::min(batch_size, total_ray_num - batch_start);
+    if (budget > 0 && pool_memory_per_ray == 0) {
+      curr_batch_size = std::min(curr_batch_size, kBudgetProbeRayNum);
+    } else if (budget > 0) {
+      curr_batch_size = std::min(curr_batch_size, std::max(budget / pool_memory_per_ray, size_t{ 1 }));
+    }
+
+    // First batch uses the run key directly, so a run in one batch is the same as before batching is introduced.
+    random_key_ = batch_idx == 0 ? run_random_key_ : math::RandomNumberGenerator::MakeKey(run_random_key_, batch_idx);
+    RunBatch(curr_batch_size);
+
+    peak_pool_memory_ = std::max(peak_pool_memory_, ray_seg_store->GetMemoryUsage() + ray_info_pool->GetMemoryUsage());
+    auto reserved_memory =
+        ray_seg_store->Size() * RaySegmentStore::kSegmentBytes + ray_info_pool->Size() * sizeof(RayInfo);
+    pool_memory_per_ray = std::max(pool_memory_per_ray, (reserved_memory + curr_batch_size - 1) / curr_batch_size);
+    if (consumer) {
+      consumer(simulation_ray_data_);
+    }
+  }
+}
+
+
+// Trace a batch of initial rays through all multi-scatter levels.
+void Simulator::RunBatch(size_t ray_num) {
   simulation_ray_data_.wavelength_info_ = context_->wavelengths_[current_wavelength_index_];
+  current_scatter_index_ = 0;
 
-  InitSunRays();
+  InitSunRays(ray_num);
 
   const auto& multi_scatter_info = context_->multi_scatter_info_;
   for (size_t i = 0; i < multi_scatter_info.size(); i++) {
+    current_scatter_index_ = i;
     simulation_ray_data_.PrepareNewScatter(total_ray_num_);
 
     for (const auto& c : multi_scatter_info[i]->GetCrystalInfo()) {
@@ -431,21 +687,61 @@ void Simulator::Run() {
 }
 
 
+// Release data of last batch. Object pools keep their chunks, so memory is reused by next batch.
+void Simulator::ClearBatchData() {
+  simulation_ray_data_.Clear();
+  RaySegmentStore::GetInstance()->Clear();
+  RayInfoPool::GetInstance()->Clear();
+  entry_ray_data_.Clear();
+  entry_ray_offset_ = 0;
+  trace_count_ = 0;
+}
+
+
+// Get a random number generator for a given ray (or a given block of rays).
+// Its stream is determined by the stream type, current scatter index and the index, so the random numbers a ray uses
+// do not depend on which thread processes it.
+math::RandomNumberGenerator Simulator::GetRandomNumberGenerator(RandomStream stream, size_t idx) const {
+  return math::RandomNumberGenerator(random_key_, GetRandomStreamId(stream, idx));
+}
+
+
+// Same as above, but under a key derived from sub_key, for streams that need more than 48 bits of index.
+math::RandomNumberGenerator Simulator::GetRandomNumberGenerator(RandomStream stream, size_t idx,
+                                                                uint64_t sub_key) const {
+  return math::RandomNumberGenerator(math::RandomNumberGenerator::MakeKey(random_key_, sub_key),
+                                     GetRandomStreamId(stream, idx));
+}
+
+
+uint64_t Simulator::GetRandomStreamId(RandomStream stream, size_t idx) const {
+  return (static_cast<uint64_t>(stream) << 56) |                            // stream type, 8 bits
+         ((static_cast<uint64_t>(current_scatter_index_) & 0xff) << 48) |  // scatter index, 8 bits
+         (static_cast<uint64_t>(idx) & 0xffffffffffffull);                 // index, 48 bits
+}
+
+
 // Init sun rays, and fill into dir[1]. They will be rotated and fill into dir[0] in InitEntryRays().
 // In world frame.
-void Simulator::InitSunRays() {
+void Simulator::InitSunRays(size_t ray_num) {
   using math::RandomSampler;
 
-  total_ray_num_ = context_->GetInitRayNum();
+  total_ray_num_ = ray_num;
   float sun_r = context_->sun_ctx_->GetSunDiameter() / 2;  // In degree
   const float* sun_ray_dir = context_->sun_ctx_->GetSunPosition();
   if (entry_ray_data_.ray_num < total_ray_num_) {
     entry_ray_data_.Allocate(total_ray_num_);
   }
 
-  RandomSampler::SampleSphericalPointsCart(sun_ray_dir, sun_r, entry_ray_data_.ray_dir, entry_ray_data_.ray_num);
+  for (size_t i = 0; i * kSunRayBlockSize < total_ray_num_; i++) {
+    auto rng = GetRandomNumberGenerator(RandomStream::kSunRay, i);
+    auto num = std::min(kSunRayBlockSize, total_ray_num_ - i * kSunRayBlockSize);
+    RandomSampler::SampleSphericalPointsCart(&rng, sun_ray_dir, sun_r,
+                                             entry_ray_data_.ray_dir + i * kSunRayBlockSize * 3, num);
+  }
   for (size_t i = 0; i < entry_ray_data_.ray_num; i++) {
-    entry_ray_data_.ray_seg[i] = nullptr;
+    entry_ray_data_.ray_w[i] = 1.0f;
+    entry_ray_data_.ray_seg[i] = kInvalidPoolHandle;
   }
 }
 
@@ -453,46 +749,90 @@ void Simulator::InitSunRays() {
 // Init entry rays into a crystal. Fill pt[0], face_id[0], w[0] and ray_seg[0].
 // Rotate entry rays into crystal frame
 // Add RayContext and main axis rotation
+// Rays are processed in range jobs. Every ray has its own random number stream and its own (reserved) slots in
+// object pools, so result does not depend on how jobs are scheduled.
 void Simulator::InitEntryRays(const CrystalContext* ctx) {
   const auto* crystal = ctx->GetCrystal();
   auto crystal_id = context_->GetCrystalId(crystal);
   const auto* face_vertex = crystal->GetFaceVertex();
 
-  auto ray_pool = RaySegmentPool::GetInstance();
-  auto ray_info_pool = RayInfoPool::GetInstance();
-
-  using math::RandomSampler;
-  float axis_rot[3];
-  for (size_t i = 0; i < active_ray_num_; i++) {
-    InitMainAxis(ctx, axis_rot);
-    math::RotateZ(axis_rot, entry_ray_data_.ray_dir + (i + entry_ray_offset_) * 3, buffer_.dir[0] + i * 3);
+  if (current_scatter_index_ == 0) {
+    simulation_ray_data_.AddInitRayNum(active_ray_num_);
+  }
 
-    buffer_.face_id[0][i] = ctx->RandomSampleFace(buffer_.dir[0] + i * 3);
-    RandomSampler::SampleTriangularPoints(face_vertex + buffer_.face_id[0][i] * 9, buffer_.pt[0] + i * 3);
+  auto threading_pool = ThreadingPool::GetInstance();
+  if (curr_lightweight_) {
+    // No ray segments. Only keep what is needed for filtering and rotating exit rays back.
+    threading_pool->AddRangeBasedJobs(active_ray_num_, [=](size_t idx0, size_t idx1) {
+      for (size_t i = idx0; i < idx1; i++) {
+        auto idx = i + entry_ray_offset_;
+        auto rng = GetRandomNumberGenerator(RandomStream::kEntryRay, idx);
+        InitMainAxis(ctx, &rng, entry_ray_data_.ray_axis + idx * 3);
+        math::RotateZ(entry_ray_data_.ray_axis + idx * 3, entry_ray_data_.ray_dir + idx * 3, buffer_.dir[0] + i * 3);
+
+        buffer_.face_id[0][i] = ctx->RandomSampleFace(&rng, buffer_.dir[0] + i * 3);
+        math::RandomSampler::SampleTriangularPoints(&rng, face_vertex + buffer_.face_id[0][i] * 9,
+                                                    buffer_.pt[0] + i * 3);
+        buffer_.w[0][i] = entry_ray_data_.ray_w[idx];
+        buffer_.root_idx[0][i] = static_cast<uint32_t>(idx);
+        buffer_.path_code[0][i] = RayPathCode{};
+        buffer_.path_hash[0][i] = 0;
+        buffer_.path_state[0][i] = RayPathAutomaton::kInitState;
+
+        std::memcpy(entry_ray_data_.ray_entry_dir + idx * 3, buffer_.dir[0] + i * 3, sizeof(float) * 3);
+        entry_ray_data_.ray_entry_face_id[idx] = buffer_.face_id[0][i];
+      }
+    });
+    threading_pool->WaitFinish();
+    return;
+  }
 
-    auto prev_r = entry_ray_data_.ray_seg[entry_ray_offset_ + i];
-    buffer_.w[0][i] = prev_r ? prev_r->w : 1.0f;
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  auto ray_info_pool = RayInfoPool::GetInstance();
+  auto ray_seg_idx0 = ray_seg_store->ReserveSegments(active_ray_num_);
+  auto ray_info_idx0 = ray_info_pool->ReserveObjects(active_ray_num_);
+
+  threading_pool->AddRangeBasedJobs(active_ray_num_, [=](size_t idx0, size_t idx1) {
+    using math::RandomSampler;
+    float axis_rot[3];
+    for (size_t i = idx0; i < idx1; i++) {
+      auto rng = GetRandomNumberGenerator(RandomStream::kEntryRay, i + entry_ray_offset_);
+      InitMainAxis(ctx, &rng, axis_rot);
+      math::RotateZ(axis_rot, entry_ray_data_.ray_dir + (i + entry_ray_offset_) * 3, buffer_.dir[0] + i * 3);
+
+      buffer_.face_id[0][i] = ctx->RandomSampleFace(&rng, buffer_.dir[0] + i * 3);
+      RandomSampler::SampleTriangularPoints(&rng, face_vertex + buffer_.face_id[0][i] * 9, buffer_.pt[0] + i * 3);
+      buffer_.w[0][i] = entry_ray_data_.ray_w[entry_ray_offset_ + i];
+      buffer_.path_code[0][i] = RayPathCode{};
+      buffer_.path_hash[0][i] = 0;
+      buffer_.path_state[0][i] = RayPathAutomaton::kInitState;
+
+      auto r = static_cast<PoolHandle>(ray_seg_idx0 + i);
+      auto ray_info_handle = static_cast<PoolHandle>(ray_info_idx0 + i);
+      ray_seg_store->Set(r, buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, buffer_.w[0][i], buffer_.face_id[0][i],
+                         kInvalidPoolHandle, ray_info_handle, RaySegmentState::kOnGoing);
+      buffer_.ray_seg[0][i] = r;
+      auto ray_info = ray_info_pool->GetObjectAt(ray_info_handle, r, crystal_id, axis_rot);
+      ray_info->prev_ray_segment = entry_ray_data_.ray_seg[entry_ray_offset_ + i];
+    }
+  });
+  threading_pool->WaitFinish();
 
-    auto r = ray_pool->GetObject(buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, buffer_.w[0][i], buffer_.face_id[0][i]);
-    buffer_.ray_seg[0][i] = r;
-    r->root_ctx = ray_info_pool->GetObject(r, crystal_id, axis_rot);
-    r->root_ctx->prev_ray_segment = prev_r;
-    simulation_ray_data_.AddRay(r->root_ctx);
+  for (size_t i = 0; i < active_ray_num_; i++) {
+    simulation_ray_data_.AddRay(static_cast<PoolHandle>(ray_info_idx0 + i));
   }
 }
 
 
 // Init crystal main axis.
 // Random sample points on a sphere with given parameters.
-void Simulator::InitMainAxis(const CrystalContext* ctx, float* axis) {
-  auto rng = math::RandomNumberGenerator::GetInstance();
-
+void Simulator::InitMainAxis(const CrystalContext* ctx, math::RandomNumberGenerator* rng, float* axis) {
   auto axis_dist = ctx->GetAxisDistribution();
   if (axis_dist.latitude_dist == math::Distribution::kUniform) {
     // Random sample on full sphere, ignore other parameters.
-    math::RandomSampler::SampleSphericalPointsSph(axis);
+    math::RandomSampler::SampleSphericalPointsSph(rng, axis);
   } else {
-    math::RandomSampler::SampleSphericalPointsSph(axis_dist, axis);
+    math::RandomSampler::SampleSphericalPointsSph(rng, axis_dist, axis);
   }
 
   if (axis_dist.roll_dist == math::Distribution::kUniform) {
@@ -506,45 +846,88 @@ void Simulator::InitMainAxis(const CrystalContext* ctx, float* axis) {
 
 // Restore and shuffle resulted rays, and fill into dir[0].
 void Simulator::PrepareMultiScatterRays(float prob) {
-  auto last_exit_ray_seg_num = simulation_ray_data_.GetLastExitRaySegments().size();
-  if (buffer_size_ < last_exit_ray_seg_num * 2) {
-    buffer_size_ = last_exit_ray_seg_num * 2;
+  auto last_exit_ray_num = curr_lightweight_ ? simulation_ray_data_.GetLastExitRayData().size() / 4 :
+                                               simulation_ray_data_.GetLastExitRaySegments().size();
+  if (buffer_size_ < last_exit_ray_num * 2) {
+    buffer_size_ = last_exit_ray_num * 2;
     buffer_.Allocate(buffer_size_);
   }
-  if (entry_ray_data_.ray_num < last_exit_ray_seg_num) {
-    entry_ray_data_.Allocate(last_exit_ray_seg_num);
+  if (entry_ray_data_.ray_num < last_exit_ray_num) {
+    entry_ray_data_.Allocate(last_exit_ray_num);
   }
 
-  auto rng = math::RandomNumberGenerator::GetInstance();
+  // With Russian roulette, rays below kScatMinW survive with probability w / kScatMinW, instead of being dropped.
+  // Every survivor gets weight kScatMinW, whether it continues or not, so that the expected weight is unchanged.
+  auto rng = GetRandomNumberGenerator(RandomStream::kMultiScatter, 0);
+  bool roulette = context_->GetRouletteThreshold() > 0;
   size_t idx = 0;
-  for (const auto& r : simulation_ray_data_.GetLastExitRaySegments()) {
-    if (r->w < context_->kScatMinW) {
-      r->state = RaySegmentState::kAirAbsorbed;
-      continue;
+  if (curr_lightweight_) {
+    // Continued rays are moved into entry data, and the others are kept as final exit rays.
+    auto& last_exit_data = simulation_ray_data_.GetLastExitRayData();
+    auto& last_layer_masks = simulation_ray_data_.GetLastExitRayLayerMasks();
+    std::vector<float> final_exit_data;
+    std::vector<uint32_t> final_layer_masks;
+    final_exit_data.reserve(last_exit_data.size());
+    for (size_t i = 0; i < last_exit_ray_num; i++) {
+      const auto* d = last_exit_data.data() + i * 4;
+      float w = d[3];
+      if (w < context_->kScatMinW && !(roulette && rng.GetUniform() * context_->kScatMinW < w)) {
+        continue;
+      }
+      w = std::max(w, context_->kScatMinW);
+      if (rng.GetUniform() > prob) {
+        final_exit_data.insert(final_exit_data.end(), d, d + 3);
+        final_exit_data.emplace_back(w);
+        if (!last_layer_masks.empty()) {
+          final_layer_masks.emplace_back(last_layer_masks[i]);
+        }
+        continue;
+      }
+      std::memcpy(entry_ray_data_.ray_dir + idx * 3, d, sizeof(float) * 3);
+      entry_ray_data_.ray_w[idx] = w;
+      entry_ray_data_.ray_seg[idx] = kInvalidPoolHandle;
+      idx++;
     }
-    if (rng->GetUniform() > prob) {
-      continue;
+    last_exit_data.swap(final_exit_data);
+    last_layer_masks.swap(final_layer_masks);
+  } else {
+    auto ray_seg_store = RaySegmentStore::GetInstance();
+    auto ray_info_pool = RayInfoPool::GetInstance();
+    for (const auto& r : simulation_ray_data_.GetLastExitRaySegments()) {
+      float w = ray_seg_store->GetWeight(r);
+      if (w < context_->kScatMinW && !(roulette && rng.GetUniform() * context_->kScatMinW < w)) {
+        ray_seg_store->SetState(r, RaySegmentState::kAirAbsorbed);
+        continue;
+      }
+      if (w < context_->kScatMinW) {
+        w = context_->kScatMinW;
+        ray_seg_store->SetWeight(r, w);
+      }
+      if (rng.GetUniform() > prob) {
+        continue;
+      }
+      ray_seg_store->SetState(r, RaySegmentState::kContinued);
+      const auto axis_rot = ray_info_pool->Get(ray_seg_store->GetRayInfo(r))->main_axis.val();
+      math::RotateZBack(axis_rot, ray_seg_store->GetDir(r), entry_ray_data_.ray_dir + idx * 3);
+      entry_ray_data_.ray_w[idx] = w;
+      entry_ray_data_.ray_seg[idx] = r;
+      idx++;
     }
-    r->state = RaySegmentState::kContinued;
-    const auto axis_rot = r->root_ctx->main_axis.val();
-    math::RotateZBack(axis_rot, r->dir.val(), entry_ray_data_.ray_dir + idx * 3);
-    entry_ray_data_.ray_seg[idx] = r;
-    idx++;
   }
   total_ray_num_ = idx;
 
   // Shuffle
   for (size_t i = 0; i < total_ray_num_; i++) {
-    int tmp_idx = math::RandomSampler::SampleInt(static_cast<int>(total_ray_num_ - i));
+    int tmp_idx = math::RandomSampler::SampleInt(&rng, static_cast<int>(total_ray_num_ - i));
 
     float tmp_dir[3];
     std::memcpy(tmp_dir, entry_ray_data_.ray_dir + (i + tmp_idx) * 3, sizeof(float) * 3);
     std::memcpy(entry_ray_data_.ray_dir + (i + tmp_idx) * 3, entry_ray_data_.ray_dir + i * 3, sizeof(float) * 3);
     std::memcpy(entry_ray_data_.ray_dir + i * 3, tmp_dir, sizeof(float) * 3);
 
-    RaySegment* tmp_r = entry_ray_data_.ray_seg[i + tmp_idx];
-    entry_ray_data_.ray_seg[i + tmp_idx] = entry_ray_data_.ray_seg[i];
-    entry_ray_data_.ray_seg[i] = tmp_r;
+    std::swap(entry_ray_data_.ray_w[i + tmp_idx], entry_ray_data_.ray_w[i]);
+
+    std::swap(entry_ray_data_.ray_seg[i + tmp_idx], entry_ray_data_.ray_seg[i]);
   }
 }
 
@@ -552,10 +935,22 @@ void Simulator::PrepareMultiScatterRays(float prob) {
 // Trace rays.
 // Start from dir[0] and pt[0].
 void Simulator::TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter) {
+  static_assert(RayPathCode::kMaxLength >= ProjectContext::kMaxRayHitNum, "Ray path code is too short!");
+
   auto pool = ThreadingPool::GetInstance();
 
   int max_recursion_num = context_->GetRayHitNum();
   auto n = static_cast<float>(IceRefractiveIndex::Get(simulation_ray_data_.wavelength_info_.wavelength));
+  const FresnelTable* fresnel = fresnel_table_.get();
+  filter->ApplySymmetry(crystal);
+  const auto* automaton = filter->GetPathAutomaton();
+  bool prune = automaton && filter->CanPruneRays(crystal);
+  for (auto f : output_filters_) {
+    f->ApplySymmetry(crystal);
+  }
+  auto propagate = Optics::GetPropagateFunc(crystal);
+  float roulette_w = context_->GetRouletteThreshold();
+  auto trace_idx = static_cast<uint64_t>(trace_count_++) * ProjectContext::kMaxRayHitNum;
   for (int i = 0; i < max_recursion_num; i++) {
     if (buffer_size_ < active_ray_num_ * 2) {
       buffer_size_ = active_ray_num_ * kBufferSizeFactor;
@@ -563,70 +958,234 @@ void Simulator::TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter)
     }
     pool->AddRangeBasedJobs(active_ray_num_, [=](size_t idx0, size_t idx1) {
       size_t current_num = idx1 - idx0;
-      Optics::HitSurface(crystal, n, current_num,                                                       //
-                         buffer_.dir[0] + idx0 * 3, buffer_.face_id[0] + idx0, buffer_.w[0] + idx0,     //
-                         buffer_.dir[1] + idx0 * 6, buffer_.w[1] + idx0 * 2);                           //
-      Optics::Propagate(crystal, current_num * 2, buffer_.pt[0] + idx0 * 3,                             //
-                        buffer_.dir[1] + idx0 * 6, buffer_.w[1] + idx0 * 2, buffer_.face_id[0] + idx0,  //
-                        buffer_.pt[1] + idx0 * 6, buffer_.face_id[1] + idx0 * 2);                       //
+      Optics::HitSurfaceSimd(crystal, n, current_num,                                                   //
+                             buffer_.dir[0] + idx0 * 3, buffer_.face_id[0] + idx0, buffer_.w[0] + idx0,  //
+                             buffer_.dir[1] + idx0 * 6, buffer_.w[1] + idx0 * 2,                         //
+                             fresnel);                                                                   //
+      propagate(crystal, current_num * 2, buffer_.pt[0] + idx0 * 3,                                     //
+                buffer_.dir[1] + idx0 * 6, buffer_.w[1] + idx0 * 2, buffer_.face_id[0] + idx0,          //
+                buffer_.pt[1] + idx0 * 6, buffer_.face_id[1] + idx0 * 2);                               //
+
+      // Every range has its own random numbers for Russian roulette. Ranges do not depend on thread number.
+      auto rng = GetRandomNumberGenerator(RandomStream::kRoulette, idx0, trace_idx + i);
+
+      // Append the face just hit to ray path.
+      for (size_t j = idx0 * 2; j < idx1 * 2; j++) {
+        int fn = crystal->FaceNumber(buffer_.face_id[0][j / 2]);
+        buffer_.path_code[1][j] = buffer_.path_code[0][j / 2];
+        buffer_.path_code[1][j].Set(i, fn);
+        buffer_.path_hash[1][j] = buffer_.path_hash[0][j / 2] ^ RayPathHashItem(static_cast<unsigned int>(fn), i);
+        buffer_.path_state[1][j] =
+            automaton ? automaton->Next(buffer_.path_state[0][j / 2], fn) : RayPathAutomaton::kInitState;
+
+        // Drop rays that still in crystal but cannot pass filter any more. They are skipped like refractive rays
+        // in total reflection case.
+        if (prune && buffer_.face_id[1][j] >= 0 && !automaton->CanGoFurther(buffer_.path_state[1][j])) {
+          buffer_.w[1][j] = 0;
+        }
+
+        // Russian roulette. Rays dropped here are skipped in the same way.
+        auto& w = buffer_.w[1][j];
+        if (buffer_.face_id[1][j] >= 0 && w > ProjectContext::kPropMinW && w < roulette_w) {
+          w = rng.GetUniform() * roulette_w < w ? roulette_w : 0;
+        }
+      }
     });
     pool->WaitFinish();
-    StoreRaySegments(crystal, filter);
+    if (curr_lightweight_) {
+      StoreExitRays(crystal, filter, i + 2);
+    } else {
+      StoreRaySegments(crystal, filter, i + 2);
+    }
     RefreshBuffer();  // active_ray_num_ is updated.
   }
 }
 
 
 // Save rays
-void Simulator::StoreRaySegments(const Crystal* crystal, AbstractRayPathFilter* filter) {
-  filter->ApplySymmetry(crystal);
-  auto ray_pool = RaySegmentPool::GetInstance();
-  for (size_t i = 0; i < active_ray_num_ * 2; i++) {
-    if (buffer_.w[1][i] <= 0) {  // Refractive rays in total reflection case
-      continue;
+// Run in range jobs. Each range gets its own consecutive slots in ray segment pool and its own exit ray list.
+// Lists are merged in range order, so result does not depend on job scheduling.
+void Simulator::StoreRaySegments(const Crystal* crystal, const AbstractRayPathFilter* filter, int hit_num) {
+  auto num = active_ray_num_ * 2;
+  auto threading_pool = ThreadingPool::GetInstance();
+  auto step = ThreadingPool::GetRangeStep(num);
+  auto range_num = (num + step - 1) / step;
+
+  // First count ray segments in every range, then reserve them all at once.
+  std::vector<size_t> range_seg_offset(range_num + 1, 0);
+  threading_pool->AddRangeBasedJobs(num, step, [=, &range_seg_offset](size_t idx0, size_t idx1) {
+    size_t cnt = 0;
+    for (size_t i = idx0; i < idx1; i++) {
+      if (buffer_.w[1][i] > 0) {  // Refractive rays in total reflection case are skipped
+        cnt++;
+      }
     }
+    range_seg_offset[idx0 / step + 1] = cnt;
+  });
+  threading_pool->WaitFinish();
+  std::partial_sum(range_seg_offset.begin(), range_seg_offset.end(), range_seg_offset.begin());
 
-    auto r = ray_pool->GetObject(buffer_.pt[0] + i / 2 * 3, buffer_.dir[1] + i * 3, buffer_.w[1][i],
-                                 buffer_.face_id[0][i / 2]);
-    if (buffer_.face_id[1][i] < 0) {
-      r->state = RaySegmentState::kFinished;
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  auto ray_info_pool = RayInfoPool::GetInstance();
+  auto ray_seg_idx0 = ray_seg_store->ReserveSegments(range_seg_offset.back());
+
+  std::vector<std::vector<PoolHandle>> range_exit_ray_segs(range_num);
+  std::vector<std::vector<uint32_t>> range_layer_masks(range_num);
+  threading_pool->AddRangeBasedJobs(num, step, [=, &range_seg_offset, &range_exit_ray_segs,
+                                                &range_layer_masks](size_t idx0, size_t idx1) {
+    auto ray_seg_idx = ray_seg_idx0 + range_seg_offset[idx0 / step];
+    auto& exit_ray_segs = range_exit_ray_segs[idx0 / step];
+    auto& layer_masks = range_layer_masks[idx0 / step];
+    for (size_t i = idx0; i < idx1; i++) {
+      if (buffer_.w[1][i] <= 0) {  // Refractive rays in total reflection case
+        continue;
+      }
+
+      auto state = RaySegmentState::kOnGoing;
+      if (buffer_.face_id[1][i] < 0) {
+        state = RaySegmentState::kFinished;
+      }
+      if (buffer_.w[1][i] < ProjectContext::kPropMinW) {
+        state = RaySegmentState::kCrystalAbsorbed;
+      }
+
+      auto r = static_cast<PoolHandle>(ray_seg_idx++);
+      auto prev_r = buffer_.ray_seg[0][i / 2];
+      auto ray_info_handle = ray_seg_store->GetRayInfo(prev_r);
+      ray_seg_store->Set(r, buffer_.pt[0] + i / 2 * 3, buffer_.dir[1] + i * 3, buffer_.w[1][i],
+                         buffer_.face_id[0][i / 2], prev_r, ray_info_handle, state);
+      buffer_.ray_seg[1][i] = r;
+
+      if (state != RaySegmentState::kFinished) {
+        continue;
+      }
+      RayPathInfo ray_path;
+      auto first_r = ray_info_pool->Get(ray_info_handle)->first_ray_segment;
+      ray_path.entry_dir = ray_seg_store->GetDir(first_r);
+      ray_path.exit_dir = ray_seg_store->GetDir(r);
+      ray_path.entry_face_id = ray_seg_store->GetFaceId(first_r);
+      ray_path.exit_face_id = buffer_.face_id[0][i / 2];
+      ray_path.hit_num = hit_num;
+      ray_path.path_hash = buffer_.path_hash[1][i];
+      ray_path.path_code = buffer_.path_code[1][i];
+      ray_path.path_state = buffer_.path_state[1][i];
+      if (!filter->Filter(crystal, ray_path)) {
+        continue;
+      }
+      exit_ray_segs.emplace_back(r);
+      if (!output_filters_.empty()) {
+        layer_masks.emplace_back(GetOutputLayerMask(crystal, ray_path));
+      }
     }
-    if (r->w < ProjectContext::kPropMinW) {
-      r->state = RaySegmentState::kCrystalAbsorbed;
+  });
+  threading_pool->WaitFinish();
+
+  for (size_t k = 0; k < range_num; k++) {
+    for (const auto& r : range_exit_ray_segs[k]) {
+      simulation_ray_data_.AddExitRaySegment(r);
     }
+    simulation_ray_data_.AddExitRayLayerMasks(range_layer_masks[k]);
+  }
+}
 
-    auto prev_ray_seg = buffer_.ray_seg[0][i / 2];
-    if (i % 2 == 0) {
-      prev_ray_seg->next_reflect = r;
-    } else {
-      prev_ray_seg->next_refract = r;
+
+// Save exit rays only, for lightweight mode
+// No ray segment is created. Finished rays that pass the filter are rotated back into world frame and stored as
+// (x, y, z, w). Like StoreRaySegments, every range has its own list and lists are merged in range order.
+void Simulator::StoreExitRays(const Crystal* crystal, const AbstractRayPathFilter* filter, int hit_num) {
+  auto num = active_ray_num_ * 2;
+  auto threading_pool = ThreadingPool::GetInstance();
+  auto step = ThreadingPool::GetRangeStep(num);
+  auto range_num = (num + step - 1) / step;
+
+  std::vector<std::vector<float>> range_exit_data(range_num);
+  std::vector<std::vector<uint32_t>> range_layer_masks(range_num);
+  threading_pool->AddRangeBasedJobs(num, step, [=, &range_exit_data, &range_layer_masks](size_t idx0, size_t idx1) {
+    auto& exit_data = range_exit_data[idx0 / step];
+    auto& layer_masks = range_layer_masks[idx0 / step];
+    for (size_t i = idx0; i < idx1; i++) {
+      auto root_idx = buffer_.root_idx[0][i / 2];
+      buffer_.root_idx[1][i] = root_idx;
+      if (buffer_.face_id[1][i] >= 0 || buffer_.w[1][i] < ProjectContext::kPropMinW) {
+        continue;  // Not finished, absorbed, or refractive rays in total reflection case
+      }
+
+      RayPathInfo ray_path;
+      ray_path.entry_dir = entry_ray_data_.ray_entry_dir + root_idx * 3;
+      ray_path.exit_dir = buffer_.dir[1] + i * 3;
+      ray_path.entry_face_id = entry_ray_data_.ray_entry_face_id[root_idx];
+      ray_path.exit_face_id = buffer_.face_id[0][i / 2];
+      ray_path.hit_num = hit_num;
+      ray_path.path_hash = buffer_.path_hash[1][i];
+      ray_path.path_code = buffer_.path_code[1][i];
+      ray_path.path_state = buffer_.path_state[1][i];
+      if (!filter->Filter(crystal, ray_path)) {
+        continue;
+      }
+
+      float dir[4];  // RotateZBack loads 4 floats
+      std::memcpy(dir, buffer_.dir[1] + i * 3, sizeof(float) * 3);
+      auto data_idx = exit_data.size();
+      exit_data.resize(data_idx + 4);
+      math::RotateZBack(entry_ray_data_.ray_axis + root_idx * 3, dir, exit_data.data() + data_idx);
+      exit_data[data_idx + 3] = buffer_.w[1][i];
+      if (!output_filters_.empty()) {
+        layer_masks.emplace_back(GetOutputLayerMask(crystal, ray_path));
+      }
     }
-    r->prev = prev_ray_seg;
-    r->root_ctx = prev_ray_seg->root_ctx;
-    buffer_.ray_seg[1][i] = r;
+  });
+  threading_pool->WaitFinish();
 
-    if (r->state == RaySegmentState::kFinished && filter->Filter(crystal, r)) {
-      simulation_ray_data_.AddExitRaySegment(r);
+  for (size_t k = 0; k < range_num; k++) {
+    simulation_ray_data_.AddExitRayData(range_exit_data[k]);
+    simulation_ray_data_.AddExitRayLayerMasks(range_layer_masks[k]);
+  }
+}
+
+
+// Evaluate all output filters on a final ray. Bit k of result is set if k-th output filter accepts it.
+// Output filters do not track path states during tracing, so the state is computed from path code here.
+uint32_t Simulator::GetOutputLayerMask(const Crystal* crystal, RayPathInfo ray_path) const {
+  uint32_t mask = 0;
+  for (size_t k = 0; k < output_filters_.size(); k++) {
+    const auto* automaton = output_filters_[k]->GetPathAutomaton();
+    ray_path.path_state =
+        automaton ? automaton->Run(ray_path.path_code, ray_path.hit_num - 1) : RayPathAutomaton::kInitState;
+    if (output_filters_[k]->Filter(crystal, ray_path)) {
+      mask |= 1u << k;
     }
   }
+  return mask;
 }
 
 
 // Squeeze data, copy into another buffer_ (from buf[1] to buf[0])
 // Update active_ray_num_.
+// It is a parallel stream compaction: count alive rays in every range, do an exclusive scan, then copy. If all rays
+// are alive, the two buffers are simply swapped.
 void Simulator::RefreshBuffer() {
-  size_t idx = 0;
-  for (size_t i = 0; i < active_ray_num_ * 2; i++) {
-    if (buffer_.face_id[1][i] >= 0 && buffer_.w[1][i] > ProjectContext::kPropMinW) {
-      std::memcpy(buffer_.pt[0] + idx * 3, buffer_.pt[1] + i * 3, sizeof(float) * 3);
-      std::memcpy(buffer_.dir[0] + idx * 3, buffer_.dir[1] + i * 3, sizeof(float) * 3);
-      buffer_.w[0][idx] = buffer_.w[1][i];
-      buffer_.face_id[0][idx] = buffer_.face_id[1][i];
-      buffer_.ray_seg[0][idx] = buffer_.ray_seg[1][i];
-      idx++;
-    }
+  auto num = active_ray_num_ * 2;
+  auto threading_pool = ThreadingPool::GetInstance();
+  auto step = ThreadingPool::GetRangeStep(num);
+  auto range_num = (num + step - 1) / step;
+
+  std::vector<size_t> range_offset(range_num + 1, 0);
+  threading_pool->AddRangeBasedJobs(num, step, [=, &range_offset](size_t idx0, size_t idx1) {
+    range_offset[idx0 / step + 1] = buffer_.CountAliveRays(idx0, idx1);
+  });
+  threading_pool->WaitFinish();
+  std::partial_sum(range_offset.begin(), range_offset.end(), range_offset.begin());
+
+  active_ray_num_ = range_offset.back();
+  if (active_ray_num_ == num) {
+    buffer_.Swap();
+    return;
   }
-  active_ray_num_ = idx;
+
+  threading_pool->AddRangeBasedJobs(num, step, [=, &range_offset](size_t idx0, size_t idx1) {
+    buffer_.CompactAliveRays(idx0, idx1, range_offset[idx0 / step], curr_lightweight_);
+  });
+  threading_pool->WaitFinish();
 }
 
 
@@ -635,24 +1194,30 @@ const SimulationRayData& Simulator::GetSimulationRayData() {
 }
 
 
+size_t Simulator::GetPeakPoolMemory() const {
+  return peak_pool_memory_;
+}
+
+
 #ifdef FOR_TEST
 void Simulator::PrintRayInfo() {
-  std::stack<RaySegment*> s;
+  auto ray_seg_store = RaySegmentStore::GetInstance();
+  std::stack<PoolHandle> s;
   for (const auto& rs : simulation_ray_data_.GetExitRaySegments()) {
     for (const auto& r : rs) {
-      auto p = r;
-      while (p) {
+      for (auto p = r; p != kInvalidPoolHandle; p = ray_seg_store->GetParent(p)) {
         s.push(p);
-        p = p->prev;
       }
       std::printf("%zu,0,0,0,0,0,-1\n", s.size());
       while (!s.empty()) {
-        p = s.top();
+        auto p = s.top();
         s.pop();
+        const auto* pt = ray_seg_store->GetPoint(p);
+        const auto* dir = ray_seg_store->GetDir(p);
         std::printf("%+.4f,%+.4f,%+.4f,%+.4f,%+.4f,%+.4f,%+.4f\n",  //
-                    p->pt.x(), p->pt.y(), p->pt.z(),                // point
-                    p->dir.x(), p->dir.y(), p->dir.z(),             // direction
-                    p->w);                                          // weight
+                    pt[0], pt[1], pt[2],                            // point
+                    dir[0], dir[1], dir[2],                         // direction
+                    ray_seg_store->GetWeight(p));                   // weight
       }
     }
   }
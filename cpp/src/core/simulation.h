@@ -1,6 +1,8 @@
 #ifndef SRC_CORE_SIMULATION_H_
 #define SRC_CORE_SIMULATION_H_
 
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "context/context.h"
@@ -56,34 +58,62 @@ class SimulationRayData : public ISerializable {
 
   void Clear();
   void PrepareNewScatter(size_t ray_num);
-  void AddRay(RayInfo* ray);
+  void AddRay(PoolHandle ray);
+  void AddInitRayNum(size_t num);
 
   SimpleRayData CollectFinalRayData() const;
 
-  void AddExitRaySegment(RaySegment* r);
-  const std::vector<RaySegment*>& GetLastExitRaySegments() const;
+  /**
+   * @brief Collect final rays of one output layer, i.e. final rays accepted by the layer-th output filter.
+   *
+   * @see ProjectContext::GetOutputFilterIds()
+   * @param layer
+   */
+  SimpleRayData CollectFinalRayData(size_t layer) const;
+
+  void AddExitRaySegment(PoolHandle r);
+  const std::vector<PoolHandle>& GetLastExitRaySegments() const;
+
+  /**
+   * @brief Add exit rays from lightweight tracing, where no ray segment is kept.
+   *
+   * @param data exit rays, in the same layout as SimpleRayData, i.e. (x, y, z, w) in world frame.
+   */
+  void AddExitRayData(const std::vector<float>& data);
+  std::vector<float>& GetLastExitRayData();
+
+  /**
+   * @brief Add output layer masks of exit rays, in the same order as exit rays are added.
+   *
+   * @param masks bit k is set if the ray is accepted by k-th output filter.
+   */
+  void AddExitRayLayerMasks(const std::vector<uint32_t>& masks);
+  std::vector<uint32_t>& GetLastExitRayLayerMasks();
 #ifdef FOR_TEST
-  const std::vector<std::vector<RaySegment*>>& GetExitRaySegments() const;
+  const std::vector<std::vector<PoolHandle>>& GetExitRaySegments() const;
 #endif
 
   /**
    * @brief Serialize self to a file.
    *
-   * This class only holds pointers to ray segments and ray infos, rather than objects themselves.
+   * This class only holds handles of ray segments and ray infos, rather than objects themselves.
    * To serialize data completely, this method will serialize ray segment pool and ray info
    * pool first.
    *
+   * Exit rays from lightweight tracing and output layer masks are not serialized. Use CollectFinalRayData() to
+   * get them.
+   *
    * The layout of file is:
    * ray info pool,         // ray info pool
    * ray seg pool,          // ray seg pool
    * uint32,                // multi-scatters, K
    * {
    *   uint32,              // ray numbers, N
-   *   (uint32 * 2) * N,    // ray info pointers
+   *   uint32 * N,          // ray info handles
    * } * K
    * {
    *   uint32,              // ray seg numbers, N
-   *   (uint32 * 2) * N,    // ray seg pointers
+   *   uint32 * N,          // ray seg handles
    * } * K
    *
    * @param file
@@ -94,7 +124,7 @@ class SimulationRayData : public ISerializable {
   /**
    * @brief Deserialize (load data) from a file.
    *
-   * This class only holds pointers to ray segments and ray infos, rather than objects themselves.
+   * This class only holds handles of ray segments and ray infos, rather than objects themselves.
    * To load data correctly, this method will deserialize ray segment pool and ray info
    * pool first, i.e. it will clear all existing data in ray segment pool and ray info pool.
    *
@@ -106,19 +136,66 @@ class SimulationRayData : public ISerializable {
   void Deserialize(File& file, endian::Endianness endianness) override;
 
  private:
-  std::vector<std::vector<RayInfo*>> rays_;
-  std::vector<std::vector<RaySegment*>> exit_ray_segments_;
+  static constexpr uint32_t kAllLayers = 0xffffffff;
+
+  SimpleRayData CollectRayData(uint32_t layer_mask) const;
+
+  std::vector<std::vector<PoolHandle>> rays_;
+  std::vector<std::vector<PoolHandle>> exit_ray_segments_;
+  std::vector<std::vector<float>> exit_ray_data_;
+  std::vector<std::vector<uint32_t>> exit_ray_layer_masks_;  // Empty if no output filter is set.
+  size_t init_ray_num_ = 0;
 };
 
 class Simulator {
  public:
+  using BatchConsumer = std::function<void(const SimulationRayData&)>;
+
   explicit Simulator(ProjectContextPtr context);
   Simulator(const Simulator& other) = delete;
 
   void SetCurrentWavelengthIndex(int index);
+
+  /**
+   * @brief Enable or disable lightweight mode.
+   *
+   * In lightweight mode, no ray segment is kept. Exit rays are written directly as (x, y, z, w) in world
+   * frame, so memory does not grow with ray history. It suits callers that only need CollectFinalRayData().
+   *
+   * @param enable
+   */
+  void EnableLightweightMode(bool enable);
+  bool GetLightweightMode() const;
+
+  /*! @brief Run simulation. All initial rays are traced in one batch, regardless of batch size setting. */
   void Run();
+
+  /**
+   * @brief Run simulation in batches, so that memory usage is bounded.
+   *
+   * Initial rays are split into batches of ProjectContext::GetRayBatchSize() rays. Every batch is traced through all
+   * multi-scatter levels, then handed to consumer, and then released before next batch starts. So peak memory depends
+   * on batch size rather than total ray number. After it returns, GetSimulationRayData() only holds the last batch.
+   *
+   * If ProjectContext::GetPoolMemoryBudget() is set (and ray segments are kept), batches may be smaller than
+   * ProjectContext::GetRayBatchSize(). The first batch has at most kBudgetProbeRayNum rays. Later batches are sized
+   * by the largest pool memory per initial ray seen so far, and pool chunks above the budget are freed between
+   * batches. Pools are allocated in whole chunks, so they may go over the budget by up to one chunk each.
+   *
+   * @param consumer called once for every batch, e.g. a file writer or a renderer.
+   */
+  void Run(const BatchConsumer& consumer);
   const SimulationRayData& GetSimulationRayData();
 
+  /**
+   * @brief Peak memory of ray segment store and ray info pool in last run (i.e. at one wavelength), in bytes.
+   *
+   * It counts allocated chunks, including those kept from earlier batches, so it is close to resident memory.
+   */
+  size_t GetPeakPoolMemory() const;
+
+  static constexpr size_t kBudgetProbeRayNum = 1000;
+
 #ifdef FOR_TEST
   void PrintRayInfo();  // For debug
 #endif
@@ -132,7 +209,11 @@ class Simulator {
     void Allocate(size_t ray_number);
 
     float* ray_dir;
-    RaySegment** ray_seg;
+    float* ray_w;
+    PoolHandle* ray_seg;
+    float* ray_axis;         // Main axis of crystal, only used in lightweight mode.
+    float* ray_entry_dir;    // Incident direction in crystal frame, only used in lightweight mode.
+    int* ray_entry_face_id;  // Only used in lightweight mode.
     size_t ray_num;
     size_t buf_size;
   };
@@ -147,11 +228,20 @@ class Simulator {
     void Allocate(size_t ray_number);
     void Print();
 
+    bool IsAlive(size_t idx) const;
+    size_t CountAliveRays(size_t idx0, size_t idx1) const;
+    void CompactAliveRays(size_t idx0, size_t idx1, size_t dst_idx, bool lightweight);
+    void Swap();
+
     float* pt[2];
     float* dir[2];
     float* w[2];
     int* face_id[2];
-    RaySegment** ray_seg[2];
+    PoolHandle* ray_seg[2];     // Not used in lightweight mode.
+    uint32_t* root_idx[2];      // Index of entry ray. Only used in lightweight mode.
+    RayPathCode* path_code[2];  // Face numbers of path so far. Updated on every hit.
+    size_t* path_hash[2];       // RayPathHash() of path so far. Updated on every hit.
+    int* path_state[2];         // State of filter's path automaton. Updated on every hit.
 
     size_t ray_num;
 
@@ -160,22 +250,46 @@ class Simulator {
   };
 
 
-  static void InitMainAxis(const CrystalContext* ctx, float* axis);
+  enum class RandomStream : uint64_t {
+    kSunRay = 1,
+    kEntryRay,
+    kMultiScatter,
+    kRoulette,
+  };
+
+  math::RandomNumberGenerator GetRandomNumberGenerator(RandomStream stream, size_t idx) const;
+  math::RandomNumberGenerator GetRandomNumberGenerator(RandomStream stream, size_t idx, uint64_t sub_key) const;
+  uint64_t GetRandomStreamId(RandomStream stream, size_t idx) const;
 
-  void InitSunRays();
+  static void InitMainAxis(const CrystalContext* ctx, math::RandomNumberGenerator* rng, float* axis);
+
+  void RunBatches(size_t batch_size, const BatchConsumer& consumer);
+  void RunBatch(size_t ray_num);
+  void ClearBatchData();
+  void InitSunRays(size_t ray_num);
   void InitEntryRays(const CrystalContext* ctx);
   void TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter);
   void PrepareMultiScatterRays(float prob);
-  void StoreRaySegments(const Crystal* crystal, AbstractRayPathFilter* filter);
+  void StoreRaySegments(const Crystal* crystal, const AbstractRayPathFilter* filter, int hit_num);
+  void StoreExitRays(const Crystal* crystal, const AbstractRayPathFilter* filter, int hit_num);
+  uint32_t GetOutputLayerMask(const Crystal* crystal, RayPathInfo ray_path) const;
   void RefreshBuffer();
 
   static constexpr int kBufferSizeFactor = 4;
+  static constexpr size_t kSunRayBlockSize = 1024;
 
   ProjectContextPtr context_;
 
   SimulationRayData simulation_ray_data_;
+  std::vector<AbstractRayPathFilter*> output_filters_;
 
   int current_wavelength_index_;
+  bool lightweight_mode_;  // Set by user.
+  bool curr_lightweight_;  // Actually used in current run.
+  size_t current_scatter_index_;
+  size_t run_count_;
+  uint64_t run_random_key_;
+  uint64_t random_key_;  // Key of current batch.
 
   size_t total_ray_num_;
   size_t active_ray_num_;
@@ -184,6 +298,10 @@ class Simulator {
   BufferData buffer_;
   EntryRayData entry_ray_data_;
   size_t entry_ray_offset_;
+  size_t trace_count_;        // TraceRays() calls in current batch.
+  size_t peak_pool_memory_;  // Of current run.
+
+  std::unique_ptr<FresnelTable> fresnel_table_;  // Of current wavelength. nullptr if it is not used.
 };
 
 }  // namespace icehalo
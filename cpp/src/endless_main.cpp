@@ -1,5 +1,6 @@
 #include <chrono>
 #include <cstdio>
+#include <vector>
 #include <opencv2/opencv.hpp>
 
 #include "context/context.h"
@@ -15,10 +16,19 @@ int main(int argc, char* argv[]) {
   auto start = std::chrono::system_clock::now();
   icehalo::ProjectContextPtr proj_ctx = icehalo::ProjectContext::CreateFromFile(argv[1]);
   icehalo::Simulator simulator(proj_ctx);
+  simulator.EnableLightweightMode(true);  // Only final rays are rendered.
   icehalo::SpectrumRenderer renderer;
   renderer.SetCameraContext(proj_ctx->cam_ctx_);
   renderer.SetRenderContext(proj_ctx->render_ctx_);
 
+  // One more renderer for every output layer.
+  auto layer_num = proj_ctx->GetOutputFilterIds().size();
+  std::vector<icehalo::SpectrumRenderer> layer_renderers(layer_num);
+  for (auto& r : layer_renderers) {
+    r.SetCameraContext(proj_ctx->cam_ctx_);
+    r.SetRenderContext(proj_ctx->render_ctx_);
+  }
+
   auto t = std::chrono::system_clock::now();
   std::chrono::duration<float, std::ratio<1, 1000>> diff = t - start;
   std::printf("Initialization: %.2fms\n", diff.count());
@@ -38,12 +48,16 @@ int main(int argc, char* argv[]) {
       simulator.SetCurrentWavelengthIndex(i);
 
       auto t0 = std::chrono::system_clock::now();
-      simulator.Run();
+      simulator.Run([&renderer, &layer_renderers](const icehalo::SimulationRayData& ray_data) {
+        renderer.LoadRayData(ray_data.CollectFinalRayData());
+        for (size_t k = 0; k < layer_renderers.size(); k++) {
+          layer_renderers[k].LoadRayData(ray_data.CollectFinalRayData(k));
+        }
+      });
       auto t1 = std::chrono::system_clock::now();
       diff = t1 - t0;
       std::printf("Ray tracing: %.2fms\n", diff.count());
-
-      renderer.LoadRayData(simulator.GetSimulationRayData().CollectFinalRayData());
+      std::printf("Peak pool memory: %.2fMB\n", simulator.GetPeakPoolMemory() / 1048576.0);
     }
 
     renderer.RenderToImage();
@@ -52,6 +66,13 @@ int main(int argc, char* argv[]) {
                 renderer.GetImageBuffer());
     cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
     cv::imwrite(proj_ctx->GetDefaultImagePath(), img);
+    for (size_t k = 0; k < layer_num; k++) {
+      layer_renderers[k].RenderToImage();
+      cv::Mat layer_img(proj_ctx->render_ctx_->GetImageHeight(), proj_ctx->render_ctx_->GetImageWidth(), CV_8UC3,
+                        layer_renderers[k].GetImageBuffer());
+      cv::cvtColor(layer_img, layer_img, cv::COLOR_RGB2BGR);
+      cv::imwrite(proj_ctx->GetDefaultImagePath(k), layer_img);
+    }
 
     t = std::chrono::system_clock::now();
     total_ray_num += proj_ctx->GetInitRayNum() * wavelengths.size();
@@ -1,6 +1,7 @@
 #ifndef SRC_IO_FILE_H_
 #define SRC_IO_FILE_H_
 
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -68,7 +69,10 @@ template <>
 struct ByteSwapImp<2> {
   template <typename T>
   void operator()(T* x) noexcept {
-    *x = ntohs(*x);
+    uint16_t tmp;
+    std::memcpy(&tmp, x, sizeof(tmp));
+    tmp = ntohs(tmp);
+    std::memcpy(x, &tmp, sizeof(tmp));
   }
 };
 
@@ -76,7 +80,10 @@ template <>
 struct ByteSwapImp<4> {
   template <typename T>
   void operator()(T* x) noexcept {
-    *x = ntohl(*x);
+    uint32_t tmp;
+    std::memcpy(&tmp, x, sizeof(tmp));
+    tmp = ntohl(tmp);
+    std::memcpy(x, &tmp, sizeof(tmp));
   }
 };
 
@@ -227,6 +234,7 @@ size_t File::Write(const T* data, size_t n) {
 
 bool FileExists(const char* filename);
 
+/*! @brief List simulation data files, i.e. `.bin` files, in dir. Output layer files (`.layer`) are not listed. */
 std::vector<File> ListDataFiles(const char* dir);
 
 std::string PathJoin(const std::string& p1, const std::string& p2);
@@ -47,11 +47,6 @@ struct ISerializable {
 };
 
 
-constexpr uintptr_t CombineU32AsPointer(uint32_t high, uint32_t low) {
-  return static_cast<uintptr_t>(high) << 32 | static_cast<uintptr_t>(low);
-}
-
-
 class IJsonizable {
  public:
   virtual ~IJsonizable() = default;
@@ -26,21 +26,37 @@ int main(int argc, char* argv[]) {
     printf("starting at wavelength: %d\n", wl.wavelength);
     simulator.SetCurrentWavelengthIndex(i);
 
+    // Every batch is saved into its own file.
+    float saving_time = 0;
     auto t0 = std::chrono::system_clock::now();
-    simulator.Run();
-    auto t1 = std::chrono::system_clock::now();
-    diff = t1 - t0;
-    printf("Ray tracing: %.2fms\n", diff.count());
+    simulator.Run([&](const SimulationRayData& ray_data) {
+      auto t2 = std::chrono::system_clock::now();
+      auto timestamp = static_cast<long long>(t2.time_since_epoch().count());
+      std::sprintf(filename, "directions_%d_%lld.bin", wl.wavelength, timestamp);
+      icehalo::File file(context->GetDataDirectory().c_str(), filename);
+      file.Open(icehalo::FileOpenMode::kWrite);
+      ray_data.Serialize(file, true);
+      file.Close();
 
-    t0 = std::chrono::system_clock::now();
-    std::sprintf(filename, "directions_%d_%lli.bin", wl.wavelength, t0.time_since_epoch().count());
-    icehalo::File file(context->GetDataDirectory().c_str(), filename);
-    file.Open(icehalo::FileOpenMode::kWrite);
-    simulator.GetSimulationRayData().Serialize(file, true);
+      // Final rays of every output layer go into their own file. They hold SimpleRayData rather than
+      // SimulationRayData, so they use their own extension and are skipped by ListDataFiles().
+      const auto& output_filter_ids = context->GetOutputFilterIds();
+      for (size_t k = 0; k < output_filter_ids.size(); k++) {
+        std::sprintf(filename, "directions_%d_%lld_filter_%d.layer", wl.wavelength, timestamp, output_filter_ids[k]);
+        icehalo::File layer_file(context->GetDataDirectory().c_str(), filename);
+        layer_file.Open(icehalo::FileOpenMode::kWrite);
+        ray_data.CollectFinalRayData(k).Serialize(layer_file, true);
+        layer_file.Close();
+      }
 
-    t1 = std::chrono::system_clock::now();
+      std::chrono::duration<float, std::ratio<1, 1000>> saving_diff = std::chrono::system_clock::now() - t2;
+      saving_time += saving_diff.count();
+    });
+    auto t1 = std::chrono::system_clock::now();
     diff = t1 - t0;
-    printf("Saving: %.2fms\n", diff.count());
+    printf("Ray tracing: %.2fms\n", diff.count() - saving_time);
+    printf("Saving: %.2fms\n", saving_time);
+    printf("Peak pool memory: %.2fMB\n", simulator.GetPeakPoolMemory() / 1048576.0);
   }
 
   auto end = std::chrono::system_clock::now();
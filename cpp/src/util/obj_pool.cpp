@@ -1,87 +1,72 @@
 #include "util/obj_pool.h"
 
+#include <algorithm>
+#include <stdexcept>
+
 #include "core/optics.h"
+#include "util/page_alloc.h"
 
 namespace icehalo {
 
-constexpr uint32_t kInvalidIndex = 0xffffffff;
+template <typename T>
+constexpr size_t ObjectPool<T>::kChunkSize;
+
+template <typename T>
+constexpr size_t ObjectPool<T>::kMaxChunkNum;
 
 
 template <typename T>
 ObjectPool<T>::~ObjectPool() {
-  for (auto seg : objects_) {
-    delete[] seg;
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    FreeArray(objects_[i].load(), kChunkSize);
   }
-  objects_.clear();
 }
 
 
 template <typename T>
 void ObjectPool<T>::Clear() {
-  next_unused_id_ = 0;
-  current_chunk_id_ = 0;
-  deserialized_chunk_size_ = 0;
+  next_unused_id_.store(0);
 }
 
 
 template <typename T>
-T* ObjectPool<T>::GetPointerFromSerializeData(T* dummy_ptr) {
-  auto combined_id = reinterpret_cast<uintptr_t>(dummy_ptr);
-  uint32_t chunk_id = (combined_id & 0xffffffff00000000) >> 32;
-  uint32_t obj_id = (combined_id & 0x00000000ffffffff);
-
-  if (deserialized_chunk_size_ == 0) {
-    return nullptr;
-  }
-  if (chunk_id == kInvalidIndex || obj_id == kInvalidIndex) {
-    return nullptr;
-  }
-
-  size_t id = chunk_id * deserialized_chunk_size_ + obj_id;
-  uint32_t this_chunk_id = id / kChunkSize;
-  uint32_t this_obj_id = id % kChunkSize;
-  if (this_chunk_id >= objects_.size()) {
-    return nullptr;
-  }
-
-  return objects_[this_chunk_id] + this_obj_id;
+size_t ObjectPool<T>::Size() const {
+  return next_unused_id_.load();
 }
 
 
 template <typename T>
-T* ObjectPool<T>::GetPointerFromSerializeData(uint32_t chunk_id, uint32_t obj_id) {
-  return GetPointerFromSerializeData(reinterpret_cast<T*>(CombineU32AsPointer(chunk_id, obj_id)));
+size_t ObjectPool<T>::GetMemoryUsage() const {
+  size_t chunk_num = 0;
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    if (objects_[i].load(std::memory_order_acquire)) {
+      chunk_num++;
+    }
+  }
+  return chunk_num * sizeof(T) * kChunkSize;
 }
 
 
 template <typename T>
-std::tuple<uint32_t, uint32_t> ObjectPool<T>::GetObjectSerializeIndex(T* obj) {
-  if (!obj) {
-    return { kInvalidIndex, kInvalidIndex };
-  }
-
-  uint32_t chunk_id = 0;
-  T* last_chunk = nullptr;
-  for (const auto& chunk : objects_) {
-    if (last_chunk && obj < chunk) {
-      return { chunk_id - 1, static_cast<uint32_t>(obj - last_chunk) };
+void ObjectPool<T>::ReleaseChunks(size_t max_bytes) {
+  auto memory = GetMemoryUsage();
+  auto used_chunk_num = (next_unused_id_.load() + kChunkSize - 1) / kChunkSize;
+  for (size_t i = kMaxChunkNum; i > used_chunk_num && memory > max_bytes; i--) {
+    T* chunk = objects_[i - 1].exchange(nullptr, std::memory_order_acq_rel);
+    if (chunk) {
+      FreeArray(chunk, kChunkSize);
+      memory -= sizeof(T) * kChunkSize;
     }
-    chunk_id++;
-    last_chunk = chunk;
-  }
-  if (last_chunk && obj < objects_.back() + kChunkSize) {
-    return { chunk_id - 1, static_cast<uint32_t>(obj - last_chunk) };
-  } else {
-    return { kInvalidIndex, kInvalidIndex };
   }
 }
 
 
 template <typename T>
 void ObjectPool<T>::Map(std::function<void(T&)> f) {
-  const std::lock_guard<std::mutex> lock(id_mutex_);
-  for (const auto& chunk : objects_) {
-    size_t chunk_size = (chunk == objects_.back() ? next_unused_id_.load() : kChunkSize);
+  size_t total_num = next_unused_id_.load();
+  for (size_t i = 0; i * kChunkSize < total_num; i++) {
+    auto* chunk = objects_[i].load(std::memory_order_acquire);
+    size_t chunk_size = std::min(total_num - i * kChunkSize, kChunkSize);
     for (size_t j = 0; j < chunk_size; j++) {
       f(chunk[j]);
     }
@@ -97,31 +82,46 @@ ObjectPool<T>* ObjectPool<T>::GetInstance() {
 
 
 template <typename T>
-ObjectPool<T>::ObjectPool() : current_chunk_id_(0), next_unused_id_(0), deserialized_chunk_size_(0) {
-  auto* pool = new T[kChunkSize];
-  objects_.emplace_back(pool);
+ObjectPool<T>::ObjectPool() : objects_(new std::atomic<T*>[kMaxChunkNum]), next_unused_id_(0) {
+  static_assert(std::is_trivially_copyable<T>::value, "Pooled objects are serialized as raw memory.");
+  static_assert(std::is_trivially_destructible<T>::value, "Pooled objects are never destructed.");
+  for (size_t i = 0; i < kMaxChunkNum; i++) {
+    objects_[i].store(nullptr);
+  }
 }
 
 
 template <typename T>
-uint32_t ObjectPool<T>::RefreshChunkIndex() {
-  auto id = next_unused_id_.fetch_add(1);
-  if (id >= kChunkSize) {
-    const std::lock_guard<std::mutex> lock(id_mutex_);
-    id = next_unused_id_;
-    if (id > kChunkSize) {
-      auto seg_size = objects_.size();
-      if (current_chunk_id_ + 1 >= seg_size) {
-        auto* curr_pool = new T[kChunkSize];
-        objects_.emplace_back(curr_pool);
-        current_chunk_id_ = seg_size;
-      } else {
-        current_chunk_id_++;
-      }
-      id = 0;
-      next_unused_id_ = 0;
+T* ObjectPool<T>::AllocateChunk() {
+  return AllocateArray<T>(kChunkSize);
+}
+
+
+// Make sure chunks holding objects [idx0, idx1) exist. A thread that loses the race frees its own chunk.
+template <typename T>
+void ObjectPool<T>::AddChunks(size_t idx0, size_t idx1) {
+  for (size_t i = idx0 / kChunkSize; i * kChunkSize < idx1; i++) {
+    if (objects_[i].load(std::memory_order_acquire)) {
+      continue;
+    }
+    T* chunk = AllocateChunk();
+    T* expected = nullptr;
+    if (!objects_[i].compare_exchange_strong(expected, chunk, std::memory_order_acq_rel)) {
+      FreeArray(chunk, kChunkSize);
     }
   }
+}
+
+
+template <typename T>
+size_t ObjectPool<T>::ReserveObjects(size_t num) {
+  auto id = next_unused_id_.load(std::memory_order_relaxed);
+  do {
+    if (num > kInvalidPoolHandle - id) {
+      throw std::overflow_error("Too many objects in pool!");
+    }
+  } while (!next_unused_id_.compare_exchange_weak(id, id + num, std::memory_order_relaxed));
+  AddChunks(id, id + num);
   return id;
 }
 
@@ -132,23 +132,20 @@ void ObjectPool<T>::Serialize(File& file, bool with_boi) const {
     file.Write(ISerializable::kDefaultBoi);
   }
 
-  size_t total_num = kChunkSize * (objects_.size() - 1) + next_unused_id_;
+  size_t total_num = next_unused_id_.load();
+  size_t obj_size = sizeof(T);
   file.Write(total_num);
-  file.Write(kChunkSize);
+  file.Write(obj_size);
 
-  for (const auto& chunk : objects_) {
-    size_t num = (chunk == objects_.back() ? next_unused_id_.load() : kChunkSize);
-    for (size_t i = 0; i < num; i++) {
-      chunk[i].Serialize(file, false);
-    }
+  for (size_t i = 0; i * kChunkSize < total_num; i++) {
+    size_t num = std::min(total_num - i * kChunkSize, kChunkSize);
+    file.Write(objects_[i].load(std::memory_order_acquire), num);
   }
 }
 
 
 template <typename T>
 void ObjectPool<T>::Deserialize(File& file, endian::Endianness endianness) {
-  const std::lock_guard<std::mutex> lock(id_mutex_);
-
   endianness = CheckEndianness(file, endianness);
   bool need_swap = (endianness != endian::kCompileEndian);
 
@@ -158,34 +155,33 @@ void ObjectPool<T>::Deserialize(File& file, endian::Endianness endianness) {
     endian::ByteSwap::Swap(&total_num);
   }
 
-  size_t chunk_size;
-  file.Read(&chunk_size);
+  size_t obj_size;
+  file.Read(&obj_size);
   if (need_swap) {
-    endian::ByteSwap::Swap(&chunk_size);
+    endian::ByteSwap::Swap(&obj_size);
   }
-  if (chunk_size == 0) {
-    throw std::invalid_argument("Chunk size is invalid!");
+  if (obj_size != sizeof(T)) {
+    throw std::invalid_argument("Object size is invalid!");
+  }
+  if (total_num > kInvalidPoolHandle) {
+    throw std::invalid_argument("Object number is invalid!");
   }
 
   Clear();
-  deserialized_chunk_size_ = chunk_size;
-  size_t chunks = total_num / kChunkSize + (total_num % kChunkSize ? 1 : 0);
-  for (current_chunk_id_ = 0; current_chunk_id_ < chunks; current_chunk_id_++) {
-    if (current_chunk_id_ >= objects_.size()) {
-      objects_.emplace_back(new T[kChunkSize]);
-    }
-    auto* chunk = objects_[current_chunk_id_];
-    size_t curr_num = kChunkSize;
-    if (current_chunk_id_ + 1 == chunks) {
-      curr_num = total_num % kChunkSize;
-    }
-    for (next_unused_id_ = 0; next_unused_id_ < curr_num; next_unused_id_++) {
-      chunk[next_unused_id_].Deserialize(file, endianness);
+  AddChunks(0, total_num);
+  for (size_t i = 0; i * kChunkSize < total_num; i++) {
+    auto* chunk = objects_[i].load(std::memory_order_acquire);
+    size_t curr_num = std::min(total_num - i * kChunkSize, kChunkSize);
+    file.Read(chunk, curr_num);
+    if (need_swap) {
+      for (size_t j = 0; j < curr_num; j++) {
+        chunk[j].SwapBytes();
+      }
     }
   }
+  next_unused_id_.store(total_num);
 }
 
-template class ObjectPool<RaySegment>;
 template class ObjectPool<RayInfo>;
 
 }  // namespace icehalo
\ No newline at end of file
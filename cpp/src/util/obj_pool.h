@@ -2,8 +2,9 @@
 #define SRC_UTIL_OBJ_POOL_H_
 
 #include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
-#include <mutex>
 #include <type_traits>
 #include <vector>
 
@@ -11,6 +12,11 @@
 
 namespace icehalo {
 
+/*! @brief Index of an object among all chunks of its pool. Pooled objects refer to each other by handles. */
+using PoolHandle = uint32_t;
+constexpr PoolHandle kInvalidPoolHandle = 0xffffffff;
+
+
 template <typename T>
 class ObjectPool : public ISerializable {
  public:
@@ -21,33 +27,64 @@ class ObjectPool : public ISerializable {
 
   template <class... Arg>
   T* GetObject(Arg&&... args) {
-    auto id = RefreshChunkIndex();
-    T* obj = objects_[current_chunk_id_] + id;
+    return GetObjectAt(ReserveObjects(1), std::forward<Arg>(args)...);
+  }
+
+  /**
+   * @brief Reserve some consecutive objects, without constructing them.
+   *
+   * It is lock-free, and can be called from multiple threads at the same time. The counter is bumped with a
+   * compare-and-swap, and missing chunks are allocated by whichever thread gets there first. Chunks are never
+   * moved, so GetObjectAt(size_t, Arg&&...) and Get() on reserved objects are safe meanwhile.
+   * Chunks are allocated by AllocateArray(), without constructing objects.
+   *
+   * @param num the number of objects to reserve.
+   * @return the index of the first reserved object. It is also the handle of that object.
+   * @throw std::overflow_error if the pool would hold more objects than PoolHandle can address.
+   */
+  size_t ReserveObjects(size_t num);
+
+  template <class... Arg>
+  T* GetObjectAt(size_t idx, Arg&&... args) {
+    T* obj = objects_[idx / kChunkSize].load(std::memory_order_acquire) + idx % kChunkSize;
     return new (obj) T(std::forward<Arg>(args)...);
   }
 
+  /*! @brief Get an object by its handle. Return nullptr for kInvalidPoolHandle. */
+  T* Get(PoolHandle h) const {
+    return h == kInvalidPoolHandle ? nullptr :
+                                     objects_[h / kChunkSize].load(std::memory_order_acquire) + h % kChunkSize;
+  }
+
   void Clear();
   void Map(std::function<void(T&)>);
 
-  T* GetPointerFromSerializeData(T* dummy_ptr);
-  T* GetPointerFromSerializeData(uint32_t chunk_id, uint32_t obj_id);
-  std::tuple<uint32_t, uint32_t> GetObjectSerializeIndex(T* obj);
+  /*! @brief The number of reserved objects. */
+  size_t Size() const;
+
+  /*! @brief Bytes taken by allocated chunks, including those kept after Clear(). */
+  size_t GetMemoryUsage() const;
+
+  /**
+   * @brief Free unused chunks, from the last one, until allocated chunks take at most max_bytes.
+   *
+   * Chunks holding reserved objects are never freed. It must not be called together with ReserveObjects().
+   */
+  void ReleaseChunks(size_t max_bytes);
 
   /**
    * @brief Serialize self to a file.
    *
-   * This class is a template class. It has only 2 instantiations, RaySegmentPool and RayInfoPool, which
-   * all implement interface ISerializable. In fact, this method will call objects'
-   * ISerializable::Serialize(File&, bool) to serialize themselves.
+   * This class is a template class. It has only 1 instantiation, RayInfoPool. The object type is trivially
+   * copyable and refers to other objects by PoolHandle only, so objects are written as raw memory, chunk by
+   * chunk, and handles stay valid after deserialization.
    *
-   * If the object contains pointers, it is necessary to call ObjectPool<T>::GetPointerFromSerializeData(T*)
-   * to get the real pointer. This could be done by calling ObjectPool<T>::Map(std::function<void(T&)>)
-   * to apply the action on every element in this pool.
+   * When the file is of different endianness, objects' SwapBytes() is called after reading.
    *
    * The file layout is:
-   * uint64,            // the number of object
-   * uint64,            // chunk size
-   * obj * N,           // the object serialization data
+   * uint64,            // the number of object, N
+   * uint64,            // object size in byte, S
+   * (byte * S) * N,    // raw object data
    *
    * @param file
    * @param with_boi
@@ -59,21 +96,16 @@ class ObjectPool : public ISerializable {
 
  private:
   ObjectPool();
-
-  uint32_t RefreshChunkIndex();
+  static T* AllocateChunk();
+  void AddChunks(size_t idx0, size_t idx1);
 
   static constexpr size_t kChunkSize = 1024 * 1024;
+  static constexpr size_t kMaxChunkNum = (kInvalidPoolHandle + kChunkSize - 1) / kChunkSize;
 
-  std::vector<T*> objects_;
-  uint32_t current_chunk_id_;
-  std::atomic<uint32_t> next_unused_id_;
-  std::mutex id_mutex_;
-  size_t deserialized_chunk_size_;
+  std::unique_ptr<std::atomic<T*>[]> objects_;  // kMaxChunkNum slots. Chunks are kept after Clear() and reused.
+  std::atomic<size_t> next_unused_id_;          // Index among all chunks.
 };
 
-struct RaySegment;
-using RaySegmentPool = ObjectPool<RaySegment>;
-
 struct RayInfo;
 using RayInfoPool = ObjectPool<RayInfo>;
 
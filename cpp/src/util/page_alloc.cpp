@@ -0,0 +1,224 @@
+#include "util/page_alloc.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+
+#ifdef OS_LINUX
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace icehalo {
+
+namespace {
+
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+bool UseMappedPages(size_t bytes) {
+#ifdef OS_LINUX
+  return bytes >= kHugePageSize && (GetPageMode() != PageMode::kDefault || GetNumaMode() != NumaMode::kDefault);
+#else
+  (void)bytes;
+  return false;
+#endif
+}
+
+
+#ifdef OS_LINUX
+size_t RoundUpToHugePage(size_t bytes) {
+  return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+
+// Map more than needed, and unmap the unaligned head and the tail, so that the array starts at a huge page.
+void* MapAlignedPages(size_t bytes, bool transparent_huge) {
+  size_t map_size = bytes + kHugePageSize;
+  void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  auto addr = reinterpret_cast<uintptr_t>(p);
+  auto aligned = (addr + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  if (aligned > addr) {
+    munmap(p, aligned - addr);
+  }
+  if (addr + map_size > aligned + bytes) {
+    munmap(reinterpret_cast<void*>(aligned + bytes), addr + map_size - aligned - bytes);
+  }
+  if (transparent_huge) {
+    madvise(reinterpret_cast<void*>(aligned), bytes, MADV_HUGEPAGE);
+  }
+  return reinterpret_cast<void*>(aligned);
+}
+
+
+void* MapExplicitHugePages(size_t bytes) {
+  void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    return p;
+  }
+
+  static std::atomic<bool> warned{ false };
+  if (!warned.exchange(true)) {
+    std::fprintf(stderr, "WARNING! Cannot map explicit huge pages. Use transparent huge pages instead.\n");
+  }
+  return MapAlignedPages(bytes, true);
+}
+
+
+// Nodes this process may allocate memory on. glibc has no wrapper of get_mempolicy() and mbind(), and libnuma is
+// not required, so they are called by syscall().
+constexpr int kMaxNumaNodes = 1024;
+constexpr int kBitsPerMaskWord = 8 * sizeof(unsigned long);
+
+struct NumaNodeMask {
+  unsigned long bits[kMaxNumaNodes / kBitsPerMaskWord];
+  int node_num;
+};
+
+
+const NumaNodeMask& GetAllowedNumaNodes() {
+  static const NumaNodeMask kMask = [] {
+    NumaNodeMask mask{};
+    if (syscall(SYS_get_mempolicy, nullptr, mask.bits, kMaxNumaNodes, nullptr, MPOL_F_MEMS_ALLOWED) != 0) {
+      return NumaNodeMask{};
+    }
+    for (auto word : mask.bits) {
+      mask.node_num += __builtin_popcountl(word);
+    }
+    return mask;
+  }();
+  return kMask;
+}
+
+
+// Pages are not touched yet, so the policy applies to all of them.
+void ApplyNumaMode(void* ptr, size_t bytes) {
+  if (GetNumaMode() != NumaMode::kInterleave) {
+    return;
+  }
+  const auto& nodes = GetAllowedNumaNodes();
+  if (nodes.node_num < 2) {
+    return;
+  }
+
+  // The kernel reads maxnode - 1 bits of the mask.
+  if (syscall(SYS_mbind, ptr, bytes, MPOL_INTERLEAVE, nodes.bits, kMaxNumaNodes + 1, 0) != 0) {
+    static std::atomic<bool> warned{ false };
+    if (!warned.exchange(true)) {
+      std::fprintf(stderr, "WARNING! Cannot interleave pages on NUMA nodes. Use default policy instead.\n");
+    }
+  }
+}
+#endif
+
+}  // namespace
+
+
+PageMode GetPageMode() {
+  static const PageMode kMode = [] {
+    const char* name = std::getenv("ICEHALO_PAGE_MODE");
+    if (name == nullptr || name[0] == '\0') {
+      return PageMode::kDefault;
+    }
+
+    for (auto mode : { PageMode::kDefault, PageMode::kTransparentHuge, PageMode::kExplicitHuge }) {
+      if (std::strcmp(name, GetPageModeName(mode)) == 0) {
+        return mode;
+      }
+    }
+    std::fprintf(stderr, "WARNING! Unknown ICEHALO_PAGE_MODE %s. Use %s instead.\n", name,
+                 GetPageModeName(PageMode::kDefault));
+    return PageMode::kDefault;
+  }();
+  return kMode;
+}
+
+
+NumaMode GetNumaMode() {
+  static const NumaMode kMode = [] {
+    const char* name = std::getenv("ICEHALO_NUMA_MODE");
+    if (name == nullptr || name[0] == '\0') {
+      return NumaMode::kDefault;
+    }
+
+    for (auto mode : { NumaMode::kDefault, NumaMode::kInterleave }) {
+      if (std::strcmp(name, GetNumaModeName(mode)) == 0) {
+        return mode;
+      }
+    }
+    std::fprintf(stderr, "WARNING! Unknown ICEHALO_NUMA_MODE %s. Use %s instead.\n", name,
+                 GetNumaModeName(NumaMode::kDefault));
+    return NumaMode::kDefault;
+  }();
+  return kMode;
+}
+
+
+const char* GetPageModeName(PageMode mode) {
+  switch (mode) {
+    case PageMode::kDefault:
+      return "default";
+    case PageMode::kTransparentHuge:
+      return "thp";
+    case PageMode::kExplicitHuge:
+      return "hugetlb";
+  }
+  return "";
+}
+
+
+const char* GetNumaModeName(NumaMode mode) {
+  switch (mode) {
+    case NumaMode::kDefault:
+      return "default";
+    case NumaMode::kInterleave:
+      return "interleave";
+  }
+  return "";
+}
+
+
+void* AllocatePages(size_t bytes) {
+  if (bytes == 0) {
+    return nullptr;
+  }
+  if (!UseMappedPages(bytes)) {
+    return ::operator new(bytes);
+  }
+
+#ifdef OS_LINUX
+  bytes = RoundUpToHugePage(bytes);
+  auto page_mode = GetPageMode();
+  void* p = page_mode == PageMode::kExplicitHuge ? MapExplicitHugePages(bytes) :
+                                                   MapAlignedPages(bytes, page_mode == PageMode::kTransparentHuge);
+  ApplyNumaMode(p, bytes);
+  return p;
+#else
+  return nullptr;
+#endif
+}
+
+
+void FreePages(void* ptr, size_t bytes) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (!UseMappedPages(bytes)) {
+    ::operator delete(ptr);
+    return;
+  }
+
+#ifdef OS_LINUX
+  munmap(ptr, RoundUpToHugePage(bytes));
+#endif
+}
+
+}  // namespace icehalo
@@ -0,0 +1,73 @@
+#ifndef SRC_UTIL_PAGE_ALLOC_H_
+#define SRC_UTIL_PAGE_ALLOC_H_
+
+#include <cstddef>
+
+namespace icehalo {
+
+/*! @brief How large arrays (trace buffers, pool chunks) are backed by memory pages. */
+enum class PageMode {
+  kDefault,          // Plain operator new
+  kTransparentHuge,  // mmap, aligned to huge pages, with madvise(MADV_HUGEPAGE)
+  kExplicitHuge,     // mmap with MAP_HUGETLB. Falls back to kTransparentHuge if no huge page is reserved.
+};
+
+
+/*! @brief How pages of large arrays are placed on NUMA nodes. */
+enum class NumaMode {
+  kDefault,     // Policy of the process, usually the node of the thread that first touches a page
+  kInterleave,  // mbind(MPOL_INTERLEAVE) over all allowed nodes
+};
+
+
+/**
+ * @brief Page mode used by AllocatePages().
+ *
+ * It is read once from environment variable ICEHALO_PAGE_MODE, which is one of GetPageModeName(). Default is
+ * kDefault. Huge pages are only available on Linux, and kDefault is always used on other systems.
+ */
+PageMode GetPageMode();
+const char* GetPageModeName(PageMode mode);
+
+
+/**
+ * @brief NUMA mode used by AllocatePages().
+ *
+ * It is read once from environment variable ICEHALO_NUMA_MODE, which is one of GetNumaModeName(). Default is
+ * kDefault. Worker threads are not bound to nodes, so a range of a trace buffer is not always traced on the node
+ * that first touched it. kInterleave spreads pages over all nodes instead, so that no single node serves all
+ * threads. It is only available on Linux, and is ignored if there is only one node.
+ */
+NumaMode GetNumaMode();
+const char* GetNumaModeName(NumaMode mode);
+
+
+/**
+ * @brief Allocate uninitialized memory for a large array.
+ *
+ * Arrays smaller than a huge page always use operator new. Larger ones are mapped if GetPageMode() or
+ * GetNumaMode() is not kDefault.
+ *
+ * @param bytes
+ * @return nullptr if bytes is 0.
+ * @throw std::bad_alloc if memory can not be allocated.
+ */
+void* AllocatePages(size_t bytes);
+
+/*! @brief Free memory from AllocatePages(). bytes must be the same as allocated. */
+void FreePages(void* ptr, size_t bytes);
+
+
+template <class T>
+T* AllocateArray(size_t num) {
+  return static_cast<T*>(AllocatePages(sizeof(T) * num));
+}
+
+template <class T>
+void FreeArray(T* ptr, size_t num) {
+  FreePages(ptr, sizeof(T) * num);
+}
+
+}  // namespace icehalo
+
+#endif  // SRC_UTIL_PAGE_ALLOC_H_
@@ -41,6 +41,12 @@ void ThreadingPool::AddJob(std::function<void()> job) {
     return;
   }
 
+  {
+    // Count the job as running as soon as it is queued, otherwise WaitFinish() may see an empty queue and no running
+    // jobs in the gap between a worker taking the job and starting it.
+    std::lock_guard<std::mutex> lk(task_mutex_);
+    running_jobs_ += 1;
+  }
   {
     std::lock_guard<std::mutex> lock(queue_mutex_);
     queue_.emplace(std::move(job));
@@ -50,7 +56,11 @@ void ThreadingPool::AddJob(std::function<void()> job) {
 
 
 void ThreadingPool::AddRangeBasedJobs(size_t num, const std::function<void(size_t, size_t)>& job) {
-  auto step = std::max(num / 100, static_cast<size_t>(10));
+  AddRangeBasedJobs(num, GetRangeStep(num), job);
+}
+
+
+void ThreadingPool::AddRangeBasedJobs(size_t num, size_t step, const std::function<void(size_t, size_t)>& job) {
   for (size_t i = 0; i < num; i += step) {
     auto current_num = std::min(num - i, step);
     size_t start_idx = i;
@@ -60,6 +70,11 @@ void ThreadingPool::AddRangeBasedJobs(size_t num, const std::function<void(size_
 }
 
 
+size_t ThreadingPool::GetRangeStep(size_t num) {
+  return std::max(num / 100, static_cast<size_t>(10));
+}
+
+
 void ThreadingPool::WaitFinish() {
   std::unique_lock<std::mutex> lock(task_mutex_);
   task_condition_.wait(lock, [=] { return !IsTaskRunning(); });
@@ -67,7 +82,7 @@ void ThreadingPool::WaitFinish() {
 
 
 bool ThreadingPool::IsTaskRunning() {
-  return running_jobs_ > 0 || !queue_.empty();
+  return running_jobs_ > 0;
 }
 
 
@@ -78,17 +93,13 @@ void ThreadingPool::WorkingFunction() {
       std::function<void()> job = queue_.front();
       queue_.pop();
       lock.unlock();
-      {
-        std::lock_guard<std::mutex> lk(task_mutex_);
-        running_jobs_ += 1;
-      }
       job();
       {
         std::lock_guard<std::mutex> lk(task_mutex_);
         running_jobs_ -= 1;
       }
+      task_condition_.notify_all();
       lock.lock();
-      task_condition_.notify_one();
     } else if (!alive_) {
       alive_threads_ -= 1;
       task_condition_.notify_one();
@@ -19,11 +19,15 @@ class ThreadingPool {
   void Start();
   void AddJob(std::function<void()> job);
   void AddRangeBasedJobs(size_t size, const std::function<void(size_t start_idx, size_t end_idx)>& job);
+  void AddRangeBasedJobs(size_t size, size_t step, const std::function<void(size_t start_idx, size_t end_idx)>& job);
   void WaitFinish();
   bool IsTaskRunning();
 
   static ThreadingPool* GetInstance();
 
+  /*! @brief Get the range size used by AddRangeBasedJobs(). It only depends on the total size. */
+  static size_t GetRangeStep(size_t size);
+
  private:
   explicit ThreadingPool(size_t num = 1);
 
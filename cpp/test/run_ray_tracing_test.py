@@ -2,6 +2,7 @@
 # -*- coding: UTF-8 -*-
 
 from argparse import ArgumentParser
+import re
 import sys
 import subprocess
 import logging
@@ -9,7 +10,28 @@ import logging
 
 logging.basicConfig(format='%(asctime)s [%(levelname)s]: %(message)s', level=logging.DEBUG)
 
-def main(exe: str, config: str, ref: str):
+
+def match_line(ref_line: str, cur_line: str, tol: float) -> bool:
+    """Numbers match within tol, and other tokens match exactly.
+
+    Kernels of different SIMD levels (e.g. with or without FMA, sqrt or rsqrt) round differently, so results may
+    differ in the last printed digit depending on the CPU.
+    """
+    ref_tokens = re.split(r'[\s,]+', ref_line.strip())
+    cur_tokens = re.split(r'[\s,]+', cur_line.strip())
+    if len(ref_tokens) != len(cur_tokens):
+        return False
+    for t1, t2 in zip(ref_tokens, cur_tokens):
+        try:
+            if abs(float(t1) - float(t2)) > tol:
+                return False
+        except ValueError:
+            if t1 != t2:
+                return False
+    return True
+
+
+def main(exe: str, config: str, ref: str, tol: float):
     res = subprocess.run(f'"{exe}" "{config}" > tmp.log', timeout=2, shell=True, capture_output=True)
     res.check_returncode()
 
@@ -22,7 +44,7 @@ def main(exe: str, config: str, ref: str):
                 continue
             if line1.startswith('Total:'):
                 continue
-            if line1.strip() != line2.strip():
+            if not match_line(line1, line2, tol):
                 logging.warning(f'Log file does not match at line {read_lines}!')
                 logging.warning(f'ref: {line1}')
                 logging.warning(f'cur: {line2}')
@@ -33,10 +55,11 @@ if __name__ == '__main__':
     parser.add_argument('--exe', required=True, help='the path to executable', type=str)
     parser.add_argument('--config', required=True, help='the path to configuration file', type=str)
     parser.add_argument('--ref', required=True, help='the reference file', type=str)
+    parser.add_argument('--tol', default=2e-4, help='tolerance of numbers', type=float)
     args = parser.parse_args(sys.argv[1:])
 
     try:
-        main(args.exe, args.config, args.ref)
+        main(args.exe, args.config, args.ref, args.tol)
     except subprocess.CalledProcessError as e:
         logging.error(f'Exit with non-zero code: {e.returncode}')
         logging.error(e.stderr)
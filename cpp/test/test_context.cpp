@@ -37,7 +37,8 @@ TEST_F(ContextTest, FillSunDir) {
 
   constexpr int kRayNum = 200;
   float dir[3 * kRayNum];
-  icehalo::math::RandomSampler::SampleSphericalPointsCart(sun_dir, sun_d / 2, dir, kRayNum);
+  icehalo::math::RandomNumberGenerator rng;
+  icehalo::math::RandomSampler::SampleSphericalPointsCart(&rng, sun_dir, sun_d / 2, dir, kRayNum);
 
   for (int i = 0; i < kRayNum; i++) {
     float a = icehalo::math::Dot3(sun_dir, dir + i * 3);  // In rad
@@ -1,8 +1,10 @@
 #include <algorithm>
+#include <cstdint>
 #include <vector>
 
 #include "core/crystal.h"
 #include "core/mymath.h"
+#include "core/optics.h"
 #include "gtest/gtest.h"
 
 namespace {
@@ -287,4 +289,113 @@ TEST_F(CrystalTest, IrregularHexPrismVertex1) {
   CheckCrystal(c1, c2);
 }
 
+
+TEST_F(CrystalTest, Convex) {
+  using icehalo::math::kSqrt3;
+
+  auto c = icehalo::Crystal::CreateHexPrism(1.2f);
+  EXPECT_TRUE(c->IsConvex());
+  EXPECT_EQ(c->TotalPlanes(), 8);
+  int plane_face_num = 0;
+  for (const auto& faces : c->GetPlaneFaces()) {
+    for (auto f : faces) {
+      EXPECT_EQ(c->FaceNumber(f), c->FaceNumber(faces[0]));
+    }
+    plane_face_num += static_cast<int>(faces.size());
+  }
+  EXPECT_EQ(plane_face_num, c->TotalFaces());
+
+  c = icehalo::Crystal::CreateHexPyramid(1, 1, 2, 3, 0.2f, 1.2f, 0.3f);
+  EXPECT_TRUE(c->IsConvex());
+
+  c = icehalo::Crystal::CreateHexPyramid(0.2f, 0.0f, 0.5f);  // Sliver triangles of zero height segment are ignored.
+  EXPECT_TRUE(c->IsConvex());
+  EXPECT_EQ(c->TotalPlanes(), 14);
+
+  float dist[6] = { 1.0f, 1.0f, 1.5f, 1.0f, 2.5f, 1.0f };
+  c = icehalo::Crystal::CreateIrregularHexPrism(dist, 1.2f);
+  EXPECT_TRUE(c->IsConvex());
+
+  // A prism with one dented side.
+  float h = 1.2f;
+  // clang-format off
+  std::vector<icehalo::math::Vec3f> pts {
+    {  kSqrt3 / 2, -0.5f,  h },
+    {  kSqrt3 / 2,  0.5f,  h },
+    {        0.0f,  0.2f,  h },
+    { -kSqrt3 / 2,  1.0f,  h },
+    { -kSqrt3 / 2, -1.5f,  h },
+    {  kSqrt3 / 2, -0.5f, -h },
+    {  kSqrt3 / 2,  0.5f, -h },
+    {        0.0f,  0.2f, -h },
+    { -kSqrt3 / 2,  1.0f, -h },
+    { -kSqrt3 / 2, -1.5f, -h },
+  };
+  std::vector<icehalo::math::TriangleIdx> faces {
+    { 0, 1, 2 }, { 0, 2, 4 }, { 2, 3, 4 },
+    { 0, 6, 1 }, { 0, 5, 6 },
+    { 1, 7, 2 }, { 1, 6, 7 },
+    { 2, 8, 3 }, { 2, 7, 8 },
+    { 3, 9, 4 }, { 3, 8, 9 },
+    { 4, 5, 0 }, { 4, 9, 5 },
+    { 5, 7, 6 }, { 5, 9, 7 }, { 7, 9, 8 },
+  };
+  // clang-format on
+  c = icehalo::Crystal::CreateCustomCrystal(pts, faces);
+  EXPECT_FALSE(c->IsConvex());
+}
+
+
+TEST_F(CrystalTest, FaceData) {
+  auto c = icehalo::Crystal::CreateHexPyramid(0.2f, 1.2f, 0.3f);
+  auto face_num = c->TotalFaces();
+  std::vector<float> expect_data(face_num * icehalo::Optics::kPacketFaceDataSize);
+  icehalo::Optics::FillPacketFaceData(face_num, c->GetFaceBaseVector(), c->GetFaceVertex(), c->GetFaceNorm(),
+                                      expect_data.data());
+
+  const float* face_data = c->GetFaceData();
+  ASSERT_NE(face_data, nullptr);
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(face_data) % 16, 0u);
+  EXPECT_EQ(icehalo::Optics::kPacketFaceDataSize % 4, 0);
+  EXPECT_EQ(std::vector<float>(face_data, face_data + expect_data.size()), expect_data);
+}
+
+
+TEST_F(CrystalTest, CandidatePlanes) {
+  icehalo::CrystalPtrU crystals[]{
+    icehalo::Crystal::CreateHexPrism(1.2f),
+    icehalo::Crystal::CreateHexPyramid(0.2f, 1.2f, 0.3f),
+    icehalo::Crystal::CreateCubicPyramid(0.2f, 0.3f),
+  };
+
+  // Every plane that a ray may hit must be a candidate.
+  icehalo::math::RandomNumberGenerator rng;
+  for (const auto& c : crystals) {
+    ASSERT_TRUE(c->IsConvex());
+    int candidate_num = 0;
+    int plane_num = c->TotalPlanes();
+    constexpr int kDirNum = 2000;
+    for (int i = 0; i < kDirNum; i++) {
+      float dir[3]{ rng.GetGaussian(), rng.GetGaussian(), rng.GetGaussian() };
+      icehalo::math::Normalize3(dir);
+      int face_id = static_cast<int>(rng.GetUint32() % c->TotalFaces());
+      float dn_in = icehalo::math::Dot3(dir, c->GetFaceNorm() + face_id * 3);
+
+      int bin = icehalo::Crystal::GetDirBin(dir);
+      ASSERT_GE(bin, 0);
+      ASSERT_LT(bin, icehalo::Crystal::kDirBinNum);
+
+      auto mask = c->GetCandidatePlanes(dir, face_id);
+      for (int j = 0; j < plane_num; j++) {
+        float dn = icehalo::math::Dot3(dir, c->GetPlaneNorm() + j * 3);
+        if (dn * dn_in < 0) {
+          EXPECT_TRUE((mask >> j) & 1);
+        }
+        candidate_num += (mask >> j) & 1;
+      }
+    }
+    EXPECT_LT(candidate_num, kDirNum * plane_num * 3 / 4);  // Much fewer than all planes
+  }
+}
+
 }  // namespace
@@ -0,0 +1,108 @@
+#include <vector>
+
+#include "core/crystal.h"
+#include "core/filter.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class FilterTest : public ::testing::Test {};
+
+
+TEST_F(FilterTest, IncrementalRayPathHash) {
+  std::vector<uint16_t> ray_path{ 3, 1, 5, 7, 2, 4, 8, 6, 1, 3, 5, 2 };
+
+  size_t hash = 0;
+  std::vector<uint16_t> curr_path;
+  for (size_t i = 0; i < ray_path.size(); i++) {
+    hash ^= icehalo::RayPathHashItem(ray_path[i], i);
+    curr_path.emplace_back(ray_path[i]);
+    EXPECT_EQ(hash, icehalo::RayPathHash(curr_path));
+  }
+
+  std::vector<uint16_t> reversed_path(ray_path.rbegin(), ray_path.rend());
+  EXPECT_EQ(icehalo::RayPathHash(reversed_path, true), hash);
+}
+
+
+TEST_F(FilterTest, RayPathCode) {
+  icehalo::RayPathCode code{};
+  int fn[]{ 3, 1, 25, 7, 2, 44, 8, 6, 1, 13 };
+  for (int i = 0; i < 10; i++) {
+    code.Set(i, fn[i]);
+  }
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(code.Get(i), static_cast<unsigned int>(fn[i]));
+  }
+  EXPECT_FALSE(code.HasUnknownFace(10));
+
+  code.Set(9, -1);
+  EXPECT_EQ(code.Get(9), icehalo::RayPathCode::kUnknownFaceNumber);
+  EXPECT_EQ(code.Get(8), 1u);
+  EXPECT_FALSE(code.HasUnknownFace(9));
+  EXPECT_TRUE(code.HasUnknownFace(10));
+}
+
+
+TEST_F(FilterTest, SpecificPathPrefix) {
+  auto crystal = icehalo::Crystal::CreateHexPrism(1.2f);
+  icehalo::SpecificRayPathFilter filter;
+  filter.AddPath({ 3, 5, 1 });
+  filter.ApplySymmetry(crystal.get());
+  EXPECT_TRUE(filter.CanPruneRays(crystal.get()));
+
+  const auto* automaton = filter.GetPathAutomaton();
+  ASSERT_NE(automaton, nullptr);
+  auto can_go_further = [=](const std::vector<int>& path) {
+    int state = icehalo::RayPathAutomaton::kInitState;
+    for (auto fn : path) {
+      state = automaton->Next(state, fn);
+    }
+    return automaton->CanGoFurther(state);
+  };
+  EXPECT_TRUE(can_go_further({ 3 }));
+  EXPECT_TRUE(can_go_further({ 3, 5 }));
+  EXPECT_FALSE(can_go_further({ 4 }));
+  EXPECT_FALSE(can_go_further({ 3, 6 }));
+  EXPECT_FALSE(can_go_further({ 3, 5, 1 }));  // Cannot go further.
+
+  filter.AddSymmetry(icehalo::kSymmetryPrism);
+  filter.ApplySymmetry(crystal.get());
+  EXPECT_TRUE(can_go_further({ 4, 6 }));
+
+  filter.EnableComplementary(true);
+  EXPECT_FALSE(filter.CanPruneRays(crystal.get()));
+}
+
+
+TEST_F(FilterTest, SpecificMatchedPath) {
+  auto crystal = icehalo::Crystal::CreateHexPrism(1.2f);
+  icehalo::SpecificRayPathFilter filter;
+  filter.AddPath({ 3, 5 });
+  filter.AddPath({ 1, 3 });
+  filter.AddPath({ 3, 5, 7 });
+  filter.SetSymmetryFlag(icehalo::kSymmetryPrism | icehalo::kSymmetryBasal | icehalo::kSymmetryDirection);
+  filter.ApplySymmetry(crystal.get());
+
+  auto matched_path = [&](const std::vector<int>& path) {
+    icehalo::RayPathInfo ray_path;
+    ray_path.hit_num = static_cast<int>(path.size()) + 1;
+    for (size_t i = 0; i < path.size(); i++) {
+      ray_path.path_code.Set(static_cast<int>(i), path[i]);
+    }
+    ray_path.path_state = filter.GetPathAutomaton()->Run(ray_path.path_code, static_cast<int>(path.size()));
+    return filter.GetMatchedPath(ray_path);
+  };
+  EXPECT_EQ(matched_path({ 3, 5 }), 0);
+  EXPECT_EQ(matched_path({ 4, 6 }), 0);  // P
+  EXPECT_EQ(matched_path({ 6, 4 }), 0);  // D
+  EXPECT_EQ(matched_path({ 1, 3 }), 1);
+  EXPECT_EQ(matched_path({ 2, 8 }), 1);  // B and P
+  EXPECT_EQ(matched_path({ 3, 5, 7 }), 2);
+  EXPECT_EQ(matched_path({ 3 }), -1);
+  EXPECT_EQ(matched_path({ 3, 4 }), -1);
+  EXPECT_EQ(matched_path({ 3, 5, 7, 3 }), -1);
+  EXPECT_EQ(matched_path({ 3, -1 }), -1);
+}
+
+}  // namespace
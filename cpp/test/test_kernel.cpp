@@ -0,0 +1,165 @@
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include "core/crystal.h"
+#include "core/kernel.h"
+#include "core/mymath.h"
+#include "core/optics.h"
+#include "core/render.h"
+#include "gtest/gtest.h"
+#include "test_util.h"
+
+namespace {
+
+class KernelTest : public ::testing::Test {
+ protected:
+  void SetUp() override { crystal_ = icehalo::Crystal::CreateHexPrism(1.2f); }
+
+  // A packet of lines starting from random points on random faces, and going into crystal.
+  void GeneratePacket(float* pt, float* dir, int* face_id) {
+    constexpr int kN = icehalo::Optics::kPacketSize;
+    auto face_num = crystal_->TotalFaces();
+    for (int k = 0; k < kN; k++) {
+      face_id[k] = static_cast<int>(rng_.GetUint32() % face_num);
+      float p[3];
+      float d[3];
+      icehalo::test::GeneratePointOnFace(crystal_.get(), face_id[k], &rng_, p);
+      icehalo::test::GenerateDirIntoFace(crystal_.get(), face_id[k], &rng_, d);
+      for (int j = 0; j < 3; j++) {
+        pt[j * kN + k] = p[j];
+        dir[j * kN + k] = d[j];
+      }
+    }
+  }
+
+  icehalo::CrystalPtrU crystal_;
+  icehalo::math::RandomNumberGenerator rng_;
+};
+
+
+TEST_F(KernelTest, Level) {
+  EXPECT_LE(icehalo::GetSimdLevel(), icehalo::GetMaxSimdLevel());
+  EXPECT_EQ(icehalo::GetKernels().level, icehalo::GetSimdLevel());
+  for (auto level : { icehalo::SimdLevel::kScalar, icehalo::SimdLevel::kSse4, icehalo::SimdLevel::kAvx2,
+                      icehalo::SimdLevel::kAvx512 }) {
+    EXPECT_EQ(icehalo::GetKernels(level).level, level);
+  }
+
+  const char* name = std::getenv("ICEHALO_SIMD_LEVEL");
+  if (name == nullptr || name[0] == '\0') {
+    EXPECT_EQ(icehalo::GetSimdLevel(), icehalo::GetMaxSimdLevel());
+  }
+}
+
+
+// Kernels of every level supported by CPU give the same results as scalar ones, except for rounding errors.
+TEST_F(KernelTest, SameResultsOnAllLevels) {
+  constexpr int kN = icehalo::Optics::kPacketSize;
+  constexpr int kPacketNum = 64;
+  const float kHitSurfaceTolerance = icehalo::Optics::kHitSurfaceUlp * std::numeric_limits<float>::epsilon();
+  const float kFresnelTolerance = 1e-5f;
+  icehalo::FresnelTable fresnel(1.31f, kFresnelTolerance);
+
+  auto face_num = crystal_->TotalFaces();
+  std::vector<float> face_data(face_num * icehalo::Optics::kPacketFaceDataSize);
+  icehalo::Optics::FillPacketFaceData(face_num, crystal_->GetFaceBaseVector(), crystal_->GetFaceVertex(),
+                                      crystal_->GetFaceNorm(), face_data.data());
+
+  float pt[kN * 3];
+  float dir[kN * 3];
+  float norm[kN * 3];
+  float w[kN];
+  int face_id[kN];
+  uint64_t plane_mask[kN];
+  float cam_rot[3]{ 30.0f, 40.0f, 5.0f };
+  float dir4[kN * 4];  // x, y, z, w, as in simulation results
+
+  const auto& scalar_kernels = icehalo::GetKernels(icehalo::SimdLevel::kScalar);
+  for (int i = 0; i < kPacketNum; i++) {
+    GeneratePacket(pt, dir, face_id);
+    for (int k = 0; k < kN; k++) {
+      for (int j = 0; j < 3; j++) {
+        norm[j * kN + k] = crystal_->GetFaceNorm()[face_id[k] * 3 + j];
+        dir4[k * 4 + j] = dir[j * kN + k];
+      }
+      plane_mask[k] = crystal_->GetCandidatePlanes(dir4 + k * 4, face_id[k]);
+      w[k] = rng_.GetUniform();
+      dir4[k * 4 + 3] = w[k];
+    }
+
+    float t0[kN];
+    int idx0[kN];
+    float t1[kN];
+    int idx1[kN];
+    float plane_t0[kN];
+    int plane_idx0[kN];
+    float dir_out0[kN * 6];
+    float w_out0[kN * 2];
+    float table_dir_out0[kN * 6];
+    float table_w_out0[kN * 2];
+    float rot0[kN * 3];
+    int xy0[kN * 2];
+    scalar_kernels.intersect_lines_with_triangles_packet(pt, dir, face_id, face_num, face_data.data(), t0, idx0);
+    scalar_kernels.intersect_lines_with_planes_packet(pt, dir, face_id, crystal_->GetFaceNorm(),
+                                                      crystal_->TotalPlanes(), crystal_->GetPlaneNorm(),
+                                                      crystal_->GetPlaneDist(), plane_mask, plane_t0, plane_idx0);
+    scalar_kernels.hit_surface_packet(1.31f, nullptr, dir, norm, w, dir_out0, dir_out0 + kN * 3, w_out0, w_out0 + kN);
+    scalar_kernels.hit_surface_packet(1.31f, &fresnel, dir, norm, w, table_dir_out0, table_dir_out0 + kN * 3,
+                                      table_w_out0, table_w_out0 + kN);
+    scalar_kernels.rotate_z_with_data_step(cam_rot, dir4, rot0, 4, 3, kN);
+    scalar_kernels.equal_area_fish_eye(cam_rot, 60.0f, kN, dir4, 400, 300, xy0, icehalo::VisibleRange::kFull);
+
+    for (auto level : { icehalo::SimdLevel::kSse4, icehalo::SimdLevel::kAvx2, icehalo::SimdLevel::kAvx512 }) {
+      if (level > icehalo::GetMaxSimdLevel()) {
+        continue;
+      }
+      const auto& kernels = icehalo::GetKernels(level);
+      kernels.intersect_lines_with_triangles_packet(pt, dir, face_id, face_num, face_data.data(), t1, idx1);
+      for (int k = 0; k < kN; k++) {
+        EXPECT_EQ(idx1[k], idx0[k]);
+        EXPECT_NEAR(t1[k], t0[k], 1e-4f);
+      }
+
+      kernels.intersect_lines_with_planes_packet(pt, dir, face_id, crystal_->GetFaceNorm(), crystal_->TotalPlanes(),
+                                                 crystal_->GetPlaneNorm(), crystal_->GetPlaneDist(), plane_mask, t1,
+                                                 idx1);
+      for (int k = 0; k < kN; k++) {
+        EXPECT_EQ(idx1[k], plane_idx0[k]);
+        EXPECT_NEAR(t1[k], plane_t0[k], 1e-4f);
+      }
+
+      float dir_out1[kN * 6];
+      float w_out1[kN * 2];
+      kernels.hit_surface_packet(1.31f, nullptr, dir, norm, w, dir_out1, dir_out1 + kN * 3, w_out1, w_out1 + kN);
+      for (int k = 0; k < kN * 6; k++) {
+        EXPECT_NEAR(dir_out1[k], dir_out0[k], kHitSurfaceTolerance);
+      }
+      for (int k = 0; k < kN * 2; k++) {
+        EXPECT_NEAR(w_out1[k], w_out0[k], kHitSurfaceTolerance);
+      }
+
+      kernels.hit_surface_packet(1.31f, &fresnel, dir, norm, w, dir_out1, dir_out1 + kN * 3, w_out1, w_out1 + kN);
+      for (int k = 0; k < kN * 6; k++) {
+        EXPECT_NEAR(dir_out1[k], table_dir_out0[k], kHitSurfaceTolerance);
+      }
+      for (int k = 0; k < kN * 2; k++) {
+        EXPECT_NEAR(w_out1[k], table_w_out0[k], kFresnelTolerance);  // Table index follows the rounded cosine
+      }
+
+      float rot1[kN * 3];
+      kernels.rotate_z_with_data_step(cam_rot, dir4, rot1, 4, 3, kN);
+      for (int k = 0; k < kN * 3; k++) {
+        EXPECT_NEAR(rot1[k], rot0[k], 1e-6f);
+      }
+
+      int xy1[kN * 2];
+      kernels.equal_area_fish_eye(cam_rot, 60.0f, kN, dir4, 400, 300, xy1, icehalo::VisibleRange::kFull);
+      for (int k = 0; k < kN * 2; k++) {
+        EXPECT_NEAR(xy1[k], xy0[k], 1);  // Rounding to pixel may differ
+      }
+    }
+  }
+}
+
+}  // namespace
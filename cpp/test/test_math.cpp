@@ -0,0 +1,84 @@
+#include <cmath>
+#include <cstdint>
+
+#include "core/mymath.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class MathTest : public ::testing::Test {};
+
+
+TEST_F(MathTest, RandomNumberKnownAnswer) {
+  // Known answer of Philox4x32-10, with zero key and zero counter.
+  icehalo::math::RandomNumberGenerator rng(0, 0);
+  uint32_t expect[4]{ 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 };
+  for (const auto& e : expect) {
+    EXPECT_EQ(rng.GetUint32(), e);
+  }
+}
+
+
+TEST_F(MathTest, RandomNumberStream) {
+  constexpr int kNum = 1000;
+  constexpr uint64_t kKey = 12345;
+
+  icehalo::math::RandomNumberGenerator rng0(kKey, 7);
+  icehalo::math::RandomNumberGenerator rng1(kKey, 7);
+  icehalo::math::RandomNumberGenerator rng2(kKey, 8);
+  icehalo::math::RandomNumberGenerator rng3(kKey + 1, 7);
+
+  int diff_stream = 0;
+  int diff_key = 0;
+  for (int i = 0; i < kNum; i++) {
+    auto v0 = rng0.GetUint32();
+    EXPECT_EQ(v0, rng1.GetUint32());  // Same key and stream, same sequence.
+    diff_stream += (v0 != rng2.GetUint32());
+    diff_key += (v0 != rng3.GetUint32());
+  }
+  EXPECT_GT(diff_stream, kNum * 9 / 10);
+  EXPECT_GT(diff_key, kNum * 9 / 10);
+}
+
+
+TEST_F(MathTest, RandomNumberDistribution) {
+  constexpr int kNum = 100000;
+  icehalo::math::RandomNumberGenerator rng(icehalo::math::RandomNumberGenerator::MakeKey(1, 0), 0);
+
+  double sum_u = 0;
+  double sum_g = 0;
+  double sum_g2 = 0;
+  for (int i = 0; i < kNum; i++) {
+    float u = rng.GetUniform();
+    ASSERT_GE(u, 0.0f);
+    ASSERT_LT(u, 1.0f);
+    sum_u += u;
+
+    float g = rng.GetGaussian();
+    ASSERT_TRUE(std::isfinite(g));
+    sum_g += g;
+    sum_g2 += g * g;
+  }
+  EXPECT_NEAR(sum_u / kNum, 0.5, 5e-3);
+  EXPECT_NEAR(sum_g / kNum, 0.0, 1e-2);
+  EXPECT_NEAR(sum_g2 / kNum, 1.0, 2e-2);
+}
+
+
+TEST_F(MathTest, SampleIntRange) {
+  icehalo::math::RandomNumberGenerator rng(icehalo::math::RandomNumberGenerator::MakeKey(1, 1), 0);
+  float p[4]{ 0.1f, 0.2f, 0.3f, 0.4f };
+  int count[4]{};
+  constexpr int kNum = 100000;
+  for (int i = 0; i < kNum; i++) {
+    int k = icehalo::math::RandomSampler::SampleInt(&rng, p, 4);
+    ASSERT_GE(k, 0);
+    ASSERT_LT(k, 4);
+    count[k]++;
+  }
+  for (int i = 0; i < 4; i++) {
+    EXPECT_NEAR(count[i] * 1.0 / kNum, p[i], 1e-2);
+  }
+}
+
+}  // namespace
@@ -1,7 +1,14 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
 #include "core/crystal.h"
 #include "core/optics.h"
 #include "core/simulation.h"
 #include "gtest/gtest.h"
+#include "test_util.h"
 
 extern std::string config_file_name;
 
@@ -14,8 +21,51 @@ class OpticsTest : public ::testing::Test {
     context_ = icehalo::ProjectContext::CreateFromFile(config_file_name.c_str());
   }
 
+  // Random rays start from random points on random faces, and go into crystal. Every point has two directions,
+  // same as reflected and refracted rays.
+  void GenerateRays(const icehalo::Crystal* c, int point_num,                                   // input
+                    std::vector<float>* pt, std::vector<float>* dir, std::vector<int>* face_id) {  // output
+    auto face_num = c->TotalFaces();
+    auto face_area = c->GetFaceArea();
+
+    pt->resize(point_num * 3);
+    dir->resize(point_num * 2 * 3);
+    face_id->resize(point_num);
+    for (int i = 0; i < point_num; i++) {
+      int f = 0;
+      do {
+        f = static_cast<int>(rng_.GetUint32() % face_num);
+      } while (!(face_area[f] > 1e-3f));  // Skip degenerate faces.
+      (*face_id)[i] = f;
+      icehalo::test::GeneratePointOnFace(c, f, &rng_, pt->data() + i * 3);
+      for (int k = 0; k < 2; k++) {
+        icehalo::test::GenerateDirIntoFace(c, f, &rng_, dir->data() + (i * 2 + k) * 3);
+      }
+    }
+  }
+
+  // Random rays hit random faces, from any side. They are inputs of HitSurface().
+  void GenerateHits(const icehalo::Crystal* c, int num,                                         // input
+                    std::vector<float>* dir, std::vector<float>* w, std::vector<int>* face_id) {  // output
+    auto face_num = c->TotalFaces();
+
+    dir->resize(num * 3);
+    w->resize(num);
+    face_id->resize(num);
+    for (int i = 0; i < num; i++) {
+      float* d = dir->data() + i * 3;
+      for (int j = 0; j < 3; j++) {
+        d[j] = rng_.GetGaussian();
+      }
+      icehalo::math::Normalize3(d);
+      (*w)[i] = rng_.GetUniform();
+      (*face_id)[i] = static_cast<int>(rng_.GetUint32() % face_num);
+    }
+  }
+
   icehalo::CrystalPtrU crystal_;
   icehalo::ProjectContextPtr context_;
+  icehalo::math::RandomNumberGenerator rng_;
 };
 
 
@@ -135,6 +185,81 @@ TEST_F(OpticsTest, HitSurface1) {
 }
 
 
+TEST_F(OpticsTest, HitSurfaceSimd) {
+  constexpr float kN = 1.31;
+  constexpr int kNum = 1001;  // Not a multiple of packet size.
+
+  std::vector<float> dir_in;
+  std::vector<float> w_in;
+  std::vector<int> face_id_in;
+  GenerateHits(crystal_.get(), kNum, &dir_in, &w_in, &face_id_in);
+
+  std::vector<float> dir_out(kNum * 2 * 3);
+  std::vector<float> w_out(kNum * 2);
+  icehalo::Optics::HitSurface(crystal_.get(), kN, kNum, dir_in.data(), face_id_in.data(), w_in.data(),  // input
+                              dir_out.data(), w_out.data());                                            // output
+  std::vector<float> simd_dir_out(kNum * 2 * 3);
+  std::vector<float> simd_w_out(kNum * 2);
+  icehalo::Optics::HitSurfaceSimd(crystal_.get(), kN, kNum, dir_in.data(), face_id_in.data(), w_in.data(),  //
+                                  simd_dir_out.data(), simd_w_out.data());                                 //
+
+  // All outputs are not greater than 1, so tolerance is given as ULPs of 1.0.
+  const float kTolerance = icehalo::Optics::kHitSurfaceUlp * std::numeric_limits<float>::epsilon();
+  int total_reflection_num = 0;
+  for (int i = 0; i < kNum * 2; i++) {
+    EXPECT_NEAR(w_out[i], simd_w_out[i], kTolerance);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(dir_out[i * 3 + j], simd_dir_out[i * 3 + j], kTolerance);
+    }
+    if (w_out[i] < 0) {
+      total_reflection_num++;
+    }
+  }
+  EXPECT_GT(total_reflection_num, 0);
+}
+
+
+// Table lookup matches GetReflectRatio() within the error bound, and HitSurface() with a table only differs in
+// weights.
+TEST_F(OpticsTest, FresnelTable) {
+  constexpr float kN = 1.31;
+  constexpr float kMaxError = 1e-5f;
+  constexpr int kNum = 1000;
+
+  icehalo::FresnelTable table(kN, kMaxError);
+  EXPECT_LE(table.GetMaxError(), kMaxError);
+  EXPECT_LT(table.Size(), icehalo::FresnelTable::kMaxSize);
+  EXPECT_NEAR(table.Get(0.0f), 1.0f, kMaxError);
+  for (int i = 0; i < kNum; i++) {
+    // Rays going out are not checked here, because GetReflectRatio() in float is less accurate than the table near
+    // the critical angle.
+    float c = rng_.GetUniform();
+    EXPECT_NEAR(table.Get(c), icehalo::Optics::GetReflectRatio(c, 1 / kN), kMaxError * 2);
+  }
+  EXPECT_THROW(icehalo::FresnelTable(kN, 0.0f), std::invalid_argument);
+
+  std::vector<float> dir_in;
+  std::vector<float> w_in;
+  std::vector<int> face_id_in;
+  GenerateHits(crystal_.get(), kNum, &dir_in, &w_in, &face_id_in);
+
+  std::vector<float> dir_out(kNum * 2 * 3);
+  std::vector<float> w_out(kNum * 2);
+  icehalo::Optics::HitSurface(crystal_.get(), kN, kNum, dir_in.data(), face_id_in.data(), w_in.data(),  // input
+                              dir_out.data(), w_out.data());                                            // output
+  std::vector<float> table_dir_out(kNum * 2 * 3);
+  std::vector<float> table_w_out(kNum * 2);
+  icehalo::Optics::HitSurface(crystal_.get(), kN, kNum, dir_in.data(), face_id_in.data(), w_in.data(),  // input
+                              table_dir_out.data(), table_w_out.data(), &table);                        // output
+  for (int i = 0; i < kNum * 2; i++) {
+    EXPECT_NEAR(w_out[i], table_w_out[i], kMaxError * 2);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_FLOAT_EQ(dir_out[i * 3 + j], table_dir_out[i * 3 + j]);
+    }
+  }
+}
+
+
 TEST_F(OpticsTest, RayFaceIntersection0) {
   auto c = icehalo::Crystal::CreateHexPrism(1.0f);
   auto face_num = c->TotalFaces();
@@ -216,4 +341,217 @@ TEST_F(OpticsTest, RayFaceIntersection1) {
   }
 }
 
+
+TEST_F(OpticsTest, RayFaceIntersectionPacket) {
+  auto face_num = crystal_->TotalFaces();
+  auto face_norm = crystal_->GetFaceNorm();
+  auto face_base = crystal_->GetFaceBaseVector();
+  auto face_point = crystal_->GetFaceVertex();
+
+  std::vector<float> face_data(face_num * icehalo::Optics::kPacketFaceDataSize);
+  icehalo::Optics::FillPacketFaceData(face_num, face_base, face_point, face_norm, face_data.data());
+
+  // Random rays start from random points on random faces, and go into crystal.
+  constexpr int kN = icehalo::Optics::kPacketSize;
+  constexpr int kPacketNum = 64;
+  icehalo::math::RandomNumberGenerator rng;
+  int hit_num = 0;
+  for (int i = 0; i < kPacketNum; i++) {
+    float pt[kN * 3];
+    float dir[kN * 3];
+    int face_id[kN];
+    for (int k = 0; k < kN; k++) {
+      face_id[k] = static_cast<int>(rng.GetUint32() % face_num);
+      float p[3];
+      float d[3];
+      icehalo::test::GeneratePointOnFace(crystal_.get(), face_id[k], &rng, p);
+      icehalo::test::GenerateDirIntoFace(crystal_.get(), face_id[k], &rng, d);
+      for (int j = 0; j < 3; j++) {
+        pt[j * kN + k] = p[j];
+        dir[j * kN + k] = d[j];
+      }
+    }
+
+    float t[kN];
+    int idx[kN];
+    icehalo::Optics::IntersectLinesWithTrianglesPacket(pt, dir, face_id, face_num, face_data.data(), t, idx);
+
+    for (int k = 0; k < kN; k++) {
+      float curr_pt[3]{ pt[k], pt[k + kN], pt[k + kN * 2] };
+      float curr_dir[3]{ dir[k], dir[k + kN], dir[k + kN * 2] };
+      float expect_pt[3]{};
+      int expect_id = -1;
+      icehalo::Optics::IntersectLineWithTriangles(curr_pt, curr_dir, face_id[k], face_num,  // input
+                                                  face_base, face_point, face_norm,         // input
+                                                  expect_pt, &expect_id);                   // output
+      ASSERT_EQ(expect_id, idx[k]);
+      if (expect_id < 0) {
+        continue;
+      }
+      hit_num++;
+      for (int j = 0; j < 3; j++) {
+        // Rounding errors are amplified for rays nearly parallel to the face, so tolerance is larger than kFloatEps.
+        EXPECT_NEAR(curr_pt[j] + t[k] * curr_dir[j], expect_pt[j], 1e-4);
+      }
+    }
+  }
+  EXPECT_GT(hit_num, kN * kPacketNum / 2);
+}
+
+
+TEST_F(OpticsTest, PropagateConvex) {
+  float dist[6] = { 1.0f, 1.0f, 1.5f, 1.0f, 2.5f, 1.0f };
+  icehalo::CrystalPtrU crystals[]{
+    icehalo::Crystal::CreateHexPrism(1.2f),
+    icehalo::Crystal::CreateHexPyramid(1, 1, 2, 3, 0.2f, 1.2f, 0.3f),
+    icehalo::Crystal::CreateIrregularHexPrism(dist, 1.2f),
+  };
+
+  constexpr int kPointNum = 256;
+  for (const auto& c : crystals) {
+    ASSERT_TRUE(c->IsConvex());
+    auto face_num = c->TotalFaces();
+    auto face_norm = c->GetFaceNorm();
+    auto face_base = c->GetFaceBaseVector();
+    auto face_point = c->GetFaceVertex();
+
+    std::vector<float> pt;
+    std::vector<float> dir;
+    std::vector<float> w(kPointNum * 2, 1.0f);
+    std::vector<int> face_id;
+    GenerateRays(c.get(), kPointNum, &pt, &dir, &face_id);
+    w[3] = 0;  // Skipped ray.
+
+    std::vector<float> pt_out(kPointNum * 2 * 3);
+    std::vector<int> face_id_out(kPointNum * 2);
+    icehalo::Optics::Propagate(c.get(), kPointNum * 2, pt.data(), dir.data(), w.data(), face_id.data(),  // input
+                               pt_out.data(), face_id_out.data());                                      // output
+    EXPECT_EQ(face_id_out[3], -1);
+
+    for (int i = 0; i < kPointNum * 2; i++) {
+      if (i == 3) {
+        continue;
+      }
+      float expect_pt[3]{};
+      int expect_id = -1;
+      icehalo::Optics::IntersectLineWithTriangles(pt.data() + i / 2 * 3, dir.data() + i * 3, face_id[i / 2],  //
+                                                  face_num, face_base, face_point, face_norm,                 //
+                                                  expect_pt, &expect_id);                                     //
+      ASSERT_GE(expect_id, 0);
+      EXPECT_EQ(c->FaceNumber(expect_id), c->FaceNumber(face_id_out[i]));
+      for (int j = 0; j < 3; j++) {
+        EXPECT_NEAR(pt_out[i * 3 + j], expect_pt[j], 1e-4);
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, PropagateSpecialized) {
+  icehalo::CrystalPtrU crystals[]{
+    icehalo::Crystal::CreateHexPrism(1.2f),
+    icehalo::Crystal::CreateCubicPyramid(0.2f, 0.3f),
+    icehalo::Crystal::CreateHexPyramid(0.2f, 1.2f, 0.3f),
+    icehalo::Crystal::CreateHexPyramid(0.2f, 0.0f, 0.5f),  // Fewer planes than a full pyramid.
+  };
+
+  // Same crystal as a custom one uses generic kernel, and results should be exactly the same.
+  constexpr int kPointNum = 256;
+  for (const auto& c : crystals) {
+    auto custom = icehalo::Crystal::CreateCustomCrystal(c->GetVertexes(), c->GetFaces(), c->GetFaceNumberMap());
+    ASSERT_TRUE(c->IsConvex());
+    ASSERT_EQ(c->TotalPlanes(), custom->TotalPlanes());
+    auto propagate = icehalo::Optics::GetPropagateFunc(c.get());
+    EXPECT_NE(propagate, icehalo::Optics::GetPropagateFunc(custom.get()));
+
+    std::vector<float> pt;
+    std::vector<float> dir;
+    std::vector<float> w(kPointNum * 2, 1.0f);
+    std::vector<int> face_id;
+    GenerateRays(c.get(), kPointNum, &pt, &dir, &face_id);
+
+    std::vector<float> pt_out(kPointNum * 2 * 3);
+    std::vector<int> face_id_out(kPointNum * 2);
+    propagate(c.get(), kPointNum * 2, pt.data(), dir.data(), w.data(), face_id.data(),  // input
+              pt_out.data(), face_id_out.data());                                      // output
+    std::vector<float> expect_pt_out(kPointNum * 2 * 3);
+    std::vector<int> expect_face_id_out(kPointNum * 2);
+    icehalo::Optics::Propagate(custom.get(), kPointNum * 2, pt.data(), dir.data(), w.data(), face_id.data(),  //
+                               expect_pt_out.data(), expect_face_id_out.data());                             //
+
+    EXPECT_EQ(face_id_out, expect_face_id_out);
+    EXPECT_EQ(pt_out, expect_pt_out);
+  }
+}
+
+
+TEST_F(OpticsTest, PropagateBvh) {
+  // A torus is not convex, and has enough faces to build BVH.
+  constexpr int kRingNum = 32;
+  constexpr int kTubeNum = 12;
+  constexpr float kRingRadius = 1.0f;
+  constexpr float kTubeRadius = 0.3f;
+  std::vector<icehalo::math::Vec3f> pts;
+  std::vector<icehalo::math::TriangleIdx> faces;
+  for (int i = 0; i < kRingNum; i++) {
+    for (int j = 0; j < kTubeNum; j++) {
+      float u = 2 * icehalo::math::kPi * i / kRingNum;
+      float v = 2 * icehalo::math::kPi * j / kTubeNum;
+      float r = kRingRadius + kTubeRadius * std::cos(v);
+      pts.emplace_back(r * std::cos(u), r * std::sin(u), kTubeRadius * std::sin(v));
+
+      int a = i * kTubeNum + j;
+      int b = (i + 1) % kRingNum * kTubeNum + j;
+      int c = (i + 1) % kRingNum * kTubeNum + (j + 1) % kTubeNum;
+      int d = i * kTubeNum + (j + 1) % kTubeNum;
+      faces.emplace_back(a, b, c);  // Normals point outward
+      faces.emplace_back(a, c, d);
+    }
+  }
+  auto crystal = icehalo::Crystal::CreateCustomCrystal(pts, faces);
+  ASSERT_FALSE(crystal->IsConvex());
+  ASSERT_GE(crystal->TotalFaces(), icehalo::Crystal::kBvhMinFaces);
+  const auto* bvh = crystal->GetBvh();
+  ASSERT_NE(bvh, nullptr);
+  EXPECT_EQ(icehalo::Crystal::CreateHexPrism(1.2f)->GetBvh(), nullptr);
+
+  auto face_num = crystal->TotalFaces();
+  std::vector<int> face_index(bvh->GetFaceIndex(), bvh->GetFaceIndex() + face_num);
+  std::sort(face_index.begin(), face_index.end());
+  for (int i = 0; i < face_num; i++) {
+    ASSERT_EQ(face_index[i], i);
+  }
+
+  constexpr int kPointNum = 512;
+  std::vector<float> pt;
+  std::vector<float> dir;
+  std::vector<float> w(kPointNum * 2, 1.0f);
+  std::vector<int> face_id;
+  GenerateRays(crystal.get(), kPointNum, &pt, &dir, &face_id);
+
+  std::vector<float> pt_out(kPointNum * 2 * 3);
+  std::vector<int> face_id_out(kPointNum * 2);
+  icehalo::Optics::Propagate(crystal.get(), kPointNum * 2, pt.data(), dir.data(), w.data(), face_id.data(),  // input
+                             pt_out.data(), face_id_out.data());                                            // output
+
+  int hit_num = 0;
+  for (int i = 0; i < kPointNum * 2; i++) {
+    float expect_pt[3]{};
+    int expect_id = -1;
+    icehalo::Optics::IntersectLineWithTriangles(pt.data() + i / 2 * 3, dir.data() + i * 3, face_id[i / 2],  //
+                                                face_num, crystal->GetFaceBaseVector(),                     //
+                                                crystal->GetFaceVertex(), crystal->GetFaceNorm(),           //
+                                                expect_pt, &expect_id);                                     //
+    ASSERT_EQ(expect_id, face_id_out[i]);
+    if (expect_id < 0) {
+      continue;
+    }
+    hit_num++;
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(pt_out[i * 3 + j], expect_pt[j], 1e-4);
+    }
+  }
+  EXPECT_GT(hit_num, kPointNum);
+}
+
 }  // namespace
@@ -0,0 +1,51 @@
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+
+#include "gtest/gtest.h"
+#include "util/page_alloc.h"
+
+namespace {
+
+// Modes come from ICEHALO_PAGE_MODE and ICEHALO_NUMA_MODE. See test/CMakeLists.txt for runs with other modes.
+TEST(PageAlloc, AllocateAndFree) {
+  const char* name = std::getenv("ICEHALO_PAGE_MODE");
+  auto mode = icehalo::GetPageMode();
+  if (name == nullptr || name[0] == '\0') {
+    EXPECT_EQ(mode, icehalo::PageMode::kDefault);
+  } else {
+    EXPECT_STREQ(icehalo::GetPageModeName(mode), name);
+  }
+
+  const char* numa_name = std::getenv("ICEHALO_NUMA_MODE");
+  auto numa_mode = icehalo::GetNumaMode();
+  if (numa_name == nullptr || numa_name[0] == '\0') {
+    EXPECT_EQ(numa_mode, icehalo::NumaMode::kDefault);
+  } else {
+    EXPECT_STREQ(icehalo::GetNumaModeName(numa_mode), numa_name);
+  }
+
+  EXPECT_EQ(icehalo::AllocateArray<float>(0), nullptr);
+  icehalo::FreeArray<float>(nullptr, 0);
+
+  // Small arrays always come from operator new, and large ones may be huge pages.
+  constexpr size_t kSmallNum = 100;
+  constexpr size_t kLargeNum = 3 * 1024 * 1024 + 7;
+  for (auto num : { kSmallNum, kLargeNum }) {
+    auto* data = icehalo::AllocateArray<float>(num);
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % alignof(float), 0u);
+    for (size_t i = 0; i < num; i++) {
+      data[i] = static_cast<float>(i);
+    }
+    EXPECT_FLOAT_EQ(data[num - 1], static_cast<float>(num - 1));
+#ifdef OS_LINUX
+    if (num == kLargeNum && (mode != icehalo::PageMode::kDefault || numa_mode != icehalo::NumaMode::kDefault)) {
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % (2 * 1024 * 1024), 0u);
+    }
+#endif
+    icehalo::FreeArray(data, num);
+  }
+}
+
+}  // namespace
@@ -1,3 +1,6 @@
+#include <thread>
+#include <vector>
+
 #include "core/optics.h"
 #include "gtest/gtest.h"
 #include "io/file.h"
@@ -16,9 +19,9 @@ class RaySegmentSerializationTest : public ::testing::Test {
   }
 };
 
-TEST_F(RaySegmentSerializationTest, SingleRaySegment) {
-  auto ray_seg_pool = icehalo::RaySegmentPool::GetInstance();
-  ray_seg_pool->Clear();
+TEST_F(RaySegmentSerializationTest, RaySegStore) {
+  auto ray_seg_store = icehalo::RaySegmentStore::GetInstance();
+  ray_seg_store->Clear();
 
   float pt[] = { -1.0f, 0.3f,  0.5f,     // For r0
                  0.2f,  -0.8f, 0.1f,     // For r1
@@ -28,103 +31,121 @@ TEST_F(RaySegmentSerializationTest, SingleRaySegment) {
                   1.0f,  -1.0f, 0.2f };  // For r2
   float w[] = { 1.0f, 0.9f, 0.1f };
   int face_id[] = { 23, 5, 37 };
-  auto r0 = ray_seg_pool->GetObject(pt + 0, dir + 0, w[0], face_id[0]);
-  auto r1 = ray_seg_pool->GetObject(pt + 3, dir + 3, w[1], face_id[1]);
-  auto r2 = ray_seg_pool->GetObject(pt + 6, dir + 6, w[2], face_id[2]);
-
-  r0->next_reflect = r1;
-  r0->next_refract = r2;
-  r1->prev = r0;
-  r2->prev = r0;
+  using icehalo::kInvalidPoolHandle;
+  using icehalo::RaySegmentState;
+  auto r0 = static_cast<icehalo::PoolHandle>(ray_seg_store->ReserveSegments(3));
+  auto r1 = r0 + 1;
+  auto r2 = r0 + 2;
+  ray_seg_store->Set(r0, pt + 0, dir + 0, w[0], face_id[0], kInvalidPoolHandle, 7, RaySegmentState::kOnGoing);
+  ray_seg_store->Set(r1, pt + 3, dir + 3, w[1], face_id[1], r0, 7, RaySegmentState::kFinished);
+  ray_seg_store->Set(r2, pt + 6, dir + 6, w[2], face_id[2], r0, 7, RaySegmentState::kCrystalAbsorbed);
 
   icehalo::File file(working_dir.c_str(), "tmp.bin");
   file.Open(icehalo::FileOpenMode::kWrite);
-  r0->Serialize(file, true);
+  ray_seg_store->Serialize(file, true);
   file.Close();
 
-  ray_seg_pool->Clear();
-
+  ray_seg_store->Clear();
   file.Open(icehalo::FileOpenMode::kRead);
-  auto r_test = ray_seg_pool->GetObject();
-  r_test->Deserialize(file, icehalo::endian::kUnknownEndian);
-
-  EXPECT_EQ(r_test->next_reflect, reinterpret_cast<icehalo::RaySegment*>(1));
-  EXPECT_EQ(r_test->next_refract, reinterpret_cast<icehalo::RaySegment*>(2));
-  EXPECT_EQ(r_test->prev, reinterpret_cast<icehalo::RaySegment*>(0xffffffffffffffff));
-  EXPECT_EQ(r_test->root_ctx, reinterpret_cast<icehalo::RayInfo*>(0xffffffffffffffff));
-  EXPECT_EQ(r_test->w, w[0]);
-  CheckEqualFloat3(r_test->pt.val(), pt + 0);
-  CheckEqualFloat3(r_test->dir.val(), dir + 0);
-  EXPECT_EQ(r_test->face_id, face_id[0]);
-  EXPECT_EQ(r_test->state, icehalo::RaySegmentState::kOnGoing);
+  ray_seg_store->Deserialize(file, icehalo::endian::kUnknownEndian);
+  file.Close();
+
+  // Handles are kept as they are.
+  ASSERT_EQ(ray_seg_store->Size(), 3u);
+  RaySegmentState state[] = { RaySegmentState::kOnGoing, RaySegmentState::kFinished,
+                              RaySegmentState::kCrystalAbsorbed };
+  for (int i = 0; i < 3; i++) {
+    auto r = r0 + i;
+    CheckEqualFloat3(ray_seg_store->GetPoint(r), pt + i * 3);
+    CheckEqualFloat3(ray_seg_store->GetDir(r), dir + i * 3);
+    EXPECT_EQ(ray_seg_store->GetWeight(r), w[i]);
+    EXPECT_EQ(ray_seg_store->GetFaceId(r), face_id[i]);
+    EXPECT_EQ(ray_seg_store->GetState(r), state[i]);
+    EXPECT_EQ(ray_seg_store->GetRayInfo(r), 7u);
+  }
+  EXPECT_EQ(ray_seg_store->GetParent(r0), kInvalidPoolHandle);
+  EXPECT_EQ(ray_seg_store->GetParent(r1), r0);
+  EXPECT_EQ(ray_seg_store->GetParent(r2), r0);
 }
 
-TEST_F(RaySegmentSerializationTest, RaySegPool) {
-  auto ray_seg_pool = icehalo::RaySegmentPool::GetInstance();
-  ray_seg_pool->Clear();
 
-  float pt[] = { -1.0f, 0.3f,  0.5f,     // For r0
-                 0.2f,  -0.8f, 0.1f,     // For r1
-                 0.7f,  0.7f,  1.0f };   // For r2
-  float dir[] = { -0.8f, 0.9f,  0.1f,    // For r0
-                  -0.9f, 0.9f,  1.0f,    // For r1
-                  1.0f,  -1.0f, 0.2f };  // For r2
-  float w[] = { 1.0f, 0.9f, 0.1f };
-  int face_id[] = { 23, 5, 37 };
-  auto r0 = ray_seg_pool->GetObject(pt + 0, dir + 0, w[0], face_id[0]);
-  auto r1 = ray_seg_pool->GetObject(pt + 3, dir + 3, w[1], face_id[1]);
-  auto r2 = ray_seg_pool->GetObject(pt + 6, dir + 6, w[2], face_id[2]);
+TEST_F(RaySegmentSerializationTest, RayInfoPool) {
+  auto ray_info_pool = icehalo::RayInfoPool::GetInstance();
+  ray_info_pool->Clear();
 
-  r0->next_reflect = r1;
-  r0->next_refract = r2;
-  r1->prev = r0;
-  r2->prev = r0;
+  float axis[] = { 0.1f, -0.2f, 1.5f };
+  auto idx0 = ray_info_pool->ReserveObjects(2);
+  ray_info_pool->GetObjectAt(idx0, 11, 2, axis);
+  ray_info_pool->GetObjectAt(idx0 + 1, 12, 3, axis)->prev_ray_segment = 5;
 
   icehalo::File file(working_dir.c_str(), "tmp.bin");
   file.Open(icehalo::FileOpenMode::kWrite);
-  ray_seg_pool->Serialize(file, true);
+  ray_info_pool->Serialize(file, true);
   file.Close();
 
+  ray_info_pool->Clear();
   file.Open(icehalo::FileOpenMode::kRead);
-  ray_seg_pool->Deserialize(file, icehalo::endian::kUnknownEndian);
-
-  using icehalo::RaySegment;
-  ray_seg_pool->Map([=](RaySegment& r) {
-    r.next_reflect = ray_seg_pool->GetPointerFromSerializeData(r.next_reflect);
-    r.next_refract = ray_seg_pool->GetPointerFromSerializeData(r.next_refract);
-    r.prev = ray_seg_pool->GetPointerFromSerializeData(r.prev);
-  });
-
-  using icehalo::CombineU32AsPointer;
-  r0 = ray_seg_pool->GetPointerFromSerializeData(reinterpret_cast<RaySegment*>(CombineU32AsPointer(0, 0)));
-  r1 = ray_seg_pool->GetPointerFromSerializeData(reinterpret_cast<RaySegment*>(CombineU32AsPointer(0, 1)));
-  r2 = ray_seg_pool->GetPointerFromSerializeData(reinterpret_cast<RaySegment*>(CombineU32AsPointer(0, 2)));
-
-  EXPECT_EQ(r0->next_reflect, r1);
-  EXPECT_EQ(r0->next_refract, r2);
-  EXPECT_EQ(r0->prev, nullptr);
-  EXPECT_EQ(r0->root_ctx, reinterpret_cast<icehalo::RayInfo*>(0xffffffffffffffff));
-  EXPECT_EQ(r0->w, w[0]);
-  CheckEqualFloat3(r0->pt.val(), pt + 0);
-  CheckEqualFloat3(r0->dir.val(), dir + 0);
-  EXPECT_EQ(r0->face_id, face_id[0]);
-  EXPECT_EQ(r0->state, icehalo::RaySegmentState::kOnGoing);
-
-  EXPECT_EQ(r1->prev, r0);
-  EXPECT_EQ(r1->root_ctx, reinterpret_cast<icehalo::RayInfo*>(0xffffffffffffffff));
-  EXPECT_EQ(r1->w, w[1]);
-  CheckEqualFloat3(r1->pt.val(), pt + 3);
-  CheckEqualFloat3(r1->dir.val(), dir + 3);
-  EXPECT_EQ(r1->face_id, face_id[1]);
-  EXPECT_EQ(r1->state, icehalo::RaySegmentState::kOnGoing);
-
-  EXPECT_EQ(r2->prev, r0);
-  EXPECT_EQ(r2->root_ctx, reinterpret_cast<icehalo::RayInfo*>(0xffffffffffffffff));
-  EXPECT_EQ(r2->w, w[2]);
-  CheckEqualFloat3(r2->pt.val(), pt + 6);
-  CheckEqualFloat3(r2->dir.val(), dir + 6);
-  EXPECT_EQ(r2->face_id, face_id[2]);
-  EXPECT_EQ(r2->state, icehalo::RaySegmentState::kOnGoing);
+  ray_info_pool->Deserialize(file, icehalo::endian::kUnknownEndian);
+  file.Close();
+
+  auto r0 = ray_info_pool->Get(idx0);
+  auto r1 = ray_info_pool->Get(idx0 + 1);
+  EXPECT_EQ(r0->first_ray_segment, 11u);
+  EXPECT_EQ(r0->prev_ray_segment, icehalo::kInvalidPoolHandle);
+  EXPECT_EQ(r0->crystal_id, 2);
+  CheckEqualFloat3(r0->main_axis.val(), axis);
+  EXPECT_EQ(r1->first_ray_segment, 12u);
+  EXPECT_EQ(r1->prev_ray_segment, 5u);
+  EXPECT_EQ(r1->crystal_id, 3);
+  CheckEqualFloat3(r1->main_axis.val(), axis);
+}
+
+
+// Reservations from several threads get disjoint ranges, and crossing chunk boundaries is safe.
+TEST(RaySegmentStoreTest, ConcurrentReserve) {
+  constexpr int kThreadNum = 4;
+  constexpr size_t kBlockNum = 8;
+  constexpr size_t kBlockSize = icehalo::RaySegmentStore::kChunkSize / 16 + 7;
+
+  auto ray_seg_store = icehalo::RaySegmentStore::GetInstance();
+  ray_seg_store->Clear();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreadNum; t++) {
+    threads.emplace_back([=]() {
+      float pt[3]{};
+      float dir[3]{};
+      for (size_t k = 0; k < kBlockNum; k++) {
+        auto idx0 = ray_seg_store->ReserveSegments(kBlockSize);
+        for (size_t i = 0; i < kBlockSize; i++) {
+          ray_seg_store->Set(static_cast<icehalo::PoolHandle>(idx0 + i), pt, dir, 1.0f, t, icehalo::kInvalidPoolHandle,
+                             static_cast<icehalo::PoolHandle>(idx0), icehalo::RaySegmentState::kOnGoing);
+        }
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+
+  ASSERT_EQ(ray_seg_store->Size(), kThreadNum * kBlockNum * kBlockSize);
+  std::vector<int> block_num(kThreadNum, 0);
+  for (size_t idx0 = 0; idx0 < ray_seg_store->Size(); idx0 += kBlockSize) {
+    auto h0 = static_cast<icehalo::PoolHandle>(idx0);
+    int t = ray_seg_store->GetFaceId(h0);
+    ASSERT_GE(t, 0);
+    ASSERT_LT(t, kThreadNum);
+    block_num[t]++;
+    for (size_t i = 0; i < kBlockSize; i++) {
+      auto h = static_cast<icehalo::PoolHandle>(idx0 + i);
+      ASSERT_EQ(ray_seg_store->GetFaceId(h), t);
+      ASSERT_EQ(ray_seg_store->GetRayInfo(h), h0);
+    }
+  }
+  for (auto n : block_num) {
+    EXPECT_EQ(n, static_cast<int>(kBlockNum));
+  }
+  ray_seg_store->Clear();
 }
 
 }  // namespace
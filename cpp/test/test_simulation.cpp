@@ -0,0 +1,200 @@
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+
+#include "context/context.h"
+#include "core/simulation.h"
+#include "gtest/gtest.h"
+
+extern std::string config_file_name;
+
+namespace {
+
+class SimulationTest : public ::testing::Test {
+ protected:
+  void SetUp() override { context_ = icehalo::ProjectContext::CreateFromFile(config_file_name.c_str()); }
+
+  icehalo::ProjectContextPtr context_;
+};
+
+
+TEST_F(SimulationTest, LightweightMode) {
+  icehalo::Simulator full_simulator(context_);
+  EXPECT_FALSE(full_simulator.GetLightweightMode());
+  full_simulator.SetCurrentWavelengthIndex(0);
+  full_simulator.Run();
+  auto full_data = full_simulator.GetSimulationRayData().CollectFinalRayData();
+
+  icehalo::Simulator lightweight_simulator(context_);
+  lightweight_simulator.EnableLightweightMode(true);
+  EXPECT_TRUE(lightweight_simulator.GetLightweightMode());
+  lightweight_simulator.SetCurrentWavelengthIndex(0);
+  lightweight_simulator.Run();
+  auto lightweight_data = lightweight_simulator.GetSimulationRayData().CollectFinalRayData();
+
+  // Same random streams are used in both modes, so final rays should be exactly the same.
+  ASSERT_GT(full_data.size, 0u);
+  ASSERT_EQ(full_data.size, lightweight_data.size);
+  EXPECT_EQ(full_data.init_ray_num, lightweight_data.init_ray_num);
+  EXPECT_FLOAT_EQ(full_data.total_ray_energy, lightweight_data.total_ray_energy);
+  EXPECT_EQ(std::memcmp(full_data.buf.get(), lightweight_data.buf.get(), sizeof(float) * 4 * full_data.size), 0);
+}
+
+
+TEST_F(SimulationTest, BatchRun) {
+  auto total_ray_num = context_->GetInitRayNum();
+  ASSERT_GT(total_ray_num, 1u);
+
+  // Batch size 0 means one batch, same as Run().
+  icehalo::Simulator full_simulator(context_);
+  full_simulator.SetCurrentWavelengthIndex(0);
+  full_simulator.Run();
+  auto full_data = full_simulator.GetSimulationRayData().CollectFinalRayData();
+
+  icehalo::Simulator simulator(context_);
+  simulator.SetCurrentWavelengthIndex(0);
+  int batch_num = 0;
+  simulator.Run([&](const icehalo::SimulationRayData& ray_data) {
+    auto data = ray_data.CollectFinalRayData();
+    EXPECT_EQ(data.init_ray_num, total_ray_num);
+    EXPECT_EQ(data.size, full_data.size);
+    EXPECT_FLOAT_EQ(data.total_ray_energy, full_data.total_ray_energy);
+    batch_num++;
+  });
+  EXPECT_EQ(batch_num, 1);
+
+  size_t batch_size = total_ray_num / 2 - 1;
+  context_->SetRayBatchSize(batch_size);
+  batch_num = 0;
+  size_t init_ray_num = 0;
+  simulator.Run([&](const icehalo::SimulationRayData& ray_data) {
+    auto data = ray_data.CollectFinalRayData();
+    EXPECT_LE(data.init_ray_num, batch_size);
+    init_ray_num += data.init_ray_num;
+    batch_num++;
+  });
+  context_->SetRayBatchSize(0);
+  EXPECT_EQ(batch_num, 3);
+  EXPECT_EQ(init_ray_num, total_ray_num);
+}
+
+
+// With a budget, batches are no larger than the probe batch here, and all initial rays are still traced.
+TEST_F(SimulationTest, PoolMemoryBudget) {
+  size_t total_ray_num = icehalo::Simulator::kBudgetProbeRayNum * 3 / 2;
+  context_->SetInitRayNum(total_ray_num);
+  context_->SetPoolMemoryBudget(1);
+  EXPECT_EQ(context_->GetPoolMemoryBudget(), 1u);
+
+  icehalo::Simulator simulator(context_);
+  simulator.SetCurrentWavelengthIndex(0);
+  int batch_num = 0;
+  size_t init_ray_num = 0;
+  simulator.Run([&](const icehalo::SimulationRayData& ray_data) {
+    auto data = ray_data.CollectFinalRayData();
+    EXPECT_LE(data.init_ray_num, icehalo::Simulator::kBudgetProbeRayNum);
+    init_ray_num += data.init_ray_num;
+    batch_num++;
+  });
+  context_->SetPoolMemoryBudget(0);
+  EXPECT_GE(batch_num, 2);
+  EXPECT_EQ(init_ray_num, total_ray_num);
+  EXPECT_GT(simulator.GetPeakPoolMemory(), 0u);
+}
+
+
+// Russian roulette keeps expected energy, but leaves fewer rays. Results do not depend on mode.
+TEST_F(SimulationTest, RussianRoulette) {
+  context_->SetInitRayNum(200);  // More rays for a stable energy
+  icehalo::Simulator simulator(context_);
+  simulator.SetCurrentWavelengthIndex(0);
+  simulator.Run();
+  auto data = simulator.GetSimulationRayData().CollectFinalRayData();
+
+  context_->SetRouletteThreshold(0.05f);
+  EXPECT_FLOAT_EQ(context_->GetRouletteThreshold(), 0.05f);
+  icehalo::Simulator full_simulator(context_);
+  full_simulator.SetCurrentWavelengthIndex(0);
+  full_simulator.Run();
+  auto full_data = full_simulator.GetSimulationRayData().CollectFinalRayData();
+
+  icehalo::Simulator lightweight_simulator(context_);
+  lightweight_simulator.EnableLightweightMode(true);
+  lightweight_simulator.SetCurrentWavelengthIndex(0);
+  lightweight_simulator.Run();
+  auto lightweight_data = lightweight_simulator.GetSimulationRayData().CollectFinalRayData();
+  context_->SetRouletteThreshold(0);
+
+  ASSERT_GT(full_data.size, 0u);
+  EXPECT_LT(full_data.size, data.size);
+  EXPECT_NEAR(full_data.total_ray_energy, data.total_ray_energy, data.total_ray_energy * 0.02f);
+  ASSERT_EQ(full_data.size, lightweight_data.size);
+  EXPECT_EQ(std::memcmp(full_data.buf.get(), lightweight_data.buf.get(), sizeof(float) * 4 * full_data.size), 0);
+}
+
+
+TEST_F(SimulationTest, OutputLayers) {
+  EXPECT_THROW(context_->SetOutputFilterIds({ 0, 99 }), std::invalid_argument);
+  context_->SetOutputFilterIds({ 0, 3, 2 });
+
+  icehalo::Simulator full_simulator(context_);
+  full_simulator.SetCurrentWavelengthIndex(0);
+  full_simulator.Run();
+  const auto& full_ray_data = full_simulator.GetSimulationRayData();
+  auto full_data = full_ray_data.CollectFinalRayData();
+
+  icehalo::Simulator lightweight_simulator(context_);
+  lightweight_simulator.EnableLightweightMode(true);
+  lightweight_simulator.SetCurrentWavelengthIndex(0);
+  lightweight_simulator.Run();
+  const auto& lightweight_ray_data = lightweight_simulator.GetSimulationRayData();
+  context_->SetOutputFilterIds({});
+
+  // Filter 0 is a none filter, so its layer holds all final rays.
+  auto layer_data = full_ray_data.CollectFinalRayData(0);
+  ASSERT_GT(full_data.size, 0u);
+  ASSERT_EQ(layer_data.size, full_data.size);
+  EXPECT_EQ(std::memcmp(layer_data.buf.get(), full_data.buf.get(), sizeof(float) * 4 * full_data.size), 0);
+
+  for (size_t k = 0; k < 3; k++) {
+    layer_data = full_ray_data.CollectFinalRayData(k);
+    EXPECT_LE(layer_data.size, full_data.size);
+    EXPECT_EQ(layer_data.init_ray_num, full_data.init_ray_num);
+
+    auto lightweight_layer_data = lightweight_ray_data.CollectFinalRayData(k);
+    ASSERT_EQ(layer_data.size, lightweight_layer_data.size);
+    EXPECT_EQ(std::memcmp(layer_data.buf.get(), lightweight_layer_data.buf.get(), sizeof(float) * 4 * layer_data.size),
+              0);
+  }
+  EXPECT_EQ(full_ray_data.CollectFinalRayData(3).size, 0u);  // No such layer.
+}
+
+
+// Rays leaving crystal below kScatMinW are given a chance to scatter again, and survivors that do not scatter keep
+// the raised weight too. So the exit energy of a partial multi-scatter run is kept in expectation.
+TEST_F(SimulationTest, MultiScatterRoulette) {
+  context_->SetInitRayNum(1000);
+  context_->multi_scatter_info_[0]->SetProbability(0.5f);
+
+  icehalo::Simulator simulator(context_);
+  simulator.SetCurrentWavelengthIndex(0);
+  simulator.Run();
+  auto data = simulator.GetSimulationRayData().CollectFinalRayData();
+
+  context_->SetRouletteThreshold(0.05f);
+  for (bool lightweight : { false, true }) {
+    icehalo::Simulator roulette_simulator(context_);
+    roulette_simulator.EnableLightweightMode(lightweight);
+    roulette_simulator.SetCurrentWavelengthIndex(0);
+    roulette_simulator.Run();
+    auto roulette_data = roulette_simulator.GetSimulationRayData().CollectFinalRayData();
+
+    ASSERT_GT(roulette_data.size, 0u);
+    EXPECT_LT(roulette_data.size, data.size);
+    EXPECT_NEAR(roulette_data.total_ray_energy / roulette_data.init_ray_num,
+                data.total_ray_energy / data.init_ray_num, data.total_ray_energy / data.init_ray_num * 0.02f);
+  }
+  context_->SetRouletteThreshold(0);
+}
+
+}  // namespace
@@ -0,0 +1,40 @@
+#ifndef TEST_TEST_UTIL_H_
+#define TEST_TEST_UTIL_H_
+
+#include "core/crystal.h"
+#include "core/mymath.h"
+
+namespace icehalo {
+namespace test {
+
+/*! @brief A random point on face face_id of crystal. pt has 3 floats. */
+inline void GeneratePointOnFace(const Crystal* crystal, int face_id, math::RandomNumberGenerator* rng,  // input
+                                float* pt) {                                                           // output
+  float a = rng->GetUniform();
+  float b = rng->GetUniform() * (1 - a);
+  const float* v = crystal->GetFaceVertex() + face_id * 9;
+  for (int j = 0; j < 3; j++) {
+    pt[j] = v[j] * (1 - a - b) + v[j + 3] * a + v[j + 6] * b;
+  }
+}
+
+
+/*! @brief A random unit direction going into crystal through face face_id. dir has 3 floats. */
+inline void GenerateDirIntoFace(const Crystal* crystal, int face_id, math::RandomNumberGenerator* rng,  // input
+                                float* dir) {                                                          // output
+  for (int j = 0; j < 3; j++) {
+    dir[j] = rng->GetGaussian();
+  }
+  math::Normalize3(dir);
+  if (math::Dot3(dir, crystal->GetFaceNorm() + face_id * 3) > 0) {
+    for (int j = 0; j < 3; j++) {
+      dir[j] = -dir[j];
+    }
+  }
+}
+
+}  // namespace test
+}  // namespace icehalo
+
+
+#endif  // TEST_TEST_UTIL_H_